@@ -221,10 +221,26 @@ enum {
 /** Miscellaneous stream preferences. */
 typedef enum {
   CUBEB_STREAM_PREF_NONE     = 0x00, /**< No stream preferences are requested. */
-  CUBEB_STREAM_PREF_LOOPBACK = 0x01 /**< Request a loopback stream. Should be
+  CUBEB_STREAM_PREF_LOOPBACK = 0x01, /**< Request a loopback stream. Should be
                                          specified on the input params and an
                                          output device to loopback from should
                                          be passed in place of an input device. */
+  CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE = 0x02, /**< Always call the data callback
+                                                 with the same number of frames:
+                                                 the latency passed to
+                                                 cubeb_stream_init, rounded up
+                                                 to a power of two. This can
+                                                 add up to that many frames of
+                                                 latency. */
+  CUBEB_STREAM_PREF_SHARED_DEVICE = 0x04 /**< Mix this output stream, in
+                                              process, with the other streams
+                                              of the context that have this
+                                              preference, the same device and
+                                              the same parameters, into a
+                                              single device stream. This makes
+                                              playing many short streams at
+                                              once cheaper. Backends that
+                                              don't need it ignore it. */
 } cubeb_stream_prefs;
 
 /** Stream format initialization parameters. */
@@ -557,20 +573,85 @@ CUBEB_EXPORT int cubeb_stream_get_latency(cubeb_stream * stream, uint32_t * late
     @retval CUBEB_ERROR_NOT_SUPPORTED */
 CUBEB_EXPORT int cubeb_stream_set_volume(cubeb_stream * stream, float volume);
 
+/** Set a volume per channel for an output stream, on top of the volume set
+    with cubeb_stream_set_volume. Changes of volume are ramped over the next
+    block of audio the stream renders, so that they don't click.
+    @param stream the stream for which to adjust the volumes.
+    @param volumes one float per channel, between 0.0 (muted) and 1.0
+           (maximum volume).
+    @param channels the number of volumes, which must be the channel count of
+           the stream.
+    @retval CUBEB_OK
+    @retval CUBEB_ERROR_INVALID_PARAMETER if stream or volumes is null, if a
+            volume is outside [0.0, 1.0], or if channels is not the channel
+            count of the stream.
+    @retval CUBEB_ERROR_NOT_SUPPORTED */
+CUBEB_EXPORT int cubeb_stream_set_channel_volumes(cubeb_stream * stream,
+                                                  float const * volumes,
+                                                  uint32_t channels);
+
 /** If the stream is stereo, set the left/right panning. If the stream is mono,
-    this has no effect.
+    this has no effect. Streams with more channels, in a layout with left and
+    right channels (quad, 5.1, 7.1...), have the channels on the other side
+    attenuated with a constant-power law, and the center channels left as
+    they are.
     @param stream the stream for which to change the panning
     @param panning a number from -1.0 to 1.0. -1.0 means that the stream is
            fully mixed in the left channel, 1.0 means the stream is fully
            mixed in the right channel. 0.0 is equal power in the right and
-           left channel (default).
+           left channel (default). In the other layouts, -1.0 means that
+           only the left channels are heard, 1.0 that only the right ones
+           are.
     @retval CUBEB_OK
     @retval CUBEB_ERROR_INVALID_PARAMETER if stream is null or if panning is
             outside the [-1.0, 1.0] range.
     @retval CUBEB_ERROR_NOT_SUPPORTED
-    @retval CUBEB_ERROR stream is not mono nor stereo */
+    @retval CUBEB_ERROR stream has no output */
 CUBEB_EXPORT int cubeb_stream_set_panning(cubeb_stream * stream, float panning);
 
+/** Set the matrix that mixes the channels of an output stream into the
+    channels of the device, in place of the one derived from their layouts.
+    This can be called while the stream is running: the stream crossfades from
+    the previous matrix to the new one over the next block of audio it
+    renders, without being restarted.
+    @param stream the stream for which to change the mixing matrix.
+    @param matrix `out_channels` rows of `in_channels` coefficients, the
+           output channel `i` being the sum of the input channels `j`
+           weighted by `matrix[i * in_channels + j]`. The coefficients must be
+           in [-1.0, 1.0] for CUBEB_SAMPLE_S16* streams. NULL goes back to the
+           matrix derived from the layouts.
+    @param in_channels the channel count of the stream.
+    @param out_channels the channel count of the device.
+    @retval CUBEB_OK
+    @retval CUBEB_ERROR_INVALID_PARAMETER if stream is null, if the channel
+            counts are not the ones of the stream and the device, or if a
+            coefficient is out of range.
+    @retval CUBEB_ERROR_NOT_SUPPORTED */
+CUBEB_EXPORT int cubeb_stream_set_mixing_matrix(cubeb_stream * stream,
+                                                float const * matrix,
+                                                uint32_t in_channels,
+                                                uint32_t out_channels);
+
+/** Let the input of a duplex stream, whose input and output devices don't
+    share a clock, be buffered according to how regularly it arrives, between
+    `min_frames` and `max_frames`. By default, up to 50ms of input are kept.
+    Input in excess is dropped, so that the input isn't delayed more than
+    needed. This must be called before cubeb_stream_start.
+    @param stream the stream for which to set the bounds.
+    @param min_frames the fewest frames to keep, at the rate of the input
+           stream.
+    @param max_frames the most frames to keep, at the rate of the input
+           stream.
+    @retval CUBEB_OK
+    @retval CUBEB_ERROR_INVALID_PARAMETER if stream is null or if `min_frames`
+            is above `max_frames`.
+    @retval CUBEB_ERROR_NOT_SUPPORTED if the stream is not a duplex stream, or
+            if the backend doesn't buffer the input.
+    @retval CUBEB_ERROR if the stream has already been started. */
+CUBEB_EXPORT int cubeb_stream_set_input_buffer_bounds(cubeb_stream * stream,
+                                                      uint32_t min_frames,
+                                                      uint32_t max_frames);
+
 /** Get the current output device for this stream.
     @param stm the stream for which to query the current output device
     @param device a pointer in which the current output device will be stored.
@@ -64,7 +64,17 @@ struct cubeb_ops {
   int (* stream_get_position)(cubeb_stream * stream, uint64_t * position);
   int (* stream_get_latency)(cubeb_stream * stream, uint32_t * latency);
   int (* stream_set_volume)(cubeb_stream * stream, float volumes);
+  int (* stream_set_channel_volumes)(cubeb_stream * stream,
+                                     float const * volumes,
+                                     uint32_t channels);
   int (* stream_set_panning)(cubeb_stream * stream, float panning);
+  int (* stream_set_mixing_matrix)(cubeb_stream * stream,
+                                   float const * matrix,
+                                   uint32_t in_channels,
+                                   uint32_t out_channels);
+  int (* stream_set_input_buffer_bounds)(cubeb_stream * stream,
+                                         uint32_t min_frames,
+                                         uint32_t max_frames);
   int (* stream_get_current_device)(cubeb_stream * stream,
                                     cubeb_device ** const device);
   int (* stream_device_destroy)(cubeb_stream * stream,
@@ -411,6 +411,30 @@ cubeb_stream_set_volume(cubeb_stream * stream, float volume)
   return stream->context->ops->stream_set_volume(stream, volume);
 }
 
+int
+cubeb_stream_set_channel_volumes(cubeb_stream * stream,
+                                 float const * volumes, uint32_t channels)
+{
+  uint32_t i;
+
+  if (!stream || !volumes || !channels) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+
+  for (i = 0; i < channels; i++) {
+    if (!(volumes[i] >= 0.0 && volumes[i] <= 1.0)) {
+      return CUBEB_ERROR_INVALID_PARAMETER;
+    }
+  }
+
+  if (!stream->context->ops->stream_set_channel_volumes) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  return stream->context->ops->stream_set_channel_volumes(stream, volumes,
+                                                          channels);
+}
+
 int cubeb_stream_set_panning(cubeb_stream * stream, float panning)
 {
   if (!stream || panning < -1.0 || panning > 1.0) {
@@ -424,6 +448,41 @@ int cubeb_stream_set_panning(cubeb_stream * stream, float panning)
   return stream->context->ops->stream_set_panning(stream, panning);
 }
 
+int cubeb_stream_set_mixing_matrix(cubeb_stream * stream,
+                                   float const * matrix,
+                                   uint32_t in_channels,
+                                   uint32_t out_channels)
+{
+  if (!stream || !in_channels || !out_channels) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+
+  if (!stream->context->ops->stream_set_mixing_matrix) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  return stream->context->ops->stream_set_mixing_matrix(stream, matrix,
+                                                        in_channels,
+                                                        out_channels);
+}
+
+int cubeb_stream_set_input_buffer_bounds(cubeb_stream * stream,
+                                         uint32_t min_frames,
+                                         uint32_t max_frames)
+{
+  if (!stream || min_frames > max_frames) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+
+  if (!stream->context->ops->stream_set_input_buffer_bounds) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  return stream->context->ops->stream_set_input_buffer_bounds(stream,
+                                                              min_frames,
+                                                              max_frames);
+}
+
 int cubeb_stream_get_current_device(cubeb_stream * stream,
                                     cubeb_device ** const device)
 {
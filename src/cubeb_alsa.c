@@ -17,6 +17,8 @@
 #include <alsa/asoundlib.h>
 #include "cubeb/cubeb.h"
 #include "cubeb-internal.h"
+#include "cubeb_gain.h"
+#include "cubeb_mix_engine.h"
 
 #define CUBEB_STREAM_MAX 16
 #define CUBEB_WATCHDOG_MS 10000
@@ -34,6 +36,8 @@ static int cubeb_alsa_error_handler_set = 0;
 
 static struct cubeb_ops const alsa_ops;
 
+struct alsa_shared_device;
+
 struct cubeb {
   struct cubeb_ops const * ops;
 
@@ -65,6 +69,18 @@ struct cubeb {
      workaround is not required. */
   snd_config_t * local_config;
   int is_pa;
+
+  /* Mutex for the devices shared by the streams that have
+     CUBEB_STREAM_PREF_SHARED_DEVICE, and for these streams.  It can be taken
+     while holding the context's mutex, but not the other way around. */
+  pthread_mutex_t shared_mutex;
+  struct alsa_shared_device * shared_devices;
+  /* Signaled when a shared device is done calling the state callbacks of its
+     streams. */
+  pthread_cond_t shared_cond;
+  /* Held while a shared device is opened, so that it is opened once.  It is
+     taken before the context's mutex and shared_mutex. */
+  pthread_mutex_t shared_open_mutex;
 };
 
 enum stream_state {
@@ -84,6 +100,8 @@ struct cubeb_stream {
   snd_pcm_t * pcm;
   cubeb_data_callback data_callback;
   cubeb_state_callback state_callback;
+  /* Only updated with atomic operations for the shared streams, whose
+     callback doesn't take `mutex`. */
   snd_pcm_uframes_t stream_position;
   snd_pcm_uframes_t last_position;
   snd_pcm_uframes_t buffer_size;
@@ -108,13 +126,50 @@ struct cubeb_stream {
      PulseAudio where streams would stop requesting new data despite still
      being logically active and playing. */
   struct timeval last_activity;
-  float volume;
+  /* The volume of playback streams, NULL for capture streams. */
+  cubeb_gain * gain;
 
   char * buffer;
   snd_pcm_uframes_t bufframes;
   snd_pcm_stream_t stream_type;
 
   struct cubeb_stream * other_stream;
+
+  /* Streams mixed into a shared device have no pcm of their own: their
+     audio is pulled by the shared device's mix engine.  These are protected
+     by the context's shared_mutex, except `drained` and `drained_frames`,
+     which are only used by the mix engine when the stream is started, and
+     `mixed_state`. */
+  struct alsa_shared_device * shared;
+  cubeb_mix_source * source;
+  struct cubeb_stream * next_shared;
+  int drained;
+  snd_pcm_uframes_t drained_frames;
+  /* RUNNING, until the mix engine is done with the stream: INACTIVE once it
+     is drained, ERROR if its callback failed.  Written atomically by the mix
+     engine, see alsa_shared_stream_sync. */
+  enum stream_state mixed_state;
+  /* Set while the device fails, for the streams to notify. */
+  int notify_error;
+};
+
+/* A playback stream opened for the streams that have
+   CUBEB_STREAM_PREF_SHARED_DEVICE and the same device and parameters: it
+   plays the mix of these streams, which don't take a slot of the context.
+   It is started when it is created, and destroyed with its last stream. */
+struct alsa_shared_device {
+  struct alsa_shared_device * next;
+  char * pcm_name;
+  cubeb_stream_params params;
+  cubeb_stream * stm;
+  cubeb_mix_engine * engine;
+  /* The streams mixed into this device. */
+  cubeb_stream * streams;
+  /* The device stream failed, and can't be joined anymore. */
+  int error;
+  /* The state callbacks of the streams are being called: the streams can't
+     leave `streams` until it is cleared. */
+  int notifying;
 };
 
 static int
@@ -392,14 +447,10 @@ alsa_process_stream(cubeb_stream * stm)
 
     if (stm->params.format == CUBEB_SAMPLE_FLOAT32NE) {
       float * b = (float *) stm->buffer;
-      for (uint32_t i = 0; i < avail * stm->params.channels; i++) {
-        b[i] *= stm->volume;
-      }
+      cubeb_gain_apply_float(stm->gain, b, b, avail);
     } else {
-      short * b = (short *) stm->buffer;
-      for (uint32_t i = 0; i < avail * stm->params.channels; i++) {
-        b[i] *= stm->volume;
-      }
+      int16_t * b = (int16_t *) stm->buffer;
+      cubeb_gain_apply_s16(stm->gain, b, b, avail);
     }
 
     wrote = snd_pcm_writei(stm->pcm, stm->buffer, avail);
@@ -775,6 +826,15 @@ alsa_init(cubeb ** context, char const * context_name)
   r = pthread_mutex_init(&ctx->mutex, NULL);
   assert(r == 0);
 
+  r = pthread_mutex_init(&ctx->shared_mutex, NULL);
+  assert(r == 0);
+
+  r = pthread_cond_init(&ctx->shared_cond, NULL);
+  assert(r == 0);
+
+  r = pthread_mutex_init(&ctx->shared_open_mutex, NULL);
+  assert(r == 0);
+
   r = pipe(fd);
   assert(r == 0);
 
@@ -857,6 +917,11 @@ alsa_destroy(cubeb * ctx)
   close(ctx->control_fd_read);
   close(ctx->control_fd_write);
   pthread_mutex_destroy(&ctx->mutex);
+  assert(!ctx->shared_devices);
+  pthread_mutex_destroy(&ctx->shared_mutex);
+  r = pthread_cond_destroy(&ctx->shared_cond);
+  assert(r == 0);
+  pthread_mutex_destroy(&ctx->shared_open_mutex);
   free(ctx->fds);
 
   if (ctx->local_config) {
@@ -869,6 +934,8 @@ alsa_destroy(cubeb * ctx)
 }
 
 static void alsa_stream_destroy(cubeb_stream * stm);
+static int alsa_stream_start(cubeb_stream * stm);
+static int alsa_stream_stop(cubeb_stream * stm);
 
 static int
 alsa_stream_init_single(cubeb * ctx, cubeb_stream ** stream, char const * stream_name,
@@ -892,7 +959,8 @@ alsa_stream_init_single(cubeb * ctx, cubeb_stream ** stream, char const * stream
 
   *stream = NULL;
 
-  if (stream_params->prefs & CUBEB_STREAM_PREF_LOOPBACK) {
+  if (stream_params->prefs & (CUBEB_STREAM_PREF_LOOPBACK |
+                              CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE)) {
     return CUBEB_ERROR_NOT_SUPPORTED;
   }
 
@@ -930,7 +998,10 @@ alsa_stream_init_single(cubeb * ctx, cubeb_stream ** stream, char const * stream
   stm->user_ptr = user_ptr;
   stm->params = *stream_params;
   stm->state = INACTIVE;
-  stm->volume = 1.0;
+  stm->gain = NULL;
+  if (stream_type == SND_PCM_STREAM_PLAYBACK) {
+    stm->gain = cubeb_gain_create(stream_params->channels);
+  }
   stm->buffer = NULL;
   stm->bufframes = 0;
   stm->stream_type = stream_type;
@@ -995,6 +1066,387 @@ alsa_stream_init_single(cubeb * ctx, cubeb_stream ** stream, char const * stream
   return CUBEB_OK;
 }
 
+static int
+alsa_can_share(cubeb_stream_params * stream_params)
+{
+  return (stream_params->prefs & CUBEB_STREAM_PREF_SHARED_DEVICE) &&
+         !(stream_params->prefs & (CUBEB_STREAM_PREF_LOOPBACK |
+                                   CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE)) &&
+         (stream_params->format == CUBEB_SAMPLE_FLOAT32NE ||
+          stream_params->format == CUBEB_SAMPLE_S16NE);
+}
+
+static long
+alsa_shared_data_callback(cubeb_stream * stm, void * user_ptr,
+                          void const * input_buffer, void * output_buffer,
+                          long nframes)
+{
+  (void)stm;
+  (void)input_buffer;
+  struct alsa_shared_device * shared = user_ptr;
+
+  /* Never drain: the device plays silence while no stream is started. */
+  cubeb_mix_engine_mix(shared->engine, output_buffer, nframes);
+  return nframes;
+}
+
+/* Called with the context's shared_mutex held.  A stream the mix engine is
+   done with stops being mixed, and takes the state it ended in. */
+static void
+alsa_shared_stream_sync(cubeb_stream * stm)
+{
+  enum stream_state state;
+
+  if (stm->state != RUNNING) {
+    return;
+  }
+  state = __atomic_load_n(&stm->mixed_state, __ATOMIC_ACQUIRE);
+  if (state != RUNNING) {
+    cubeb_mix_engine_remove(stm->shared->engine, stm->source);
+    stm->state = state;
+  }
+}
+
+static void
+alsa_shared_state_callback(cubeb_stream * stm, void * user_ptr,
+                           cubeb_state state)
+{
+  cubeb * ctx = stm->context;
+  struct alsa_shared_device * shared = user_ptr;
+  cubeb_stream * member;
+
+  if (state != CUBEB_STATE_ERROR) {
+    return;
+  }
+
+  /* The callbacks are called without the lock, so that they can start or
+     stop streams.  The streams stay in the list meanwhile. */
+  pthread_mutex_lock(&ctx->shared_mutex);
+  shared->error = 1;
+  shared->notifying = 1;
+  for (member = shared->streams; member; member = member->next_shared) {
+    alsa_shared_stream_sync(member);
+    if (member->state == RUNNING) {
+      member->state = ERROR;
+      member->notify_error = 1;
+    }
+  }
+  member = shared->streams;
+  pthread_mutex_unlock(&ctx->shared_mutex);
+
+  for (; member; member = member->next_shared) {
+    if (member->notify_error) {
+      member->notify_error = 0;
+      member->state_callback(member, member->user_ptr, CUBEB_STATE_ERROR);
+    }
+  }
+
+  pthread_mutex_lock(&ctx->shared_mutex);
+  shared->notifying = 0;
+  pthread_cond_broadcast(&ctx->shared_cond);
+  pthread_mutex_unlock(&ctx->shared_mutex);
+}
+
+static long
+alsa_shared_source_callback(void * user_ptr, void * buffer, long nframes)
+{
+  cubeb_stream * stm = user_ptr;
+  /* Frames written by the streams can be in the buffer of the device stream
+     or in the pcm. */
+  snd_pcm_uframes_t queued = stm->shared->stm->buffer_size;
+  long got;
+
+  /* Once done, the stream isn't called anymore until it is started again. */
+  if (stm->drained) {
+    stm->drained_frames += nframes;
+    if (stm->drained_frames < queued) {
+      return 0;
+    }
+    __atomic_store_n(&stm->mixed_state, INACTIVE, __ATOMIC_RELEASE);
+    stm->state_callback(stm, stm->user_ptr, CUBEB_STATE_DRAINED);
+    return -1;
+  }
+
+  got = stm->data_callback(stm, stm->user_ptr, NULL, buffer, nframes);
+  if (got < 0) {
+    __atomic_store_n(&stm->mixed_state, ERROR, __ATOMIC_RELEASE);
+    stm->state_callback(stm, stm->user_ptr, CUBEB_STATE_ERROR);
+    return -1;
+  }
+
+  __atomic_fetch_add(&stm->stream_position, got, __ATOMIC_RELAXED);
+
+  if (got < nframes) {
+    stm->drained = 1;
+    stm->drained_frames = nframes - got;
+  }
+  return got;
+}
+
+static void
+alsa_shared_device_destroy(struct alsa_shared_device * shared)
+{
+  if (shared->stm) {
+    alsa_stream_stop(shared->stm);
+    alsa_stream_destroy(shared->stm);
+  }
+  if (shared->engine) {
+    cubeb_mix_engine_destroy(shared->engine);
+  }
+  free(shared->pcm_name);
+  free(shared);
+}
+
+static int
+alsa_shared_device_create(cubeb * ctx, struct alsa_shared_device ** device,
+                          char const * pcm_name,
+                          cubeb_stream_params * stream_params,
+                          unsigned int latency_frames)
+{
+  struct alsa_shared_device * shared;
+  int r;
+
+  shared = calloc(1, sizeof(*shared));
+  assert(shared);
+
+  shared->pcm_name = strdup(pcm_name);
+  assert(shared->pcm_name);
+  shared->params = *stream_params;
+  shared->params.prefs = CUBEB_STREAM_PREF_NONE;
+
+  shared->engine = cubeb_mix_engine_create(shared->params.format,
+                                           shared->params.channels);
+  if (!shared->engine) {
+    alsa_shared_device_destroy(shared);
+    return CUBEB_ERROR_INVALID_FORMAT;
+  }
+
+  r = alsa_stream_init_single(ctx, &shared->stm, NULL, SND_PCM_STREAM_PLAYBACK,
+                              (cubeb_devid) shared->pcm_name, &shared->params,
+                              latency_frames, alsa_shared_data_callback,
+                              alsa_shared_state_callback, shared);
+  if (r == CUBEB_OK) {
+    r = alsa_stream_start(shared->stm);
+  }
+  if (r != CUBEB_OK) {
+    alsa_shared_device_destroy(shared);
+    return r;
+  }
+
+  *device = shared;
+
+  return CUBEB_OK;
+}
+
+/* Called with the context's shared_mutex held. */
+static struct alsa_shared_device *
+alsa_find_shared_device(cubeb * ctx, char const * pcm_name,
+                        cubeb_stream_params * stream_params)
+{
+  struct alsa_shared_device * shared;
+
+  for (shared = ctx->shared_devices; shared; shared = shared->next) {
+    if (!shared->error &&
+        strcmp(shared->pcm_name, pcm_name) == 0 &&
+        shared->params.format == stream_params->format &&
+        shared->params.rate == stream_params->rate &&
+        shared->params.channels == stream_params->channels &&
+        shared->params.layout == stream_params->layout) {
+      return shared;
+    }
+  }
+
+  return NULL;
+}
+
+static int
+alsa_shared_stream_init(cubeb * ctx, cubeb_stream ** stream,
+                        cubeb_devid deviceid,
+                        cubeb_stream_params * stream_params,
+                        unsigned int latency_frames,
+                        cubeb_data_callback data_callback,
+                        cubeb_state_callback state_callback,
+                        void * user_ptr)
+{
+  cubeb_stream * stm;
+  struct alsa_shared_device * shared;
+  int r;
+  char const * pcm_name = deviceid ? (char const *) deviceid : CUBEB_ALSA_PCM_NAME;
+
+  *stream = NULL;
+
+  /* The device stream is opened without shared_mutex, the first stream of a
+     device joining it when it is published.  Another stream can be opening
+     the same device meanwhile: look again once it is done. */
+  pthread_mutex_lock(&ctx->shared_mutex);
+  shared = alsa_find_shared_device(ctx, pcm_name, stream_params);
+  if (!shared) {
+    pthread_mutex_unlock(&ctx->shared_mutex);
+    pthread_mutex_lock(&ctx->shared_open_mutex);
+    pthread_mutex_lock(&ctx->shared_mutex);
+    shared = alsa_find_shared_device(ctx, pcm_name, stream_params);
+    if (!shared) {
+      pthread_mutex_unlock(&ctx->shared_mutex);
+      r = alsa_shared_device_create(ctx, &shared, pcm_name, stream_params,
+                                    latency_frames);
+      if (r != CUBEB_OK) {
+        pthread_mutex_unlock(&ctx->shared_open_mutex);
+        return r;
+      }
+      pthread_mutex_lock(&ctx->shared_mutex);
+      shared->next = ctx->shared_devices;
+      ctx->shared_devices = shared;
+    }
+    pthread_mutex_unlock(&ctx->shared_open_mutex);
+  }
+
+  stm = calloc(1, sizeof(*stm));
+  assert(stm);
+
+  stm->context = ctx;
+  stm->data_callback = data_callback;
+  stm->state_callback = state_callback;
+  stm->user_ptr = user_ptr;
+  stm->params = *stream_params;
+  stm->state = INACTIVE;
+  stm->gain = cubeb_gain_create(stream_params->channels);
+  stm->stream_type = SND_PCM_STREAM_PLAYBACK;
+  stm->shared = shared;
+  stm->source = cubeb_mix_source_create(shared->engine,
+                                        alsa_shared_source_callback, stm,
+                                        stm->gain);
+
+  r = pthread_mutex_init(&stm->mutex, NULL);
+  assert(r == 0);
+
+  r = pthread_cond_init(&stm->cond, NULL);
+  assert(r == 0);
+
+  stm->next_shared = shared->streams;
+  shared->streams = stm;
+  pthread_mutex_unlock(&ctx->shared_mutex);
+
+  *stream = stm;
+
+  return CUBEB_OK;
+}
+
+static void
+alsa_shared_stream_destroy(cubeb_stream * stm)
+{
+  int r;
+  cubeb * ctx = stm->context;
+  struct alsa_shared_device * shared = stm->shared;
+  struct alsa_shared_device ** device;
+  cubeb_stream ** member;
+
+  pthread_mutex_lock(&ctx->shared_mutex);
+  while (shared->notifying) {
+    r = pthread_cond_wait(&ctx->shared_cond, &ctx->shared_mutex);
+    assert(r == 0);
+  }
+  cubeb_mix_engine_remove(shared->engine, stm->source);
+  for (member = &shared->streams; *member != stm;
+       member = &(*member)->next_shared) {
+  }
+  *member = stm->next_shared;
+  if (shared->streams) {
+    shared = NULL;
+  } else {
+    for (device = &ctx->shared_devices; *device != shared;
+         device = &(*device)->next) {
+    }
+    *device = shared->next;
+  }
+  pthread_mutex_unlock(&ctx->shared_mutex);
+
+  cubeb_mix_source_destroy(stm->source);
+
+  /* Last stream of the device: close it. */
+  if (shared) {
+    alsa_shared_device_destroy(shared);
+  }
+
+  pthread_mutex_destroy(&stm->mutex);
+  r = pthread_cond_destroy(&stm->cond);
+  assert(r == 0);
+  cubeb_gain_destroy(stm->gain);
+
+  free(stm);
+}
+
+static int
+alsa_shared_stream_start(cubeb_stream * stm)
+{
+  cubeb * ctx = stm->context;
+  int r = CUBEB_OK;
+
+  pthread_mutex_lock(&ctx->shared_mutex);
+  /* A stream that has drained can be started again. */
+  alsa_shared_stream_sync(stm);
+  if (stm->shared->error || stm->state != INACTIVE) {
+    r = CUBEB_ERROR;
+  } else {
+    /* Not mixed until added: safe to reset. */
+    stm->drained = 0;
+    stm->drained_frames = 0;
+    stm->mixed_state = RUNNING;
+    cubeb_mix_engine_add(stm->shared->engine, stm->source);
+    stm->state = RUNNING;
+  }
+  pthread_mutex_unlock(&ctx->shared_mutex);
+
+  return r;
+}
+
+static int
+alsa_shared_stream_stop(cubeb_stream * stm)
+{
+  cubeb * ctx = stm->context;
+
+  pthread_mutex_lock(&ctx->shared_mutex);
+  cubeb_mix_engine_remove(stm->shared->engine, stm->source);
+  stm->state = INACTIVE;
+  pthread_mutex_unlock(&ctx->shared_mutex);
+
+  return CUBEB_OK;
+}
+
+static int
+alsa_shared_stream_get_position(cubeb_stream * stm, uint64_t * position)
+{
+  cubeb_stream * device = stm->shared->stm;
+  snd_pcm_sframes_t delay;
+  snd_pcm_uframes_t written;
+
+  /* The frames of the stream go through the buffer of the device stream,
+     then the pcm. */
+  pthread_mutex_lock(&device->mutex);
+  if (snd_pcm_state(device->pcm) != SND_PCM_STATE_RUNNING ||
+      snd_pcm_delay(device->pcm, &delay) != 0 || delay < 0) {
+    delay = 0;
+  }
+  delay += device->bufframes;
+  pthread_mutex_unlock(&device->mutex);
+
+  /* The mix engine doesn't take the stream's mutex: it only protects
+     last_position here. */
+  written = __atomic_load_n(&stm->stream_position, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&stm->mutex);
+  *position = 0;
+  if (written >= (snd_pcm_uframes_t) delay) {
+    *position = written - delay;
+  }
+  /* The delay is read apart from the position: never go back. */
+  if (*position < stm->last_position) {
+    *position = stm->last_position;
+  }
+  stm->last_position = *position;
+  pthread_mutex_unlock(&stm->mutex);
+
+  return CUBEB_OK;
+}
+
 static int
 alsa_stream_init(cubeb * ctx, cubeb_stream ** stream, char const * stream_name,
                  cubeb_devid input_device,
@@ -1015,9 +1467,15 @@ alsa_stream_init(cubeb * ctx, cubeb_stream ** stream, char const * stream_name,
   }
 
   if (result == CUBEB_OK && output_stream_params) {
-    result = alsa_stream_init_single(ctx, &outstm, stream_name, SND_PCM_STREAM_PLAYBACK,
-                                     output_device, output_stream_params, latency_frames,
-                                     data_callback, state_callback, user_ptr);
+    if (!input_stream_params && alsa_can_share(output_stream_params)) {
+      result = alsa_shared_stream_init(ctx, &outstm, output_device,
+                                       output_stream_params, latency_frames,
+                                       data_callback, state_callback, user_ptr);
+    } else {
+      result = alsa_stream_init_single(ctx, &outstm, stream_name, SND_PCM_STREAM_PLAYBACK,
+                                       output_device, output_stream_params, latency_frames,
+                                       data_callback, state_callback, user_ptr);
+    }
   }
 
   if (result == CUBEB_OK && input_stream_params && output_stream_params) {
@@ -1040,6 +1498,11 @@ alsa_stream_destroy(cubeb_stream * stm)
   int r;
   cubeb * ctx;
 
+  if (stm->shared) {
+    alsa_shared_stream_destroy(stm);
+    return;
+  }
+
   assert(stm && (stm->state == INACTIVE ||
                  stm->state == ERROR ||
                  stm->state == DRAINING));
@@ -1074,6 +1537,9 @@ alsa_stream_destroy(cubeb_stream * stm)
   pthread_mutex_unlock(&ctx->mutex);
 
   free(stm->buffer);
+  if (stm->gain) {
+    cubeb_gain_destroy(stm->gain);
+  }
 
   free(stm);
 }
@@ -1088,6 +1554,8 @@ alsa_get_max_channel_count(cubeb * ctx, uint32_t * max_channels)
   params.rate = 44100;
   params.format = CUBEB_SAMPLE_FLOAT32NE;
   params.channels = 2;
+  params.layout = CUBEB_LAYOUT_UNDEFINED;
+  params.prefs = CUBEB_STREAM_PREF_NONE;
 
   snd_pcm_hw_params_alloca(&hw_params);
 
@@ -1177,6 +1645,10 @@ alsa_stream_start(cubeb_stream * stm)
   assert(stm);
   ctx = stm->context;
 
+  if (stm->shared) {
+    return alsa_shared_stream_start(stm);
+  }
+
   if (stm->stream_type == SND_PCM_STREAM_PLAYBACK && stm->other_stream) {
     int r = alsa_stream_start(stm->other_stream);
     if (r != CUBEB_OK)
@@ -1213,6 +1685,10 @@ alsa_stream_stop(cubeb_stream * stm)
   assert(stm);
   ctx = stm->context;
 
+  if (stm->shared) {
+    return alsa_shared_stream_stop(stm);
+  }
+
   if (stm->stream_type == SND_PCM_STREAM_PLAYBACK && stm->other_stream) {
     int r = alsa_stream_stop(stm->other_stream);
     if (r != CUBEB_OK)
@@ -1242,6 +1718,10 @@ alsa_stream_get_position(cubeb_stream * stm, uint64_t * position)
 
   assert(stm && position);
 
+  if (stm->shared) {
+    return alsa_shared_stream_get_position(stm, position);
+  }
+
   pthread_mutex_lock(&stm->mutex);
 
   delay = -1;
@@ -1269,6 +1749,11 @@ static int
 alsa_stream_get_latency(cubeb_stream * stm, uint32_t * latency)
 {
   snd_pcm_sframes_t delay;
+
+  if (stm->shared) {
+    return alsa_stream_get_latency(stm->shared->stm, latency);
+  }
+
   /* This function returns the delay in frames until a frame written using
      snd_pcm_writei is sent to the DAC. The DAC delay should be < 1ms anyways. */
   if (snd_pcm_delay(stm->pcm, &delay)) {
@@ -1284,10 +1769,32 @@ static int
 alsa_stream_set_volume(cubeb_stream * stm, float volume)
 {
   /* setting the volume using an API call does not seem very stable/supported */
-  pthread_mutex_lock(&stm->mutex);
-  stm->volume = volume;
-  pthread_mutex_unlock(&stm->mutex);
+  if (stm->gain) {
+    cubeb_gain_set_volume(stm->gain, volume);
+  }
+
+  return CUBEB_OK;
+}
+
+static int
+alsa_stream_set_channel_volumes(cubeb_stream * stm, float const * volumes,
+                                uint32_t channels)
+{
+  if (!stm->gain) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  return cubeb_gain_set_channel_volumes(stm->gain, volumes, channels);
+}
+
+static int
+alsa_stream_set_panning(cubeb_stream * stm, float panning)
+{
+  if (!stm->gain) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
 
+  cubeb_gain_set_panning(stm->gain, stm->params.layout, panning);
   return CUBEB_OK;
 }
 
@@ -1369,7 +1876,10 @@ static struct cubeb_ops const alsa_ops = {
   .stream_get_position = alsa_stream_get_position,
   .stream_get_latency = alsa_stream_get_latency,
   .stream_set_volume = alsa_stream_set_volume,
-  .stream_set_panning = NULL,
+  .stream_set_channel_volumes = alsa_stream_set_channel_volumes,
+  .stream_set_panning = alsa_stream_set_panning,
+  .stream_set_mixing_matrix = NULL,
+  .stream_set_input_buffer_bounds = NULL,
   .stream_get_current_device = NULL,
   .stream_device_destroy = NULL,
   .stream_register_device_changed_callback = NULL,
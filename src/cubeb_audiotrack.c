@@ -434,7 +434,10 @@ static struct cubeb_ops const audiotrack_ops = {
   .stream_get_position = audiotrack_stream_get_position,
   .stream_get_latency = audiotrack_stream_get_latency,
   .stream_set_volume = audiotrack_stream_set_volume,
+  .stream_set_channel_volumes = NULL,
   .stream_set_panning = NULL,
+  .stream_set_mixing_matrix = NULL,
+  .stream_set_input_buffer_bounds = NULL,
   .stream_get_current_device = NULL,
   .stream_device_destroy = NULL,
   .stream_register_device_changed_callback = NULL,
@@ -22,8 +22,8 @@
 #include <AudioToolbox/AudioToolbox.h>
 #include "cubeb/cubeb.h"
 #include "cubeb-internal.h"
+#include "cubeb_gain.h"
 #include "cubeb_mixer.h"
-#include "cubeb_panner.h"
 #if !TARGET_OS_IPHONE
 #include "cubeb_osx_run_loop.h"
 #endif
@@ -180,8 +180,19 @@ struct cubeb_stream {
   /* Latency requested by the user. */
   uint32_t latency_frames = 0;
   atomic<uint32_t> current_latency_frames{ 0 };
-  atomic<float> panning{ 0 };
+  /* Applies the panning, on the callback thread. */
+  unique_ptr<cubeb_gain, decltype(&cubeb_gain_destroy)> panner;
   unique_ptr<cubeb_resampler, decltype(&cubeb_resampler_destroy)> resampler;
+  /* Bounds of the input buffer of a duplex stream, at the rate of the input
+   * stream, set before the stream starts. Applied to the resampler when it
+   * starts, and again when the stream is reinitialized. Protected by
+   * `mutex`. */
+  bool has_input_buffer_bounds = false;
+  /* True once the stream has been started: the resampler can be in use from
+   * then on. Protected by `mutex`. */
+  bool started = false;
+  uint32_t input_buffer_min_frames = 0;
+  uint32_t input_buffer_max_frames = 0;
   /* This is true if a device change callback is currently running.  */
   atomic<bool> switching_device{ false };
   atomic<bool> buffer_size_change_state{ false };
@@ -189,6 +200,12 @@ struct cubeb_stream {
   AudioObjectID plugin_id = 0;              // used to create aggregate device
   /* Mixer interface */
   unique_ptr<cubeb_mixer, decltype(&cubeb_mixer_destroy)> mixer;
+  /* Whether the output goes through the mixer: when the layouts of the stream
+   * and of the device differ, or once a matrix has been set. */
+  atomic<bool> remix{ false };
+  /* The matrix set with cubeb_stream_set_mixing_matrix, if any, set again on
+   * the mixer when it is re-created. Protected by `mutex`. */
+  vector<float> output_matrix;
   /* Buffer where remixing/resampling will occur when upmixing is required */
   /* Only accessed from callback thread */
   unique_ptr<uint8_t[]> temp_buffer;
@@ -547,7 +564,8 @@ audiounit_output_callback(void * user_ptr,
   }
 
   /* Get output buffer. */
-  if (stm->mixer) {
+  bool remix = stm->remix.load(memory_order_relaxed);
+  if (remix) {
     // If remixing needs to occur, we can't directly work in our final
     // destination buffer as data may be overwritten or too small to start with.
     size_t size_needed = output_frames * stm->output_stream_params.channels *
@@ -615,10 +633,6 @@ audiounit_output_callback(void * user_ptr,
   stm->frames_played = stm->frames_queued;
   stm->frames_queued += outframes;
 
-  AudioFormatFlags outaff = stm->output_desc.mFormatFlags;
-  float panning = (stm->output_desc.mChannelsPerFrame == 2) ?
-      stm->panning.load(memory_order_relaxed) : 0.0f;
-
   /* Post process output samples. */
   if (stm->draining) {
     size_t outbpf = cubeb_sample_size(stm->output_stream_params.format);
@@ -626,24 +640,23 @@ audiounit_output_callback(void * user_ptr,
     memset((uint8_t*)output_buffer + outframes * outbpf, 0, (output_frames - outframes) * outbpf);
   }
 
+  /* Panning, which doesn't touch the samples when centered. */
+  if (stm->output_stream_params.format == CUBEB_SAMPLE_FLOAT32NE) {
+    cubeb_gain_apply_float(stm->panner.get(), (float*)output_buffer,
+                           (float*)output_buffer, outframes);
+  } else if (stm->output_stream_params.format == CUBEB_SAMPLE_S16NE) {
+    cubeb_gain_apply_s16(stm->panner.get(), (short*)output_buffer,
+                         (short*)output_buffer, outframes);
+  }
+
   /* Mixing */
-  if (stm->mixer) {
+  if (remix) {
     audiounit_mix_output_buffer(stm,
                                 output_frames,
                                 output_buffer,
                                 stm->temp_buffer_size,
                                 outBufferList->mBuffers[0].mData,
                                 outBufferList->mBuffers[0].mDataByteSize);
-  } else {
-    /* Pan stereo. */
-    if (panning != 0.0f) {
-      if (outaff & kAudioFormatFlagIsFloat) {
-        cubeb_pan_stereo_buffer_float(
-          (float*)output_buffer, outframes, panning);
-      } else if (outaff & kAudioFormatFlagIsSignedInteger) {
-        cubeb_pan_stereo_buffer_int((short*)output_buffer, outframes, panning);
-      }
-    }
   }
 
   return noErr;
@@ -1351,6 +1364,19 @@ audiounit_init_mixer(cubeb_stream * stm)
                                       stm->context->channels,
                                       stm->context->layout));
   assert(stm->mixer);
+
+  // Keep the matrix of the user over device changes, unless the new device
+  // has another number of channels.
+  if (stm->output_matrix.empty()) {
+    return;
+  }
+  if (stm->output_matrix.size() !=
+        stm->output_stream_params.channels * stm->context->channels ||
+      cubeb_mixer_set_matrix(stm->mixer.get(),
+                             stm->output_matrix.data()) != CUBEB_OK) {
+    LOG("(%p) Mixing matrix doesn't fit the new device, dropping it", stm);
+    stm->output_matrix.clear();
+  }
 }
 
 static int
@@ -2316,12 +2342,16 @@ audiounit_configure_output(cubeb_stream * stm)
   LOG("(%p) Output device sampling rate: %.2f", stm, output_hw_desc.mSampleRate);
   stm->context->channels = output_hw_desc.mChannelsPerFrame;
 
-  // Set the input layout to match the output device layout.
+  // Set the input layout to match the output device layout. The mixer is
+  // there even when the layouts match, for cubeb_stream_set_mixing_matrix.
   audiounit_layout_init(stm, OUTPUT);
-  if (stm->context->channels != stm->output_stream_params.channels ||
-      stm->context->layout != stm->output_stream_params.layout) {
+  audiounit_init_mixer(stm);
+  bool layouts_differ =
+    stm->context->channels != stm->output_stream_params.channels ||
+    stm->context->layout != stm->output_stream_params.layout;
+  stm->remix = layouts_differ || !stm->output_matrix.empty();
+  if (layouts_differ) {
     LOG("Incompatible channel layouts detected, setting up remixer");
-    audiounit_init_mixer(stm);
     // We will be remixing the data before it reaches the output device.
     // We need to adjust the number of channels and other
     // AudioStreamDescription details.
@@ -2330,8 +2360,6 @@ audiounit_configure_output(cubeb_stream * stm)
                                       stm->output_desc.mChannelsPerFrame;
     stm->output_desc.mBytesPerPacket =
       stm->output_desc.mBytesPerFrame * stm->output_desc.mFramesPerPacket;
-  } else {
-    stm->mixer = nullptr;
   }
 
   r = AudioUnitSetProperty(stm->output_unit,
@@ -2380,6 +2408,18 @@ audiounit_configure_output(cubeb_stream * stm)
   return CUBEB_OK;
 }
 
+/* The resampler counts the input frames at the rate of the device. */
+static int
+audiounit_apply_input_buffer_bounds(cubeb_stream * stm)
+{
+  stm->mutex.assert_current_thread_owns();
+  double ratio = stm->input_hw_rate / stm->input_stream_params.rate;
+  return cubeb_resampler_set_input_buffer_bounds(
+      stm->resampler.get(),
+      static_cast<uint32_t>(stm->input_buffer_min_frames * ratio),
+      static_cast<uint32_t>(stm->input_buffer_max_frames * ratio));
+}
+
 static int
 audiounit_setup_stream(cubeb_stream * stm)
 {
@@ -2530,11 +2570,22 @@ audiounit_setup_stream(cubeb_stream * stm)
                                               target_sample_rate,
                                               stm->data_callback,
                                               stm->user_ptr,
-                                              CUBEB_RESAMPLER_QUALITY_DESKTOP));
+                                              CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                                              CUBEB_RESAMPLER_RECLOCK_NONE,
+                                              cubeb_resampler_block_size(
+                                                has_input(stm) ? &stm->input_stream_params : NULL,
+                                                has_output(stm) ? &stm->output_stream_params : NULL,
+                                                stm->latency_frames)));
   if (!stm->resampler) {
     LOG("(%p) Could not create resampler.", stm);
     return CUBEB_ERROR;
   }
+  if (stm->has_input_buffer_bounds &&
+      audiounit_apply_input_buffer_bounds(stm) != CUBEB_OK) {
+    LOG("(%p) Could not set the bounds of the input buffer.", stm);
+    return CUBEB_ERROR;
+  }
+  cubeb_resampler_reserve(stm->resampler.get(), stm->latency_frames);
 
   if (stm->input_unit != NULL) {
     r = AudioUnitInitialize(stm->input_unit);
@@ -2580,6 +2631,7 @@ cubeb_stream::cubeb_stream(cubeb * context)
   : context(context)
   , resampler(nullptr, cubeb_resampler_destroy)
   , mixer(nullptr, cubeb_mixer_destroy)
+  , panner(nullptr, cubeb_gain_destroy)
 {
   PodZero(&input_desc, 1);
   PodZero(&output_desc, 1);
@@ -2630,6 +2682,10 @@ audiounit_stream_init(cubeb * context,
   }
   if (output_stream_params) {
     stm->output_stream_params = *output_stream_params;
+    stm->panner.reset(cubeb_gain_create(output_stream_params->channels));
+    if (!stm->panner) {
+      return CUBEB_ERROR_INVALID_FORMAT;
+    }
     r = audiounit_set_device_info(stm.get(), reinterpret_cast<uintptr_t>(output_device), OUTPUT);
     if (r != CUBEB_OK) {
       LOG("(%p) Fail to set device info for output.", stm.get());
@@ -2747,6 +2803,16 @@ static int
 audiounit_stream_start(cubeb_stream * stm)
 {
   auto_lock context_lock(stm->context->mutex);
+  {
+    // The units don't run yet: the resampler isn't in use.
+    auto_lock lock(stm->mutex);
+    if (!stm->started && stm->has_input_buffer_bounds &&
+        audiounit_apply_input_buffer_bounds(stm) != CUBEB_OK) {
+      LOG("(%p) Could not set the bounds of the input buffer.", stm);
+      return CUBEB_ERROR;
+    }
+    stm->started = true;
+  }
   stm->shutdown = false;
   stm->draining = false;
 
@@ -2842,13 +2908,67 @@ audiounit_stream_set_volume(cubeb_stream * stm, float volume)
   return CUBEB_OK;
 }
 
-int audiounit_stream_set_panning(cubeb_stream * stm, float panning)
+static int
+audiounit_stream_set_input_buffer_bounds(cubeb_stream * stm,
+                                         uint32_t min_frames,
+                                         uint32_t max_frames)
+{
+  if (!has_input(stm) || !has_output(stm)) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  auto_lock lock(stm->mutex);
+  /* The resampler can't be changed while the units use it. */
+  if (stm->started) {
+    return CUBEB_ERROR;
+  }
+  /* Applied in audiounit_stream_start. */
+  stm->has_input_buffer_bounds = true;
+  stm->input_buffer_min_frames = min_frames;
+  stm->input_buffer_max_frames = max_frames;
+  return CUBEB_OK;
+}
+
+static int
+audiounit_stream_set_mixing_matrix(cubeb_stream * stm, float const * matrix,
+                                   uint32_t in_channels, uint32_t out_channels)
 {
-  if (stm->output_desc.mChannelsPerFrame > 2) {
+  if (!has_output(stm)) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  auto_lock lock(stm->mutex);
+  if (in_channels != stm->output_stream_params.channels ||
+      out_channels != stm->context->channels) {
     return CUBEB_ERROR_INVALID_PARAMETER;
   }
+  if (!stm->mixer) {
+    return CUBEB_ERROR;
+  }
+
+  int r = cubeb_mixer_set_matrix(stm->mixer.get(), matrix);
+  if (r != CUBEB_OK) {
+    return r;
+  }
+  if (matrix) {
+    stm->output_matrix.assign(matrix, matrix + in_channels * out_channels);
+  } else {
+    stm->output_matrix.clear();
+  }
+  // The mixer crossfades to the new matrix, even back to the one of the
+  // layouts.
+  stm->remix = true;
+  return CUBEB_OK;
+}
+
+int audiounit_stream_set_panning(cubeb_stream * stm, float panning)
+{
+  if (!stm->panner) {
+    return CUBEB_ERROR;
+  }
 
-  stm->panning.store(panning, memory_order_relaxed);
+  cubeb_gain_set_panning(stm->panner.get(),
+                         stm->output_stream_params.layout, panning);
   return CUBEB_OK;
 }
 
@@ -3450,7 +3570,10 @@ cubeb_ops const audiounit_ops = {
   /*.stream_get_position =*/ audiounit_stream_get_position,
   /*.stream_get_latency =*/ audiounit_stream_get_latency,
   /*.stream_set_volume =*/ audiounit_stream_set_volume,
+  /*.stream_set_channel_volumes =*/ NULL,
   /*.stream_set_panning =*/ audiounit_stream_set_panning,
+  /*.stream_set_mixing_matrix =*/ audiounit_stream_set_mixing_matrix,
+  /*.stream_set_input_buffer_bounds =*/ audiounit_stream_set_input_buffer_bounds,
   /*.stream_get_current_device =*/ audiounit_stream_get_current_device,
   /*.stream_device_destroy =*/ audiounit_stream_device_destroy,
   /*.stream_register_device_changed_callback =*/ audiounit_stream_register_device_changed_callback,
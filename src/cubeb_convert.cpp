@@ -0,0 +1,1268 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+#include "cubeb_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CUBEB_CONVERT_X86
+#include <immintrin.h>
+#include "cubeb_cpu.h"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+/* NEON is always there on AArch64, and has round-to-nearest-even
+   conversions, like lrintf and the x86 ones. */
+#define CUBEB_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CUBEB_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CUBEB_TARGET(isa)
+#endif
+
+/* GCC only allows using intrinsics in functions that have the right target
+   attribute since GCC 4.9. */
+#if defined(__GNUC__) && !defined(__clang__) && \
+    (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 9))
+#define CUBEB_NO_AVX2_DISPATCH
+#endif
+
+namespace {
+
+struct convert_kernels {
+  void (*s16_to_float)(int16_t const *, float *, size_t, float);
+  void (*float_to_s16)(float const *, int16_t *, size_t, float);
+  void (*float_to_s16_dither)(float const *, int16_t *, size_t, float,
+                              cubeb_convert_dither_state *);
+  void (*gain_float)(float const *, float *, size_t, float);
+  void (*gain_s16)(int16_t const *, int16_t *, size_t, float);
+  void (*byteswap16)(void const *, void *, size_t);
+  void (*byteswap32)(void const *, void *, size_t);
+  void (*interleave_float)(float const * const *, float *, uint32_t, size_t,
+                           float);
+  void (*deinterleave_float)(float const *, float * const *, uint32_t, size_t,
+                             float);
+  void (*gain_ramp_float)(float const *, float *, uint32_t, size_t,
+                          float const *, float const *);
+  void (*gain_ramp_s16)(int16_t const *, int16_t *, uint32_t, size_t,
+                        float const *, float const *);
+  void (*accumulate_float)(float const *, float *, size_t, float);
+  void (*accumulate_s16)(int16_t const *, float *, size_t, float);
+};
+
+/* Scalar versions, also used for the samples that don't fill a vector. */
+
+int16_t
+clip_to_s16(float x)
+{
+  x = std::min(std::max(x, -32768.0f), 32767.0f);
+  return static_cast<int16_t>(lrintf(x));
+}
+
+void
+s16_to_float_c(int16_t const * in, float * out, size_t samples, float gain)
+{
+  gain /= 32768.0f;
+  /* From the end, to convert in place. */
+  while (samples--) {
+    out[samples] = in[samples] * gain;
+  }
+}
+
+void
+float_to_s16_c(float const * in, int16_t * out, size_t samples, float gain)
+{
+  gain *= 32768.0f;
+  for (size_t i = 0; i < samples; i++) {
+    out[i] = clip_to_s16(in[i] * gain);
+  }
+}
+
+uint32_t
+xorshift32(uint32_t x)
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+/* The difference of the two 16-bit halves of a random number has a
+   triangular distribution in ]-1; 1[. */
+float
+triangular_noise(uint32_t r)
+{
+  return (static_cast<int32_t>(r & 0xffff) - static_cast<int32_t>(r >> 16)) *
+         (1.0f / 65536.0f);
+}
+
+/* Sample i uses lane i % 4 of the state, so that the vector versions, which
+   process four samples at a time, give the same output. */
+void
+float_to_s16_dither_c(float const * in, int16_t * out, size_t samples,
+                      float gain, cubeb_convert_dither_state * state)
+{
+  gain *= 32768.0f;
+  for (size_t i = 0; i < samples; i++) {
+    uint32_t & lane = state->lanes[i % 4];
+    lane = xorshift32(lane);
+    out[i] = clip_to_s16(in[i] * gain + triangular_noise(lane));
+  }
+}
+
+void
+gain_float_c(float const * in, float * out, size_t samples, float gain)
+{
+  for (size_t i = 0; i < samples; i++) {
+    out[i] = in[i] * gain;
+  }
+}
+
+void
+gain_s16_c(int16_t const * in, int16_t * out, size_t samples, float gain)
+{
+  for (size_t i = 0; i < samples; i++) {
+    out[i] = clip_to_s16(in[i] * gain);
+  }
+}
+
+void
+byteswap16_c(void const * in, void * out, size_t samples)
+{
+  uint16_t const * src = static_cast<uint16_t const *>(in);
+  uint16_t * dst = static_cast<uint16_t *>(out);
+  for (size_t i = 0; i < samples; i++) {
+    dst[i] = static_cast<uint16_t>((src[i] << 8) | (src[i] >> 8));
+  }
+}
+
+void
+byteswap32_c(void const * in, void * out, size_t samples)
+{
+  uint32_t const * src = static_cast<uint32_t const *>(in);
+  uint32_t * dst = static_cast<uint32_t *>(out);
+  for (size_t i = 0; i < samples; i++) {
+    uint32_t x = src[i];
+    dst[i] = (x << 24) | ((x << 8) & 0xff0000) | ((x >> 8) & 0xff00) | (x >> 24);
+  }
+}
+
+void
+interleave_float_c(float const * const * in, float * out, uint32_t channels,
+                   size_t frames, float gain)
+{
+  for (uint32_t c = 0; c < channels; c++) {
+    for (size_t f = 0; f < frames; f++) {
+      out[f * channels + c] = in[c][f] * gain;
+    }
+  }
+}
+
+void
+deinterleave_float_c(float const * in, float * const * out, uint32_t channels,
+                     size_t frames, float gain)
+{
+  for (uint32_t c = 0; c < channels; c++) {
+    for (size_t f = 0; f < frames; f++) {
+      out[c][f] = in[f * channels + c] * gain;
+    }
+  }
+}
+
+/* The ramps are computed in groups of frames that fill whole vectors of eight
+   samples. The gain of a sample is `a + d * n`, `n` being the index of its
+   group, `a` and `d` only depending on its position in the group: all the
+   versions compute the same gains, whatever their vector size. */
+const uint32_t RAMP_MAX_CHANNELS = 32;
+
+size_t
+ramp_group_frames(uint32_t channels)
+{
+  /* 8 / gcd(channels, 8) */
+  uint32_t lowest_bit = channels & (~channels + 1);
+  return 8 / std::min<uint32_t>(lowest_bit, 8);
+}
+
+float
+ramp_step(float from, float to, size_t frames)
+{
+  return (to - from) / static_cast<float>(frames);
+}
+
+/* `a` and `d` for the samples of a group. */
+void
+ramp_lanes(uint32_t channels, size_t frames,
+           float const * from, float const * to, float * a, float * d)
+{
+  size_t group = ramp_group_frames(channels);
+  for (uint32_t c = 0; c < channels; c++) {
+    float step = ramp_step(from[c], to[c], frames);
+    for (size_t k = 0; k < group; k++) {
+      a[k * channels + c] = from[c] + step * static_cast<float>(k + 1);
+      d[k * channels + c] = step * static_cast<float>(group);
+    }
+  }
+}
+
+/* The frames from `begin`, of a ramp over `frames` frames. */
+template<typename T>
+void
+gain_ramp_c_from(T const * in, T * out, uint32_t channels, size_t frames,
+                 float const * from, float const * to, size_t begin)
+{
+  size_t group = ramp_group_frames(channels);
+  for (uint32_t c = 0; c < channels; c++) {
+    float step = ramp_step(from[c], to[c], frames);
+    float d = step * static_cast<float>(group);
+    for (size_t f = begin; f < frames; f++) {
+      float a = from[c] + step * static_cast<float>(f % group + 1);
+      float gain = a + d * static_cast<float>(f / group);
+      size_t i = f * channels + c;
+      out[i] = std::is_same<T, float>::value
+               ? static_cast<T>(in[i] * gain)
+               : static_cast<T>(clip_to_s16(in[i] * gain));
+    }
+  }
+}
+
+void
+gain_ramp_float_c(float const * in, float * out, uint32_t channels,
+                  size_t frames, float const * from, float const * to)
+{
+  gain_ramp_c_from(in, out, channels, frames, from, to, 0);
+}
+
+void
+gain_ramp_s16_c(int16_t const * in, int16_t * out, uint32_t channels,
+                size_t frames, float const * from, float const * to)
+{
+  gain_ramp_c_from(in, out, channels, frames, from, to, 0);
+}
+
+void
+accumulate_float_c(float const * in, float * out, size_t samples, float gain)
+{
+  for (size_t i = 0; i < samples; i++) {
+    out[i] += in[i] * gain;
+  }
+}
+
+void
+accumulate_s16_c(int16_t const * in, float * out, size_t samples, float gain)
+{
+  gain /= 32768.0f;
+  for (size_t i = 0; i < samples; i++) {
+    out[i] += in[i] * gain;
+  }
+}
+
+const convert_kernels c_kernels = {
+  s16_to_float_c,
+  float_to_s16_c,
+  float_to_s16_dither_c,
+  gain_float_c,
+  gain_s16_c,
+  byteswap16_c,
+  byteswap32_c,
+  interleave_float_c,
+  deinterleave_float_c,
+  gain_ramp_float_c,
+  gain_ramp_s16_c,
+  accumulate_float_c,
+  accumulate_s16_c
+};
+
+#if defined(CUBEB_CONVERT_X86)
+
+CUBEB_TARGET("sse2") __m128i
+float_to_s16_sse2(__m128 a, __m128 b)
+{
+  const __m128 min = _mm_set1_ps(-32768.0f);
+  const __m128 max = _mm_set1_ps(32767.0f);
+  /* Clip before converting: out of range values would become INT32_MIN. */
+  a = _mm_min_ps(_mm_max_ps(a, min), max);
+  b = _mm_min_ps(_mm_max_ps(b, min), max);
+  return _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+}
+
+CUBEB_TARGET("sse2") void
+s16_to_float_sse2(int16_t const * in, float * out, size_t samples, float gain)
+{
+  size_t vectors = samples / 8;
+  s16_to_float_c(in + vectors * 8, out + vectors * 8, samples % 8, gain);
+  const __m128 g = _mm_set1_ps(gain / 32768.0f);
+  while (vectors--) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + vectors * 8));
+    /* Sign extend to 32 bits. */
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(out + vectors * 8, _mm_mul_ps(_mm_cvtepi32_ps(lo), g));
+    _mm_storeu_ps(out + vectors * 8 + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), g));
+  }
+}
+
+CUBEB_TARGET("sse2") void
+float_to_s16_sse2(float const * in, int16_t * out, size_t samples, float gain)
+{
+  const __m128 g = _mm_set1_ps(gain * 32768.0f);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), g);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), g);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     float_to_s16_sse2(a, b));
+  }
+  float_to_s16_c(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("sse2") __m128
+triangular_noise_sse2(__m128i r)
+{
+  const __m128i mask = _mm_set1_epi32(0xffff);
+  __m128i d = _mm_sub_epi32(_mm_and_si128(r, mask), _mm_srli_epi32(r, 16));
+  return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+CUBEB_TARGET("sse2") __m128i
+xorshift32_sse2(__m128i x)
+{
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+CUBEB_TARGET("sse2") void
+float_to_s16_dither_sse2(float const * in, int16_t * out, size_t samples,
+                         float gain, cubeb_convert_dither_state * state)
+{
+  const __m128 g = _mm_set1_ps(gain * 32768.0f);
+  __m128i lanes = _mm_loadu_si128(reinterpret_cast<__m128i *>(state->lanes));
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    lanes = xorshift32_sse2(lanes);
+    __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), g),
+                          triangular_noise_sse2(lanes));
+    lanes = xorshift32_sse2(lanes);
+    __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), g),
+                          triangular_noise_sse2(lanes));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     float_to_s16_sse2(a, b));
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state->lanes), lanes);
+  float_to_s16_dither_c(in + i, out + i, samples - i, gain, state);
+}
+
+CUBEB_TARGET("sse2") void
+gain_float_sse2(float const * in, float * out, size_t samples, float gain)
+{
+  const __m128 g = _mm_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    __m128 a = _mm_loadu_ps(in + i);
+    __m128 b = _mm_loadu_ps(in + i + 4);
+    _mm_storeu_ps(out + i, _mm_mul_ps(a, g));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(b, g));
+  }
+  gain_float_c(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("sse2") void
+gain_s16_sse2(int16_t const * in, int16_t * out, size_t samples, float gain)
+{
+  const __m128 g = _mm_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     float_to_s16_sse2(_mm_mul_ps(_mm_cvtepi32_ps(lo), g),
+                                       _mm_mul_ps(_mm_cvtepi32_ps(hi), g)));
+  }
+  gain_s16_c(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("sse2") void
+byteswap16_sse2(void const * in, void * out, size_t samples)
+{
+  uint16_t const * src = static_cast<uint16_t const *>(in);
+  uint16_t * dst = static_cast<uint16_t *>(out);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), x);
+  }
+  byteswap16_c(src + i, dst + i, samples - i);
+}
+
+CUBEB_TARGET("sse2") void
+byteswap32_sse2(void const * in, void * out, size_t samples)
+{
+  uint32_t const * src = static_cast<uint32_t const *>(in);
+  uint32_t * dst = static_cast<uint32_t *>(out);
+  size_t i = 0;
+  for (; i + 4 <= samples; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+    /* Swap the 16-bit halves, then the bytes of each half. */
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), x);
+  }
+  byteswap32_c(src + i, dst + i, samples - i);
+}
+
+/* Only stereo has a vector version, the other channel counts are rare
+   enough in backends that deal with planar buffers. */
+CUBEB_TARGET("sse2") void
+interleave_float_sse2(float const * const * in, float * out,
+                      uint32_t channels, size_t frames, float gain)
+{
+  if (channels != 2) {
+    interleave_float_c(in, out, channels, frames, gain);
+    return;
+  }
+  const __m128 g = _mm_set1_ps(gain);
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    __m128 l = _mm_mul_ps(_mm_loadu_ps(in[0] + f), g);
+    __m128 r = _mm_mul_ps(_mm_loadu_ps(in[1] + f), g);
+    _mm_storeu_ps(out + 2 * f, _mm_unpacklo_ps(l, r));
+    _mm_storeu_ps(out + 2 * f + 4, _mm_unpackhi_ps(l, r));
+  }
+  float const * tail[2] = { in[0] + f, in[1] + f };
+  interleave_float_c(tail, out + 2 * f, 2, frames - f, gain);
+}
+
+CUBEB_TARGET("sse2") void
+deinterleave_float_sse2(float const * in, float * const * out,
+                        uint32_t channels, size_t frames, float gain)
+{
+  if (channels != 2) {
+    deinterleave_float_c(in, out, channels, frames, gain);
+    return;
+  }
+  const __m128 g = _mm_set1_ps(gain);
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    __m128 a = _mm_loadu_ps(in + 2 * f);
+    __m128 b = _mm_loadu_ps(in + 2 * f + 4);
+    __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(out[0] + f, _mm_mul_ps(l, g));
+    _mm_storeu_ps(out[1] + f, _mm_mul_ps(r, g));
+  }
+  float * tail[2] = { out[0] + f, out[1] + f };
+  deinterleave_float_c(in + 2 * f, tail, 2, frames - f, gain);
+}
+
+CUBEB_TARGET("sse2") void
+gain_ramp_float_sse2(float const * in, float * out, uint32_t channels,
+                     size_t frames, float const * from, float const * to)
+{
+  if (channels > RAMP_MAX_CHANNELS) {
+    gain_ramp_float_c(in, out, channels, frames, from, to);
+    return;
+  }
+  alignas(16) float a[8 * RAMP_MAX_CHANNELS];
+  alignas(16) float d[8 * RAMP_MAX_CHANNELS];
+  ramp_lanes(channels, frames, from, to, a, d);
+  const size_t group = ramp_group_frames(channels);
+  const size_t samples = group * channels;
+  const size_t groups = frames / group;
+  for (size_t n = 0; n < groups; n++) {
+    const __m128 nv = _mm_set1_ps(static_cast<float>(n));
+    float const * src = in + n * samples;
+    float * dst = out + n * samples;
+    for (size_t j = 0; j < samples; j += 4) {
+      __m128 g = _mm_add_ps(_mm_load_ps(a + j),
+                            _mm_mul_ps(_mm_load_ps(d + j), nv));
+      _mm_storeu_ps(dst + j, _mm_mul_ps(_mm_loadu_ps(src + j), g));
+    }
+  }
+  gain_ramp_c_from(in, out, channels, frames, from, to, groups * group);
+}
+
+CUBEB_TARGET("sse2") void
+gain_ramp_s16_sse2(int16_t const * in, int16_t * out, uint32_t channels,
+                   size_t frames, float const * from, float const * to)
+{
+  if (channels > RAMP_MAX_CHANNELS) {
+    gain_ramp_s16_c(in, out, channels, frames, from, to);
+    return;
+  }
+  alignas(16) float a[8 * RAMP_MAX_CHANNELS];
+  alignas(16) float d[8 * RAMP_MAX_CHANNELS];
+  ramp_lanes(channels, frames, from, to, a, d);
+  const size_t group = ramp_group_frames(channels);
+  const size_t samples = group * channels;
+  const size_t groups = frames / group;
+  for (size_t n = 0; n < groups; n++) {
+    const __m128 nv = _mm_set1_ps(static_cast<float>(n));
+    int16_t const * src = in + n * samples;
+    int16_t * dst = out + n * samples;
+    for (size_t j = 0; j < samples; j += 8) {
+      __m128 g0 = _mm_add_ps(_mm_load_ps(a + j),
+                             _mm_mul_ps(_mm_load_ps(d + j), nv));
+      __m128 g1 = _mm_add_ps(_mm_load_ps(a + j + 4),
+                             _mm_mul_ps(_mm_load_ps(d + j + 4), nv));
+      __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + j));
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                       float_to_s16_sse2(_mm_mul_ps(_mm_cvtepi32_ps(lo), g0),
+                                         _mm_mul_ps(_mm_cvtepi32_ps(hi), g1)));
+    }
+  }
+  gain_ramp_c_from(in, out, channels, frames, from, to, groups * group);
+}
+
+/* Not fused: the sums would differ from the other versions. */
+CUBEB_TARGET("sse2") void
+accumulate_float_sse2(float const * in, float * out, size_t samples,
+                      float gain)
+{
+  const __m128 g = _mm_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), g);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), g);
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), a));
+    _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4), b));
+  }
+  accumulate_float_c(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("sse2") void
+accumulate_s16_sse2(int16_t const * in, float * out, size_t samples,
+                    float gain)
+{
+  const __m128 g = _mm_set1_ps(gain / 32768.0f);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(lo), g);
+    __m128 b = _mm_mul_ps(_mm_cvtepi32_ps(hi), g);
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), a));
+    _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4), b));
+  }
+  accumulate_s16_c(in + i, out + i, samples - i, gain);
+}
+
+const convert_kernels sse2_kernels = {
+  s16_to_float_sse2,
+  float_to_s16_sse2,
+  float_to_s16_dither_sse2,
+  gain_float_sse2,
+  gain_s16_sse2,
+  byteswap16_sse2,
+  byteswap32_sse2,
+  interleave_float_sse2,
+  deinterleave_float_sse2,
+  gain_ramp_float_sse2,
+  gain_ramp_s16_sse2,
+  accumulate_float_sse2,
+  accumulate_s16_sse2
+};
+
+#if !defined(CUBEB_NO_AVX2_DISPATCH)
+
+CUBEB_TARGET("avx2") __m256i
+float_to_s16_avx2(__m256 a, __m256 b)
+{
+  const __m256 min = _mm256_set1_ps(-32768.0f);
+  const __m256 max = _mm256_set1_ps(32767.0f);
+  a = _mm256_min_ps(_mm256_max_ps(a, min), max);
+  b = _mm256_min_ps(_mm256_max_ps(b, min), max);
+  __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a),
+                                      _mm256_cvtps_epi32(b));
+  /* The packing works on each 128-bit lane: put the quarters back in
+     order. */
+  return _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+CUBEB_TARGET("avx2") void
+s16_to_float_avx2(int16_t const * in, float * out, size_t samples, float gain)
+{
+  size_t vectors = samples / 8;
+  s16_to_float_c(in + vectors * 8, out + vectors * 8, samples % 8, gain);
+  const __m256 g = _mm256_set1_ps(gain / 32768.0f);
+  while (vectors--) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + vectors * 8));
+    __m256 y = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x));
+    _mm256_storeu_ps(out + vectors * 8, _mm256_mul_ps(y, g));
+  }
+}
+
+CUBEB_TARGET("avx2") void
+float_to_s16_avx2(float const * in, int16_t * out, size_t samples, float gain)
+{
+  const __m256 g = _mm256_set1_ps(gain * 32768.0f);
+  size_t i = 0;
+  for (; i + 16 <= samples; i += 16) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), g);
+    __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), g);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        float_to_s16_avx2(a, b));
+  }
+  float_to_s16_sse2(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("avx2") void
+gain_float_avx2(float const * in, float * out, size_t samples, float gain)
+{
+  const __m256 g = _mm256_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 16 <= samples; i += 16) {
+    __m256 a = _mm256_loadu_ps(in + i);
+    __m256 b = _mm256_loadu_ps(in + i + 8);
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(a, g));
+    _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(b, g));
+  }
+  gain_float_sse2(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("avx2") void
+gain_s16_avx2(int16_t const * in, int16_t * out, size_t samples, float gain)
+{
+  const __m256 g = _mm256_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 16 <= samples; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i + 8));
+    __m256 a = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x));
+    __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(y));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        float_to_s16_avx2(_mm256_mul_ps(a, g),
+                                          _mm256_mul_ps(b, g)));
+  }
+  gain_s16_sse2(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("avx2") void
+gain_ramp_float_avx2(float const * in, float * out, uint32_t channels,
+                     size_t frames, float const * from, float const * to)
+{
+  if (channels > RAMP_MAX_CHANNELS) {
+    gain_ramp_float_c(in, out, channels, frames, from, to);
+    return;
+  }
+  alignas(32) float a[8 * RAMP_MAX_CHANNELS];
+  alignas(32) float d[8 * RAMP_MAX_CHANNELS];
+  ramp_lanes(channels, frames, from, to, a, d);
+  const size_t group = ramp_group_frames(channels);
+  const size_t samples = group * channels;
+  const size_t groups = frames / group;
+  for (size_t n = 0; n < groups; n++) {
+    const __m256 nv = _mm256_set1_ps(static_cast<float>(n));
+    float const * src = in + n * samples;
+    float * dst = out + n * samples;
+    for (size_t j = 0; j < samples; j += 8) {
+      __m256 g = _mm256_add_ps(_mm256_load_ps(a + j),
+                               _mm256_mul_ps(_mm256_load_ps(d + j), nv));
+      _mm256_storeu_ps(dst + j, _mm256_mul_ps(_mm256_loadu_ps(src + j), g));
+    }
+  }
+  gain_ramp_c_from(in, out, channels, frames, from, to, groups * group);
+}
+
+CUBEB_TARGET("avx2") void
+gain_ramp_s16_avx2(int16_t const * in, int16_t * out, uint32_t channels,
+                   size_t frames, float const * from, float const * to)
+{
+  if (channels > RAMP_MAX_CHANNELS) {
+    gain_ramp_s16_c(in, out, channels, frames, from, to);
+    return;
+  }
+  alignas(32) float a[8 * RAMP_MAX_CHANNELS];
+  alignas(32) float d[8 * RAMP_MAX_CHANNELS];
+  ramp_lanes(channels, frames, from, to, a, d);
+  const size_t group = ramp_group_frames(channels);
+  const size_t samples = group * channels;
+  const size_t groups = frames / group;
+  const __m256 min = _mm256_set1_ps(-32768.0f);
+  const __m256 max = _mm256_set1_ps(32767.0f);
+  for (size_t n = 0; n < groups; n++) {
+    const __m256 nv = _mm256_set1_ps(static_cast<float>(n));
+    int16_t const * src = in + n * samples;
+    int16_t * dst = out + n * samples;
+    for (size_t j = 0; j < samples; j += 8) {
+      __m256 g = _mm256_add_ps(_mm256_load_ps(a + j),
+                               _mm256_mul_ps(_mm256_load_ps(d + j), nv));
+      __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + j));
+      __m256 y = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x)), g);
+      __m256i z = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(y, min), max));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                       _mm_packs_epi32(_mm256_castsi256_si128(z),
+                                       _mm256_extracti128_si256(z, 1)));
+    }
+  }
+  gain_ramp_c_from(in, out, channels, frames, from, to, groups * group);
+}
+
+CUBEB_TARGET("avx2") void
+accumulate_float_avx2(float const * in, float * out, size_t samples,
+                      float gain)
+{
+  const __m256 g = _mm256_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 16 <= samples; i += 16) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), g);
+    __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), g);
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), a));
+    _mm256_storeu_ps(out + i + 8,
+                     _mm256_add_ps(_mm256_loadu_ps(out + i + 8), b));
+  }
+  accumulate_float_sse2(in + i, out + i, samples - i, gain);
+}
+
+CUBEB_TARGET("avx2") void
+accumulate_s16_avx2(int16_t const * in, float * out, size_t samples,
+                    float gain)
+{
+  const __m256 g = _mm256_set1_ps(gain / 32768.0f);
+  size_t i = 0;
+  for (; i + 16 <= samples; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i + 8));
+    __m256 a = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x)), g);
+    __m256 b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(y)), g);
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), a));
+    _mm256_storeu_ps(out + i + 8,
+                     _mm256_add_ps(_mm256_loadu_ps(out + i + 8), b));
+  }
+  accumulate_s16_sse2(in + i, out + i, samples - i, gain);
+}
+
+/* Byte swapping, dithering and interleaving are bound by memory accesses,
+   or by the dependency of the noise generator: the SSE2 versions are as
+   fast. */
+const convert_kernels avx2_kernels = {
+  s16_to_float_avx2,
+  float_to_s16_avx2,
+  float_to_s16_dither_sse2,
+  gain_float_avx2,
+  gain_s16_avx2,
+  byteswap16_sse2,
+  byteswap32_sse2,
+  interleave_float_sse2,
+  deinterleave_float_sse2,
+  gain_ramp_float_avx2,
+  gain_ramp_s16_avx2,
+  accumulate_float_avx2,
+  accumulate_s16_avx2
+};
+
+#endif // !CUBEB_NO_AVX2_DISPATCH
+
+int
+cpu_simd_level()
+{
+  int features = cubeb_cpu_x86_features();
+  if (features & CUBEB_CPU_AVX2) {
+    return CUBEB_CONVERT_SIMD_AVX2;
+  }
+  if (features & CUBEB_CPU_SSE2) {
+    return CUBEB_CONVERT_SIMD_SSE2;
+  }
+  return CUBEB_CONVERT_SIMD_NONE;
+}
+
+#elif defined(CUBEB_CONVERT_NEON)
+
+int16x8_t
+float_to_s16_neon(float32x4_t a, float32x4_t b)
+{
+  const float32x4_t min = vdupq_n_f32(-32768.0f);
+  const float32x4_t max = vdupq_n_f32(32767.0f);
+  a = vminq_f32(vmaxq_f32(a, min), max);
+  b = vminq_f32(vmaxq_f32(b, min), max);
+  return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                      vqmovn_s32(vcvtnq_s32_f32(b)));
+}
+
+void
+s16_to_float_neon(int16_t const * in, float * out, size_t samples, float gain)
+{
+  size_t vectors = samples / 8;
+  s16_to_float_c(in + vectors * 8, out + vectors * 8, samples % 8, gain);
+  gain /= 32768.0f;
+  while (vectors--) {
+    int16x8_t x = vld1q_s16(in + vectors * 8);
+    float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+    float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+    vst1q_f32(out + vectors * 8, vmulq_n_f32(lo, gain));
+    vst1q_f32(out + vectors * 8 + 4, vmulq_n_f32(hi, gain));
+  }
+}
+
+void
+float_to_s16_neon(float const * in, int16_t * out, size_t samples, float gain)
+{
+  float g = gain * 32768.0f;
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    float32x4_t a = vmulq_n_f32(vld1q_f32(in + i), g);
+    float32x4_t b = vmulq_n_f32(vld1q_f32(in + i + 4), g);
+    vst1q_s16(out + i, float_to_s16_neon(a, b));
+  }
+  float_to_s16_c(in + i, out + i, samples - i, gain);
+}
+
+uint32x4_t
+xorshift32_neon(uint32x4_t x)
+{
+  x = veorq_u32(x, vshlq_n_u32(x, 13));
+  x = veorq_u32(x, vshrq_n_u32(x, 17));
+  return veorq_u32(x, vshlq_n_u32(x, 5));
+}
+
+float32x4_t
+triangular_noise_neon(uint32x4_t r)
+{
+  int32x4_t d = vsubq_s32(vreinterpretq_s32_u32(vandq_u32(r, vdupq_n_u32(0xffff))),
+                          vreinterpretq_s32_u32(vshrq_n_u32(r, 16)));
+  return vmulq_n_f32(vcvtq_f32_s32(d), 1.0f / 65536.0f);
+}
+
+void
+float_to_s16_dither_neon(float const * in, int16_t * out, size_t samples,
+                         float gain, cubeb_convert_dither_state * state)
+{
+  float g = gain * 32768.0f;
+  uint32x4_t lanes = vld1q_u32(state->lanes);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    lanes = xorshift32_neon(lanes);
+    float32x4_t a = vaddq_f32(vmulq_n_f32(vld1q_f32(in + i), g),
+                              triangular_noise_neon(lanes));
+    lanes = xorshift32_neon(lanes);
+    float32x4_t b = vaddq_f32(vmulq_n_f32(vld1q_f32(in + i + 4), g),
+                              triangular_noise_neon(lanes));
+    vst1q_s16(out + i, float_to_s16_neon(a, b));
+  }
+  vst1q_u32(state->lanes, lanes);
+  float_to_s16_dither_c(in + i, out + i, samples - i, gain, state);
+}
+
+void
+gain_float_neon(float const * in, float * out, size_t samples, float gain)
+{
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    float32x4_t a = vld1q_f32(in + i);
+    float32x4_t b = vld1q_f32(in + i + 4);
+    vst1q_f32(out + i, vmulq_n_f32(a, gain));
+    vst1q_f32(out + i + 4, vmulq_n_f32(b, gain));
+  }
+  gain_float_c(in + i, out + i, samples - i, gain);
+}
+
+void
+gain_s16_neon(int16_t const * in, int16_t * out, size_t samples, float gain)
+{
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    int16x8_t x = vld1q_s16(in + i);
+    float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+    float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+    vst1q_s16(out + i, float_to_s16_neon(vmulq_n_f32(lo, gain),
+                                         vmulq_n_f32(hi, gain)));
+  }
+  gain_s16_c(in + i, out + i, samples - i, gain);
+}
+
+void
+byteswap16_neon(void const * in, void * out, size_t samples)
+{
+  uint8_t const * src = static_cast<uint8_t const *>(in);
+  uint8_t * dst = static_cast<uint8_t *>(out);
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    vst1q_u8(dst + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+  }
+  byteswap16_c(src + 2 * i, dst + 2 * i, samples - i);
+}
+
+void
+byteswap32_neon(void const * in, void * out, size_t samples)
+{
+  uint8_t const * src = static_cast<uint8_t const *>(in);
+  uint8_t * dst = static_cast<uint8_t *>(out);
+  size_t i = 0;
+  for (; i + 4 <= samples; i += 4) {
+    vst1q_u8(dst + 4 * i, vrev32q_u8(vld1q_u8(src + 4 * i)));
+  }
+  byteswap32_c(src + 4 * i, dst + 4 * i, samples - i);
+}
+
+void
+interleave_float_neon(float const * const * in, float * out,
+                      uint32_t channels, size_t frames, float gain)
+{
+  if (channels != 2) {
+    interleave_float_c(in, out, channels, frames, gain);
+    return;
+  }
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    float32x4x2_t x;
+    x.val[0] = vmulq_n_f32(vld1q_f32(in[0] + f), gain);
+    x.val[1] = vmulq_n_f32(vld1q_f32(in[1] + f), gain);
+    vst2q_f32(out + 2 * f, x);
+  }
+  float const * tail[2] = { in[0] + f, in[1] + f };
+  interleave_float_c(tail, out + 2 * f, 2, frames - f, gain);
+}
+
+void
+deinterleave_float_neon(float const * in, float * const * out,
+                        uint32_t channels, size_t frames, float gain)
+{
+  if (channels != 2) {
+    deinterleave_float_c(in, out, channels, frames, gain);
+    return;
+  }
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    float32x4x2_t x = vld2q_f32(in + 2 * f);
+    vst1q_f32(out[0] + f, vmulq_n_f32(x.val[0], gain));
+    vst1q_f32(out[1] + f, vmulq_n_f32(x.val[1], gain));
+  }
+  float * tail[2] = { out[0] + f, out[1] + f };
+  deinterleave_float_c(in + 2 * f, tail, 2, frames - f, gain);
+}
+
+void
+gain_ramp_float_neon(float const * in, float * out, uint32_t channels,
+                     size_t frames, float const * from, float const * to)
+{
+  if (channels > RAMP_MAX_CHANNELS) {
+    gain_ramp_float_c(in, out, channels, frames, from, to);
+    return;
+  }
+  float a[8 * RAMP_MAX_CHANNELS];
+  float d[8 * RAMP_MAX_CHANNELS];
+  ramp_lanes(channels, frames, from, to, a, d);
+  const size_t group = ramp_group_frames(channels);
+  const size_t samples = group * channels;
+  const size_t groups = frames / group;
+  for (size_t n = 0; n < groups; n++) {
+    const float32x4_t nv = vdupq_n_f32(static_cast<float>(n));
+    float const * src = in + n * samples;
+    float * dst = out + n * samples;
+    for (size_t j = 0; j < samples; j += 4) {
+      /* Not vmlaq_f32, that may be fused: the gains would differ from the
+         other versions. */
+      float32x4_t g = vaddq_f32(vld1q_f32(a + j),
+                                vmulq_f32(vld1q_f32(d + j), nv));
+      vst1q_f32(dst + j, vmulq_f32(vld1q_f32(src + j), g));
+    }
+  }
+  gain_ramp_c_from(in, out, channels, frames, from, to, groups * group);
+}
+
+void
+gain_ramp_s16_neon(int16_t const * in, int16_t * out, uint32_t channels,
+                   size_t frames, float const * from, float const * to)
+{
+  if (channels > RAMP_MAX_CHANNELS) {
+    gain_ramp_s16_c(in, out, channels, frames, from, to);
+    return;
+  }
+  float a[8 * RAMP_MAX_CHANNELS];
+  float d[8 * RAMP_MAX_CHANNELS];
+  ramp_lanes(channels, frames, from, to, a, d);
+  const size_t group = ramp_group_frames(channels);
+  const size_t samples = group * channels;
+  const size_t groups = frames / group;
+  for (size_t n = 0; n < groups; n++) {
+    const float32x4_t nv = vdupq_n_f32(static_cast<float>(n));
+    int16_t const * src = in + n * samples;
+    int16_t * dst = out + n * samples;
+    for (size_t j = 0; j < samples; j += 8) {
+      float32x4_t g0 = vaddq_f32(vld1q_f32(a + j),
+                                 vmulq_f32(vld1q_f32(d + j), nv));
+      float32x4_t g1 = vaddq_f32(vld1q_f32(a + j + 4),
+                                 vmulq_f32(vld1q_f32(d + j + 4), nv));
+      int16x8_t x = vld1q_s16(src + j);
+      float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+      float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+      vst1q_s16(dst + j, float_to_s16_neon(vmulq_f32(lo, g0),
+                                           vmulq_f32(hi, g1)));
+    }
+  }
+  gain_ramp_c_from(in, out, channels, frames, from, to, groups * group);
+}
+
+void
+accumulate_float_neon(float const * in, float * out, size_t samples,
+                      float gain)
+{
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    float32x4_t a = vmulq_n_f32(vld1q_f32(in + i), gain);
+    float32x4_t b = vmulq_n_f32(vld1q_f32(in + i + 4), gain);
+    vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), a));
+    vst1q_f32(out + i + 4, vaddq_f32(vld1q_f32(out + i + 4), b));
+  }
+  accumulate_float_c(in + i, out + i, samples - i, gain);
+}
+
+void
+accumulate_s16_neon(int16_t const * in, float * out, size_t samples,
+                    float gain)
+{
+  float g = gain / 32768.0f;
+  size_t i = 0;
+  for (; i + 8 <= samples; i += 8) {
+    int16x8_t x = vld1q_s16(in + i);
+    float32x4_t a = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), g);
+    float32x4_t b = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), g);
+    vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), a));
+    vst1q_f32(out + i + 4, vaddq_f32(vld1q_f32(out + i + 4), b));
+  }
+  accumulate_s16_c(in + i, out + i, samples - i, gain);
+}
+
+const convert_kernels neon_kernels = {
+  s16_to_float_neon,
+  float_to_s16_neon,
+  float_to_s16_dither_neon,
+  gain_float_neon,
+  gain_s16_neon,
+  byteswap16_neon,
+  byteswap32_neon,
+  interleave_float_neon,
+  deinterleave_float_neon,
+  gain_ramp_float_neon,
+  gain_ramp_s16_neon,
+  accumulate_float_neon,
+  accumulate_s16_neon
+};
+
+int
+cpu_simd_level()
+{
+  return CUBEB_CONVERT_SIMD_NEON;
+}
+
+#else
+
+int
+cpu_simd_level()
+{
+  return CUBEB_CONVERT_SIMD_NONE;
+}
+
+#endif
+
+std::atomic<int> max_level(CUBEB_CONVERT_SIMD_NEON);
+std::atomic<const convert_kernels *> active_kernels(nullptr);
+
+/* Clamp a CUBEB_CONVERT_SIMD_* level to what this build and CPU can do. */
+int
+usable_simd_level(int level)
+{
+  static const int cpu_level = cpu_simd_level();
+  level = std::min(level, cpu_level);
+#if defined(CUBEB_CONVERT_NEON)
+  return level == CUBEB_CONVERT_SIMD_NEON ? level : CUBEB_CONVERT_SIMD_NONE;
+#else
+#if defined(CUBEB_NO_AVX2_DISPATCH)
+  level = std::min<int>(level, CUBEB_CONVERT_SIMD_SSE2);
+#endif
+  return std::max<int>(level, CUBEB_CONVERT_SIMD_NONE);
+#endif
+}
+
+const convert_kernels *
+select_kernels(int level)
+{
+  switch (level) {
+#if defined(CUBEB_CONVERT_X86)
+#if !defined(CUBEB_NO_AVX2_DISPATCH)
+  case CUBEB_CONVERT_SIMD_AVX2:
+    return &avx2_kernels;
+#endif
+  case CUBEB_CONVERT_SIMD_SSE2:
+    return &sse2_kernels;
+#elif defined(CUBEB_CONVERT_NEON)
+  case CUBEB_CONVERT_SIMD_NEON:
+    return &neon_kernels;
+#endif
+  default:
+    return &c_kernels;
+  }
+}
+
+const convert_kernels *
+kernels()
+{
+  const convert_kernels * k = active_kernels.load(std::memory_order_relaxed);
+  if (!k) {
+    k = select_kernels(cubeb_convert_get_simd_level());
+    active_kernels.store(k, std::memory_order_relaxed);
+  }
+  return k;
+}
+
+} // namespace
+
+int
+cubeb_convert_get_simd_level(void)
+{
+  return usable_simd_level(max_level.load(std::memory_order_relaxed));
+}
+
+int
+cubeb_convert_set_simd_level(int level)
+{
+  max_level.store(level, std::memory_order_relaxed);
+  int usable = cubeb_convert_get_simd_level();
+  active_kernels.store(select_kernels(usable), std::memory_order_relaxed);
+  return usable;
+}
+
+void
+cubeb_convert_s16_to_float(int16_t const * in, float * out,
+                           size_t samples, float gain)
+{
+  kernels()->s16_to_float(in, out, samples, gain);
+}
+
+void
+cubeb_convert_float_to_s16(float const * in, int16_t * out,
+                           size_t samples, float gain)
+{
+  kernels()->float_to_s16(in, out, samples, gain);
+}
+
+void
+cubeb_convert_dither_init(cubeb_convert_dither_state * state, uint32_t seed)
+{
+  for (int i = 0; i < 4; i++) {
+    /* xorshift32 must not start at zero. */
+    seed = seed * 1664525u + 1013904223u;
+    state->lanes[i] = seed ? seed : 1;
+  }
+}
+
+void
+cubeb_convert_float_to_s16_dither(float const * in, int16_t * out,
+                                  size_t samples, float gain,
+                                  cubeb_convert_dither_state * state)
+{
+  kernels()->float_to_s16_dither(in, out, samples, gain, state);
+}
+
+void
+cubeb_convert_gain_float(float const * in, float * out,
+                         size_t samples, float gain)
+{
+  /* Unity and mute don't need a multiplication per sample. */
+  if (gain == 1.0f) {
+    if (in != out) {
+      memcpy(out, in, samples * sizeof(float));
+    }
+  } else if (gain == 0.0f) {
+    memset(out, 0, samples * sizeof(float));
+  } else {
+    kernels()->gain_float(in, out, samples, gain);
+  }
+}
+
+void
+cubeb_convert_gain_s16(int16_t const * in, int16_t * out,
+                       size_t samples, float gain)
+{
+  if (gain == 1.0f) {
+    if (in != out) {
+      memcpy(out, in, samples * sizeof(int16_t));
+    }
+  } else if (gain == 0.0f) {
+    memset(out, 0, samples * sizeof(int16_t));
+  } else {
+    kernels()->gain_s16(in, out, samples, gain);
+  }
+}
+
+void
+cubeb_convert_gain_ramp_float(float const * in, float * out,
+                              uint32_t channels, size_t frames,
+                              float const * from, float const * to)
+{
+  if (!channels || !frames) {
+    return;
+  }
+  kernels()->gain_ramp_float(in, out, channels, frames, from, to);
+}
+
+void
+cubeb_convert_gain_ramp_s16(int16_t const * in, int16_t * out,
+                            uint32_t channels, size_t frames,
+                            float const * from, float const * to)
+{
+  if (!channels || !frames) {
+    return;
+  }
+  kernels()->gain_ramp_s16(in, out, channels, frames, from, to);
+}
+
+void
+cubeb_convert_accumulate_float(float const * in, float * out,
+                               size_t samples, float gain)
+{
+  if (gain == 0.0f) {
+    return;
+  }
+  kernels()->accumulate_float(in, out, samples, gain);
+}
+
+void
+cubeb_convert_accumulate_s16(int16_t const * in, float * out,
+                             size_t samples, float gain)
+{
+  if (gain == 0.0f) {
+    return;
+  }
+  kernels()->accumulate_s16(in, out, samples, gain);
+}
+
+void
+cubeb_convert_byteswap16(void const * in, void * out, size_t samples)
+{
+  kernels()->byteswap16(in, out, samples);
+}
+
+void
+cubeb_convert_byteswap32(void const * in, void * out, size_t samples)
+{
+  kernels()->byteswap32(in, out, samples);
+}
+
+void
+cubeb_convert_interleave_float(float const * const * in, float * out,
+                               uint32_t channels, size_t frames, float gain)
+{
+  kernels()->interleave_float(in, out, channels, frames, gain);
+}
+
+void
+cubeb_convert_deinterleave_float(float const * in, float * const * out,
+                                 uint32_t channels, size_t frames, float gain)
+{
+  kernels()->deinterleave_float(in, out, channels, frames, gain);
+}
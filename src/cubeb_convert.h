@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#ifndef CUBEB_CONVERT_H
+#define CUBEB_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * Sample format conversions shared by the backends, with SSE2, AVX2 and NEON
+ * versions picked at runtime.
+ *
+ * Samples are native-endian. Floats are in [-1.0; 1.0], and 1.0 is 32768 in
+ * S16: float to S16 conversions round to the nearest integer and clip. All
+ * the conversions take a gain, applied on the way: pass 1.0 to only convert.
+ *
+ * Unless noted otherwise, `out` can be the same buffer as `in`, to convert in
+ * place. Buffers don't need to be aligned. */
+
+/* Instruction sets that can be selected at runtime. */
+enum {
+  CUBEB_CONVERT_SIMD_NONE = 0,
+  CUBEB_CONVERT_SIMD_SSE2 = 1,
+  CUBEB_CONVERT_SIMD_AVX2 = 2,
+  CUBEB_CONVERT_SIMD_NEON = 3
+};
+
+/** Returns the instruction set used by the conversions, as one of the
+ * CUBEB_CONVERT_SIMD_* values. This is the best one supported by the CPU,
+ * unless it has been limited with cubeb_convert_set_simd_level. */
+int cubeb_convert_get_simd_level(void);
+
+/** Limit the instruction set used by the conversions. This is meant for
+ * testing and benchmarking, and must not be called while conversions are
+ * running on other threads.
+ * @return The level that will actually be used, which can be lower than
+ * `level` if the CPU does not support it. */
+int cubeb_convert_set_simd_level(int level);
+
+/** Convert `samples` S16 samples to float. Converting in place works, the
+ * buffer being walked from the end. */
+void cubeb_convert_s16_to_float(int16_t const * in, float * out,
+                                size_t samples, float gain);
+
+/** Convert `samples` float samples to S16. */
+void cubeb_convert_float_to_s16(float const * in, int16_t * out,
+                                size_t samples, float gain);
+
+/** State of the noise generator used by cubeb_convert_float_to_s16_dither. */
+typedef struct {
+  uint32_t lanes[4];
+} cubeb_convert_dither_state;
+
+/** Seed a dither state. `seed` can be anything. */
+void cubeb_convert_dither_init(cubeb_convert_dither_state * state,
+                               uint32_t seed);
+
+/** Convert `samples` float samples to S16, adding triangular dither of one
+ * LSB peak before rounding. The output only depends on the state and the
+ * input, not on the instruction set used. */
+void cubeb_convert_float_to_s16_dither(float const * in, int16_t * out,
+                                       size_t samples, float gain,
+                                       cubeb_convert_dither_state * state);
+
+/** Apply a gain to `samples` float samples. A gain of 1.0 only copies the
+ * samples, if `out` isn't `in`, and a gain of 0.0 writes silence. */
+void cubeb_convert_gain_float(float const * in, float * out,
+                              size_t samples, float gain);
+
+/** Apply a gain to `samples` S16 samples, clipping the result. A gain of 1.0
+ * only copies the samples, if `out` isn't `in`, and a gain of 0.0 writes
+ * silence. */
+void cubeb_convert_gain_s16(int16_t const * in, int16_t * out,
+                            size_t samples, float gain);
+
+/** Apply a gain per channel to `frames` interleaved frames of `channels`
+ * float samples, going linearly from `from[c]` to `to[c]` across the frames:
+ * frame `f` gets `from[c] + (to[c] - from[c]) * (f + 1) / frames`, up to
+ * rounding. With `from` equal to `to`, this is a constant gain per channel. */
+void cubeb_convert_gain_ramp_float(float const * in, float * out,
+                                   uint32_t channels, size_t frames,
+                                   float const * from, float const * to);
+
+/** cubeb_convert_gain_ramp_float for S16 samples, clipping the result. */
+void cubeb_convert_gain_ramp_s16(int16_t const * in, int16_t * out,
+                                 uint32_t channels, size_t frames,
+                                 float const * from, float const * to);
+
+/** Add `samples` float samples, times a gain, to `out`, to mix them with the
+ * samples already there. `out` can't be `in`. A gain of 0.0 leaves `out`
+ * as it is. */
+void cubeb_convert_accumulate_float(float const * in, float * out,
+                                    size_t samples, float gain);
+
+/** Convert `samples` S16 samples to float and add them, times a gain, to
+ * `out`. A gain of 0.0 leaves `out` as it is. */
+void cubeb_convert_accumulate_s16(int16_t const * in, float * out,
+                                  size_t samples, float gain);
+
+/** Swap the bytes of `samples` 16-bit samples, to convert between S16LE and
+ * S16BE. */
+void cubeb_convert_byteswap16(void const * in, void * out, size_t samples);
+
+/** Swap the bytes of `samples` 32-bit samples, to convert between
+ * FLOAT32LE and FLOAT32BE. */
+void cubeb_convert_byteswap32(void const * in, void * out, size_t samples);
+
+/** Interleave `channels` planar float buffers of `frames` frames into `out`.
+ * `out` can't be one of the input buffers. */
+void cubeb_convert_interleave_float(float const * const * in, float * out,
+                                    uint32_t channels, size_t frames,
+                                    float gain);
+
+/** Split `frames` interleaved frames of `channels` float samples into
+ * `channels` planar buffers. `in` can't be one of the output buffers. */
+void cubeb_convert_deinterleave_float(float const * in, float * const * out,
+                                      uint32_t channels, size_t frames,
+                                      float gain);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* CUBEB_CONVERT_H */
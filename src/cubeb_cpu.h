@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#ifndef CUBEB_CPU_H
+#define CUBEB_CPU_H
+
+/* Runtime detection of the x86 instruction sets that the sample format
+   conversions and the resampler dispatch to. This is shared by C and C++
+   code, and only included by the files that dispatch. */
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+enum {
+  CUBEB_CPU_SSE2 = 1 << 0,
+  CUBEB_CPU_AVX2 = 1 << 1,
+  CUBEB_CPU_FMA = 1 << 2
+};
+
+/* Returns the CUBEB_CPU_* flags of the instruction sets that this CPU has and
+   that the operating system supports. This executes cpuid: callers probe once
+   and keep the result. */
+static inline int
+cubeb_cpu_x86_features(void)
+{
+  int features = 0;
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  int max_leaf;
+  int avx_usable = 0;
+  __cpuid(info, 0);
+  max_leaf = info[0];
+  __cpuid(info, 1);
+  if (info[3] & (1 << 26)) {
+    features |= CUBEB_CPU_SSE2;
+  }
+  /* The OS saves the AVX registers on context switches. */
+  if ((info[2] & (1 << 27)) && (info[2] & (1 << 28))) {
+    avx_usable = (_xgetbv(0) & 6) == 6;
+  }
+  if (avx_usable && max_leaf >= 7) {
+    int ext[4];
+    __cpuidex(ext, 7, 0);
+    if (ext[1] & (1 << 5)) {
+      features |= CUBEB_CPU_AVX2;
+    }
+    if (info[2] & (1 << 12)) {
+      features |= CUBEB_CPU_FMA;
+    }
+  }
+#elif defined(__GNUC__) || defined(__clang__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    features |= CUBEB_CPU_SSE2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    features |= CUBEB_CPU_AVX2;
+  }
+  if (__builtin_cpu_supports("fma")) {
+    features |= CUBEB_CPU_FMA;
+  }
+#endif
+  return features;
+}
+
+#endif
+
+#endif /* CUBEB_CPU_H */
@@ -0,0 +1,264 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <memory>
+#include "cubeb/cubeb.h"
+#include "cubeb_convert.h"
+#include "cubeb_gain.h"
+#include "cubeb_panner.h"
+
+namespace {
+
+void
+apply_uniform(float const * in, float * out, size_t samples, float gain)
+{
+  cubeb_convert_gain_float(in, out, samples, gain);
+}
+
+void
+apply_uniform(int16_t const * in, int16_t * out, size_t samples, float gain)
+{
+  cubeb_convert_gain_s16(in, out, samples, gain);
+}
+
+void
+apply_ramp(float const * in, float * out, uint32_t channels, size_t frames,
+           float const * from, float const * to)
+{
+  cubeb_convert_gain_ramp_float(in, out, channels, frames, from, to);
+}
+
+void
+apply_ramp(int16_t const * in, int16_t * out, uint32_t channels, size_t frames,
+           float const * from, float const * to)
+{
+  cubeb_convert_gain_ramp_s16(in, out, channels, frames, from, to);
+}
+
+float
+to_sample(float x, float)
+{
+  return x;
+}
+
+int16_t
+to_sample(float x, int16_t)
+{
+  return static_cast<int16_t>(lrintf(std::min(std::max(x, -32768.0f), 32767.0f)));
+}
+
+/** Apply the gains of a stereo stream whose channels are also mixed into each
+ * other, ramping from `from` to `to` over the block like apply_ramp. */
+template<typename T>
+void
+apply_stereo(T const * in, T * out, size_t frames,
+             float const * from, float const * to,
+             float const * cross_from, float const * cross_to)
+{
+  float step[2], cross_step[2];
+  for (int c = 0; c < 2; c++) {
+    step[c] = (to[c] - from[c]) / frames;
+    cross_step[c] = (cross_to[c] - cross_from[c]) / frames;
+  }
+  for (size_t f = 0; f < frames; f++) {
+    float k = static_cast<float>(f + 1);
+    float l = in[2 * f];
+    float r = in[2 * f + 1];
+    out[2 * f] = to_sample(l * (from[0] + step[0] * k) +
+                           r * (cross_from[0] + cross_step[0] * k), T());
+    out[2 * f + 1] = to_sample(r * (from[1] + step[1] * k) +
+                               l * (cross_from[1] + cross_step[1] * k), T());
+  }
+}
+
+} // namespace
+
+struct cubeb_gain {
+  explicit cubeb_gain(uint32_t channels)
+    : channels(channels)
+    , volume(1.0f)
+    , channel_volumes(new std::atomic<float>[channels])
+    , pan_gains(new std::atomic<float>[channels])
+    , pan_cross(new std::atomic<float>[channels])
+    , current(new float[channels])
+    , target(new float[channels])
+    , current_cross(new float[channels])
+    , target_cross(new float[channels])
+  {
+    for (uint32_t c = 0; c < channels; c++) {
+      channel_volumes[c].store(1.0f, std::memory_order_relaxed);
+      pan_gains[c].store(1.0f, std::memory_order_relaxed);
+      pan_cross[c].store(0.0f, std::memory_order_relaxed);
+      current[c] = 1.0f;
+      target[c] = 1.0f;
+      current_cross[c] = 0.0f;
+      target_cross[c] = 0.0f;
+    }
+  }
+
+  /** Compute the gains of the next block in `target`. Returns true if they
+   * are the gains of the previous block. Before the first block, there is
+   * nothing to ramp from: they are. */
+  bool load_target()
+  {
+    float v = volume.load(std::memory_order_relaxed);
+    bool steady = true;
+    for (uint32_t c = 0; c < channels; c++) {
+      float channel = v * channel_volumes[c].load(std::memory_order_relaxed);
+      target[c] = channel * pan_gains[c].load(std::memory_order_relaxed);
+      target_cross[c] = channel * pan_cross[c].load(std::memory_order_relaxed);
+      if (!started) {
+        current[c] = target[c];
+        current_cross[c] = target_cross[c];
+      }
+      steady &= target[c] == current[c] &&
+                target_cross[c] == current_cross[c];
+    }
+    started = true;
+    return steady;
+  }
+
+  /** Whether the channels are mixed into each other, in the last block or in
+   * the next one. Only for stereo. */
+  bool crossed() const
+  {
+    for (uint32_t c = 0; c < channels; c++) {
+      if (current_cross[c] != 0.0f || target_cross[c] != 0.0f) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool uniform() const
+  {
+    if (crossed()) {
+      return false;
+    }
+    for (uint32_t c = 1; c < channels; c++) {
+      if (current[c] != current[0]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template<typename T>
+  void apply(T const * in, T * out, size_t frames)
+  {
+    if (!frames) {
+      return;
+    }
+    bool steady = load_target();
+    if (crossed()) {
+      apply_stereo(in, out, frames, current.get(), target.get(),
+                   current_cross.get(), target_cross.get());
+      std::copy(target.get(), target.get() + channels, current.get());
+      std::copy(target_cross.get(), target_cross.get() + channels,
+                current_cross.get());
+      return;
+    }
+    if (steady) {
+      if (uniform()) {
+        apply_uniform(in, out, frames * channels, current[0]);
+      } else {
+        apply_ramp(in, out, channels, frames, current.get(), current.get());
+      }
+      return;
+    }
+    apply_ramp(in, out, channels, frames, current.get(), target.get());
+    std::copy(target.get(), target.get() + channels, current.get());
+  }
+
+  const uint32_t channels;
+  std::atomic<float> volume;
+  std::unique_ptr<std::atomic<float>[]> channel_volumes;
+  /** Computed by cubeb_pan_gains when the panning changes. */
+  std::unique_ptr<std::atomic<float>[]> pan_gains;
+  std::unique_ptr<std::atomic<float>[]> pan_cross;
+  /** The gains of the last block, and of the next one, and the ones with
+   * which the other channel is mixed in. Only used on the audio thread. */
+  std::unique_ptr<float[]> current;
+  std::unique_ptr<float[]> target;
+  std::unique_ptr<float[]> current_cross;
+  std::unique_ptr<float[]> target_cross;
+  bool started = false;
+};
+
+cubeb_gain *
+cubeb_gain_create(uint32_t channels)
+{
+  if (!channels) {
+    return nullptr;
+  }
+  return new cubeb_gain(channels);
+}
+
+void
+cubeb_gain_set_volume(cubeb_gain * gain, float volume)
+{
+  gain->volume.store(volume, std::memory_order_relaxed);
+}
+
+int
+cubeb_gain_set_channel_volumes(cubeb_gain * gain, float const * volumes,
+                               uint32_t channels)
+{
+  if (channels != gain->channels) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+  for (uint32_t c = 0; c < channels; c++) {
+    gain->channel_volumes[c].store(volumes[c], std::memory_order_relaxed);
+  }
+  return CUBEB_OK;
+}
+
+void
+cubeb_gain_set_panning(cubeb_gain * gain, cubeb_channel_layout layout,
+                       float pan)
+{
+  std::unique_ptr<float[]> gains(new float[gain->channels]);
+  std::unique_ptr<float[]> cross(new float[gain->channels]);
+  cubeb_pan_gains(layout, gain->channels, pan, gains.get(), cross.get());
+  for (uint32_t c = 0; c < gain->channels; c++) {
+    gain->pan_gains[c].store(gains[c], std::memory_order_relaxed);
+    gain->pan_cross[c].store(cross[c], std::memory_order_relaxed);
+  }
+}
+
+int
+cubeb_gain_get_uniform(cubeb_gain * gain, float * uniform)
+{
+  if (!gain->load_target() || !gain->uniform()) {
+    return 0;
+  }
+  *uniform = gain->current[0];
+  return 1;
+}
+
+void
+cubeb_gain_apply_float(cubeb_gain * gain, float const * in, float * out,
+                       size_t frames)
+{
+  gain->apply(in, out, frames);
+}
+
+void
+cubeb_gain_apply_s16(cubeb_gain * gain, int16_t const * in, int16_t * out,
+                     size_t frames)
+{
+  gain->apply(in, out, frames);
+}
+
+void
+cubeb_gain_destroy(cubeb_gain * gain)
+{
+  delete gain;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#ifndef CUBEB_GAIN_H
+#define CUBEB_GAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cubeb/cubeb.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * The volume of an output stream, applied by the backends that don't have a
+ * volume control of their own.
+ *
+ * The gain of each channel is the volume of the stream times the volume of
+ * the channel times its panning gain; a panned stereo stream also gets the
+ * other channel mixed in. All of them can be changed from any thread while
+ * the audio thread applies the gain: the next block then ramps linearly from
+ * the previous gains to the new ones, instead of jumping to them and
+ * clicking. A gain of 1.0 on all channels doesn't touch the samples, a gain
+ * of 0.0 writes silence, and the samples are multiplied with the SIMD
+ * kernels of cubeb_convert otherwise. */
+typedef struct cubeb_gain cubeb_gain;
+
+/** Create a gain stage for `channels` channels, at a volume of 1.0. */
+cubeb_gain * cubeb_gain_create(uint32_t channels);
+
+/** Set the volume of all the channels, in [0.0; 1.0]. */
+void cubeb_gain_set_volume(cubeb_gain * gain, float volume);
+
+/** Set the volume of each channel, in [0.0; 1.0], on top of the volume set
+ * with cubeb_gain_set_volume.
+ * @param volumes One volume per channel.
+ * @param channels The number of volumes, which must be the channel count of
+ *        the stage.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_INVALID_PARAMETER if `channels` is not the channel
+ *         count of the stage. */
+int cubeb_gain_set_channel_volumes(cubeb_gain * gain, float const * volumes,
+                                   uint32_t channels);
+
+/** Pan the channels, laid out as `layout`, to `pan`, in [-1.0; 1.0]: see
+ * cubeb_pan_gains. The gains are computed here, so that panning costs nothing
+ * more than a per-channel volume on the audio thread, or a 2x2 matrix for
+ * stereo. */
+void cubeb_gain_set_panning(cubeb_gain * gain, cubeb_channel_layout layout,
+                            float pan);
+
+/** If the next block gets the same gain on all channels, without a ramp,
+ * returns 1 and stores this gain in `uniform`: callers that convert the
+ * samples anyway can apply it as part of the conversion, instead of calling
+ * cubeb_gain_apply_*. Returns 0 otherwise. */
+int cubeb_gain_get_uniform(cubeb_gain * gain, float * uniform);
+
+/** Apply the gain to a block of `frames` interleaved frames. `out` can be
+ * `in`. These are called on the audio thread, and don't lock or allocate. */
+void cubeb_gain_apply_float(cubeb_gain * gain, float const * in, float * out,
+                            size_t frames);
+void cubeb_gain_apply_s16(cubeb_gain * gain, int16_t const * in, int16_t * out,
+                          size_t frames);
+
+void cubeb_gain_destroy(cubeb_gain * gain);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* CUBEB_GAIN_H */
@@ -20,6 +20,8 @@
 #include <math.h>
 #include "cubeb/cubeb.h"
 #include "cubeb-internal.h"
+#include "cubeb_convert.h"
+#include "cubeb_gain.h"
 #include "cubeb_resampler.h"
 #include "cubeb_utils.h"
 
@@ -61,23 +63,6 @@ enum devstream {
   DUPLEX,
 };
 
-static void
-s16ne_to_float(float * dst, const int16_t * src, size_t n)
-{
-  for (size_t i = 0; i < n; i++)
-    *(dst++) = (float)((float)*(src++) / 32767.0f);
-}
-
-static void
-float_to_s16ne(int16_t * dst, float * src, size_t n)
-{
-  for (size_t i = 0; i < n; i++) {
-    if (*src > 1.f) *src = 1.f;
-    if (*src < -1.f) *src = -1.f;
-    *(dst++) = (int16_t)((int16_t)(*(src++) * 32767));
-  }
-}
-
 extern "C"
 {
 /*static*/ int jack_init (cubeb ** context, char const * context_name);
@@ -112,6 +97,10 @@ static int cbjack_stream_start(cubeb_stream * stream);
 static int cbjack_stream_stop(cubeb_stream * stream);
 static int cbjack_stream_get_position(cubeb_stream * stream, uint64_t * position);
 static int cbjack_stream_set_volume(cubeb_stream * stm, float volume);
+static int cbjack_stream_set_channel_volumes(cubeb_stream * stm,
+                                             float const * volumes,
+                                             uint32_t channels);
+static int cbjack_stream_set_panning(cubeb_stream * stm, float panning);
 
 static struct cubeb_ops const cbjack_ops = {
   .init = jack_init,
@@ -130,7 +119,10 @@ static struct cubeb_ops const cbjack_ops = {
   .stream_get_position = cbjack_stream_get_position,
   .stream_get_latency = cbjack_get_latency,
   .stream_set_volume = cbjack_stream_set_volume,
-  .stream_set_panning = NULL,
+  .stream_set_channel_volumes = cbjack_stream_set_channel_volumes,
+  .stream_set_panning = cbjack_stream_set_panning,
+  .stream_set_mixing_matrix = NULL,
+  .stream_set_input_buffer_bounds = NULL,
   .stream_get_current_device = cbjack_stream_get_current_device,
   .stream_device_destroy = cbjack_stream_device_destroy,
   .stream_register_device_changed_callback = NULL,
@@ -164,6 +156,8 @@ struct cubeb_stream {
   jack_port_t * output_ports[MAX_CHANNELS];
   jack_port_t * input_ports[MAX_CHANNELS];
   float volume;
+  /**< Volume of the output, per channel and ramped. */
+  cubeb_gain * gain;
 };
 
 struct cubeb {
@@ -457,12 +451,21 @@ cbjack_deinterleave_playback_refill_float(cubeb_stream * stream, float ** in, fl
   out_interleaved_buffer = stream->context->out_resampled_interleaved_buffer_float;
 
   if (outptr) {
-    // convert interleaved output buffers to contiguous buffers
+    // convert interleaved output buffers to contiguous buffers, applying the
+    // volume while deinterleaving when it is the same on all channels
+    if (done_frames > 0) {
+      float gain;
+      if (!cubeb_gain_get_uniform(stream->gain, &gain)) {
+        cubeb_gain_apply_float(stream->gain, out_interleaved_buffer,
+                               out_interleaved_buffer, done_frames);
+        gain = 1.0f;
+      }
+      cubeb_convert_deinterleave_float(out_interleaved_buffer, bufs_out,
+                                       stream->out_params.channels,
+                                       done_frames, gain);
+    }
     for (unsigned int c = 0; c < stream->out_params.channels; c++) {
       float* buffer = bufs_out[c];
-      for (long f = 0; f < done_frames; f++) {
-        buffer[f] = out_interleaved_buffer[(f * stream->out_params.channels) + c] * stream->volume;
-      }
       if (done_frames < needed_frames) {
         // draining
         for (long f = done_frames; f < needed_frames; f++) {
@@ -512,17 +515,28 @@ cbjack_deinterleave_playback_refill_s16ne(cubeb_stream * stream, short ** in, fl
                                      (bufs_out != NULL) ? stream->context->out_resampled_interleaved_buffer_s16ne : NULL,
                                      needed_frames);
 
-  s16ne_to_float(stream->context->out_resampled_interleaved_buffer_float, stream->context->out_resampled_interleaved_buffer_s16ne, done_frames * stream->out_params.channels);
-
   out_interleaved_buffer = stream->context->out_resampled_interleaved_buffer_float;
 
   if (outptr) {
-    // convert interleaved output buffers to contiguous buffers
+    // convert interleaved output buffers to contiguous buffers, applying the
+    // volume while converting to float when it is the same on all channels
+    if (done_frames > 0) {
+      float gain;
+      bool uniform = cubeb_gain_get_uniform(stream->gain, &gain);
+      cubeb_convert_s16_to_float(stream->context->out_resampled_interleaved_buffer_s16ne,
+                                 out_interleaved_buffer,
+                                 done_frames * stream->out_params.channels,
+                                 uniform ? gain : 1.0f);
+      if (!uniform) {
+        cubeb_gain_apply_float(stream->gain, out_interleaved_buffer,
+                               out_interleaved_buffer, done_frames);
+      }
+      cubeb_convert_deinterleave_float(out_interleaved_buffer, bufs_out,
+                                       stream->out_params.channels,
+                                       done_frames, 1.0f);
+    }
     for (unsigned int c = 0; c < stream->out_params.channels; c++) {
       float* buffer = bufs_out[c];
-      for (long f = 0; f < done_frames; f++) {
-        buffer[f] = out_interleaved_buffer[(f * stream->out_params.channels) + c] * stream->volume;
-      }
       if (done_frames < needed_frames) {
         // draining
         for (long f = done_frames; f < needed_frames; f++) {
@@ -559,13 +573,11 @@ cbjack_interleave_capture(cubeb_stream * stream, float **in, jack_nframes_t nfra
 {
   float *in_buffer = stream->context->in_float_interleaved_buffer;
 
-  for (unsigned int c = 0; c < stream->in_params.channels; c++) {
-    for (long f = 0; f < nframes; f++) {
-      in_buffer[(f * stream->in_params.channels) + c] = in[c][f] * stream->volume;
-    }
-  }
+  cubeb_convert_interleave_float(in, in_buffer, stream->in_params.channels,
+                                 nframes, stream->volume);
   if (format_mismatch) {
-    float_to_s16ne(stream->context->in_resampled_interleaved_buffer_s16ne, in_buffer, nframes * stream->in_params.channels);
+    cubeb_convert_float_to_s16(in_buffer, stream->context->in_resampled_interleaved_buffer_s16ne,
+                               nframes * stream->in_params.channels, 1.0f);
   } else {
     memset(stream->context->in_resampled_interleaved_buffer_float, 0, (FIFO_SIZE * MAX_CHANNELS * 3) * sizeof(float));
     memcpy(stream->context->in_resampled_interleaved_buffer_float, in_buffer, (FIFO_SIZE * MAX_CHANNELS * 2) * sizeof(float));
@@ -719,7 +731,7 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
                    cubeb_stream_params * input_stream_params,
                    cubeb_devid output_device,
                    cubeb_stream_params * output_stream_params,
-                   unsigned int /*latency_frames*/,
+                   unsigned int latency_frames,
                    cubeb_data_callback data_callback,
                    cubeb_state_callback state_callback,
                    void * user_ptr)
@@ -815,6 +827,7 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
   stm->state_callback = state_callback;
   stm->position = 0;
   stm->volume = 1.0f;
+  stm->gain = nullptr;
   context->jack_buffer_size = api_jack_get_buffer_size(context->jack_client);
   context->fragment_size = context->jack_buffer_size;
 
@@ -825,6 +838,10 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
 
   stm->resampler = NULL;
 
+  unsigned int block_size =
+    cubeb_resampler_block_size(input_stream_params, output_stream_params,
+                               latency_frames);
+
   if (stm->devs == DUPLEX) {
     stm->resampler = cubeb_resampler_create(stm,
                                           &stm->in_params,
@@ -832,7 +849,9 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
                                           stream_actual_rate,
                                           stm->data_callback,
                                           stm->user_ptr,
-                                          CUBEB_RESAMPLER_QUALITY_DESKTOP);
+                                          CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                                          CUBEB_RESAMPLER_RECLOCK_NONE,
+                                          block_size);
   } else if (stm->devs == IN_ONLY) {
     stm->resampler = cubeb_resampler_create(stm,
                                           &stm->in_params,
@@ -840,7 +859,9 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
                                           stream_actual_rate,
                                           stm->data_callback,
                                           stm->user_ptr,
-                                          CUBEB_RESAMPLER_QUALITY_DESKTOP);
+                                          CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                                          CUBEB_RESAMPLER_RECLOCK_NONE,
+                                          block_size);
   } else if (stm->devs == OUT_ONLY) {
     stm->resampler = cubeb_resampler_create(stm,
                                           nullptr,
@@ -848,7 +869,9 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
                                           stream_actual_rate,
                                           stm->data_callback,
                                           stm->user_ptr,
-                                          CUBEB_RESAMPLER_QUALITY_DESKTOP);
+                                          CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                                          CUBEB_RESAMPLER_RECLOCK_NONE,
+                                          block_size);
   }
 
   if (!stm->resampler) {
@@ -856,6 +879,12 @@ cbjack_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_
     pthread_mutex_unlock(&stm->mutex);
     return CUBEB_ERROR;
   }
+  /* JACK always calls back with its buffer size. */
+  cubeb_resampler_reserve(stm->resampler, context->jack_buffer_size);
+
+  if (stm->devs == DUPLEX || stm->devs == OUT_ONLY) {
+    stm->gain = cubeb_gain_create(stm->out_params.channels);
+  }
 
   if (stm->devs == DUPLEX || stm->devs == OUT_ONLY) {
     for (unsigned int c = 0; c < stm->out_params.channels; c++) {
@@ -924,6 +953,10 @@ cbjack_stream_destroy(cubeb_stream * stream)
     cubeb_resampler_destroy(stream->resampler);
     stream->resampler = NULL;
   }
+  if (stream->gain) {
+    cubeb_gain_destroy(stream->gain);
+    stream->gain = NULL;
+  }
   stream->in_use = false;
   pthread_mutex_unlock(&stream->mutex);
 }
@@ -955,6 +988,29 @@ static int
 cbjack_stream_set_volume(cubeb_stream * stm, float volume)
 {
   stm->volume = volume;
+  if (stm->gain) {
+    cubeb_gain_set_volume(stm->gain, volume);
+  }
+  return CUBEB_OK;
+}
+
+static int
+cbjack_stream_set_channel_volumes(cubeb_stream * stm, float const * volumes,
+                                  uint32_t channels)
+{
+  if (!stm->gain) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  return cubeb_gain_set_channel_volumes(stm->gain, volumes, channels);
+}
+
+static int
+cbjack_stream_set_panning(cubeb_stream * stm, float panning)
+{
+  if (!stm->gain) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  cubeb_gain_set_panning(stm->gain, stm->out_params.layout, panning);
   return CUBEB_OK;
 }
 
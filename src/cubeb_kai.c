@@ -13,6 +13,7 @@
 
 #include "cubeb/cubeb.h"
 #include "cubeb-internal.h"
+#include "cubeb_convert.h"
 
 /* We don't support more than 2 channels in KAI */
 #define MAX_CHANNELS 2
@@ -96,21 +97,6 @@ kai_destroy(cubeb * ctx)
   free(ctx);
 }
 
-static void
-float_to_s16ne(int16_t *dst, float *src, size_t n)
-{
-  long l;
-
-  while (n--) {
-    l = lrintf(*src++ * 0x8000);
-    if (l > 32767)
-      l = 32767;
-    if (l < -32768)
-      l = -32768;
-    *dst++ = (int16_t)l;
-  }
-}
-
 static ULONG APIENTRY
 kai_callback(PVOID cbdata, PVOID buffer, ULONG len)
 {
@@ -136,15 +122,10 @@ kai_callback(PVOID cbdata, PVOID buffer, ULONG len)
     stm->state_callback(stm, stm->user_ptr, CUBEB_STATE_DRAINED);
 
   if (stm->params.format == CUBEB_SAMPLE_FLOAT32NE)
-    float_to_s16ne(buffer, p, elements);
-
-  if (soft_volume != -1.0f) {
-    int16_t *b = buffer;
-    int i;
-
-    for (i = 0; i < elements; i++)
-      *b++ *= soft_volume;
-  }
+    cubeb_convert_float_to_s16(p, buffer, elements,
+                               soft_volume != -1.0f ? soft_volume : 1.0f);
+  else if (soft_volume != -1.0f)
+    cubeb_convert_gain_s16(buffer, buffer, elements, soft_volume);
 
   return frames_to_bytes(frames, stm->params);
 }
@@ -173,8 +154,9 @@ kai_stream_init(cubeb * context, cubeb_stream ** stream,
   if (!output_stream_params)
     return CUBEB_ERROR_INVALID_PARAMETER;
 
-  // Loopback is unsupported
-  if (output_stream_params->prefs & CUBEB_STREAM_PREF_LOOPBACK) {
+  // Loopback and fixed block sizes are unsupported
+  if (output_stream_params->prefs & (CUBEB_STREAM_PREF_LOOPBACK |
+                                     CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE)) {
     return CUBEB_ERROR_NOT_SUPPORTED;
   }
 
@@ -362,7 +344,10 @@ static struct cubeb_ops const kai_ops = {
   /*.stream_get_position =*/ kai_stream_get_position,
   /*.stream_get_latency = */ kai_stream_get_latency,
   /*.stream_set_volume =*/ kai_stream_set_volume,
+  /*.stream_set_channel_volumes =*/ NULL,
   /*.stream_set_panning =*/ NULL,
+  /*.stream_set_mixing_matrix =*/ NULL,
+  /*.stream_set_input_buffer_bounds =*/ NULL,
   /*.stream_get_current_device =*/ NULL,
   /*.stream_device_destroy =*/ NULL,
   /*.stream_register_device_changed_callback=*/ NULL,
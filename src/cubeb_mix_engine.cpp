@@ -0,0 +1,288 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "cubeb_mix_engine.h"
+#include "cubeb_assert.h"
+#include "cubeb_convert.h"
+#include "cubeb_utils.h"
+
+namespace {
+
+/** Size of the float bus the sources are added in. */
+const size_t ENGINE_BLOCK_BYTES = 16 * 1024;
+
+/** The place of a source in the list of the sources that are mixed. A source
+ * gets a new node each time it is added, so that it can be added again
+ * before the mixing thread has unlinked its previous node. */
+struct mix_node {
+  explicit mix_node(cubeb_mix_source * source)
+    : source(source)
+  {
+  }
+
+  cubeb_mix_source * const source;
+  /** Only changed by the mixing thread once the node is in the list. */
+  mix_node * next = nullptr;
+  /** Set by cubeb_mix_engine_remove. The mixing thread then skips the node,
+   * unlinks it, and hands it back to be freed. */
+  std::atomic<bool> removed { false };
+  /** Set when the callback of the source returns a negative value. Only used
+   * by the mixing thread. */
+  bool done = false;
+  mix_node * next_retired = nullptr;
+};
+
+} // namespace
+
+struct cubeb_mix_source {
+  cubeb_mix_source(cubeb_mix_engine * engine,
+                   cubeb_mix_source_callback callback,
+                   void * user_ptr,
+                   cubeb_gain * gain)
+    : engine(engine)
+    , callback(callback)
+    , user_ptr(user_ptr)
+    , gain(gain)
+  {
+  }
+
+  cubeb_mix_engine * const engine;
+  const cubeb_mix_source_callback callback;
+  void * const user_ptr;
+  cubeb_gain * const gain;
+  /** The node of the source while it is added. Only used by the threads that
+   * add and remove it. */
+  mix_node * node = nullptr;
+};
+
+struct cubeb_mix_engine {
+  cubeb_mix_engine(cubeb_sample_format format, uint32_t channels)
+    : format(format)
+    , channels(channels)
+    , block_frames(ENGINE_BLOCK_BYTES / (channels * sizeof(float)))
+    , bus(new float[block_frames * channels])
+    , scratch(new uint8_t[block_frames * channels *
+                          cubeb_sample_size(format)])
+  {
+  }
+
+  ~cubeb_mix_engine()
+  {
+    free_nodes(head.load(std::memory_order_relaxed),
+               &mix_node::next);
+    reclaim();
+  }
+
+  static void free_nodes(mix_node * node, mix_node * mix_node::*link)
+  {
+    while (node) {
+      mix_node * next = node->*link;
+      delete node;
+      node = next;
+    }
+  }
+
+  /** Free the nodes the mixing thread has unlinked. */
+  void reclaim()
+  {
+    free_nodes(retired.exchange(nullptr, std::memory_order_acquire),
+               &mix_node::next_retired);
+  }
+
+  /** Called on the mixing thread once `node` is unlinked. */
+  void retire(mix_node * node)
+  {
+    node->next_retired = retired.load(std::memory_order_relaxed);
+    while (!retired.compare_exchange_weak(node->next_retired, node,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+  }
+
+  /** Returns false if the source is done. */
+  bool add_source(cubeb_mix_source * source, long frames)
+  {
+    long got = source->callback(source->user_ptr, scratch.get(), frames);
+    if (got <= 0) {
+      return got == 0;
+    }
+    got = std::min(got, frames);
+    size_t samples = got * channels;
+
+    /* A gain that is the same on all the channels is applied while adding,
+       ramps and per-channel gains in a pass of their own. */
+    float gain = 1.0f;
+    if (format == CUBEB_SAMPLE_FLOAT32NE) {
+      float * samples_in = reinterpret_cast<float *>(scratch.get());
+      if (source->gain && !cubeb_gain_get_uniform(source->gain, &gain)) {
+        cubeb_gain_apply_float(source->gain, samples_in, samples_in, got);
+        gain = 1.0f;
+      }
+      cubeb_convert_accumulate_float(samples_in, bus.get(), samples, gain);
+    } else {
+      int16_t * samples_in = reinterpret_cast<int16_t *>(scratch.get());
+      if (source->gain && !cubeb_gain_get_uniform(source->gain, &gain)) {
+        cubeb_gain_apply_s16(source->gain, samples_in, samples_in, got);
+        gain = 1.0f;
+      }
+      cubeb_convert_accumulate_s16(samples_in, bus.get(), samples, gain);
+    }
+    return true;
+  }
+
+  unsigned int mix_block(void * output, long frames)
+  {
+    /* Odd while the sources are walked, see cubeb_mix_engine_remove. */
+    passes.fetch_add(1);
+
+    std::fill_n(bus.get(), frames * channels, 0.0f);
+    unsigned int mixed = 0;
+    mix_node * previous = nullptr;
+    mix_node * node = head.load(std::memory_order_acquire);
+    while (node) {
+      mix_node * next = node->next;
+      if (!node->removed.load()) {
+        /* Done sources stay in the list, so that removing them works as
+           for the others, but aren't called anymore. */
+        if (!node->done) {
+          node->done = !add_source(node->source, frames);
+          mixed += !node->done;
+        }
+        previous = node;
+      } else if (previous) {
+        previous->next = next;
+        retire(node);
+      } else {
+        /* The head can only be unlinked if no source has been added in
+           front of it since: it is otherwise unlinked next time. */
+        mix_node * expected = node;
+        if (head.compare_exchange_strong(expected, next,
+                                         std::memory_order_acquire)) {
+          retire(node);
+        } else {
+          previous = node;
+        }
+      }
+      node = next;
+    }
+
+    passes.fetch_add(1);
+
+    if (format == CUBEB_SAMPLE_FLOAT32NE) {
+      PodCopy(static_cast<float *>(output), bus.get(), frames * channels);
+    } else {
+      cubeb_convert_float_to_s16(bus.get(), static_cast<int16_t *>(output),
+                                 frames * channels, 1.0f);
+    }
+    return mixed;
+  }
+
+  const cubeb_sample_format format;
+  const uint32_t channels;
+  const size_t block_frames;
+  const std::unique_ptr<float[]> bus;
+  const std::unique_ptr<uint8_t[]> scratch;
+  /** The nodes of the sources, newest first. */
+  std::atomic<mix_node *> head { nullptr };
+  /** The nodes unlinked by the mixing thread, waiting to be freed. */
+  std::atomic<mix_node *> retired { nullptr };
+  /** Incremented before and after walking the sources. */
+  std::atomic<uint32_t> passes { 0 };
+};
+
+cubeb_mix_engine *
+cubeb_mix_engine_create(cubeb_sample_format format, uint32_t channels)
+{
+  if ((format != CUBEB_SAMPLE_FLOAT32NE && format != CUBEB_SAMPLE_S16NE) ||
+      !channels) {
+    return nullptr;
+  }
+  return new cubeb_mix_engine(format, channels);
+}
+
+void
+cubeb_mix_engine_destroy(cubeb_mix_engine * engine)
+{
+  delete engine;
+}
+
+cubeb_mix_source *
+cubeb_mix_source_create(cubeb_mix_engine * engine,
+                        cubeb_mix_source_callback callback,
+                        void * user_ptr,
+                        cubeb_gain * gain)
+{
+  return new cubeb_mix_source(engine, callback, user_ptr, gain);
+}
+
+void
+cubeb_mix_source_destroy(cubeb_mix_source * source)
+{
+  XASSERT(!source->node);
+  delete source;
+}
+
+int
+cubeb_mix_engine_add(cubeb_mix_engine * engine, cubeb_mix_source * source)
+{
+  XASSERT(source->engine == engine);
+  if (source->node) {
+    return CUBEB_ERROR;
+  }
+  engine->reclaim();
+
+  mix_node * node = new mix_node(source);
+  node->next = engine->head.load(std::memory_order_relaxed);
+  while (!engine->head.compare_exchange_weak(node->next, node,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+  }
+  source->node = node;
+  return CUBEB_OK;
+}
+
+void
+cubeb_mix_engine_remove(cubeb_mix_engine * engine, cubeb_mix_source * source)
+{
+  XASSERT(source->engine == engine);
+  mix_node * node = source->node;
+  if (!node) {
+    return;
+  }
+  source->node = nullptr;
+
+  /* If the mixing thread is walking the sources, it may have seen the node
+     before it was marked: wait for the end of this walk. The next ones skip
+     the node. */
+  node->removed.store(true);
+  uint32_t passes = engine->passes.load();
+  if (passes & 1) {
+    while (engine->passes.load() == passes) {
+      std::this_thread::yield();
+    }
+  }
+  engine->reclaim();
+}
+
+unsigned int
+cubeb_mix_engine_mix(cubeb_mix_engine * engine, void * output, long frames)
+{
+  size_t frame_size = engine->channels * cubeb_sample_size(engine->format);
+  uint8_t * out = static_cast<uint8_t *>(output);
+  unsigned int mixed = 0;
+  while (frames > 0) {
+    long block = std::min<long>(frames, engine->block_frames);
+    mixed = engine->mix_block(out, block);
+    out += block * frame_size;
+    frames -= block;
+  }
+  return mixed;
+}
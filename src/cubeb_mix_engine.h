@@ -0,0 +1,102 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#ifndef CUBEB_MIX_ENGINE_H
+#define CUBEB_MIX_ENGINE_H
+
+#include "cubeb/cubeb.h"
+#include "cubeb_gain.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * Mixes the audio of any number of sources into a single buffer, for the
+ * backends that play several streams through one device stream.
+ *
+ * The sources have the format and channel count of the engine. Their audio is
+ * added in a float bus, with their gain, block by block so that the bus stays
+ * in the L1 cache, and the bus is then converted to the format of the engine,
+ * clipping it.
+ *
+ * Sources are added and removed in constant time, from any thread, while
+ * another thread mixes: the mixing thread walks a lock-free list, and never
+ * waits for the other threads. */
+typedef struct cubeb_mix_engine cubeb_mix_engine;
+
+/** A source of a mix engine. */
+typedef struct cubeb_mix_source cubeb_mix_source;
+
+/**
+ * Called by cubeb_mix_engine_mix, on the mixing thread, to get the audio of a
+ * source.
+ * @param user_ptr The pointer passed to cubeb_mix_source_create.
+ * @param buffer Where to write the frames, in the format of the engine.
+ * @param frames The number of frames to write.
+ * @return The number of frames written. The frames that are not written, if
+ *         fewer than `frames`, or all of them if this is negative, are
+ *         silent. A negative value also means that the source is done: it
+ *         is not called anymore until it is removed and added again.
+ */
+typedef long (* cubeb_mix_source_callback)(void * user_ptr, void * buffer,
+                                           long frames);
+
+/**
+ * Create a mix engine.
+ * @retval NULL if `format` is not CUBEB_SAMPLE_S16NE or
+ *         CUBEB_SAMPLE_FLOAT32NE, or `channels` is 0.
+ */
+cubeb_mix_engine * cubeb_mix_engine_create(cubeb_sample_format format,
+                                           uint32_t channels);
+
+/** Destroy a mix engine. No thread can be mixing, and all the sources must
+ * have been removed. */
+void cubeb_mix_engine_destroy(cubeb_mix_engine * engine);
+
+/**
+ * Create a source for `engine`, initially not mixed.
+ * @param gain Applied to the source before it is added to the others, or
+ *        NULL. The source does not own it.
+ */
+cubeb_mix_source * cubeb_mix_source_create(cubeb_mix_engine * engine,
+                                           cubeb_mix_source_callback callback,
+                                           void * user_ptr,
+                                           cubeb_gain * gain);
+
+/** Destroy a source, which must not be added to its engine. */
+void cubeb_mix_source_destroy(cubeb_mix_source * source);
+
+/**
+ * Start mixing `source`, from the next block.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR if the source is already added.
+ */
+int cubeb_mix_engine_add(cubeb_mix_engine * engine, cubeb_mix_source * source);
+
+/** Stop mixing `source`. When this returns, its callback is not running and
+ * won't be called anymore, and it can be destroyed. This waits for the block
+ * being mixed, if any: it must not be called from a source callback. Removing
+ * a source that isn't added does nothing. */
+void cubeb_mix_engine_remove(cubeb_mix_engine * engine,
+                             cubeb_mix_source * source);
+
+/**
+ * Mix `frames` frames of all the sources into `output`, in the format of the
+ * engine. This doesn't lock or allocate, and is meant to be called from the
+ * audio thread of the device stream, one thread at a time.
+ * @return The number of sources mixed in the last block, not counting the
+ *         ones that are done.
+ */
+unsigned int cubeb_mix_engine_mix(cubeb_mix_engine * engine, void * output,
+                                  long frames);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* CUBEB_MIX_ENGINE_H */
@@ -10,12 +10,20 @@
 #define NOMINMAX
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <cmath>
 #include <cstdlib>
+#include <map>
 #include <memory>
+#include <tuple>
 #include <type_traits>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CUBEB_MIXER_SSE2
+#include <emmintrin.h>
+#endif
 #include "cubeb-internal.h"
 #include "cubeb_mixer.h"
 #include "cubeb_utils.h"
@@ -106,6 +114,26 @@ struct MixerContext {
     _valid = init() >= 0;
   }
 
+  /** A context for a matrix given by the user, of `out_channels` rows of
+   * `in_channels` coefficients, see cubeb_mixer_set_matrix. */
+  MixerContext(cubeb_sample_format f,
+               uint32_t in_channels,
+               uint32_t out_channels,
+               const float * matrix)
+    : _format(f)
+    , _in_ch_layout(CUBEB_LAYOUT_UNDEFINED)
+    , _out_ch_layout(CUBEB_LAYOUT_UNDEFINED)
+    , _in_ch_count(in_channels)
+    , _out_ch_count(out_channels)
+  {
+    for (uint32_t i = 0; i < out_channels; i++) {
+      for (uint32_t j = 0; j < in_channels; j++) {
+        _matrix[i][j] = matrix[i * in_channels + j];
+      }
+    }
+    _valid = init_kernel_tables() >= 0;
+  }
+
   static bool even(cubeb_channel_layout layout)
   {
     if (!layout) {
@@ -157,6 +185,7 @@ struct MixerContext {
 
   int auto_matrix();
   int init();
+  int init_kernel_tables();
 
   const cubeb_sample_format _format;
   const cubeb_channel_layout _in_ch_layout;              ///< input channel layout
@@ -169,8 +198,9 @@ struct MixerContext {
   double _matrix[CHANNELS_MAX][CHANNELS_MAX] = {{ 0 }};        ///< floating point rematrixing coefficients
   float _matrix_flt[CHANNELS_MAX][CHANNELS_MAX] = {{ 0 }};     ///< single precision floating point rematrixing coefficients
   int32_t _matrix32[CHANNELS_MAX][CHANNELS_MAX] = {{ 0 }};     ///< 17.15 fixed point rematrixing coefficients
-  uint8_t _matrix_ch[CHANNELS_MAX][CHANNELS_MAX+1] = {{ 0 }};  ///< Lists of input channels per output channel that have non zero rematrixing coefficients
-  bool _clipping = false;                          ///< Set to true if clipping detection is required
+  float _columns_flt[CHANNELS_MAX][CHANNELS_MAX] = {{ 0 }};    ///< _matrix_flt transposed: the coefficients of an input channel for all the output channels, zero-padded to whole vectors
+  int16_t _columns16[CHANNELS_MAX][2*CHANNELS_MAX] = {{ 0 }};  ///< _matrix32 transposed, each coefficient split in two halves, see init()
+  uint8_t _vector_ch[CHANNELS_MAX/4][CHANNELS_MAX+1] = {{ 0 }}; ///< Lists of input channels per vector of four output channels that have non zero rematrixing coefficients
   bool _valid = false;                             ///< Set to true if context is valid.
 };
 
@@ -354,14 +384,6 @@ int MixerContext::auto_matrix()
       }
   }
 
-  if (_format == CUBEB_SAMPLE_FLOAT32NE) {
-    for (uint32_t i = 0; i < FF_ARRAY_ELEMS(_matrix); i++) {
-      for (uint32_t j = 0; j < FF_ARRAY_ELEMS(_matrix[0]); j++) {
-        _matrix_flt[i][j] = _matrix[i][j];
-      }
-    }
-  }
-
   return 0;
 }
 
@@ -372,141 +394,487 @@ int MixerContext::init()
     return r;
   }
 
-  // Determine if matrix operation would overflow
-  if (_format == CUBEB_SAMPLE_S16NE) {
-    int maxsum = 0;
-    for (uint32_t i = 0; i < _out_ch_count; i++) {
-      double rem = 0;
-      int sum = 0;
+  return init_kernel_tables();
+}
 
-      for (uint32_t j = 0; j < _in_ch_count; j++) {
-        double target = _matrix[i][j] * 32768 + rem;
-        int value = lrintf(target);
-        rem += target - value;
-        sum += std::abs(value);
+int MixerContext::init_kernel_tables()
+{
+  if (_format == CUBEB_SAMPLE_FLOAT32NE) {
+    for (uint32_t i = 0; i < FF_ARRAY_ELEMS(_matrix); i++) {
+      for (uint32_t j = 0; j < FF_ARRAY_ELEMS(_matrix[0]); j++) {
+        _matrix_flt[i][j] = _matrix[i][j];
       }
-      maxsum = std::max(maxsum, sum);
-    }
-    if (maxsum > 32768) {
-      _clipping = true;
     }
   }
 
   // FIXME quantize for integers
   for (uint32_t i = 0; i < CHANNELS_MAX; i++) {
-    int ch_in = 0;
     for (uint32_t j = 0; j < CHANNELS_MAX; j++) {
       _matrix32[i][j] = lrintf(_matrix[i][j] * 32768);
-      if (_matrix[i][j]) {
-        _matrix_ch[i][++ch_in] = j;
+    }
+  }
+
+  // Transpose the matrices for the frame-major kernels, that compute a whole
+  // output frame from one input frame. _mm_madd_epi16 multiplies pairs of
+  // 16-bit values and sums each pair: the 17.15 coefficients, up to 32768 for
+  // S16, are split in two halves that are multiplied by the same sample. The
+  // sums can exceed 32768 after rounding: the kernels saturate.
+  for (uint32_t j = 0; j < _in_ch_count; j++) {
+    for (uint32_t i = 0; i < _out_ch_count; i++) {
+      _columns_flt[j][i] = _matrix_flt[i][j];
+      if (_format == CUBEB_SAMPLE_S16NE) {
+        assert(std::abs(_matrix32[i][j]) <= 32768);
+        _columns16[j][2 * i] = _matrix32[i][j] / 2;
+        _columns16[j][2 * i + 1] = _matrix32[i][j] - _matrix32[i][j] / 2;
       }
     }
-    _matrix_ch[i][0] = ch_in;
+  }
+  for (uint32_t v = 0; v < (_out_ch_count + 3) / 4; v++) {
+    int ch_in = 0;
+    for (uint32_t j = 0; j < _in_ch_count; j++) {
+      for (uint32_t i = 4 * v; i < std::min(4 * v + 4, _out_ch_count); i++) {
+        if (_matrix[i][j]) {
+          _vector_ch[v][++ch_in] = j;
+          break;
+        }
+      }
+    }
+    _vector_ch[v][0] = ch_in;
   }
 
   return 0;
 }
 
-template<typename TYPE_SAMPLE, typename TYPE_COEFF, typename F>
-void
-sum2(TYPE_SAMPLE * out,
-     uint32_t stride_out,
-     const TYPE_SAMPLE * in1,
-     const TYPE_SAMPLE * in2,
-     uint32_t stride_in,
-     TYPE_COEFF coeff1,
-     TYPE_COEFF coeff2,
-     F&& operand,
-     uint32_t frames)
+/* The kernels compute the output frames one by one, from one input frame: the
+ * output channels are computed in vectors of four, each one the sum of the
+ * columns of coefficients of the input channels it uses, times their sample.
+ * The last vector of a frame overflows into the next one, which is written
+ * after it. Only the last frames, where this would write past the end of the
+ * output buffer, go through a temporary vector. */
+
+#if defined(CUBEB_MIXER_SSE2)
+/** The coefficients the kernels use, in the order they use them, copied to
+ * the stack so that the compiler knows that the output doesn't alias them. */
+template<typename TYPE_COEFF, size_t COLS>
+struct rematrix_coefficients {
+  /** The coefficients of a vector of four output channels. */
+  static const uint32_t LANES = COLS / (CHANNELS_MAX / 4);
+
+  rematrix_coefficients(const MixerContext * s,
+                        const TYPE_COEFF (&columns)[CHANNELS_MAX][COLS])
+    : vectors((s->_out_ch_count + 3) / 4)
+  {
+    uint32_t n = 0;
+    for (uint32_t v = 0; v < vectors; v++) {
+      counts[v] = s->_vector_ch[v][0];
+      for (uint32_t k = 1; k <= counts[v]; k++, n++) {
+        channels[n] = s->_vector_ch[v][k];
+        PodCopy(coeffs[n], &columns[channels[n]][LANES * v], LANES);
+      }
+    }
+  }
+  const uint32_t vectors;
+  uint32_t counts[CHANNELS_MAX / 4];
+  uint8_t channels[CHANNELS_MAX * CHANNELS_MAX / 4];
+  alignas(16) TYPE_COEFF coeffs[CHANNELS_MAX * CHANNELS_MAX / 4][LANES];
+};
+
+static void
+rematrix_float(const MixerContext * s, float * out, const float * in,
+               uint32_t frames)
 {
-  static_assert(
-    std::is_same<TYPE_COEFF,
-                 typename std::result_of<F(TYPE_COEFF)>::type>::value,
-    "function must return the same type as used by matrix_coeff");
-  for (uint32_t i = 0; i < frames; i++) {
-    *out = operand(coeff1 * *in1 + coeff2 * *in2);
-    out += stride_out;
-    in1 += stride_in;
-    in2 += stride_in;
+  const uint32_t in_ch = s->_in_ch_count;
+  const uint32_t out_ch = s->_out_ch_count;
+  const rematrix_coefficients<float, CHANNELS_MAX> m(s, s->_columns_flt);
+  size_t remaining = static_cast<size_t>(frames) * out_ch;
+
+  for (uint32_t f = 0; f < frames; f++) {
+    const uint8_t * channels = m.channels;
+    const float (* coeffs)[4] = m.coeffs;
+    for (uint32_t v = 0; v < m.vectors; v++) {
+      __m128 acc = _mm_setzero_ps();
+      for (uint32_t k = 0; k < m.counts[v]; k++) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(in[channels[k]]),
+                                         _mm_load_ps(coeffs[k])));
+      }
+      channels += m.counts[v];
+      coeffs += m.counts[v];
+      if (4 * v + 4 <= remaining) {
+        _mm_storeu_ps(out + 4 * v, acc);
+      } else {
+        float last[4];
+        _mm_storeu_ps(last, acc);
+        PodCopy(out + 4 * v, last, out_ch - 4 * v);
+      }
+    }
+    in += in_ch;
+    out += out_ch;
+    remaining -= out_ch;
   }
 }
 
-template<typename TYPE_SAMPLE, typename TYPE_COEFF, typename F>
-void
-copy(TYPE_SAMPLE * out,
-     uint32_t stride_out,
-     const TYPE_SAMPLE * in,
-     uint32_t stride_in,
-     TYPE_COEFF coeff,
-     F&& operand,
-     uint32_t frames)
+/* The rounding and the saturation to 16 bits of _mm_packs_epi32 are those of
+ * the scalar version. */
+static void
+rematrix_s16(const MixerContext * s, int16_t * out, const int16_t * in,
+             uint32_t frames)
+{
+  const uint32_t in_ch = s->_in_ch_count;
+  const uint32_t out_ch = s->_out_ch_count;
+  const rematrix_coefficients<int16_t, 2 * CHANNELS_MAX> m(s, s->_columns16);
+  const __m128i round = _mm_set1_epi32(16384);
+  size_t remaining = static_cast<size_t>(frames) * out_ch;
+
+  for (uint32_t f = 0; f < frames; f++) {
+    const uint8_t * channels = m.channels;
+    // Two halves of a coefficient for each of the four output channels.
+    const int16_t (* coeffs)[8] = m.coeffs;
+    for (uint32_t v = 0; v < m.vectors; v++) {
+      __m128i acc = _mm_setzero_si128();
+      for (uint32_t k = 0; k < m.counts[v]; k++) {
+        // The sample, twice, in each 32-bit lane.
+        uint32_t pair = static_cast<uint16_t>(in[channels[k]]) * 0x10001u;
+        __m128i c = _mm_load_si128(reinterpret_cast<const __m128i *>(coeffs[k]));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_set1_epi32(pair), c));
+      }
+      channels += m.counts[v];
+      coeffs += m.counts[v];
+      acc = _mm_srai_epi32(_mm_add_epi32(acc, round), 15);
+      __m128i samples = _mm_packs_epi32(acc, acc);
+      if (4 * v + 4 <= remaining) {
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 4 * v), samples);
+      } else {
+        int16_t last[8];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(last), samples);
+        PodCopy(out + 4 * v, last, out_ch - 4 * v);
+      }
+    }
+    in += in_ch;
+    out += out_ch;
+    remaining -= out_ch;
+  }
+}
+#else
+static void
+rematrix_float(const MixerContext * s, float * out, const float * in,
+               uint32_t frames)
 {
-  static_assert(
-    std::is_same<TYPE_COEFF,
-                 typename std::result_of<F(TYPE_COEFF)>::type>::value,
-    "function must return the same type as used by matrix_coeff");
-  for (uint32_t i = 0; i < frames; i++) {
-    *out = operand(coeff * *in);
-    out += stride_out;
-    in += stride_in;
+  const uint32_t in_ch = s->_in_ch_count;
+  const uint32_t out_ch = s->_out_ch_count;
+
+  for (uint32_t f = 0; f < frames; f++) {
+    for (uint32_t o = 0; o < out_ch; o += 4) {
+      const uint8_t * channels = s->_vector_ch[o / 4];
+      const uint32_t count = std::min(4u, out_ch - o);
+      float acc[4] = { 0 };
+      for (uint32_t k = 1; k <= channels[0]; k++) {
+        const float * column = s->_columns_flt[channels[k]] + o;
+        for (uint32_t i = 0; i < count; i++) {
+          acc[i] += in[channels[k]] * column[i];
+        }
+      }
+      PodCopy(out + o, acc, count);
+    }
+    in += in_ch;
+    out += out_ch;
   }
 }
 
-template <typename TYPE, typename TYPE_COEFF, size_t COLS, typename F>
-static int rematrix(const MixerContext * s, TYPE * aOut, const TYPE * aIn,
-                    const TYPE_COEFF (&matrix_coeff)[COLS][COLS],
-                    F&& aF, uint32_t frames)
+static void
+rematrix_s16(const MixerContext * s, int16_t * out, const int16_t * in,
+             uint32_t frames)
 {
-  static_assert(
-    std::is_same<TYPE_COEFF,
-                 typename std::result_of<F(TYPE_COEFF)>::type>::value,
-    "function must return the same type as used by matrix_coeff");
-
-  for (uint32_t out_i = 0; out_i < s->_out_ch_count; out_i++) {
-    TYPE* out = aOut + out_i;
-    switch (s->_matrix_ch[out_i][0]) {
-      case 0:
-        for (uint32_t i = 0; i < frames; i++) {
-          out[i * s->_out_ch_count] = 0;
-        }
-        break;
-      case 1: {
-        int in_i = s->_matrix_ch[out_i][1];
-        copy(out,
-             s->_out_ch_count,
-             aIn + in_i,
-             s->_in_ch_count,
-             matrix_coeff[out_i][in_i],
-             aF,
-             frames);
-      } break;
-      case 2:
-        sum2(out,
-             s->_out_ch_count,
-             aIn + s->_matrix_ch[out_i][1],
-             aIn + s->_matrix_ch[out_i][2],
-             s->_in_ch_count,
-             matrix_coeff[out_i][s->_matrix_ch[out_i][1]],
-             matrix_coeff[out_i][s->_matrix_ch[out_i][2]],
-             aF,
-             frames);
-        break;
-      default:
-        for (uint32_t i = 0; i < frames; i++) {
-          TYPE_COEFF v = 0;
-          for (uint32_t j = 0; j < s->_matrix_ch[out_i][0]; j++) {
-            uint32_t in_i = s->_matrix_ch[out_i][1 + j];
-            v +=
-              *(aIn + in_i + i * s->_in_ch_count) * matrix_coeff[out_i][in_i];
-          }
-          out[i * s->_out_ch_count] = aF(v);
+  const uint32_t in_ch = s->_in_ch_count;
+  const uint32_t out_ch = s->_out_ch_count;
+
+  for (uint32_t f = 0; f < frames; f++) {
+    for (uint32_t o = 0; o < out_ch; o += 4) {
+      const uint8_t * channels = s->_vector_ch[o / 4];
+      const uint32_t count = std::min(4u, out_ch - o);
+      int32_t acc[4] = { 0 };
+      for (uint32_t k = 1; k <= channels[0]; k++) {
+        const int16_t * column = s->_columns16[channels[k]] + 2 * o;
+        for (uint32_t i = 0; i < count; i++) {
+          acc[i] += in[channels[k]] * (column[2 * i] + column[2 * i + 1]);
         }
-        break;
+      }
+      for (uint32_t i = 0; i < count; i++) {
+        int32_t y = (acc[i] + 16384) >> 15;
+        out[o + i] = static_cast<int16_t>(std::min(std::max(y, -32768), 32767));
+      }
     }
+    in += in_ch;
+    out += out_ch;
+  }
+}
+#endif
+
+/* Kernels specialized on the channel counts of the most common downmixes and
+ * upmixes, so that the loops on the channels are unrolled and the coefficients
+ * stay in registers. They add the products of all the input channels, in the
+ * same order as the generic kernels, which skip the zero coefficients: the
+ * output is the same, for finite samples. */
+
+#if defined(CUBEB_MIXER_SSE2)
+/* Two frames at once, so that an even number of output channels fills whole
+ * vectors, e.g. the two stereo frames of a vector. The first and last vectors
+ * can be entirely in one frame. A last odd frame goes through the generic
+ * kernel. */
+template<uint32_t IN, uint32_t OUT>
+static void
+rematrix_float_fixed(const MixerContext * s, float * out, const float * in,
+                     uint32_t frames)
+{
+  static_assert(OUT % 2 == 0, "Two frames have to fill whole vectors");
+  const uint32_t VECTORS = OUT / 2;
+  __m128 coeffs[VECTORS][IN];
+  for (uint32_t v = 0; v < VECTORS; v++) {
+    for (uint32_t j = 0; j < IN; j++) {
+      float c[4];
+      for (uint32_t l = 0; l < 4; l++) {
+        c[l] = s->_columns_flt[j][(4 * v + l) % OUT];
+      }
+      coeffs[v][j] = _mm_loadu_ps(c);
+    }
+  }
+
+  uint32_t f = 0;
+  for (; f + 2 <= frames; f += 2) {
+    __m128 acc[VECTORS];
+    for (uint32_t v = 0; v < VECTORS; v++) {
+      acc[v] = _mm_setzero_ps();
+    }
+    for (uint32_t j = 0; j < IN; j++) {
+      __m128 first = _mm_set1_ps(in[j]);
+      __m128 second = _mm_set1_ps(in[IN + j]);
+      __m128 both = _mm_shuffle_ps(first, second, _MM_SHUFFLE(0, 0, 0, 0));
+      for (uint32_t v = 0; v < VECTORS; v++) {
+        // The frames of the first and last lanes of the vector.
+        __m128 x = (4 * v) / OUT != (4 * v + 3) / OUT ? both
+                                                      : (4 * v) / OUT ? second
+                                                                      : first;
+        acc[v] = _mm_add_ps(acc[v], _mm_mul_ps(x, coeffs[v][j]));
+      }
+    }
+    for (uint32_t v = 0; v < VECTORS; v++) {
+      _mm_storeu_ps(out + 4 * v, acc[v]);
+    }
+    in += 2 * IN;
+    out += 2 * OUT;
+  }
+  if (f < frames) {
+    rematrix_float(s, out, in, frames - f);
   }
-  return 0;
 }
 
+template<uint32_t IN, uint32_t OUT>
+static void
+rematrix_s16_fixed(const MixerContext * s, int16_t * out, const int16_t * in,
+                   uint32_t frames)
+{
+  static_assert(OUT % 2 == 0, "Two frames have to fill whole vectors");
+  const uint32_t VECTORS = OUT / 2;
+  __m128i coeffs[VECTORS][IN];
+  for (uint32_t v = 0; v < VECTORS; v++) {
+    for (uint32_t j = 0; j < IN; j++) {
+      int16_t c[8];
+      for (uint32_t l = 0; l < 4; l++) {
+        c[2 * l] = s->_columns16[j][2 * ((4 * v + l) % OUT)];
+        c[2 * l + 1] = s->_columns16[j][2 * ((4 * v + l) % OUT) + 1];
+      }
+      coeffs[v][j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c));
+    }
+  }
+  const __m128i round = _mm_set1_epi32(16384);
+
+  uint32_t f = 0;
+  for (; f + 2 <= frames; f += 2) {
+    __m128i acc[VECTORS];
+    for (uint32_t v = 0; v < VECTORS; v++) {
+      acc[v] = _mm_setzero_si128();
+    }
+    for (uint32_t j = 0; j < IN; j++) {
+      __m128i first =
+        _mm_set1_epi32(static_cast<uint16_t>(in[j]) * 0x10001u);
+      __m128i second =
+        _mm_set1_epi32(static_cast<uint16_t>(in[IN + j]) * 0x10001u);
+      __m128i both = _mm_unpacklo_epi64(first, second);
+      for (uint32_t v = 0; v < VECTORS; v++) {
+        __m128i x = (4 * v) / OUT != (4 * v + 3) / OUT ? both
+                                                       : (4 * v) / OUT ? second
+                                                                       : first;
+        acc[v] = _mm_add_epi32(acc[v], _mm_madd_epi16(x, coeffs[v][j]));
+      }
+    }
+    for (uint32_t v = 0; v < VECTORS; v++) {
+      acc[v] = _mm_srai_epi32(_mm_add_epi32(acc[v], round), 15);
+    }
+    for (uint32_t v = 0; v < VECTORS; v += 2) {
+      if (v + 1 < VECTORS) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * v),
+                         _mm_packs_epi32(acc[v], acc[v + 1]));
+      } else {
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 4 * v),
+                         _mm_packs_epi32(acc[v], acc[v]));
+      }
+    }
+    in += 2 * IN;
+    out += 2 * OUT;
+  }
+  if (f < frames) {
+    rematrix_s16(s, out, in, frames - f);
+  }
+}
+#else
+template<uint32_t IN, uint32_t OUT>
+static void
+rematrix_float_fixed(const MixerContext * s, float * out, const float * in,
+                     uint32_t frames)
+{
+  float coeffs[OUT][IN];
+  for (uint32_t o = 0; o < OUT; o++) {
+    for (uint32_t j = 0; j < IN; j++) {
+      coeffs[o][j] = s->_columns_flt[j][o];
+    }
+  }
+  for (uint32_t f = 0; f < frames; f++) {
+    for (uint32_t o = 0; o < OUT; o++) {
+      float acc = 0;
+      for (uint32_t j = 0; j < IN; j++) {
+        acc += in[j] * coeffs[o][j];
+      }
+      out[o] = acc;
+    }
+    in += IN;
+    out += OUT;
+  }
+}
+
+template<uint32_t IN, uint32_t OUT>
+static void
+rematrix_s16_fixed(const MixerContext * s, int16_t * out, const int16_t * in,
+                   uint32_t frames)
+{
+  int32_t coeffs[OUT][IN];
+  for (uint32_t o = 0; o < OUT; o++) {
+    for (uint32_t j = 0; j < IN; j++) {
+      coeffs[o][j] = s->_columns16[j][2 * o] + s->_columns16[j][2 * o + 1];
+    }
+  }
+  for (uint32_t f = 0; f < frames; f++) {
+    for (uint32_t o = 0; o < OUT; o++) {
+      int32_t acc = 0;
+      for (uint32_t j = 0; j < IN; j++) {
+        acc += in[j] * coeffs[o][j];
+      }
+      int32_t y = (acc + 16384) >> 15;
+      out[o] = static_cast<int16_t>(std::min(std::max(y, -32768), 32767));
+    }
+    in += IN;
+    out += OUT;
+  }
+}
+#endif
+
+typedef void (*rematrix_float_func)(const MixerContext *, float *,
+                                    const float *, uint32_t);
+typedef void (*rematrix_s16_func)(const MixerContext *, int16_t *,
+                                  const int16_t *, uint32_t);
+
+struct rematrix_kernels {
+  uint32_t in_channels;
+  uint32_t out_channels;
+  rematrix_float_func rematrix_float;
+  rematrix_s16_func rematrix_s16;
+};
+
+/* 5.1 and 7.1 to stereo, stereo to 5.1 and mono to stereo. */
+const rematrix_kernels specialized_kernels[] = {
+  { 6, 2, rematrix_float_fixed<6, 2>, rematrix_s16_fixed<6, 2> },
+  { 8, 2, rematrix_float_fixed<8, 2>, rematrix_s16_fixed<8, 2> },
+  { 2, 6, rematrix_float_fixed<2, 6>, rematrix_s16_fixed<2, 6> },
+  { 1, 2, rematrix_float_fixed<1, 2>, rematrix_s16_fixed<1, 2> },
+};
+
+std::atomic<bool> use_specialized_kernels(true);
+
+typedef std::tuple<cubeb_sample_format, uint32_t, cubeb_channel_layout,
+                   uint32_t, cubeb_channel_layout> matrix_key;
+
+/* The matrices never change once computed: they are shared by the mixers with
+ * the same parameters, e.g. all the streams that downmix 5.1 to stereo. The
+ * cache only keeps weak references, and a matrix is freed with the last mixer
+ * that uses it. */
+struct matrix_cache {
+  owned_critical_section lock;
+  std::map<matrix_key, std::weak_ptr<const MixerContext>> matrices;
+};
+
+matrix_cache & get_matrix_cache()
+{
+  static matrix_cache cache;
+  return cache;
+}
+
+std::shared_ptr<const MixerContext>
+acquire_matrix(cubeb_sample_format format,
+               uint32_t in_channels,
+               cubeb_channel_layout in_layout,
+               uint32_t out_channels,
+               cubeb_channel_layout out_layout)
+{
+  matrix_cache & cache = get_matrix_cache();
+  matrix_key key(format, in_channels, in_layout, out_channels, out_layout);
+  auto_lock lock(cache.lock);
+
+  auto it = cache.matrices.find(key);
+  if (it != cache.matrices.end()) {
+    if (std::shared_ptr<const MixerContext> matrix = it->second.lock()) {
+      return matrix;
+    }
+  }
+  // Forget the matrices that are not used anymore.
+  for (it = cache.matrices.begin(); it != cache.matrices.end();) {
+    if (it->second.expired()) {
+      it = cache.matrices.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  // Not std::make_shared: the weak reference would keep the memory of the
+  // matrix allocated along with its reference count.
+  std::shared_ptr<const MixerContext> matrix(
+    new MixerContext(format, in_channels, in_layout, out_channels, out_layout));
+  cache.matrices[key] = matrix;
+  return matrix;
+}
+
+/** Number of frames mixed at a time during a crossfade, with the new matrix
+ * in a buffer on the stack. */
+const size_t CROSSFADE_CHUNK_FRAMES = 64;
+
+static float
+crossfade_sample(float from, float to, float t)
+{
+  return from * (1 - t) + to * t;
+}
+
+static int16_t
+crossfade_sample(int16_t from, int16_t to, float t)
+{
+  return static_cast<int16_t>(lrintf(from * (1 - t) + to * t));
+}
+
+/* The matrix of a mixer can be replaced while it is mixing, see
+ * cubeb_mixer_set_matrix. The control thread publishes the new context in
+ * _next, and the audio thread picks it up at the start of the next mix(),
+ * crossfading from the current one over that call, without locking.
+ *
+ * The audio thread announces the contexts it uses in _hazards: [0] for the
+ * current one, [1] for the one it is switching to. It only uses the context
+ * in _next after storing it in _hazards[1] and checking that it is still the
+ * one in _next. The control thread frees the contexts that are neither in
+ * _next nor in _hazards: those can't be used anymore. */
 struct cubeb_mixer
 {
   cubeb_mixer(cubeb_sample_format format,
@@ -514,8 +882,25 @@ struct cubeb_mixer
               cubeb_channel_layout in_layout,
               uint32_t out_channels,
               cubeb_channel_layout out_layout)
-    : _context(format, in_channels, in_layout, out_channels, out_layout)
+    : _context(acquire_matrix(format, in_channels, in_layout,
+                              out_channels, out_layout))
+    , _rematrix_float(rematrix_float)
+    , _rematrix_s16(rematrix_s16)
+    , _current(_context.get())
+    , _next(_context.get())
   {
+    _hazards[0].store(_current);
+    _hazards[1].store(nullptr);
+    if (!use_specialized_kernels) {
+      return;
+    }
+    for (const rematrix_kernels & kernels : specialized_kernels) {
+      if (kernels.in_channels == in_channels &&
+          kernels.out_channels == out_channels) {
+        _rematrix_float = kernels.rematrix_float;
+        _rematrix_s16 = kernels.rematrix_s16;
+      }
+    }
   }
 
   template<typename T>
@@ -523,99 +908,129 @@ struct cubeb_mixer
                       const T * input_buffer,
                       T * output_buffer) const
   {
-    if (_context._in_ch_count <= _context._out_ch_count) {
+    if (_context->_in_ch_count <= _context->_out_ch_count) {
       // Not enough channels to copy, fill the gaps with silence.
       for (uint32_t i = 0; i < frames; i++) {
-        PodCopy(output_buffer, input_buffer, _context._in_ch_count);
-        output_buffer += _context._in_ch_count;
-        input_buffer += _context._in_ch_count;
-        PodZero(output_buffer, _context._out_ch_count - _context._in_ch_count);
-        output_buffer += _context._out_ch_count - _context._in_ch_count;
+        PodCopy(output_buffer, input_buffer, _context->_in_ch_count);
+        output_buffer += _context->_in_ch_count;
+        input_buffer += _context->_in_ch_count;
+        PodZero(output_buffer, _context->_out_ch_count - _context->_in_ch_count);
+        output_buffer += _context->_out_ch_count - _context->_in_ch_count;
       }
     } else {
       for (uint32_t i = 0; i < frames; i++) {
-        PodCopy(output_buffer, input_buffer, _context._out_ch_count);
-        output_buffer += _context._out_ch_count;
-        input_buffer += _context._in_ch_count;
+        PodCopy(output_buffer, input_buffer, _context->_out_ch_count);
+        output_buffer += _context->_out_ch_count;
+        input_buffer += _context->_in_ch_count;
       }
     }
   }
 
+  void rematrix(const MixerContext * context, size_t frames,
+                const float * input_buffer, float * output_buffer) const
+  {
+    if (!context->_valid) {
+      // The channel layouts were invalid or unsupported, instead we will simply
+      // either drop the extra channels, or fill with silence the missing ones
+      copy_and_trunc(frames, input_buffer, output_buffer);
+      return;
+    }
+    _rematrix_float(context, output_buffer, input_buffer, frames);
+  }
+
+  void rematrix(const MixerContext * context, size_t frames,
+                const int16_t * input_buffer, int16_t * output_buffer) const
+  {
+    if (!context->_valid) {
+      copy_and_trunc(frames, input_buffer, output_buffer);
+      return;
+    }
+    _rematrix_s16(context, output_buffer, input_buffer, frames);
+  }
+
+  /** Mix `frames` frames with a gain going linearly from `from` to `to`
+   * across them, ending on `to` alone. */
+  template<typename T>
+  void crossfade(const MixerContext * from, const MixerContext * to,
+                 size_t frames, const T * input_buffer, T * output_buffer) const
+  {
+    const uint32_t in_channels = _context->_in_ch_count;
+    const uint32_t out_channels = _context->_out_ch_count;
+    T faded[CROSSFADE_CHUNK_FRAMES * CHANNELS_MAX];
+
+    for (size_t done = 0; done < frames; done += CROSSFADE_CHUNK_FRAMES) {
+      size_t chunk = std::min(CROSSFADE_CHUNK_FRAMES, frames - done);
+      const T * in = input_buffer + done * in_channels;
+      T * out = output_buffer + done * out_channels;
+      rematrix(from, chunk, in, out);
+      rematrix(to, chunk, in, faded);
+      for (size_t i = 0; i < chunk; i++) {
+        float t = static_cast<float>(done + i + 1) / frames;
+        for (uint32_t c = 0; c < out_channels; c++) {
+          out[i * out_channels + c] =
+            crossfade_sample(out[i * out_channels + c],
+                             faded[i * out_channels + c], t);
+        }
+      }
+    }
+  }
+
+  template<typename T>
+  void mix(size_t frames, const T * input_buffer, T * output_buffer)
+  {
+    const MixerContext * next = _next.load();
+    if (next == _current) {
+      rematrix(_current, frames, input_buffer, output_buffer);
+      return;
+    }
+
+    const MixerContext * published;
+    do {
+      published = next;
+      _hazards[1].store(published);
+      next = _next.load();
+    } while (next != published);
+
+    crossfade(_current, next, frames, input_buffer, output_buffer);
+    _current = next;
+    _hazards[0].store(next);
+    _hazards[1].store(nullptr);
+  }
+
   int mix(size_t frames,
           const void * input_buffer,
           size_t input_buffer_size,
           void * output_buffer,
-          size_t output_buffer_size) const
+          size_t output_buffer_size)
   {
-    if (frames <= 0 || _context._out_ch_count == 0) {
+    if (frames <= 0 || _context->_out_ch_count == 0) {
       return 0;
     }
 
     // Check if output buffer is of sufficient size.
     size_t size_read_needed =
-      frames * _context._in_ch_count * cubeb_sample_size(_context._format);
+      frames * _context->_in_ch_count * cubeb_sample_size(_context->_format);
     if (input_buffer_size < size_read_needed) {
       // We don't have enough data to read!
       return -1;
     }
-    if (output_buffer_size * _context._in_ch_count <
-        size_read_needed * _context._out_ch_count) {
+    if (output_buffer_size * _context->_in_ch_count <
+        size_read_needed * _context->_out_ch_count) {
       return -1;
     }
 
-    if (!valid()) {
-      // The channel layouts were invalid or unsupported, instead we will simply
-      // either drop the extra channels, or fill with silence the missing ones
-      if (_context._format == CUBEB_SAMPLE_FLOAT32NE) {
-        copy_and_trunc(frames,
-                       static_cast<const float*>(input_buffer),
-                       static_cast<float*>(output_buffer));
-      } else {
-        assert(_context._format == CUBEB_SAMPLE_S16NE);
-        copy_and_trunc(frames,
-                       static_cast<const int16_t*>(input_buffer),
-                       reinterpret_cast<int16_t*>(output_buffer));
-      }
-      return 0;
-    }
-
-    switch (_context._format)
+    switch (_context->_format)
     {
-      case CUBEB_SAMPLE_FLOAT32NE: {
-        auto f = [](float x) { return x; };
-        return rematrix(&_context,
-                        static_cast<float*>(output_buffer),
-                        static_cast<const float*>(input_buffer),
-                        _context._matrix_flt,
-                        f,
-                        frames);
-      }
+      case CUBEB_SAMPLE_FLOAT32NE:
+        mix(frames,
+            static_cast<const float*>(input_buffer),
+            static_cast<float*>(output_buffer));
+        return 0;
       case CUBEB_SAMPLE_S16NE:
-        if (_context._clipping) {
-          auto f = [](int x) {
-            int y = (x + 16384) >> 15;
-            // clip the signed integer value into the -32768,32767 range.
-            if ((y + 0x8000U) & ~0xFFFF) {
-              return (y >> 31) ^ 0x7FFF;
-            }
-            return y;
-          };
-          return rematrix(&_context,
-                          static_cast<int16_t*>(output_buffer),
-                          static_cast<const int16_t*>(input_buffer),
-                          _context._matrix32,
-                          f,
-                          frames);
-        } else {
-          auto f = [](int x) { return (x + 16384) >> 15; };
-          return rematrix(&_context,
-                          static_cast<int16_t*>(output_buffer),
-                          static_cast<const int16_t*>(input_buffer),
-                          _context._matrix32,
-                          f,
-                          frames);
-        }
-        break;
+        mix(frames,
+            static_cast<const int16_t*>(input_buffer),
+            static_cast<int16_t*>(output_buffer));
+        return 0;
       default:
         assert(false);
         break;
@@ -624,12 +1039,65 @@ struct cubeb_mixer
     return -1;
   }
 
+  int set_matrix(const float * matrix)
+  {
+    std::unique_ptr<const MixerContext> custom;
+    if (matrix) {
+      uint32_t count = _context->_in_ch_count * _context->_out_ch_count;
+      for (uint32_t i = 0; i < count; i++) {
+        if (!std::isfinite(matrix[i])) {
+          return CUBEB_ERROR_INVALID_PARAMETER;
+        }
+        // The S16 kernels need 17.15 coefficients in [-1.0, 1.0].
+        if (_context->_format == CUBEB_SAMPLE_S16NE &&
+            std::fabs(matrix[i]) > 1.0f) {
+          return CUBEB_ERROR_INVALID_PARAMETER;
+        }
+      }
+      custom.reset(new MixerContext(_context->_format,
+                                    _context->_in_ch_count,
+                                    _context->_out_ch_count,
+                                    matrix));
+    }
+
+    auto_lock lock(_custom_lock);
+    const MixerContext * next = custom ? custom.get() : _context.get();
+    if (custom) {
+      _custom.push_back(std::move(custom));
+    }
+    _next.store(next);
+
+    // _hazards[1] is read first: the audio thread stores a context in
+    // _hazards[0] before clearing _hazards[1], so that it is always seen in
+    // one of them.
+    const MixerContext * switching = _hazards[1].load();
+    const MixerContext * current = _hazards[0].load();
+    _custom.erase(
+      std::remove_if(_custom.begin(), _custom.end(),
+                     [=](const std::unique_ptr<const MixerContext> & c) {
+                       return c.get() != next && c.get() != switching &&
+                              c.get() != current;
+                     }),
+      _custom.end());
+    return CUBEB_OK;
+  }
+
   // Return false if any of the input or ouput layout were invalid.
-  bool valid() const { return _context._valid; }
+  bool valid() const { return _context->_valid; }
 
   virtual ~cubeb_mixer(){};
 
-  MixerContext _context;
+  const std::shared_ptr<const MixerContext> _context;
+  rematrix_float_func _rematrix_float;
+  rematrix_s16_func _rematrix_s16;
+  /** The context the audio thread mixes with, only used on that thread. */
+  const MixerContext * _current;
+  std::atomic<const MixerContext *> _next;
+  std::atomic<const MixerContext *> _hazards[2];
+  /** The custom matrices that may still be in use, and the lock that
+   * serializes their replacement. */
+  owned_critical_section _custom_lock;
+  std::vector<std::unique_ptr<const MixerContext>> _custom;
 };
 
 cubeb_mixer* cubeb_mixer_create(cubeb_sample_format format,
@@ -642,6 +1110,28 @@ cubeb_mixer* cubeb_mixer_create(cubeb_sample_format format,
     format, in_channels, in_layout, out_channels, out_layout);
 }
 
+int cubeb_mixer_set_specialized_kernels(int enable)
+{
+  use_specialized_kernels = enable != 0;
+  return FF_ARRAY_ELEMS(specialized_kernels);
+}
+
+int cubeb_mixer_set_matrix(cubeb_mixer * mixer, const float * matrix)
+{
+  return mixer->set_matrix(matrix);
+}
+
+size_t cubeb_mixer_shared_matrix_count()
+{
+  matrix_cache & cache = get_matrix_cache();
+  auto_lock lock(cache.lock);
+  size_t count = 0;
+  for (const auto & entry : cache.matrices) {
+    count += !entry.second.expired();
+  }
+  return count;
+}
+
 void cubeb_mixer_destroy(cubeb_mixer * mixer)
 {
   delete mixer;
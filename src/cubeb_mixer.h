@@ -20,6 +20,22 @@ cubeb_mixer * cubeb_mixer_create(cubeb_sample_format format,
                                  cubeb_channel_layout in_layout,
                                  uint32_t out_channels,
                                  cubeb_channel_layout out_layout);
+/* Whether the mixers created from now on use the kernels specialized for the
+ * most common channel counts, or the generic ones, for tests and benchmarks.
+ * Returns the number of pairs of channel counts with specialized kernels. */
+int cubeb_mixer_set_specialized_kernels(int enable);
+/* Returns the number of distinct matrices the existing mixers share, mixers
+ * with the same parameters sharing theirs, for tests. */
+size_t cubeb_mixer_shared_matrix_count(void);
+/* Replace the matrix of `mixer` with `matrix`, `out_channels` rows of
+ * `in_channels` coefficients, or go back to the one of its layouts when
+ * `matrix` is NULL. This can be called from another thread while the mixer is
+ * mixing: the next call to cubeb_mixer_mix crossfades from the previous
+ * matrix to the new one, without locking. Calls to this function must not
+ * overlap the destruction of the mixer. The coefficients of S16 mixers must
+ * be in [-1.0, 1.0].
+ * Returns CUBEB_OK or CUBEB_ERROR_INVALID_PARAMETER. */
+int cubeb_mixer_set_matrix(cubeb_mixer * mixer, const float * matrix);
 void cubeb_mixer_destroy(cubeb_mixer * mixer);
 int cubeb_mixer_mix(cubeb_mixer * mixer,
                     size_t frames,
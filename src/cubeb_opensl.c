@@ -153,6 +153,14 @@ struct cubeb_stream {
   cubeb_state_callback state_callback;
 
   cubeb_resampler * resampler;
+  /* Bounds of the input buffer of a duplex stream, at the rate of the
+   * device, set before the stream starts and applied when it starts. */
+  int has_input_buffer_bounds;
+  uint32_t input_buffer_min_frames;
+  uint32_t input_buffer_max_frames;
+  /* Set once the stream has been started: the resampler can be in use from
+   * then on. Synchronized by stream::mutex lock. */
+  int started;
   unsigned int user_output_rate;
   unsigned int output_configured_rate;
   unsigned int latency_frames;
@@ -1250,12 +1258,17 @@ opensl_stream_init(cubeb * ctx, cubeb_stream ** stream, char const * stream_name
                                           target_sample_rate,
                                           data_callback,
                                           user_ptr,
-                                          CUBEB_RESAMPLER_QUALITY_DEFAULT);
+                                          CUBEB_RESAMPLER_QUALITY_DEFAULT,
+                                          CUBEB_RESAMPLER_RECLOCK_NONE,
+                                          cubeb_resampler_block_size(input_stream_params,
+                                                                     output_stream_params,
+                                                                     stm->latency_frames));
   if (!stm->resampler) {
     LOG("Failed to create resampler");
     opensl_stream_destroy(stm);
     return CUBEB_ERROR;
   }
+  cubeb_resampler_reserve(stm->resampler, stm->latency_frames);
 
   *stream = stm;
   LOG("Cubeb stream (%p) init success", stm);
@@ -1301,6 +1314,16 @@ opensl_stream_start(cubeb_stream * stm)
 
   int r = pthread_mutex_lock(&stm->mutex);
   assert(r == 0);
+  /* The callbacks don't run yet: the resampler isn't in use. */
+  if (!stm->started && stm->has_input_buffer_bounds &&
+      cubeb_resampler_set_input_buffer_bounds(
+          stm->resampler, stm->input_buffer_min_frames,
+          stm->input_buffer_max_frames) != CUBEB_OK) {
+    r = pthread_mutex_unlock(&stm->mutex);
+    assert(r == 0);
+    return CUBEB_ERROR;
+  }
+  stm->started = 1;
   opensl_set_shutdown(stm, 0);
   opensl_set_draining(stm, 0);
   r = pthread_mutex_unlock(&stm->mutex);
@@ -1528,6 +1551,37 @@ opensl_stream_set_volume(cubeb_stream * stm, float volume)
   return CUBEB_OK;
 }
 
+static int
+opensl_stream_set_input_buffer_bounds(cubeb_stream * stm,
+                                      uint32_t min_frames,
+                                      uint32_t max_frames)
+{
+  if (!stm->input_enabled || !stm->output_enabled) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  /* The rates of the input and output streams of a duplex stream are the
+   * same, and the resampler counts the input frames at the rate of the
+   * device. */
+  uint64_t device_rate = stm->input_device_rate;
+  uint64_t stream_rate = stm->user_output_rate;
+  int rv = CUBEB_OK;
+  int r = pthread_mutex_lock(&stm->mutex);
+  assert(r == 0);
+  /* The resampler can't be changed while the callbacks use it. */
+  if (stm->started) {
+    rv = CUBEB_ERROR;
+  } else {
+    /* Applied in opensl_stream_start. */
+    stm->has_input_buffer_bounds = 1;
+    stm->input_buffer_min_frames = min_frames * device_rate / stream_rate;
+    stm->input_buffer_max_frames = max_frames * device_rate / stream_rate;
+  }
+  r = pthread_mutex_unlock(&stm->mutex);
+  assert(r == 0);
+  return rv;
+}
+
 static struct cubeb_ops const opensl_ops = {
   .init = opensl_init,
   .get_backend_id = opensl_get_backend_id,
@@ -1545,7 +1599,10 @@ static struct cubeb_ops const opensl_ops = {
   .stream_get_position = opensl_stream_get_position,
   .stream_get_latency = NULL,
   .stream_set_volume = opensl_stream_set_volume,
+  .stream_set_channel_volumes = NULL,
   .stream_set_panning = NULL,
+  .stream_set_mixing_matrix = NULL,
+  .stream_set_input_buffer_bounds = opensl_stream_set_input_buffer_bounds,
   .stream_get_current_device = NULL,
   .stream_device_destroy = NULL,
   .stream_register_device_changed_callback = NULL,
@@ -14,47 +14,84 @@
 #ifndef M_PI
 #define M_PI 3.14159263
 #endif
-
-/**
- * We use a cos/sin law.
- */
+#ifndef M_SQRT2
+#define M_SQRT2 1.41421356237309504880
+#endif
 
 namespace {
-template<typename T>
-void cubeb_pan_stereo_buffer(T * buf, uint32_t frames, float pan)
+
+const uint32_t LEFT_CHANNELS =
+  CHANNEL_FRONT_LEFT | CHANNEL_BACK_LEFT | CHANNEL_FRONT_LEFT_OF_CENTER |
+  CHANNEL_SIDE_LEFT | CHANNEL_TOP_FRONT_LEFT | CHANNEL_TOP_BACK_LEFT;
+const uint32_t RIGHT_CHANNELS =
+  CHANNEL_FRONT_RIGHT | CHANNEL_BACK_RIGHT | CHANNEL_FRONT_RIGHT_OF_CENTER |
+  CHANNEL_SIDE_RIGHT | CHANNEL_TOP_FRONT_RIGHT | CHANNEL_TOP_BACK_RIGHT;
+
+uint32_t
+count_channels(uint32_t layout)
 {
-  if (pan == 0.0) {
-    return;
+  uint32_t count = 0;
+  for (; layout; layout &= layout - 1) {
+    count++;
   }
-  /* rescale in [0; 1] */
-  pan += 1;
-  pan /= 2;
-  float left_gain  = float(cos(pan * M_PI * 0.5));
-  float right_gain = float(sin(pan * M_PI * 0.5));
-
-  /* In we are panning on the left, pan the right channel into the left one and
-   * vice-versa. */
-  if (pan < 0.5) {
-    for (uint32_t i = 0; i < frames * 2; i+=2) {
-      buf[i]     = T(buf[i] + buf[i + 1] * left_gain);
-      buf[i + 1] = T(buf[i + 1] * right_gain);
-    }
-  } else {
-    for (uint32_t i = 0; i < frames * 2; i+=2) {
-      buf[i]     = T(buf[i] * left_gain);
-      buf[i + 1] = T(buf[i + 1] + buf[i] * right_gain);
-    }
-  }
-}
+  return count;
 }
 
-void cubeb_pan_stereo_buffer_float(float * buf, uint32_t frames, float pan)
-{
-  cubeb_pan_stereo_buffer(buf, frames, pan);
 }
 
-void cubeb_pan_stereo_buffer_int(short * buf, uint32_t frames, float pan)
+void
+cubeb_pan_gains(cubeb_channel_layout layout, uint32_t channels,
+                float pan, float * gains, float * cross)
 {
-  cubeb_pan_stereo_buffer(buf, frames, pan);
-}
+  uint32_t mask = layout;
+  if (count_channels(mask) != channels) {
+    mask = channels == 2 ? CUBEB_LAYOUT_STEREO : 0;
+  }
+  for (uint32_t c = 0; c < channels; c++) {
+    cross[c] = 0.0f;
+  }
+
+  /* Stereo is panned with the cos/sin law, on [0; 1]: the channel the stream
+   * is panned away from is attenuated, and mixed into the other one. */
+  if (mask == CUBEB_LAYOUT_STEREO) {
+    gains[0] = gains[1] = 1.0f;
+    if (pan == 0.0f) {
+      return;
+    }
+    float x = (pan + 1) / 2 * float(M_PI) / 2;
+    if (pan < 0.0f) {
+      gains[1] = float(sin(x));
+      cross[0] = float(cos(x));
+    } else {
+      gains[0] = float(cos(x));
+      cross[1] = float(sin(x));
+    }
+    return;
+  }
 
+  /* Other layouts have no single other channel to mix into. The gains of the
+   * constant-power law are cos(x) on the left and sin(x) on the right, x
+   * going from 0 to pi/2. Dividing them by their value at the center leaves
+   * the side the stream is panned to at 1, and the other one at
+   * sqrt(2) * sin((1 - |pan|) * pi / 4), which is 0 when fully panned. */
+  float attenuation = 1.0f;
+  if (pan != 0.0f) {
+    attenuation = float(M_SQRT2 * sin((1 - fabs(pan)) * M_PI / 4));
+  }
+  float left = pan > 0.0f ? attenuation : 1.0f;
+  float right = pan < 0.0f ? attenuation : 1.0f;
+
+  /* The channels of a layout are in the order of their bits. */
+  uint32_t c = 0;
+  for (uint32_t bit = 1; mask && c < channels; bit <<= 1) {
+    if (!(mask & bit)) {
+      continue;
+    }
+    mask &= ~bit;
+    gains[c++] = (bit & LEFT_CHANNELS) ? left :
+                 (bit & RIGHT_CHANNELS) ? right : 1.0f;
+  }
+  for (; c < channels; c++) {
+    gains[c] = 1.0f;
+  }
+}
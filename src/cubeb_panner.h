@@ -8,18 +8,40 @@
 #if !defined(CUBEB_PANNER)
 #define CUBEB_PANNER
 
+#include <stdint.h>
+#include "cubeb/cubeb.h"
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
 /**
- * Pan an integer or an float stereo buffer according to a cos/sin pan law
- * @param buf the buffer to pan
- * @param frames the number of frames in `buf`
+ * Compute the gains that pan the channels of a layout, according to a
+ * cos/sin pan law.
+ *
+ * A stereo stream panned to the left gets its left channel untouched, plus
+ * its right channel times cos(x), and its right channel times sin(x), x going
+ * from 0 to pi/4 as `pan` goes from -1.0 to 0.0; and conversely on the right.
+ *
+ * In the other layouts, the channels on the side the stream is panned to are
+ * left untouched, and the ones on the other side are attenuated with the
+ * constant-power law, scaled so that a centered stream is unchanged. The
+ * channels that are on neither side (center, LFE) are left untouched.
+ *
+ * This is meant to be computed once, when the panning changes, and applied
+ * by cubeb_gain.
+ * @param layout the layout of the channels. If it doesn't describe
+ *        `channels` channels, a two channel stream is considered stereo and
+ *        any other stream is not panned.
+ * @param channels the number of channels, and of elements of `gains` and
+ *        `cross`
  * @param pan a float in [-1.0; 1.0]
+ * @param gains the gain of each channel, in [0.0; 1.0]
+ * @param cross the gain with which the other channel of a stereo stream is
+ *        mixed into each channel. 0.0 in the other layouts.
  */
-void cubeb_pan_stereo_buffer_float(float * buf, uint32_t frames, float pan);
-void cubeb_pan_stereo_buffer_int(short* buf, uint32_t frames, float pan);
+void cubeb_pan_gains(cubeb_channel_layout layout, uint32_t channels,
+                     float pan, float * gains, float * cross);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,319 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include "cubeb_pipeline.h"
+#include "cubeb_convert.h"
+#include "cubeb_gain.h"
+#include "cubeb_mixer.h"
+#include "cubeb_utils.h"
+
+namespace {
+
+/** Size of the intermediate buffers. The stream's audio is produced in
+ * blocks that fit in there, so that it is still in the L1 cache when it is
+ * rematrixed, scaled and converted to the device format. */
+const size_t PIPELINE_BLOCK_BYTES = 16 * 1024;
+
+/** Apply `gain` to `samples` samples of `in` and store them in `out`,
+ * converting them to the output sample format. */
+void
+scale_and_convert(const float * in, float * out, size_t samples, float gain)
+{
+  cubeb_convert_gain_float(in, out, samples, gain);
+}
+
+void
+scale_and_convert(const float * in, int16_t * out, size_t samples, float gain)
+{
+  cubeb_convert_float_to_s16(in, out, samples, gain);
+}
+
+void
+scale_and_convert(const int16_t * in, float * out, size_t samples, float gain)
+{
+  cubeb_convert_s16_to_float(in, out, samples, gain);
+}
+
+void
+scale_and_convert(const int16_t * in, int16_t * out, size_t samples, float gain)
+{
+  cubeb_convert_gain_s16(in, out, samples, gain);
+}
+
+template<typename In>
+void
+scale_and_convert(const In * in, void * out, cubeb_sample_format out_format,
+                  size_t samples, float gain)
+{
+  if (out_format == CUBEB_SAMPLE_FLOAT32NE) {
+    scale_and_convert(in, static_cast<float *>(out), samples, gain);
+  } else {
+    assert(out_format == CUBEB_SAMPLE_S16NE);
+    scale_and_convert(in, static_cast<int16_t *>(out), samples, gain);
+  }
+}
+
+bool
+is_native_format(cubeb_sample_format format)
+{
+  return format == CUBEB_SAMPLE_FLOAT32NE || format == CUBEB_SAMPLE_S16NE;
+}
+
+void
+apply_gain(cubeb_gain * gain, void * samples, cubeb_sample_format format,
+           size_t frames)
+{
+  if (format == CUBEB_SAMPLE_FLOAT32NE) {
+    float * s = static_cast<float *>(samples);
+    cubeb_gain_apply_float(gain, s, s, frames);
+  } else {
+    assert(format == CUBEB_SAMPLE_S16NE);
+    int16_t * s = static_cast<int16_t *>(samples);
+    cubeb_gain_apply_s16(gain, s, s, frames);
+  }
+}
+
+struct mixer_deleter {
+  void operator()(cubeb_mixer * mixer) { cubeb_mixer_destroy(mixer); }
+};
+
+struct gain_deleter {
+  void operator()(cubeb_gain * gain) { cubeb_gain_destroy(gain); }
+};
+
+} // namespace
+
+struct cubeb_pipeline {
+  cubeb_pipeline(cubeb_stream * stream,
+                 cubeb_data_callback callback,
+                 void * user_ptr,
+                 cubeb_resampler * resampler,
+                 cubeb_stream_params const * input_params,
+                 cubeb_stream_params const & stream_params,
+                 cubeb_stream_params const & device_params)
+    : stream(stream)
+    , callback(callback)
+    , user_ptr(user_ptr)
+    , resampler(resampler)
+    , input_frame_size(input_params ? input_params->channels *
+                                      cubeb_sample_size(input_params->format)
+                                    : 0)
+    , stream_format(stream_params.format)
+    , stream_channels(stream_params.channels)
+    , device_format(device_params.format)
+    , device_channels(device_params.channels)
+    , stream_frame_size(stream_channels * cubeb_sample_size(stream_format))
+    , mixed_frame_size(device_channels * cubeb_sample_size(stream_format))
+    , device_frame_size(device_channels * cubeb_sample_size(device_format))
+    , block_frames(PIPELINE_BLOCK_BYTES /
+                   std::max(stream_frame_size, mixed_frame_size))
+    , mixer(cubeb_mixer_create(stream_format,
+                               stream_channels, stream_params.layout,
+                               device_channels, device_params.layout))
+    , produced(new uint8_t[block_frames * stream_frame_size])
+    , mixed(new uint8_t[block_frames * mixed_frame_size])
+    , remix(stream_params.channels != device_params.channels ||
+            stream_params.layout != device_params.layout)
+    , gain(cubeb_gain_create(device_channels))
+  {
+  }
+
+  /** Get `output_frames` frames of the stream's own format from the
+   * resampler, or straight from the data callback. */
+  long source(const void * input, long * input_frames,
+              void * output, long output_frames)
+  {
+    if (resampler) {
+      return cubeb_resampler_fill(resampler, const_cast<void *>(input),
+                                  input_frames, output, output_frames);
+    }
+    if (input_frames) {
+      *input_frames = output_frames;
+    }
+    return callback(stream, user_ptr, input, output, output_frames);
+  }
+
+  long fill(const void * input_buffer, long * input_frames_count,
+            void * output_buffer, long output_frames_needed)
+  {
+    /* A gain that is the same on all the channels is applied while
+       converting, ramps and per-channel gains in a pass of their own. */
+    float uniform_gain = 1.0f;
+    bool fused = cubeb_gain_get_uniform(gain.get(), &uniform_gain);
+    bool mixing = remix.load(std::memory_order_relaxed);
+    bool in_place = !mixing && stream_format == device_format;
+
+    /* Nothing to do to the audio: let the callback write to the device. */
+    if (in_place && fused && uniform_gain == 1.0f) {
+      return source(input_buffer, input_frames_count,
+                    output_buffer, output_frames_needed);
+    }
+
+    const uint8_t * input = static_cast<const uint8_t *>(input_buffer);
+    uint8_t * output = static_cast<uint8_t *>(output_buffer);
+    long input_frames = input_frames_count ? *input_frames_count : 0;
+    long input_consumed = 0;
+    long written = 0;
+
+    while (written < output_frames_needed) {
+      long frames = std::min<long>(block_frames, output_frames_needed - written);
+      /* Split the input of a duplex stream in proportion of the output
+         requested for this block. */
+      long block_input_frames =
+        input ? input_frames * (written + frames) / output_frames_needed
+                - input_consumed
+              : 0;
+      void * block = in_place ? output : produced.get();
+
+      long got = source(input ? input + input_consumed * input_frame_size
+                              : nullptr,
+                        input ? &block_input_frames : nullptr,
+                        block, frames);
+      if (got < 0) {
+        return got;
+      }
+      input_consumed += block_input_frames;
+
+      /* Now that the block is in the cache, rematrix it, scale it and
+         convert it to the device format in one pass. */
+      void * to_convert = block;
+      if (mixing) {
+        cubeb_mixer_mix(mixer.get(), got,
+                        block, got * stream_frame_size,
+                        mixed.get(), got * mixed_frame_size);
+        to_convert = mixed.get();
+      }
+      if (!fused) {
+        apply_gain(gain.get(), to_convert, stream_format, got);
+      }
+      float block_gain = fused ? uniform_gain : 1.0f;
+      if (stream_format == CUBEB_SAMPLE_FLOAT32NE) {
+        scale_and_convert(static_cast<const float *>(to_convert), output,
+                          device_format, got * device_channels, block_gain);
+      } else {
+        scale_and_convert(static_cast<const int16_t *>(to_convert), output,
+                          device_format, got * device_channels, block_gain);
+      }
+
+      output += got * device_frame_size;
+      written += got;
+      if (got < frames) {
+        break;
+      }
+    }
+
+    if (input_frames_count) {
+      *input_frames_count = input_consumed;
+    }
+
+    return written;
+  }
+
+  cubeb_stream * const stream;
+  const cubeb_data_callback callback;
+  void * const user_ptr;
+  cubeb_resampler * const resampler;
+  const size_t input_frame_size;
+  const cubeb_sample_format stream_format;
+  const uint32_t stream_channels;
+  const cubeb_sample_format device_format;
+  const uint32_t device_channels;
+  const size_t stream_frame_size;
+  const size_t mixed_frame_size;
+  const size_t device_frame_size;
+  const size_t block_frames;
+  /** Created even when the stream and device layouts match, so that a mixing
+   * matrix can be set while the stream runs. */
+  const std::unique_ptr<cubeb_mixer, mixer_deleter> mixer;
+  /** The audio of a block, as produced by the stream, when it can't be
+   * produced in place in the device buffer. */
+  const std::unique_ptr<uint8_t[]> produced;
+  /** The audio of a block after rematrixing, still in the stream format. */
+  const std::unique_ptr<uint8_t[]> mixed;
+  /** Whether the audio goes through the mixer: when the layouts differ, or
+   * once a mixing matrix has been set. */
+  std::atomic<bool> remix;
+  /** The volume of the stream, applied after rematrixing. */
+  const std::unique_ptr<cubeb_gain, gain_deleter> gain;
+};
+
+cubeb_pipeline *
+cubeb_pipeline_create(cubeb_stream * stream,
+                      cubeb_data_callback callback,
+                      void * user_ptr,
+                      cubeb_resampler * resampler,
+                      cubeb_stream_params const * input_params,
+                      cubeb_stream_params const * stream_params,
+                      cubeb_stream_params const * device_params)
+{
+  assert(stream_params && device_params);
+  assert(resampler || callback);
+
+  if (!is_native_format(stream_params->format) ||
+      !is_native_format(device_params->format) ||
+      !stream_params->channels || !device_params->channels) {
+    return nullptr;
+  }
+
+  return new cubeb_pipeline(stream, callback, user_ptr,
+                            resampler, input_params,
+                            *stream_params, *device_params);
+}
+
+void
+cubeb_pipeline_set_volume(cubeb_pipeline * pipeline, float volume)
+{
+  cubeb_gain_set_volume(pipeline->gain.get(), volume);
+}
+
+int
+cubeb_pipeline_set_channel_volumes(cubeb_pipeline * pipeline,
+                                   float const * volumes, uint32_t channels)
+{
+  return cubeb_gain_set_channel_volumes(pipeline->gain.get(), volumes,
+                                        channels);
+}
+
+int
+cubeb_pipeline_set_mixing_matrix(cubeb_pipeline * pipeline,
+                                 float const * matrix,
+                                 uint32_t in_channels,
+                                 uint32_t out_channels)
+{
+  if (in_channels != pipeline->stream_channels ||
+      out_channels != pipeline->device_channels) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+
+  int r = cubeb_mixer_set_matrix(pipeline->mixer.get(), matrix);
+  if (r != CUBEB_OK) {
+    return r;
+  }
+  pipeline->remix.store(true, std::memory_order_relaxed);
+  return CUBEB_OK;
+}
+
+long
+cubeb_pipeline_fill(cubeb_pipeline * pipeline,
+                    void const * input_buffer,
+                    long * input_frames_count,
+                    void * output_buffer,
+                    long output_frames_needed)
+{
+  return pipeline->fill(input_buffer, input_frames_count,
+                        output_buffer, output_frames_needed);
+}
+
+void
+cubeb_pipeline_destroy(cubeb_pipeline * pipeline)
+{
+  delete pipeline;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+#ifndef CUBEB_PIPELINE_H
+#define CUBEB_PIPELINE_H
+
+#include "cubeb/cubeb.h"
+#include "cubeb_resampler.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * The output side of a stream, from the data callback to the device buffer:
+ * resampling, channel rematrixing, gain and sample format conversion.
+ *
+ * Backends that would otherwise call the resampler, then the mixer, then run
+ * a volume loop and a conversion loop over the device buffer can hand all of
+ * it to a pipeline instead. The audio is produced in blocks small enough to
+ * stay in the L1 cache, and each sample is then rematrixed, scaled and
+ * converted in a single pass that stores it once in the device buffer.
+ *
+ * When the stream and device parameters match and the volume is 1.0, the
+ * callback writes straight into the device buffer. */
+typedef struct cubeb_pipeline cubeb_pipeline;
+
+/**
+ * Create a pipeline.
+ * @param stream A cubeb_stream instance, passed to the data callback.
+ * @param callback The data callback, called when `resampler` is NULL.
+ * @param user_ptr Passed to the data callback.
+ * @param resampler The resampler of the stream, or NULL. The pipeline does
+ *        not own it.
+ * @param input_params Parameters of the input side of a duplex stream, or
+ *        NULL for an output-only stream. Only the frame size is used, to
+ *        walk the input buffer.
+ * @param stream_params Format, channel count and layout of the audio the
+ *        stream produces, i.e. the output parameters the user asked for.
+ * @param device_params Format, channel count and layout the device expects.
+ * @retval NULL if the formats are not CUBEB_SAMPLE_S16NE or
+ *         CUBEB_SAMPLE_FLOAT32NE.
+ */
+cubeb_pipeline * cubeb_pipeline_create(cubeb_stream * stream,
+                                       cubeb_data_callback callback,
+                                       void * user_ptr,
+                                       cubeb_resampler * resampler,
+                                       cubeb_stream_params const * input_params,
+                                       cubeb_stream_params const * stream_params,
+                                       cubeb_stream_params const * device_params);
+
+/**
+ * Set the gain applied to the output, in [0.0; 1.0]. This can be called from
+ * any thread while the pipeline is running: the next block ramps to it.
+ */
+void cubeb_pipeline_set_volume(cubeb_pipeline * pipeline, float volume);
+
+/**
+ * Set a gain per device channel, in [0.0; 1.0], on top of the one set with
+ * cubeb_pipeline_set_volume. This can be called from any thread while the
+ * pipeline is running.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_INVALID_PARAMETER if `channels` is not the channel
+ *         count of the device.
+ */
+int cubeb_pipeline_set_channel_volumes(cubeb_pipeline * pipeline,
+                                       float const * volumes,
+                                       uint32_t channels);
+
+/**
+ * Rematrix the stream with `matrix`, `out_channels` rows of `in_channels`
+ * coefficients, instead of the matrix of the stream and device layouts, or go
+ * back to the latter when `matrix` is NULL. This can be called from any
+ * thread while the pipeline is running: the next block crossfades from the
+ * previous matrix to the new one.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_INVALID_PARAMETER if the channel counts are not the
+ *         ones of the stream and the device, or if a coefficient is not
+ *         finite, or outside [-1.0; 1.0] for a CUBEB_SAMPLE_S16NE stream.
+ */
+int cubeb_pipeline_set_mixing_matrix(cubeb_pipeline * pipeline,
+                                     float const * matrix,
+                                     uint32_t in_channels,
+                                     uint32_t out_channels);
+
+/**
+ * Fill `output_buffer` with `output_frames_needed` frames in the device
+ * format.
+ * @param input_buffer The input of a duplex stream, or NULL.
+ * @param input_frames_count In: the number of frames in `input_buffer`. Out:
+ *        the number of frames consumed. May be NULL for output-only streams.
+ * @retval The number of frames written, less than `output_frames_needed` when
+ *         the stream is draining, or an error from the data callback.
+ */
+long cubeb_pipeline_fill(cubeb_pipeline * pipeline,
+                         void const * input_buffer,
+                         long * input_frames_count,
+                         void * output_buffer,
+                         long output_frames_needed);
+
+/**
+ * Destroy a pipeline. This does not destroy its resampler.
+ */
+void cubeb_pipeline_destroy(cubeb_pipeline * pipeline);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* CUBEB_PIPELINE_H */
@@ -14,6 +14,10 @@
 #include "cubeb-internal.h"
 #include "cubeb/cubeb.h"
 #include "cubeb_mixer.h"
+#include "cubeb_convert.h"
+#include "cubeb_pipeline.h"
+#include "cubeb_gain.h"
+#include "cubeb_resampler.h"
 #include "cubeb_strings.h"
 
 #ifdef DISABLE_LIBPULSE_DLOPEN
@@ -125,16 +129,21 @@ struct cubeb_stream {
   pa_stream * input_stream;
   cubeb_data_callback data_callback;
   cubeb_state_callback state_callback;
+  /* Only used to call the data callback with fixed size blocks, when
+     CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE is set. */
+  cubeb_resampler * resampler;
+  /* Produces the output audio and applies the volume, when the sample format
+     allows it. NULL otherwise, and `gain` is applied in
+     trigger_user_callback. */
+  cubeb_pipeline * pipeline;
+  cubeb_gain * gain;
   pa_time_event * drain_timer;
   pa_sample_spec output_sample_spec;
   pa_sample_spec input_sample_spec;
   int shutdown;
-  float volume;
   cubeb_state state;
 };
 
-static const float PULSE_NO_GAIN = -1.0;
-
 enum cork_state {
   UNCORK = 0,
   CORK = 1 << 0,
@@ -242,6 +251,20 @@ stream_state_callback(pa_stream * s, void * u)
   WRAP(pa_threaded_mainloop_signal)(stm->context->mainloop, 0);
 }
 
+static long
+call_data_callback(cubeb_stream * stm, void const * input_data,
+                   void * output_data, long nframes)
+{
+  long input_frames = nframes;
+
+  if (!stm->resampler) {
+    return stm->data_callback(stm, stm->user_ptr, input_data, output_data, nframes);
+  }
+  return cubeb_resampler_fill(stm->resampler, (void *) input_data,
+                              input_data ? &input_frames : NULL,
+                              output_data, output_data ? nframes : 0);
+}
+
 static void
 trigger_user_callback(pa_stream * s, void const * input_data, size_t nbytes, cubeb_stream * stm)
 {
@@ -266,7 +289,16 @@ trigger_user_callback(pa_stream * s, void const * input_data, size_t nbytes, cub
     assert(size % frame_size == 0);
 
     LOGV("Trigger user callback with output buffer size=%zd, read_offset=%zd", size, read_offset);
-    got = stm->data_callback(stm, stm->user_ptr, (uint8_t const *)input_data + read_offset, buffer, size / frame_size);
+    if (stm->pipeline) {
+      long input_frames = size / frame_size;
+      got = cubeb_pipeline_fill(stm->pipeline,
+                                input_data ? (uint8_t const *)input_data + read_offset : NULL,
+                                input_data ? &input_frames : NULL,
+                                buffer, size / frame_size);
+    } else {
+      got = call_data_callback(stm, input_data ? (uint8_t const *)input_data + read_offset : NULL,
+                               buffer, size / frame_size);
+    }
     if (got < 0) {
       WRAP(pa_stream_cancel_write)(s);
       stm->shutdown = 1;
@@ -278,20 +310,22 @@ trigger_user_callback(pa_stream * s, void const * input_data, size_t nbytes, cub
       read_offset += (size / frame_size) * in_frame_size;
     }
 
-    if (stm->volume != PULSE_NO_GAIN) {
-      uint32_t samples =  size * stm->output_sample_spec.channels / frame_size ;
+    float gain;
+    if (stm->gain &&
+        (!cubeb_gain_get_uniform(stm->gain, &gain) || gain != 1.0f)) {
+      size_t frames = size / frame_size;
+      uint32_t samples = frames * stm->output_sample_spec.channels;
 
+      /* Without a pipeline, the samples are not native-endian. */
       if (stm->output_sample_spec.format == PA_SAMPLE_S16BE ||
           stm->output_sample_spec.format == PA_SAMPLE_S16LE) {
-        short * b = buffer;
-        for (uint32_t i = 0; i < samples; i++) {
-          b[i] *= stm->volume;
-        }
+        cubeb_convert_byteswap16(buffer, buffer, samples);
+        cubeb_gain_apply_s16(stm->gain, buffer, buffer, frames);
+        cubeb_convert_byteswap16(buffer, buffer, samples);
       } else {
-        float * b = buffer;
-        for (uint32_t i = 0; i < samples; i++) {
-          b[i] *= stm->volume;
-        }
+        cubeb_convert_byteswap32(buffer, buffer, samples);
+        cubeb_gain_apply_float(stm->gain, buffer, buffer, frames);
+        cubeb_convert_byteswap32(buffer, buffer, samples);
       }
     }
 
@@ -375,7 +409,7 @@ stream_read_callback(pa_stream * s, size_t nbytes, void * u)
         trigger_user_callback(stm->output_stream, read_data, write_size, stm);
       } else {
         // input/capture only operation. Call callback directly
-        long got = stm->data_callback(stm, stm->user_ptr, read_data, NULL, read_frames);
+        long got = call_data_callback(stm, read_data, NULL, read_frames);
         if (got < 0 || (size_t) got != read_frames) {
           WRAP(pa_stream_cancel_write)(s);
           stm->shutdown = 1;
@@ -865,10 +899,46 @@ pulse_stream_init(cubeb * context,
   stm->data_callback = data_callback;
   stm->state_callback = state_callback;
   stm->user_ptr = user_ptr;
-  stm->volume = PULSE_NO_GAIN;
   stm->state = -1;
   assert(stm->shutdown == 0);
 
+  /* PulseAudio picks the size of the buffers it asks for, re-chunk them to
+     get fixed size blocks. The rates are the same on both sides. */
+  unsigned int block_size = cubeb_resampler_block_size(input_stream_params,
+                                                       output_stream_params,
+                                                       latency_frames);
+  if (block_size) {
+    uint32_t rate = output_stream_params ? output_stream_params->rate
+                                         : input_stream_params->rate;
+    stm->resampler = cubeb_resampler_create(stm,
+                                            input_stream_params,
+                                            output_stream_params,
+                                            rate,
+                                            data_callback,
+                                            user_ptr,
+                                            CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                                            CUBEB_RESAMPLER_RECLOCK_NONE,
+                                            block_size);
+    if (!stm->resampler) {
+      pulse_stream_destroy(stm);
+      return CUBEB_ERROR;
+    }
+    cubeb_resampler_reserve(stm->resampler, latency_frames);
+  }
+
+  /* PulseAudio does the rematrixing itself, the stream and device parameters
+     are the same: the pipeline only applies our own volume. */
+  if (output_stream_params) {
+    stm->pipeline = cubeb_pipeline_create(stm, data_callback, user_ptr,
+                                          stm->resampler,
+                                          input_stream_params,
+                                          output_stream_params,
+                                          output_stream_params);
+    if (!stm->pipeline) {
+      stm->gain = cubeb_gain_create(output_stream_params->channels);
+    }
+  }
+
   WRAP(pa_threaded_mainloop_lock)(stm->context->mainloop);
   if (output_stream_params) {
     r = create_pa_stream(stm, &stm->output_stream, output_stream_params, stream_name);
@@ -976,6 +1046,18 @@ pulse_stream_destroy(cubeb_stream * stm)
   }
   WRAP(pa_threaded_mainloop_unlock)(stm->context->mainloop);
 
+  if (stm->pipeline) {
+    cubeb_pipeline_destroy(stm->pipeline);
+  }
+
+  if (stm->gain) {
+    cubeb_gain_destroy(stm->gain);
+  }
+
+  if (stm->resampler) {
+    cubeb_resampler_destroy(stm->resampler);
+  }
+
   free(stm);
 }
 
@@ -1107,7 +1189,11 @@ pulse_stream_set_volume(cubeb_stream * stm, float volume)
   ctx = stm->context;
   if (ctx->default_sink_info &&
       (ctx->default_sink_info->flags & PA_SINK_FLAT_VOLUME)) {
-    stm->volume = volume;
+    if (stm->pipeline) {
+      cubeb_pipeline_set_volume(stm->pipeline, volume);
+    } else if (stm->gain) {
+      cubeb_gain_set_volume(stm->gain, volume);
+    }
   } else {
     ss = WRAP(pa_stream_get_sample_spec)(stm->output_stream);
 
@@ -1192,6 +1278,36 @@ pulse_stream_set_panning(cubeb_stream * stm, float panning)
   return CUBEB_OK;
 }
 
+static int
+pulse_stream_set_channel_volumes(cubeb_stream * stm, float const * volumes,
+                                 uint32_t channels)
+{
+  /* Applied by us whether PulseAudio uses flat volumes or not: they come on
+     top of the stream volume. */
+  if (stm->pipeline) {
+    return cubeb_pipeline_set_channel_volumes(stm->pipeline, volumes,
+                                              channels);
+  }
+  if (stm->gain) {
+    return cubeb_gain_set_channel_volumes(stm->gain, volumes, channels);
+  }
+  return CUBEB_ERROR_NOT_SUPPORTED;
+}
+
+static int
+pulse_stream_set_mixing_matrix(cubeb_stream * stm, float const * matrix,
+                               uint32_t in_channels, uint32_t out_channels)
+{
+  /* PulseAudio gets the stream's own channels: the matrix is applied by the
+     pipeline, lock-free, between the stream and PulseAudio. */
+  if (!stm->pipeline) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  return cubeb_pipeline_set_mixing_matrix(stm->pipeline, matrix,
+                                          in_channels, out_channels);
+}
+
 typedef struct {
   char * default_sink_name;
   char * default_source_name;
@@ -1585,7 +1701,10 @@ static struct cubeb_ops const pulse_ops = {
   .stream_get_position = pulse_stream_get_position,
   .stream_get_latency = pulse_stream_get_latency,
   .stream_set_volume = pulse_stream_set_volume,
+  .stream_set_channel_volumes = pulse_stream_set_channel_volumes,
   .stream_set_panning = pulse_stream_set_panning,
+  .stream_set_mixing_matrix = pulse_stream_set_mixing_matrix,
+  .stream_set_input_buffer_bounds = NULL,
   .stream_get_current_device = pulse_stream_get_current_device,
   .stream_device_destroy = pulse_stream_device_destroy,
   .stream_register_device_changed_callback = NULL,
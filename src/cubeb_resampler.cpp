@@ -7,6 +7,7 @@
 #ifndef NOMINMAX
 #define NOMINMAX
 #endif // NOMINMAX
+#define _USE_MATH_DEFINES
 
 #include <algorithm>
 #include <cmath>
@@ -14,11 +15,26 @@
 #include <cstring>
 #include <cstddef>
 #include <cstdio>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
 #include "cubeb_resampler.h"
 #include "cubeb-speex-resampler.h"
 #include "cubeb_resampler_internal.h"
 #include "cubeb_utils.h"
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 int
 to_speex_quality(cubeb_resampler_quality q)
 {
@@ -40,23 +56,203 @@ uint32_t min_buffered_audio_frame(uint32_t sample_rate)
   return sample_rate / 20;
 }
 
+namespace {
+/** Zeroth order modified Bessel function of the first kind, for the Kaiser
+ * window. */
+double bessel_i0(double x)
+{
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; term > 1e-20 * sum; k++) {
+    double t = x / (2 * k);
+    term *= t * t;
+    sum += term;
+  }
+  return sum;
+}
+
+/** Windowed sinc with a cutoff at a quarter of the sample-rate. The Kaiser
+ * window parameter gives about 100dB of attenuation in the stop band. */
+struct halfband_filter {
+  halfband_filter()
+  {
+    const double beta = 10;
+    const double half_width = 2 * HALFBAND_HALF_LENGTH;
+    for (uint32_t k = 0; k < HALFBAND_HALF_LENGTH; k++) {
+      double n = 2 * k + 1;
+      double sinc = sin(M_PI * n / 2) / (M_PI * n);
+      double r = n / half_width;
+      double window = bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+      coefficients[k] = static_cast<float>(sinc * window);
+    }
+  }
+  float coefficients[HALFBAND_HALF_LENGTH];
+};
+}
+
+const float * halfband_coefficients()
+{
+  static const halfband_filter filter;
+  return filter.coefficients;
+}
+
+halfband_kernel::halfband_kernel()
+{
+  const float * c = halfband_coefficients();
+  std::copy(c, c + HALFBAND_HALF_LENGTH, coefficients);
+}
+
+namespace {
+/* Add the coefficients of the halfband filter, that are symmetric, to the
+ * folded inputs: sum(coefficients[k] * (left[-k] + right[k])) for k in
+ * [0, HALFBAND_HALF_LENGTH). */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+/** Four coefficients times the sum of left[-k..-k-3] and right[k..k+3]. */
+__m128 fold(const float * coefficients, const float * left,
+            const float * right, uint32_t k)
+{
+  __m128 l = _mm_loadu_ps(left - k - 3);
+  l = _mm_shuffle_ps(l, l, _MM_SHUFFLE(0, 1, 2, 3));
+  return _mm_mul_ps(_mm_add_ps(l, _mm_loadu_ps(right + k)),
+                    _mm_loadu_ps(coefficients + k));
+}
+
+float fold_dot(const float * coefficients, const float * left,
+               const float * right)
+{
+  __m128 sum = _mm_setzero_ps();
+  for (uint32_t k = 0; k < HALFBAND_HALF_LENGTH; k += 4) {
+    sum = _mm_add_ps(sum, fold(coefficients, left, right, k));
+  }
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+  return _mm_cvtss_f32(sum);
+}
+
+/** fold_dot for four consecutive positions, which shares the loads of the
+ * coefficients and the horizontal sums. */
+void fold_dot4(const float * coefficients, const float * left,
+               const float * right, float * out)
+{
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  __m128 sum2 = _mm_setzero_ps();
+  __m128 sum3 = _mm_setzero_ps();
+  for (uint32_t k = 0; k < HALFBAND_HALF_LENGTH; k += 4) {
+    sum0 = _mm_add_ps(sum0, fold(coefficients, left, right, k));
+    sum1 = _mm_add_ps(sum1, fold(coefficients, left + 1, right + 1, k));
+    sum2 = _mm_add_ps(sum2, fold(coefficients, left + 2, right + 2, k));
+    sum3 = _mm_add_ps(sum3, fold(coefficients, left + 3, right + 3, k));
+  }
+  _MM_TRANSPOSE4_PS(sum0, sum1, sum2, sum3);
+  _mm_storeu_ps(out, _mm_add_ps(_mm_add_ps(sum0, sum1),
+                                _mm_add_ps(sum2, sum3)));
+}
+#else
+float fold_dot(const float * coefficients, const float * left,
+               const float * right)
+{
+  /* Four independent sums, that the compiler can keep in a vector
+   * register. */
+  float sum[4] = { 0, 0, 0, 0 };
+  for (uint32_t k = 0; k < HALFBAND_HALF_LENGTH; k += 4) {
+    for (uint32_t i = 0; i < 4; i++) {
+      sum[i] += coefficients[k + i] *
+                (left[-static_cast<int32_t>(k + i)] + right[k + i]);
+    }
+  }
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+void fold_dot4(const float * coefficients, const float * left,
+               const float * right, float * out)
+{
+  for (uint32_t i = 0; i < 4; i++) {
+    out[i] = fold_dot(coefficients, left + i, right + i);
+  }
+}
+#endif
+static_assert(HALFBAND_HALF_LENGTH % 4 == 0,
+              "The halfband kernels work on four coefficients at once");
+}
+
+void halfband_interpolate(const halfband_kernel & kernel, const float * input,
+                          size_t count, float * output)
+{
+  const float * c = kernel.coefficients;
+  const float * left = input + HALFBAND_HALF_LENGTH - 1;
+  const float * right = input + HALFBAND_HALF_LENGTH;
+  size_t j = 0;
+  for (; j + 4 <= count; j += 4) {
+    fold_dot4(c, left + j, right + j, output + j);
+    for (size_t i = j; i < j + 4; i++) {
+      output[i] *= 2;
+    }
+  }
+  for (; j < count; j++) {
+    output[j] = 2 * fold_dot(c, left + j, right + j);
+  }
+}
+
+void halfband_decimate(const halfband_kernel & kernel, const float * even,
+                       const float * odd, size_t count, float * output)
+{
+  const float * c = kernel.coefficients;
+  const float * left = even + HALFBAND_HALF_LENGTH - 1;
+  const float * right = even + HALFBAND_HALF_LENGTH;
+  const float * center = odd + HALFBAND_HALF_LENGTH - 1;
+  size_t j = 0;
+  for (; j + 4 <= count; j += 4) {
+    fold_dot4(c, left + j, right + j, output + j);
+  }
+  for (; j < count; j++) {
+    output[j] = fold_dot(c, left + j, right + j);
+  }
+  for (j = 0; j < count; j++) {
+    output[j] += 0.5f * center[j];
+  }
+}
+
 template<typename T>
 passthrough_resampler<T>::passthrough_resampler(cubeb_stream * s,
                                                 cubeb_data_callback cb,
                                                 void * ptr,
                                                 uint32_t input_channels,
+                                                uint32_t output_channels,
                                                 uint32_t sample_rate)
   : processor(input_channels)
   , stream(s)
   , data_callback(cb)
   , user_ptr(ptr)
   , sample_rate(sample_rate)
+  , output_channels(output_channels)
+  , jitter(sample_rate)
 {
 }
 
 template<typename T>
 long passthrough_resampler<T>::fill(void * input_buffer, long * input_frames_count,
                                     void * output_buffer, long output_frames)
+{
+  T * in_buffer = static_cast<T*>(input_buffer);
+  T * out_buffer = static_cast<T*>(output_buffer);
+  /* Without input, nothing is buffered and there is no need to split. */
+  if (in_buffer && max_frames &&
+      (*input_frames_count > max_frames || output_frames > max_frames)) {
+    return fill_in_passes([this](T * in, long * in_count, T * out, long frames) {
+                            return fill_internal(in, in_count, out, frames);
+                          }, max_frames, channels, output_channels,
+                          in_buffer, input_frames_count,
+                          out_buffer, output_frames);
+  }
+  return fill_internal(in_buffer, input_frames_count, out_buffer, output_frames);
+}
+
+template<typename T>
+long passthrough_resampler<T>::fill_internal(T * input_buffer,
+                                             long * input_frames_count,
+                                             T * output_buffer,
+                                             long output_frames)
 {
   if (input_buffer) {
     assert(input_frames_count);
@@ -66,22 +262,46 @@ long passthrough_resampler<T>::fill(void * input_buffer, long * input_frames_cou
          (output_buffer && !input_buffer && (!input_frames_count || *input_frames_count == 0)) ||
          (input_buffer && !output_buffer && output_frames == 0));
 
+  if (input_buffer && !output_buffer) {
+    output_frames = *input_frames_count;
+  }
   if (input_buffer) {
-    if (!output_buffer) {
-      output_frames = *input_frames_count;
+    jitter.input(*input_frames_count);
+    long buffered = samples_to_frames(internal_input_buffer.length());
+    if (output_buffer && *input_frames_count + buffered < output_frames) {
+      jitter.underrun();
+    }
+  }
+
+  /* Common case: nothing is buffered and the backend gives us at least as many
+   * input frames as output frames, hand its buffer directly to the callback,
+   * and only keep the frames that are left over, if any. */
+  if (!input_buffer ||
+      (internal_input_buffer.length() == 0 &&
+       *input_frames_count >= output_frames)) {
+    long rv = data_callback(stream, user_ptr, input_buffer,
+                            output_buffer, output_frames);
+    if (input_buffer) {
+      if (*input_frames_count > output_frames) {
+        T * leftover = input_buffer + frames_to_samples(output_frames);
+        internal_input_buffer.push(leftover,
+                                   frames_to_samples(*input_frames_count - output_frames));
+      }
+      *input_frames_count = output_frames;
+      drop_audio_if_needed();
     }
-    internal_input_buffer.push(static_cast<T*>(input_buffer),
-                               frames_to_samples(*input_frames_count));
+    return rv;
   }
 
+  internal_input_buffer.push(input_buffer,
+                             frames_to_samples(*input_frames_count));
+
   long rv = data_callback(stream, user_ptr, internal_input_buffer.data(),
                           output_buffer, output_frames);
 
-  if (input_buffer) {
-    internal_input_buffer.pop(nullptr, frames_to_samples(output_frames));
-    *input_frames_count = output_frames;
-    drop_audio_if_needed();
-  }
+  internal_input_buffer.pop(nullptr, frames_to_samples(output_frames));
+  *input_frames_count = output_frames;
+  drop_audio_if_needed();
 
   return rv;
 }
@@ -92,12 +312,16 @@ cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
                           OutputProcessor * output_processor,
                           cubeb_stream * s,
                           cubeb_data_callback cb,
-                          void * ptr)
+                          void * ptr,
+                          uint32_t rate,
+                          uint32_t block_size)
   : input_processor(input_processor)
   , output_processor(output_processor)
   , stream(s)
   , data_callback(cb)
   , user_ptr(ptr)
+  , block_size(block_size)
+  , rate(rate)
 {
   if (input_processor && output_processor) {
     // Add some delay on the processor that has the lowest delay so that the
@@ -111,11 +335,21 @@ cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
       uint32_t latency_diff = out_latency - in_latency;
       input_processor->add_latency(latency_diff);
     }
-    fill_internal = &cubeb_resampler_speex::fill_internal_duplex;
+    if (block_size) {
+      // The callback can need up to a block more input than what was received
+      // so far. Delay the output by the same amount to stay synchronized.
+      input_processor->add_latency(block_size);
+      output_processor->add_latency(block_size);
+      fill_internal = &cubeb_resampler_speex::fill_internal_duplex_blocks;
+    } else {
+      fill_internal = &cubeb_resampler_speex::fill_internal_duplex;
+    }
   }  else if (input_processor) {
-    fill_internal = &cubeb_resampler_speex::fill_internal_input;
+    fill_internal = block_size ? &cubeb_resampler_speex::fill_internal_input_blocks
+                               : &cubeb_resampler_speex::fill_internal_input;
   }  else if (output_processor) {
-    fill_internal = &cubeb_resampler_speex::fill_internal_output;
+    fill_internal = block_size ? &cubeb_resampler_speex::fill_internal_output_blocks
+                               : &cubeb_resampler_speex::fill_internal_output;
   }
 }
 
@@ -133,8 +367,48 @@ cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
   /* Input and output buffers, typed */
   T * in_buffer = reinterpret_cast<T*>(input_buffer);
   T * out_buffer = reinterpret_cast<T*>(output_buffer);
-  return (this->*fill_internal)(in_buffer, input_frames_count,
-                                out_buffer, output_frames_needed);
+  if (!adaptive) {
+    return fill_bounded(in_buffer, input_frames_count,
+                        out_buffer, output_frames_needed);
+  }
+
+  /* The frames this call has to handle at the rate of the backend, before
+   * `input_frames_count` is updated. */
+  long frames = out_buffer ? output_frames_needed : *input_frames_count;
+  auto start = std::chrono::steady_clock::now();
+  long rv = fill_bounded(in_buffer, input_frames_count,
+                         out_buffer, output_frames_needed);
+  int quality = adaptive->quality();
+  if (adaptive->update(frames, std::chrono::steady_clock::now() - start) != quality) {
+    if (input_processor) {
+      input_processor->set_quality(adaptive->quality());
+    }
+    if (output_processor) {
+      output_processor->set_quality(adaptive->quality());
+    }
+  }
+  return rv;
+}
+
+template<typename T, typename InputProcessor, typename OutputProcessor>
+long
+cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
+::fill_bounded(T * input_buffer, long * input_frames_count,
+               T * output_buffer, long output_frames_needed)
+{
+  long input_frames = input_buffer ? *input_frames_count : 0;
+  if (!max_frames ||
+      (input_frames <= max_frames && output_frames_needed <= max_frames)) {
+    return (this->*fill_internal)(input_buffer, input_frames_count,
+                                  output_buffer, output_frames_needed);
+  }
+  return fill_in_passes([this](T * in, long * in_count, T * out, long frames) {
+                          return (this->*fill_internal)(in, in_count, out, frames);
+                        }, max_frames,
+                        input_processor ? input_processor->channel_count() : 0,
+                        output_processor ? output_processor->channel_count() : 0,
+                        input_buffer, input_frames_count,
+                        output_buffer, output_frames_needed);
 }
 
 template<typename T, typename InputProcessor, typename OutputProcessor>
@@ -194,6 +468,10 @@ cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
   /* process the input, and present exactly `output_frames_needed` in the
   * callback. */
   input_processor->input(input_buffer, *input_frames_count);
+  if (!resampled_frame_count) {
+    /* Not enough input for a resampled frame yet, it stays buffered. */
+    return *input_frames_count;
+  }
   resampled_input = input_processor->output(resampled_frame_count, (size_t*)input_frames_count);
 
   long got = data_callback(stream, user_ptr,
@@ -276,6 +554,268 @@ cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
   return got;
 }
 
+template<typename T, typename InputProcessor, typename OutputProcessor>
+long
+cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
+::fill_internal_output_blocks(T * input_buffer, long * input_frames_count,
+                              T * output_buffer, long output_frames_needed)
+{
+  assert(!input_buffer && (!input_frames_count || *input_frames_count == 0) &&
+         output_buffer && output_frames_needed);
+
+  if (!draining) {
+    long frames_to_produce =
+      output_processor->input_needed_for_output(output_frames_needed);
+
+    /* Write each block directly in the input buffer of the output processor,
+     * after the frames of the previous blocks. */
+    while (frames_to_produce > 0) {
+      T * out_unprocessed = output_processor->input_buffer(block_size);
+      long got = data_callback(stream, user_ptr,
+                               nullptr, out_unprocessed, block_size);
+      if (got < 0) {
+        draining = true;
+        return got;
+      }
+      output_processor->written(got);
+      if (got < block_size) {
+        draining = true;
+        break;
+      }
+      frames_to_produce -= block_size;
+    }
+  }
+
+  return output_processor->output(output_buffer, output_frames_needed);
+}
+
+template<typename T, typename InputProcessor, typename OutputProcessor>
+long
+cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
+::fill_internal_input_blocks(T * input_buffer, long * input_frames_count,
+                             T * output_buffer, long /*output_frames_needed*/)
+{
+  assert(input_buffer && input_frames_count && *input_frames_count &&
+         !output_buffer);
+
+  input_processor->input(input_buffer, *input_frames_count);
+
+  /* Leave a frame of margin, the estimate can be off by one. */
+  while (input_processor->output_for_input(0) > static_cast<size_t>(block_size)) {
+    size_t input_frames_used;
+    T * resampled_input = input_processor->output(block_size, &input_frames_used);
+    long got = data_callback(stream, user_ptr,
+                             resampled_input, nullptr, block_size);
+    if (got < 0) {
+      return got;
+    }
+    if (got < block_size) {
+      return 0;
+    }
+  }
+
+  /* What has not been passed to the callback stays buffered. */
+  return *input_frames_count;
+}
+
+template<typename T, typename InputProcessor, typename OutputProcessor>
+long
+cubeb_resampler_speex<T, InputProcessor, OutputProcessor>
+::fill_internal_duplex_blocks(T * in_buffer, long * input_frames_count,
+                              T * out_buffer, long output_frames_needed)
+{
+  if (draining) {
+    // discard input and drain any signal remaining in the resampler.
+    return output_processor->output(out_buffer, output_frames_needed);
+  }
+
+  if (in_buffer) {
+    input_processor->input(in_buffer, *input_frames_count);
+  }
+
+  long frames_to_produce =
+    output_processor->input_needed_for_output(output_frames_needed);
+
+  /* The input processor was primed with a block of latency, so there is
+   * always a block of input available here. */
+  while (frames_to_produce > 0) {
+    T * resampled_input = nullptr;
+    if (in_buffer) {
+      size_t input_frames_used;
+      resampled_input = input_processor->output(block_size, &input_frames_used);
+    }
+    T * out_unprocessed = output_processor->input_buffer(block_size);
+
+    long got = data_callback(stream, user_ptr,
+                             resampled_input, out_unprocessed, block_size);
+    if (got < 0) {
+      draining = true;
+      return got;
+    }
+    output_processor->written(got);
+    if (got < block_size) {
+      draining = true;
+      break;
+    }
+    frames_to_produce -= block_size;
+  }
+
+  input_processor->drop_audio_if_needed();
+
+  long got = output_processor->output(out_buffer, output_frames_needed);
+
+  output_processor->drop_audio_if_needed();
+
+  return got;
+}
+
+namespace {
+/** The fewest output frames a chunk of cubeb_resampler_offline has, so that
+ * starting its filter over is a small fraction of its work. */
+const long OFFLINE_MIN_CHUNK_FRAMES = 16384;
+/** The number of chunks per thread, so that threads that finish early can
+ * pick up the work of the others. */
+const long OFFLINE_CHUNKS_PER_THREAD = 4;
+
+#if defined(_WIN32)
+typedef HANDLE offline_thread;
+
+template<typename F>
+unsigned __stdcall
+offline_thread_main(void * work)
+{
+  (*static_cast<F *>(work))();
+  return 0;
+}
+#else
+typedef pthread_t offline_thread;
+
+template<typename F>
+void *
+offline_thread_main(void * work)
+{
+  (*static_cast<F *>(work))();
+  return nullptr;
+}
+#endif
+
+/** Run `work` on a new thread. The thread is created with the platform API
+ * rather than std::thread, which can only report a failure by throwing.
+ * Returns false if the thread can't be created. */
+template<typename F>
+bool
+offline_thread_start(offline_thread * thread, F * work)
+{
+#if defined(_WIN32)
+  *thread = reinterpret_cast<HANDLE>(
+    _beginthreadex(NULL, 0, offline_thread_main<F>, work, 0, NULL));
+  return *thread != NULL;
+#else
+  return pthread_create(thread, NULL, offline_thread_main<F>, work) == 0;
+#endif
+}
+
+void
+offline_thread_join(offline_thread thread)
+{
+#if defined(_WIN32)
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+/** Resample `input` in chunks of output frames that start on a multiple of
+ * `den` frames, where a resampler fed the whole buffer is back at its initial
+ * phase, `num` frames further in the input. A chunk is resampled by a fresh
+ * resampler from a few periods before its start, so that the filter has
+ * the same history as when fed the whole buffer, and the output of those
+ * periods is discarded: the output is bit-identical to a single resampler's,
+ * whatever the number of threads. */
+template<typename T>
+long
+resample_offline(uint32_t channels, uint32_t source_rate, uint32_t target_rate,
+                 int quality, T const * input, long input_frames,
+                 T * output, long total_frames, uint32_t thread_count)
+{
+  int r;
+  SpeexResamplerState * state =
+    speex_resampler_init(1, source_rate, target_rate, quality, &r);
+  if (!state) {
+    return CUBEB_ERROR;
+  }
+  spx_uint32_t num, den;
+  speex_resampler_get_ratio(state, &num, &den);
+  /* The filter reads this many input frames before the one an output frame
+   * is aligned on. */
+  long history = 2 * speex_resampler_get_input_latency(state) - 1;
+  speex_resampler_destroy(state);
+
+  long warmup_periods = (history + num - 1) / num;
+  long chunk_frames =
+    std::max(OFFLINE_MIN_CHUNK_FRAMES,
+             total_frames / (thread_count * OFFLINE_CHUNKS_PER_THREAD));
+  chunk_frames = (chunk_frames + den - 1) / den * den;
+  long chunk_count = (total_frames + chunk_frames - 1) / chunk_frames;
+  thread_count = std::min<long>(thread_count, chunk_count);
+
+  std::atomic<long> next_chunk(0);
+  std::atomic<bool> failed(false);
+  auto work = [&]() {
+    std::vector<T> scratch;
+    long chunk;
+    while (!failed && (chunk = next_chunk++) < chunk_count) {
+      long first = chunk * chunk_frames;
+      long count = std::min(chunk_frames, total_frames - first);
+      long start_period = std::max(0L, first / static_cast<long>(den) -
+                                       warmup_periods);
+      long skip = first - start_period * den;
+      long input_start = start_period * num;
+      /* The last output frame is aligned on this input frame. */
+      long last = static_cast<long>(
+        static_cast<uint64_t>(first + count - 1) * num / den);
+      long input_end = std::min(input_frames, last + 1);
+
+      cubeb_resampler_speex_one_way<T> resampler(channels, source_rate,
+                                                 target_rate, quality);
+      resampler.input(const_cast<T *>(input) + input_start * channels,
+                      input_end - input_start);
+      scratch.resize((skip + count) * channels);
+      size_t got = resampler.output(scratch.data(), skip + count);
+      if (got != static_cast<size_t>(skip + count)) {
+        failed = true;
+        break;
+      }
+      PodCopy(output + first * channels, scratch.data() + skip * channels,
+              count * channels);
+    }
+  };
+
+  /* The threads are created for this call, and joined before it returns. If
+   * some can't be created, the calling thread and those that could be pick
+   * up their chunks. */
+  std::vector<offline_thread> threads;
+  threads.reserve(thread_count - 1);
+  for (uint32_t i = 1; i < thread_count; i++) {
+    offline_thread thread;
+    if (!offline_thread_start(&thread, &work)) {
+      break;
+    }
+    threads.push_back(thread);
+  }
+  work();
+  for (offline_thread thread : threads) {
+    offline_thread_join(thread);
+  }
+
+  if (failed) {
+    return CUBEB_ERROR;
+  }
+  return total_frames;
+}
+} // namespace
+
 /* Resampler C API */
 
 cubeb_resampler *
@@ -285,7 +825,9 @@ cubeb_resampler_create(cubeb_stream * stream,
                        unsigned int target_rate,
                        cubeb_data_callback callback,
                        void * user_ptr,
-                       cubeb_resampler_quality quality)
+                       cubeb_resampler_quality quality,
+                       cubeb_resampler_reclock reclock,
+                       unsigned int block_size)
 {
   cubeb_sample_format format;
 
@@ -305,7 +847,9 @@ cubeb_resampler_create(cubeb_stream * stream,
                                                     target_rate,
                                                     callback,
                                                     user_ptr,
-                                                    quality);
+                                                    quality,
+                                                    reclock,
+                                                    block_size);
     case CUBEB_SAMPLE_FLOAT32NE:
       return cubeb_resampler_create_internal<float>(stream,
                                                     input_params,
@@ -313,13 +857,31 @@ cubeb_resampler_create(cubeb_stream * stream,
                                                     target_rate,
                                                     callback,
                                                     user_ptr,
-                                                    quality);
+                                                    quality,
+                                                    reclock,
+                                                    block_size);
     default:
       assert(false);
       return nullptr;
   }
 }
 
+unsigned int
+cubeb_resampler_block_size(cubeb_stream_params const * input_params,
+                           cubeb_stream_params const * output_params,
+                           unsigned int latency_frames)
+{
+  if (!(input_params && (input_params->prefs & CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE)) &&
+      !(output_params && (output_params->prefs & CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE))) {
+    return 0;
+  }
+  unsigned int block_size = 1;
+  while (block_size < latency_frames) {
+    block_size *= 2;
+  }
+  return block_size;
+}
+
 long
 cubeb_resampler_fill(cubeb_resampler * resampler,
                      void * input_buffer,
@@ -342,3 +904,100 @@ cubeb_resampler_latency(cubeb_resampler * resampler)
 {
   return resampler->latency();
 }
+
+int
+cubeb_resampler_get_drift_compensation(cubeb_resampler * resampler,
+                                       double * ratio,
+                                       uint32_t * target_frames)
+{
+  return resampler->drift_compensation(ratio, target_frames);
+}
+
+int
+cubeb_resampler_enable_adaptive_quality(cubeb_resampler * resampler)
+{
+  return resampler->enable_adaptive_quality();
+}
+
+int
+cubeb_resampler_reserve(cubeb_resampler * resampler, unsigned int max_frames)
+{
+  assert(max_frames);
+  return resampler->reserve(max_frames);
+}
+
+int
+cubeb_resampler_set_input_buffer_bounds(cubeb_resampler * resampler,
+                                        uint32_t min_frames,
+                                        uint32_t max_frames)
+{
+  if (min_frames > max_frames) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+  return resampler->set_input_buffer_bounds(min_frames, max_frames);
+}
+
+int
+cubeb_resampler_get_input_buffer_stats(cubeb_resampler * resampler,
+                                       cubeb_resampler_input_buffer_stats * stats)
+{
+  return resampler->input_buffer_stats(stats);
+}
+
+long
+cubeb_resampler_offline_output_frames(uint32_t source_rate,
+                                      uint32_t target_rate,
+                                      long input_frames)
+{
+  /* Output frame j is produced once the input frame it is aligned on,
+   * j * source_rate / target_rate, has arrived. */
+  return static_cast<long>((static_cast<uint64_t>(input_frames) * target_rate +
+                            source_rate - 1) / source_rate);
+}
+
+long
+cubeb_resampler_offline(cubeb_sample_format format,
+                        uint32_t channels,
+                        uint32_t source_rate,
+                        uint32_t target_rate,
+                        cubeb_resampler_quality quality,
+                        void const * input,
+                        long input_frames,
+                        void * output,
+                        long output_frames,
+                        uint32_t thread_count)
+{
+  if (!channels || !source_rate || !target_rate || input_frames < 0 ||
+      (input_frames && (!input || !output))) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+  long total_frames = cubeb_resampler_offline_output_frames(source_rate,
+                                                            target_rate,
+                                                            input_frames);
+  if (output_frames < total_frames) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+  if (!total_frames) {
+    return 0;
+  }
+  if (!thread_count) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  switch (format) {
+    case CUBEB_SAMPLE_S16NE:
+      return resample_offline(channels, source_rate, target_rate,
+                              to_speex_quality(quality),
+                              static_cast<short const *>(input), input_frames,
+                              static_cast<short *>(output), total_frames,
+                              thread_count);
+    case CUBEB_SAMPLE_FLOAT32NE:
+      return resample_offline(channels, source_rate, target_rate,
+                              to_speex_quality(quality),
+                              static_cast<float const *>(input), input_frames,
+                              static_cast<float *>(output), total_frames,
+                              thread_count);
+    default:
+      return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+}
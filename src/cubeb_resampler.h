@@ -21,6 +21,36 @@ typedef enum {
   CUBEB_RESAMPLER_QUALITY_DESKTOP
 } cubeb_resampler_quality;
 
+typedef enum {
+  /** Resample at the nominal rates of the streams. */
+  CUBEB_RESAMPLER_RECLOCK_NONE,
+  /** For duplex streams whose input and output run on different clocks:
+   * continuously adjust the ratio of the input resampler so that the amount of
+   * buffered input stays around a target, instead of building up or running
+   * out of input frames and dropping them. */
+  CUBEB_RESAMPLER_RECLOCK_INPUT
+} cubeb_resampler_reclock;
+
+/** The state of the buffer of input frames of a duplex resampler, see
+ * cubeb_resampler_get_input_buffer_stats. The frames are at the rate of the
+ * input. */
+typedef struct {
+  /** The number of frames currently kept buffered at most. Input frames in
+   * excess are dropped. */
+  uint32_t target_frames;
+  /** The bounds of `target_frames`. */
+  uint32_t min_frames;
+  uint32_t max_frames;
+  /** The standard deviation of the number of frames a call consumes on top of
+   * what arrives. */
+  uint32_t jitter_frames;
+  /** The number of calls that used all the frames that were buffered, and so
+   * have probably been missing some. */
+  uint32_t underruns;
+  /** The number of frames dropped since the resampler was created. */
+  uint64_t dropped_frames;
+} cubeb_resampler_input_buffer_stats;
+
 /**
  * Create a resampler to adapt the requested sample rate into something that
  * is accepted by the audio backend.
@@ -37,6 +67,10 @@ typedef enum {
  * @param callback A callback to request data for resampling.
  * @param user_ptr User data supplied to the data callback.
  * @param quality Quality of the resampler.
+ * @param reclock Whether the input side should follow the clock of the
+ * output side.
+ * @param block_size The number of frames the callback is always called with,
+ * see cubeb_resampler_block_size, or 0 to call it with any number of frames.
  * @retval A non-null pointer if success.
  */
 cubeb_resampler * cubeb_resampler_create(cubeb_stream * stream,
@@ -45,7 +79,22 @@ cubeb_resampler * cubeb_resampler_create(cubeb_stream * stream,
                                          unsigned int target_rate,
                                          cubeb_data_callback callback,
                                          void * user_ptr,
-                                         cubeb_resampler_quality quality);
+                                         cubeb_resampler_quality quality,
+                                         cubeb_resampler_reclock reclock,
+                                         unsigned int block_size);
+
+/**
+ * Returns the number of frames the data callback of a stream has to be called
+ * with, to be passed to cubeb_resampler_create.
+ * @param input_params The input parameters of the stream, or NULL.
+ * @param output_params The output parameters of the stream, or NULL.
+ * @param latency_frames The latency requested for the stream.
+ * @retval The smallest power of two not less than `latency_frames` if
+ * CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE is set on either side, 0 otherwise.
+ */
+unsigned int cubeb_resampler_block_size(cubeb_stream_params const * input_params,
+                                        cubeb_stream_params const * output_params,
+                                        unsigned int latency_frames);
 
 /**
  * Fill the buffer with frames acquired using the data callback. Resampling will
@@ -78,6 +127,131 @@ void cubeb_resampler_destroy(cubeb_resampler * resampler);
  */
 long cubeb_resampler_latency(cubeb_resampler * resampler);
 
+/**
+ * Returns the state of the clock drift compensation of a resampler created
+ * with CUBEB_RESAMPLER_RECLOCK_INPUT.
+ * @param resampler A cubeb resampler instance.
+ * @param ratio The correction currently applied on top of the nominal input
+ * resampling ratio, e.g. 1.0001 when the input is consumed 100 ppm faster than
+ * its nominal rate.
+ * @param target_frames The number of input frames the resampler tries to keep
+ * buffered.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_NOT_SUPPORTED if the resampler does not compensate drift.
+ */
+int cubeb_resampler_get_drift_compensation(cubeb_resampler * resampler,
+                                           double * ratio,
+                                           uint32_t * target_frames);
+
+/**
+ * Let the resampler lower its quality while its calls to cubeb_resampler_fill,
+ * data callback included, take close to the duration of the audio they
+ * produce, and raise it back up to the quality it was created with when there
+ * is headroom again. Changing the quality doesn't change the latency. This
+ * must be called before the stream starts.
+ * @param resampler A cubeb resampler instance.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_NOT_SUPPORTED if the resampler has no filter whose
+ * quality can change, e.g. when no resampling is needed.
+ */
+int cubeb_resampler_enable_adaptive_quality(cubeb_resampler * resampler);
+
+/**
+ * Allocate the buffers of the resampler for calls to cubeb_resampler_fill of
+ * up to `max_frames` frames on each side, so that cubeb_resampler_fill doesn't
+ * allocate memory on the audio thread. Larger calls are split in passes of at
+ * most `max_frames` frames. This must be called before the stream starts,
+ * typically with the latency of the stream or the largest buffer the backend
+ * asks for.
+ * @param resampler A cubeb resampler instance.
+ * @param max_frames The largest number of frames the backend is expected to
+ * pass to cubeb_resampler_fill.
+ * @retval CUBEB_OK
+ */
+int cubeb_resampler_reserve(cubeb_resampler * resampler,
+                            unsigned int max_frames);
+
+/**
+ * Let the number of input frames the resampler keeps buffered adapt to how
+ * regularly the input arrives, between `min_frames` and `max_frames`, instead
+ * of always keeping up to 50ms of input. Input frames in excess are dropped,
+ * so that the input isn't delayed more than needed. This starts from
+ * `max_frames`, and must be called before the stream starts: it reallocates
+ * the buffers that cubeb_resampler_fill uses. This is what
+ * cubeb_stream_set_input_buffer_bounds does in the backends that buffer the
+ * input of duplex streams.
+ * @param resampler A cubeb resampler instance.
+ * @param min_frames The fewest frames to keep, at the rate of the input.
+ * @param max_frames The most frames to keep, at the rate of the input.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_INVALID_PARAMETER if `min_frames` is above
+ * `max_frames`.
+ * @retval CUBEB_ERROR_NOT_SUPPORTED if the resampler has no input.
+ */
+int cubeb_resampler_set_input_buffer_bounds(cubeb_resampler * resampler,
+                                            uint32_t min_frames,
+                                            uint32_t max_frames);
+
+/**
+ * Returns the state of the buffer of input frames of a resampler. This can be
+ * called from any thread while the stream is running, the fields being read
+ * one by one.
+ * @param resampler A cubeb resampler instance.
+ * @param stats The state of the buffer.
+ * @retval CUBEB_OK
+ * @retval CUBEB_ERROR_NOT_SUPPORTED if the resampler has no input.
+ */
+int cubeb_resampler_get_input_buffer_stats(cubeb_resampler * resampler,
+                                           cubeb_resampler_input_buffer_stats * stats);
+
+/**
+ * Returns the number of frames cubeb_resampler_offline produces from
+ * `input_frames` frames.
+ * @param source_rate The rate of the input.
+ * @param target_rate The rate of the output.
+ * @param input_frames The number of input frames.
+ * @retval The number of output frames.
+ */
+long cubeb_resampler_offline_output_frames(uint32_t source_rate,
+                                           uint32_t target_rate,
+                                           long input_frames);
+
+/**
+ * Resample a whole buffer at once, e.g. a decoded file, splitting it in chunks
+ * that are resampled in parallel. The output is identical to what a single
+ * resampler fed the whole buffer produces, without the latency of the filter
+ * being compensated, whatever the number of threads. This blocks until the
+ * whole buffer is resampled, and must not be called from the audio thread.
+ * @param format The sample format of the input and output buffers.
+ * @param channels The number of interleaved channels of the buffers.
+ * @param source_rate The rate of the input.
+ * @param target_rate The rate of the output.
+ * @param quality Quality of the resampler.
+ * @param input The input frames.
+ * @param input_frames The number of input frames.
+ * @param output The buffer to write the output frames to.
+ * @param output_frames The size of `output`, in frames, at least
+ * cubeb_resampler_offline_output_frames.
+ * @param thread_count The number of threads to resample on, the calling one
+ * included, or 0 for one per core. The other threads are created for the call
+ * and joined before it returns; if some can't be created, the work is shared
+ * by those that could be, and the calling thread.
+ * @retval The number of frames written to `output`.
+ * @retval CUBEB_ERROR_INVALID_PARAMETER if the parameters are invalid or
+ * `output` is too small.
+ * @retval CUBEB_ERROR on error.
+ */
+long cubeb_resampler_offline(cubeb_sample_format format,
+                             uint32_t channels,
+                             uint32_t source_rate,
+                             uint32_t target_rate,
+                             cubeb_resampler_quality quality,
+                             void const * input,
+                             long input_frames,
+                             void * output,
+                             long output_frames,
+                             uint32_t thread_count);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -11,7 +11,10 @@
 #include <cmath>
 #include <cassert>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <type_traits>
 #ifdef CUBEB_GECKO_BUILD
 #include "mozilla/UniquePtr.h"
 // In libc++, symbols such as std::unique_ptr may be defined in std::__1.
@@ -52,6 +55,33 @@ struct cubeb_resampler {
   virtual long fill(void * input_buffer, long * input_frames_count,
                     void * output_buffer, long frames_needed) = 0;
   virtual long latency() = 0;
+  /** See cubeb_resampler_get_drift_compensation. */
+  virtual int drift_compensation(double * /*ratio*/,
+                                 uint32_t * /*target_frames*/)
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  /** See cubeb_resampler_enable_adaptive_quality. */
+  virtual int enable_adaptive_quality()
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  /** See cubeb_resampler_reserve. */
+  virtual int reserve(uint32_t /*max_frames*/)
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  /** See cubeb_resampler_set_input_buffer_bounds. */
+  virtual int set_input_buffer_bounds(uint32_t /*min_frames*/,
+                                      uint32_t /*max_frames*/)
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  /** See cubeb_resampler_get_input_buffer_stats. */
+  virtual int input_buffer_stats(cubeb_resampler_input_buffer_stats * /*stats*/)
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
   virtual ~cubeb_resampler() {}
 };
 
@@ -61,6 +91,11 @@ public:
   explicit processor(uint32_t channels)
     : channels(channels)
   {}
+  /** The number of channels of the audio buffers. */
+  uint32_t channel_count() const
+  {
+    return channels;
+  }
 protected:
   size_t frames_to_samples(size_t frames) const
   {
@@ -75,6 +110,285 @@ protected:
   const uint32_t channels;
 };
 
+/** Splits a call to `fill` that has more than `max_frames` frames on either
+ * side into passes of at most `max_frames` frames, so that the buffers sized
+ * by cubeb_resampler_reserve are always large enough. In duplex, the input
+ * frames are split in proportion to the output frames. This stops after a pass
+ * that returns fewer frames than it was given, the stream being drained or in
+ * error.
+ * @return What `fill` would have returned for the whole call: the number of
+ * output frames, or of input frames for an input stream. */
+template<typename T, typename Fill>
+long fill_in_passes(Fill fill, long max_frames,
+                    uint32_t input_channels, uint32_t output_channels,
+                    T * input_buffer, long * input_frames_count,
+                    T * output_buffer, long output_frames_needed)
+{
+  long input_frames = input_buffer ? *input_frames_count : 0;
+  long passes = (std::max(input_frames, output_frames_needed) + max_frames - 1) /
+                max_frames;
+  long input_done = 0;
+  long input_used = 0;
+  long output_done = 0;
+  long rv = 0;
+
+  for (long i = 1; i <= passes; i++) {
+    /* Rounding the input up keeps at least as much input as output in each
+     * pass when there is at least as much input as output overall. */
+    long pass_input = (input_frames * i + passes - 1) / passes - input_done;
+    long pass_output = output_frames_needed * i / passes - output_done;
+    long got = fill(input_buffer ? input_buffer + input_channels * input_done
+                                 : nullptr,
+                    &pass_input,
+                    output_buffer ? output_buffer + output_channels * output_done
+                                  : nullptr,
+                    pass_output);
+    if (got < 0) {
+      return got;
+    }
+    input_done = (input_frames * i + passes - 1) / passes;
+    input_used += pass_input;
+    output_done += pass_output;
+    rv += got;
+    if (got < (output_buffer ? pass_output : pass_input)) {
+      break;
+    }
+  }
+
+  if (input_buffer) {
+    *input_frames_count = input_used;
+  }
+  return rv;
+}
+
+/** Decides the quality of the resamplers of a stream from how long each call to
+ * `fill` takes, compared to the duration of the audio it handles. The quality
+ * is lowered one step at a time while the calls take too close to the
+ * deadline, and raised back when there has been headroom for a while. The gap
+ * between the two thresholds and the longer wait to raise the quality keep it
+ * from flapping. */
+class adaptive_quality {
+public:
+  /** @parameter max_quality The speex quality to start with, and the highest
+   * one to go back to.
+   * @parameter rate The rate of the frames handled by `fill`. */
+  adaptive_quality(int max_quality, uint32_t rate)
+    : max_quality(max_quality)
+    , current_quality(max_quality)
+    , rate(rate)
+    , load(0)
+    , frames_since_change(0)
+    , frames_with_headroom(0)
+  {}
+
+  /** Accounts for a call to `fill` that took `elapsed` to handle `frames`.
+   * @return The quality to use from now on. */
+  int update(long frames, std::chrono::steady_clock::duration elapsed)
+  {
+    if (frames <= 0) {
+      return current_quality;
+    }
+    double budget = static_cast<double>(frames) / rate;
+    double used = std::chrono::duration<double>(elapsed).count();
+    /* Smooth over a few calls, so that a single late one doesn't count. */
+    load += (used / budget - load) * LOAD_SMOOTHING;
+    frames_since_change += frames;
+    frames_with_headroom = load < LOW_LOAD ? frames_with_headroom + frames : 0;
+
+    if (load > HIGH_LOAD && current_quality > SPEEX_RESAMPLER_QUALITY_MIN &&
+        frames_since_change >= rate * STEP_DOWN_MS / 1000) {
+      current_quality--;
+      frames_since_change = 0;
+    } else if (current_quality < max_quality &&
+               frames_with_headroom >= rate * STEP_UP_MS / 1000 &&
+               frames_since_change >= rate * STEP_UP_MS / 1000) {
+      current_quality++;
+      frames_since_change = 0;
+      frames_with_headroom = 0;
+    }
+    return current_quality;
+  }
+
+  int quality() const
+  {
+    return current_quality;
+  }
+private:
+  /** Past this fraction of the duration of the audio, the quality goes down. */
+  static constexpr double HIGH_LOAD = 0.5;
+  /** Under this fraction, there is room to raise the quality. */
+  static constexpr double LOW_LOAD = 0.15;
+  static constexpr double LOAD_SMOOTHING = 0.25;
+  /** Time to wait after a change before lowering the quality again, for the
+   * effect of the previous step to show in the average load. */
+  static const uint32_t STEP_DOWN_MS = 100;
+  /** Time the load has to stay low before raising the quality. */
+  static const uint32_t STEP_UP_MS = 2000;
+
+  const int max_quality;
+  int current_quality;
+  const uint32_t rate;
+  /** Smoothed fraction of the duration of the audio spent in `fill`. */
+  double load;
+  uint64_t frames_since_change;
+  uint64_t frames_with_headroom;
+};
+
+/** Decides how many frames a processor keeps buffered when dropping input to
+ * prevent building an input delay. By default, this is a fixed
+ * min_buffered_audio_frame. With bounds set, this follows how irregularly the
+ * input arrives: after each call, the frames that are buffered are compared to
+ * what was kept after the previous call, the difference being what the call
+ * consumed on top of what arrived. The target is the largest recent deficit,
+ * slowly released, or a couple of standard deviations above the average
+ * deficit if that is higher, plus a small margin. Running out of input doubles
+ * it. */
+class jitter_buffer {
+public:
+  /** @parameter rate The rate of the buffered frames. */
+  explicit jitter_buffer(uint32_t rate)
+    : rate(rate)
+    , min_target(min_buffered_audio_frame(rate))
+    , max_target(min_target)
+    , adaptive(false)
+    , kept(0)
+    , arrived(0)
+    , missing(false)
+    , peak(max_target)
+    , mean(0)
+    , variance(0)
+    , current_target(max_target)
+    , jitter(0)
+    , underruns(0)
+    , dropped(0)
+  {}
+
+  /** Adapt the target between `min_frames` and `max_frames`, starting from
+   * `max_frames`. This must be called before the stream starts. */
+  void set_bounds(uint32_t min_frames, uint32_t max_frames)
+  {
+    assert(min_frames <= max_frames);
+    min_target = min_frames;
+    max_target = max_frames;
+    adaptive = true;
+    peak = max_frames;
+    current_target = max_frames;
+  }
+
+  bool is_adaptive() const
+  {
+    return adaptive;
+  }
+
+  /** The most frames this can keep. */
+  uint32_t max_buffered() const
+  {
+    return max_target;
+  }
+
+  /** The number of frames currently kept at most. */
+  uint32_t target() const
+  {
+    return current_target;
+  }
+
+  /** Accounts for `frames` frames pushed into the buffer. */
+  void input(size_t frames)
+  {
+    arrived += frames;
+  }
+
+  /** Accounts for a call that needed more frames than were buffered. */
+  void underrun()
+  {
+    missing = true;
+  }
+
+  /** Accounts for a call that left `available` frames in the buffer.
+   * @return The number of frames to keep. */
+  size_t update(size_t available)
+  {
+    float deficit = kept > available ? kept - available : 0;
+    /* The frames consumed by the call, that gives the time between calls. */
+    float consumed = kept + arrived > available ? kept + arrived - available : 0;
+    float margin = static_cast<float>(rate) * MARGIN_MS / 1000;
+
+    if (missing) {
+      /* The deficit was larger than what was kept. */
+      underruns++;
+      missing = false;
+      peak = std::min(static_cast<float>(max_target),
+                      std::max(2 * peak, deficit + margin));
+    } else if (deficit >= peak) {
+      peak = deficit;
+    } else {
+      float weight = std::min(1.0f, consumed / (static_cast<float>(rate) *
+                                                RELEASE_SECONDS));
+      peak += (deficit - peak) * weight;
+    }
+
+    /* Average over about a second. */
+    float weight = std::min(1.0f, consumed / static_cast<float>(rate));
+    float delta = deficit - mean;
+    mean += delta * weight;
+    variance = (1 - weight) * (variance + delta * delta * weight);
+    jitter = static_cast<uint32_t>(sqrtf(variance));
+
+    if (adaptive) {
+      float target = std::max(peak, mean + DEVIATIONS * sqrtf(variance)) +
+                     margin;
+      current_target = std::max(min_target,
+                                std::min(max_target,
+                                         static_cast<uint32_t>(ceilf(target))));
+    }
+
+    size_t to_keep = current_target;
+    kept = std::min(available, to_keep);
+    dropped += available - kept;
+    arrived = 0;
+    return to_keep;
+  }
+
+  /** See cubeb_resampler_get_input_buffer_stats. */
+  void stats(cubeb_resampler_input_buffer_stats * stats) const
+  {
+    stats->target_frames = current_target;
+    stats->min_frames = min_target;
+    stats->max_frames = max_target;
+    stats->jitter_frames = jitter;
+    stats->underruns = underruns;
+    stats->dropped_frames = dropped;
+  }
+private:
+  /** Frames kept on top of the expected deficit. */
+  static const uint32_t MARGIN_MS = 2;
+  /** The largest deficit is forgotten in about this many seconds. */
+  static const uint32_t RELEASE_SECONDS = 2;
+  /** Standard deviations of the deficit above its average to keep. */
+  static constexpr float DEVIATIONS = 2;
+
+  const uint32_t rate;
+  uint32_t min_target;
+  uint32_t max_target;
+  bool adaptive;
+  /** The number of frames kept after the previous call. */
+  size_t kept;
+  /** The number of frames pushed since the previous call. */
+  size_t arrived;
+  /** Set when frames were missing since the previous call. */
+  bool missing;
+  /** Slowly released largest deficit, in frames. */
+  float peak;
+  /** Average and variance of the deficit, in frames. */
+  float mean;
+  float variance;
+  /* The fields below can be read from any thread. */
+  std::atomic<uint32_t> current_target;
+  std::atomic<uint32_t> jitter;
+  std::atomic<uint32_t> underruns;
+  std::atomic<uint64_t> dropped;
+};
+
 template<typename T>
 class passthrough_resampler : public cubeb_resampler
                             , public processor {
@@ -83,6 +397,7 @@ public:
                         cubeb_data_callback cb,
                         void * ptr,
                         uint32_t input_channels,
+                        uint32_t output_channels,
                         uint32_t sample_rate);
 
   virtual long fill(void * input_buffer, long * input_frames_count,
@@ -93,16 +408,54 @@ public:
     return 0;
   }
 
+  virtual int reserve(uint32_t frames)
+  {
+    /* Only the input is buffered: what drop_audio_if_needed keeps, and the
+     * frames of a call. */
+    if (channels) {
+      internal_input_buffer.reserve(
+          frames_to_samples(jitter.max_buffered() + 2 * frames));
+    }
+    max_frames = frames;
+    return CUBEB_OK;
+  }
+
+  virtual int set_input_buffer_bounds(uint32_t min_buffered,
+                                      uint32_t max_buffered)
+  {
+    if (!channels) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    jitter.set_bounds(min_buffered, max_buffered);
+    /* The buffer may have to be larger. */
+    if (max_frames) {
+      reserve(max_frames);
+    }
+    return CUBEB_OK;
+  }
+
+  virtual int input_buffer_stats(cubeb_resampler_input_buffer_stats * stats)
+  {
+    if (!channels) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    jitter.stats(stats);
+    return CUBEB_OK;
+  }
+
   void drop_audio_if_needed()
   {
-    uint32_t to_keep = min_buffered_audio_frame(sample_rate);
-    uint32_t available = samples_to_frames(internal_input_buffer.length());
+    size_t available = samples_to_frames(internal_input_buffer.length());
+    size_t to_keep = jitter.update(available);
     if (available > to_keep) {
       internal_input_buffer.pop(nullptr, frames_to_samples(available - to_keep));
     }
   }
 
 private:
+  long fill_internal(T * input_buffer, long * input_frames_count,
+                     T * output_buffer, long output_frames);
+
   cubeb_stream * const stream;
   const cubeb_data_callback data_callback;
   void * const user_ptr;
@@ -110,6 +463,12 @@ private:
    * some inputs. */
   auto_array<T> internal_input_buffer;
   uint32_t sample_rate;
+  const uint32_t output_channels;
+  /* Decides how many input frames drop_audio_if_needed keeps. */
+  jitter_buffer jitter;
+  /* The largest number of frames `fill` handles in one pass, or 0 if it is
+   * not bounded, see `reserve`. */
+  long max_frames = 0;
 };
 
 /** Bidirectional resampler, can resample an input and an output stream, or just
@@ -122,7 +481,9 @@ public:
                         OutputProcessing * output_processor,
                         cubeb_stream * s,
                         cubeb_data_callback cb,
-                        void * ptr);
+                        void * ptr,
+                        uint32_t rate,
+                        uint32_t block_size = 0);
 
   virtual ~cubeb_resampler_speex();
 
@@ -141,15 +502,102 @@ public:
     }
   }
 
+  virtual int drift_compensation(double * ratio, uint32_t * target_frames)
+  {
+    if (!input_processor) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    return input_processor->drift_compensation(ratio, target_frames);
+  }
+
+  virtual int enable_adaptive_quality()
+  {
+    int quality = std::max(input_processor ? input_processor->quality() : -1,
+                           output_processor ? output_processor->quality() : -1);
+    if (quality < 0) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    /* `fill` only swaps between filters made here, it doesn't compute any. */
+    if ((input_processor &&
+         !input_processor->prepare_qualities(SPEEX_RESAMPLER_QUALITY_MIN)) ||
+        (output_processor &&
+         !output_processor->prepare_qualities(SPEEX_RESAMPLER_QUALITY_MIN))) {
+      return CUBEB_ERROR;
+    }
+    adaptive.reset(new adaptive_quality(quality, rate));
+    return CUBEB_OK;
+  }
+
+  virtual int set_input_buffer_bounds(uint32_t min_buffered,
+                                      uint32_t max_buffered)
+  {
+    if (!input_processor) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    input_processor->set_buffer_bounds(min_buffered, max_buffered);
+    /* The buffers may have to be larger. */
+    if (max_frames) {
+      reserve(max_frames);
+    }
+    return CUBEB_OK;
+  }
+
+  virtual int input_buffer_stats(cubeb_resampler_input_buffer_stats * stats)
+  {
+    if (!input_processor) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    input_processor->buffer_stats(stats);
+    return CUBEB_OK;
+  }
+
+  virtual int reserve(uint32_t frames)
+  {
+    /* The most frames the callback can be called with in a pass of `frames`
+     * frames: producing blocks until there is enough can make up to a block
+     * more. */
+    size_t callback_frames = 0;
+    if (input_processor) {
+      callback_frames = input_processor->max_output_for_input(frames);
+    }
+    if (output_processor) {
+      callback_frames = std::max(callback_frames,
+                                 output_processor->max_input_for_output(frames));
+    }
+    callback_frames += block_size;
+    if (input_processor) {
+      input_processor->reserve(frames, callback_frames);
+    }
+    if (output_processor) {
+      output_processor->reserve(callback_frames, frames);
+    }
+    max_frames = frames;
+    return CUBEB_OK;
+  }
+
 private:
   typedef long(cubeb_resampler_speex::*processing_callback)(T * input_buffer, long * input_frames_count, T * output_buffer, long output_frames_needed);
 
+  /** Calls `fill_internal`, in several passes if the call has more frames than
+   * the buffers have been sized for. */
+  long fill_bounded(T * input_buffer, long * input_frames_count,
+                    T * output_buffer, long output_frames_needed);
+
   long fill_internal_duplex(T * input_buffer, long * input_frames_count,
                             T * output_buffer, long output_frames_needed);
   long fill_internal_input(T * input_buffer, long * input_frames_count,
                            T * output_buffer, long output_frames_needed);
   long fill_internal_output(T * input_buffer, long * input_frames_count,
                             T * output_buffer, long output_frames_needed);
+  /* Versions of the above that call the data callback with exactly
+   * `block_size` frames, as many times as needed, leaving what is not needed
+   * yet in the buffers of the processors. */
+  long fill_internal_duplex_blocks(T * input_buffer, long * input_frames_count,
+                                   T * output_buffer, long output_frames_needed);
+  long fill_internal_input_blocks(T * input_buffer, long * input_frames_count,
+                                  T * output_buffer, long output_frames_needed);
+  long fill_internal_output_blocks(T * input_buffer, long * input_frames_count,
+                                   T * output_buffer, long output_frames_needed);
 
   std::unique_ptr<InputProcessing> input_processor;
   std::unique_ptr<OutputProcessing> output_processor;
@@ -157,6 +605,16 @@ private:
   cubeb_stream * const stream;
   const cubeb_data_callback data_callback;
   void * const user_ptr;
+  /* The number of frames of each call to the data callback, or 0 if it can be
+   * called with any number of frames. */
+  const long block_size;
+  /* The rate of the frames passed to `fill`. */
+  const uint32_t rate;
+  /* Set when the quality adapts to the time taken by `fill`. */
+  std::unique_ptr<adaptive_quality> adaptive;
+  /* The largest number of frames `fill` handles in one pass, or 0 if it is
+   * not bounded, see `reserve`. */
+  long max_frames = 0;
   bool draining = false;
 };
 
@@ -184,13 +642,28 @@ public:
   : processor(channels)
   , resampling_ratio(static_cast<float>(source_rate) / target_rate)
   , source_rate(source_rate)
+  , target_rate(target_rate)
   , additional_latency(0)
+  , filter_latency_offset(0)
   , leftover_samples(0)
+  , jitter(source_rate)
+  , drift_target(0)
+  , buffered_average(0)
+  , drift_num(0)
+  , drift_den(0)
+  , drift_max_delta(0)
+  , drift_delta(0)
   {
     int r;
     speex_resampler = speex_resampler_init(channels, source_rate,
                                            target_rate, quality, &r);
     assert(r == RESAMPLER_ERR_SUCCESS && "resampler allocation failure");
+    speex_resampler_get_ratio(speex_resampler, &nominal_num, &nominal_den);
+    /* Resample all the channels of a frame at once when there are kernels for
+     * this channel count (2, 4, 6 or 8). Only the float path uses them. */
+    if (std::is_same<T, float>::value) {
+      speex_resampler_set_multichannel(speex_resampler, 1);
+    }
   }
 
   /** Destructor, deallocate the resampler */
@@ -203,11 +676,12 @@ public:
    * resampler so that the stream are synchronized. This must be called only on
    * a fresh resampler, otherwise, silent samples will be inserted in the
    * stream.
-   * @param frames the number of frames of latency to add. */
+   * @param frames the number of frames of latency to add, at the target
+   * rate. */
   void add_latency(size_t frames)
   {
     additional_latency += frames;
-    resampling_in_buffer.push_silence(frames_to_samples(frames));
+    resampling_in_buffer.push_silence(frames_to_samples(source_frames(frames)));
   }
 
   /* Fill the resampler with `input_frame_count` frames. */
@@ -215,6 +689,7 @@ public:
   {
     resampling_in_buffer.push(input_buffer,
                               frames_to_samples(input_frame_count));
+    jitter.input(input_frame_count);
   }
 
   /** Outputs exactly `output_frame_count` into `output_buffer`.
@@ -227,8 +702,8 @@ public:
     speex_resample(resampling_in_buffer.data(), &in_len,
                    output_buffer, &out_len);
 
-    /* This shifts back any unresampled samples to the beginning of the input
-       buffer. */
+    /* This discards the resampled samples, leaving any unresampled samples
+       at the front of the input buffer. */
     resampling_in_buffer.pop(nullptr, frames_to_samples(in_len));
 
     return out_len;
@@ -241,7 +716,8 @@ public:
   }
 
   /** Returns a buffer containing exactly `output_frame_count` resampled frames.
-    * The consumer should not hold onto the pointer. */
+    * Frames that there isn't enough input for are silence. The consumer
+    * should not hold onto the pointer. */
   T * output(size_t output_frame_count, size_t * input_frames_used)
   {
     if (resampling_out_buffer.capacity() < frames_to_samples(output_frame_count)) {
@@ -254,13 +730,22 @@ public:
     speex_resample(resampling_in_buffer.data(), &in_len,
                    resampling_out_buffer.data(), &out_len);
 
-    assert(out_len == output_frame_count);
+    if (out_len < output_frame_count) {
+      /* The input didn't arrive in time: the missing frames are silence. */
+      PodZero(resampling_out_buffer.data() + frames_to_samples(out_len),
+              frames_to_samples(output_frame_count - out_len));
+      jitter.underrun();
+    }
 
-    /* This shifts back any unresampled samples to the beginning of the input
-       buffer. */
+    /* This discards the resampled samples, leaving any unresampled samples
+       at the front of the input buffer. */
     resampling_in_buffer.pop(nullptr, frames_to_samples(in_len));
     *input_frames_used = in_len;
 
+    if (drift_target) {
+      compensate_drift(in_len);
+    }
+
     return resampling_out_buffer.data();
   }
 
@@ -271,8 +756,8 @@ public:
      * only consider a single channel here so it's the same number of frames. */
     int latency = 0;
 
-    latency =
-      speex_resampler_get_output_latency(speex_resampler) + additional_latency;
+    latency = speex_resampler_get_output_latency(speex_resampler) +
+              additional_latency + filter_latency_offset;
 
     assert(latency >= 0);
 
@@ -288,7 +773,7 @@ public:
     int32_t unresampled_frames_left = samples_to_frames(resampling_in_buffer.length());
     int32_t resampled_frames_left = samples_to_frames(resampling_out_buffer.length());
     float input_frames_needed =
-      (output_frame_count - unresampled_frames_left) * resampling_ratio
+      output_frame_count * resampling_ratio - unresampled_frames_left
         - resampled_frames_left;
     if (input_frames_needed < 0) {
       return 0;
@@ -296,6 +781,40 @@ public:
     return (uint32_t)ceilf(input_frames_needed);
   }
 
+  /** Upper bounds of the number of frames on one side of the resampler for
+   * `frames` frames on the other side, whatever the drift compensation and
+   * the frames left over from previous calls. */
+  size_t max_input_for_output(size_t frames) const
+  {
+    return with_drift_margin(static_cast<double>(frames) * nominal_num /
+                             nominal_den);
+  }
+  size_t max_output_for_input(size_t frames) const
+  {
+    /* When the quality goes down, speex first outputs what the longer filter
+     * had, and up to half of it can be left in the input buffer. The quality
+     * never goes above the current one. */
+    size_t leftover = speex_resampler_get_input_latency(speex_resampler);
+    return with_drift_margin(static_cast<double>(frames + leftover) *
+                             nominal_den / nominal_num);
+  }
+
+  /** Allocate the buffers for calls that push up to `input_frames` frames with
+   * `input` or `input_buffer`, and get up to `output_frames` frames with
+   * `output`, so that these calls don't allocate. */
+  void reserve(size_t input_frames, size_t output_frames)
+  {
+    /* What drop_audio_if_needed keeps, the frames of a call, and what is left
+     * over from the previous one. */
+    resampling_in_buffer.reserve(
+        frames_to_samples(jitter.max_buffered() +
+                          source_frames(additional_latency) +
+                          2 * input_frames));
+    if (resampling_out_buffer.capacity() < frames_to_samples(output_frames)) {
+      resampling_out_buffer.reserve(frames_to_samples(output_frames));
+    }
+  }
+
   /** Returns a pointer to the input buffer, that contains empty space for at
    * least `frame_count` elements. This is useful so that consumer can directly
    * write into the input buffer of the resampler. The pointer returned is
@@ -315,18 +834,160 @@ public:
   {
     resampling_in_buffer.set_length(leftover_samples +
                                     frames_to_samples(written_frames));
+    jitter.input(written_frames);
   }
 
   void drop_audio_if_needed()
   {
-    // Keep at most 100ms buffered.
-    uint32_t available = samples_to_frames(resampling_in_buffer.length());
-    uint32_t to_keep = min_buffered_audio_frame(source_rate);
+    // Keep what the jitter buffer asks for, on top of the latency added on
+    // purpose.
+    size_t available = samples_to_frames(resampling_in_buffer.length());
+    size_t latency_frames = source_frames(additional_latency);
+    size_t to_keep = latency_frames +
+      jitter.update(available > latency_frames ? available - latency_frames : 0);
     if (available > to_keep) {
       resampling_in_buffer.pop(nullptr, frames_to_samples(available - to_keep));
     }
+    if (drift_target && jitter.is_adaptive()) {
+      /* Aim for the middle of what is kept. */
+      drift_target = std::max(1u, jitter.target() / 2);
+    }
+  }
+
+  /** See cubeb_resampler_set_input_buffer_bounds. */
+  void set_buffer_bounds(uint32_t min_frames, uint32_t max_frames)
+  {
+    jitter.set_bounds(min_frames, max_frames);
+  }
+
+  void buffer_stats(cubeb_resampler_input_buffer_stats * stats) const
+  {
+    jitter.stats(stats);
+  }
+
+  /** Adjust the resampling ratio from now on, so that about `target_frames`
+   * input frames stay buffered after each call to `output`. This allows
+   * following the clock of the consumer when it drifts from the clock of the
+   * input, without letting input build up or run out.
+   * @return false if the ratio of this resampler can't be adjusted. */
+  bool enable_drift_compensation(uint32_t target_frames)
+  {
+    /* speex rescales the position in the filter by the new denominator when
+     * the ratio changes, which only fits in 32 bits with denominators up to
+     * 65535. Scale the ratio to the finest fraction that allows, and only
+     * change the numerator. */
+    uint32_t scale = 65535 / nominal_den;
+    if (!scale) {
+      return false;
+    }
+    drift_num = nominal_num * scale;
+    drift_den = nominal_den * scale;
+    drift_max_delta = std::max(1u, drift_num / DRIFT_MAX_CORRECTION);
+    /* Compute the filter once, for the highest ratio, so that adjusting the
+     * ratio on the audio thread doesn't compute, allocate or lock. */
+    if (speex_resampler_set_max_ratio(speex_resampler,
+                                      drift_num + drift_max_delta,
+                                      drift_den) != RESAMPLER_ERR_SUCCESS) {
+      return false;
+    }
+    drift_target = target_frames;
+    buffered_average = target_frames;
+    return true;
+  }
+
+  int drift_compensation(double * ratio, uint32_t * target_frames) const
+  {
+    if (!drift_target) {
+      return CUBEB_ERROR_NOT_SUPPORTED;
+    }
+    *ratio = 1.0 + static_cast<double>(drift_delta) / drift_num;
+    *target_frames = drift_target;
+    return CUBEB_OK;
+  }
+
+  /** The speex quality of this resampler, between 0 and 10. */
+  int quality() const
+  {
+    int quality;
+    speex_resampler_get_quality(speex_resampler, &quality);
+    return quality;
+  }
+
+  /** Computes the filters of the qualities from `min_quality` to the current
+   * one, so that `set_quality` can switch between them without locking or
+   * allocating. Returns false if that failed. */
+  bool prepare_qualities(int min_quality)
+  {
+    return speex_resampler_prepare_qualities(speex_resampler, min_quality) ==
+           RESAMPLER_ERR_SUCCESS;
+  }
+
+  /** Change the quality of the resampler while it is running. This changes the
+   * length of the filter, but speex keeps the stream continuous across the
+   * change, so the delay of the stream stays what it was. Only real-time safe
+   * for qualities passed to `prepare_qualities` before. */
+  void set_quality(int quality)
+  {
+    int before = speex_resampler_get_output_latency(speex_resampler);
+    speex_resampler_set_quality(speex_resampler, quality);
+    filter_latency_offset += before -
+      speex_resampler_get_output_latency(speex_resampler);
   }
 private:
+  /** The ratio is adjusted by 1 / DRIFT_MAX_CORRECTION (0.1%) at most, which is
+   * too little to be heard. */
+  static const uint32_t DRIFT_MAX_CORRECTION = 1000;
+  /** The difference between the amount of buffered input and the target is
+   * absorbed in about this many seconds. */
+  static const uint32_t DRIFT_RESPONSE_SECONDS = 10;
+
+  /** Converts a number of frames at the target rate to the source rate. */
+  size_t source_frames(size_t target_frames) const
+  {
+    return static_cast<size_t>(ceilf(target_frames * resampling_ratio));
+  }
+
+  /** Rounds up a number of frames at the nominal ratio, with room for the
+   * largest drift correction and for the fraction of a frame speex keeps
+   * between calls. */
+  static size_t with_drift_margin(double frames)
+  {
+    return static_cast<size_t>(ceil(frames * (1 + 2.0 / DRIFT_MAX_CORRECTION))) + 2;
+  }
+
+  void compensate_drift(uint32_t input_frames_used)
+  {
+    float buffered = samples_to_frames(resampling_in_buffer.length());
+    /* Average over about a second, so that the variations caused by the
+     * callback sizes of both sides don't move the ratio. */
+    float weight = std::min(1.0f, static_cast<float>(input_frames_used) / source_rate);
+    buffered_average += (buffered - buffered_average) * weight;
+
+    float correction = (buffered_average - drift_target) /
+                       (source_rate * DRIFT_RESPONSE_SECONDS);
+    float delta = correction * drift_num;
+    int current_delta = drift_delta;
+    /* Don't flip back and forth between two ratios. */
+    if (std::fabs(delta - current_delta) < 0.75f) {
+      return;
+    }
+    int new_delta = static_cast<int>(lrintf(delta));
+    if (new_delta > drift_max_delta) {
+      new_delta = drift_max_delta;
+    } else if (new_delta < -drift_max_delta) {
+      new_delta = -drift_max_delta;
+    }
+    if (new_delta == current_delta) {
+      return;
+    }
+
+    speex_resampler_set_rate_frac(speex_resampler, drift_num + new_delta,
+                                  drift_den, source_rate, target_rate);
+    resampling_ratio =
+      static_cast<float>(static_cast<double>(drift_num + new_delta) / drift_den);
+    drift_delta = new_delta;
+  }
+
   /** Wrapper for the speex resampling functions to have a typed
     * interface. */
   void speex_resample(float * input_buffer, uint32_t * input_frame_count,
@@ -360,22 +1021,449 @@ private:
   }
   /** The state for the speex resampler used internaly. */
   SpeexResamplerState * speex_resampler;
-  /** Source rate / target rate. */
-  const float resampling_ratio;
+  /** Source rate / target rate, including the drift compensation. */
+  float resampling_ratio;
   const uint32_t source_rate;
+  const uint32_t target_rate;
+  /** Source rate / target rate, as a reduced fraction. */
+  spx_uint32_t nominal_num;
+  spx_uint32_t nominal_den;
   /** Storage for the input frames, to be resampled. Also contains
    * any unresampled frames after resampling. */
-  auto_array<T> resampling_in_buffer;
+  sliding_array<T> resampling_in_buffer;
   /* Storage for the resampled frames, to be passed back to the caller. */
   auto_array<T> resampling_out_buffer;
   /** Additional latency inserted into the pipeline for synchronisation. */
   uint32_t additional_latency;
+  /** The difference between the latency of the filter the stream started with
+   * and the latency of the current one, see `set_quality`. This can be read
+   * from any thread. */
+  std::atomic<int> filter_latency_offset;
   /** When `input_buffer` is called, this allows tracking the number of samples
       that were in the buffer. */
   uint32_t leftover_samples;
+  /** Decides how many input frames drop_audio_if_needed keeps. */
+  jitter_buffer jitter;
+  /** The number of input frames to keep buffered when compensating drift, or
+   * 0 when not compensating drift. This follows the jitter buffer when it
+   * adapts, and can be read from any thread. */
+  std::atomic<uint32_t> drift_target;
+  /** Average number of input frames left after resampling. */
+  float buffered_average;
+  /** The nominal ratio, scaled so that it can be adjusted finely. */
+  uint32_t drift_num;
+  uint32_t drift_den;
+  int drift_max_delta;
+  /** What is currently added to `drift_num` to follow the clock of the
+   * consumer. This can be read from any thread. */
+  std::atomic<int> drift_delta;
+};
+
+/** Number of non-zero coefficients on each side of the center of the halfband
+ * filter. The filter has 4 * HALFBAND_HALF_LENGTH - 1 taps, every other one
+ * being zero. This gives about 100dB of attenuation in the stop band, with a
+ * pass band up to 45% of the lowest of the two rates. */
+const uint32_t HALFBAND_HALF_LENGTH = 32;
+
+/** Returns the HALFBAND_HALF_LENGTH non-zero coefficients of the halfband
+ * filter, starting from the center, excluding the center tap (that is always
+ * 0.5). */
+const float * halfband_coefficients();
+
+/** The coefficients of the halfband filter, held by the resampler that uses
+ * them. The first one constructed computes the filter: this is not for the
+ * audio thread. */
+struct halfband_kernel {
+  halfband_kernel();
+  float coefficients[HALFBAND_HALF_LENGTH];
 };
 
-/** This class allows delaying an audio stream by `frames` frames. */
+/** Computes the `count` interpolated frames between the `count` frames that
+ * follow the HALFBAND_HALF_LENGTH first frames of `input`, for one channel.
+ * `input` has 2 * HALFBAND_HALF_LENGTH - 1 + `count` frames. */
+void halfband_interpolate(const halfband_kernel & kernel, const float * input,
+                          size_t count, float * output);
+
+/** Computes `count` frames at half the rate, for one channel. `even` and `odd`
+ * contain the even and odd frames of the input, which has
+ * 4 * HALFBAND_HALF_LENGTH - 3 + 2 * `count` frames. */
+void halfband_decimate(const halfband_kernel & kernel, const float * even,
+                       const float * odd, size_t count, float * output);
+
+/** Handles one way of a (possibly) duplex resampler when one rate is exactly
+ * twice the other. This uses a halfband filter instead of a polyphase filter
+ * bank: half of the coefficients are zero, and every other output frame (when
+ * upsampling) is a copy of an input frame, so this is a lot cheaper than the
+ * speex resampler for a similar quality. This has the same interface as
+ * cubeb_resampler_speex_one_way. */
+template<typename T>
+class cubeb_resampler_halfband_one_way : public processor {
+public:
+  /** The sample type of this resampler, either 16-bit integers or 32-bit
+   * floats. */
+  typedef T sample_type;
+  /** Construct a resampler resampling from #source_rate to #target_rate,
+   * #target_rate being either twice or half #source_rate.
+   * @parameter channels The number of channels this resampler will resample.
+   * @parameter source_rate The sample-rate of the audio input.
+   * @parameter target_rate The sample-rate of the audio output. */
+  cubeb_resampler_halfband_one_way(uint32_t channels,
+                                   uint32_t source_rate,
+                                   uint32_t target_rate)
+  : processor(channels)
+  , upsampling(target_rate > source_rate)
+  , source_rate(source_rate)
+  , history_frames(upsampling ? 2 * HALFBAND_HALF_LENGTH - 1
+                              : 4 * HALFBAND_HALF_LENGTH - 3)
+  , additional_latency(0)
+  , leftover_samples(0)
+  , input_frames_used(0)
+  , jitter(source_rate)
+  {
+    assert(is_halfband_ratio(source_rate, target_rate));
+    /* Start with silence in the filter. */
+    in_buffer.push_silence(frames_to_samples(history_frames));
+  }
+
+  /** Returns true if this resampler can convert from `source_rate` to
+   * `target_rate`. */
+  static bool is_halfband_ratio(uint32_t source_rate, uint32_t target_rate)
+  {
+    return source_rate == 2 * target_rate || target_rate == 2 * source_rate;
+  }
+
+  /** See cubeb_resampler_speex_one_way::add_latency. */
+  void add_latency(size_t frames)
+  {
+    additional_latency += frames;
+    if (upsampling) {
+      /* One input frame makes two output frames, put the odd one directly in
+       * the output. */
+      in_buffer.push_silence(frames_to_samples(frames / 2));
+      out_leftover.push_silence(frames_to_samples(frames % 2));
+    } else {
+      in_buffer.push_silence(frames_to_samples(frames * 2));
+    }
+  }
+
+  /* Fill the resampler with `input_frame_count` frames. */
+  void input(T * input_buffer, size_t input_frame_count)
+  {
+    in_buffer.push(input_buffer, frames_to_samples(input_frame_count));
+    jitter.input(input_frame_count);
+  }
+
+  /** Outputs up to `output_frame_count` frames into `output_buffer`, and
+   * returns the number of frames written. */
+  size_t output(T * output_buffer, size_t output_frame_count)
+  {
+    return produce(output_buffer, output_frame_count);
+  }
+
+  size_t output_for_input(uint32_t input_frames)
+  {
+    size_t available = pending_frames() + input_frames;
+    return samples_to_frames(out_leftover.length()) +
+           (upsampling ? available * 2 : available / 2);
+  }
+
+  /** Returns a buffer containing exactly `output_frame_count` resampled frames.
+    * Frames that there isn't enough input for are silence. The consumer
+    * should not hold onto the pointer. */
+  T * output(size_t output_frame_count, size_t * input_frames_used_out)
+  {
+    if (out_buffer.capacity() < frames_to_samples(output_frame_count)) {
+      out_buffer.reserve(frames_to_samples(output_frame_count));
+    }
+    size_t got = produce(out_buffer.data(), output_frame_count);
+    if (got < output_frame_count) {
+      /* The input didn't arrive in time: the missing frames are silence. */
+      PodZero(out_buffer.data() + frames_to_samples(got),
+              frames_to_samples(output_frame_count - got));
+      jitter.underrun();
+    }
+    *input_frames_used_out = input_frames_used;
+
+    return out_buffer.data();
+  }
+
+  /** Get the latency of the resampler, in output frames. */
+  uint32_t latency() const
+  {
+    /* The center of the filter is HALFBAND_HALF_LENGTH input frames away from
+     * the newest frame when upsampling, and 2 * HALFBAND_HALF_LENGTH - 2
+     * input frames away when downsampling. */
+    return (upsampling ? 2 * HALFBAND_HALF_LENGTH : HALFBAND_HALF_LENGTH - 1) +
+           additional_latency;
+  }
+
+  /** See cubeb_resampler_speex_one_way::input_needed_for_output. This is
+   * always exact. */
+  uint32_t input_needed_for_output(uint32_t output_frame_count) const
+  {
+    size_t leftover = samples_to_frames(out_leftover.length());
+    size_t pending = pending_frames();
+    if (output_frame_count <= leftover) {
+      return 0;
+    }
+    size_t to_produce = output_frame_count - leftover;
+    size_t needed = upsampling ? (to_produce + 1) / 2 : to_produce * 2;
+    return needed > pending ? needed - pending : 0;
+  }
+
+  /** See cubeb_resampler_speex_one_way::max_input_for_output. */
+  size_t max_input_for_output(size_t frames) const
+  {
+    return upsampling ? (frames + 1) / 2 : frames * 2;
+  }
+  size_t max_output_for_input(size_t frames) const
+  {
+    /* Plus the frame left over when upsampling to an odd number of frames. */
+    return upsampling ? frames * 2 + 1 : frames / 2 + 1;
+  }
+
+  /** See cubeb_resampler_speex_one_way::reserve. */
+  void reserve(size_t input_frames, size_t output_frames)
+  {
+    size_t latency_frames = upsampling ? (additional_latency + 1) / 2
+                                       : additional_latency * 2;
+    in_buffer.reserve(frames_to_samples(history_frames +
+                                        jitter.max_buffered() +
+                                        latency_frames + 2 * input_frames));
+    out_leftover.reserve(frames_to_samples(2));
+    if (out_buffer.capacity() < frames_to_samples(output_frames)) {
+      out_buffer.reserve(frames_to_samples(output_frames));
+    }
+    /* Downsampling needs the most: both phases of the input, and the output. */
+    reserve_scratch(history_frames + 3 * output_frames + 2);
+  }
+
+  /** See cubeb_resampler_speex_one_way::input_buffer. */
+  T * input_buffer(size_t frame_count)
+  {
+    leftover_samples = in_buffer.length();
+    in_buffer.reserve(leftover_samples + frames_to_samples(frame_count));
+    return in_buffer.data() + leftover_samples;
+  }
+
+  /** This method works with `input_buffer`, and allows to inform the processor
+      how much frames have been written in the provided buffer. */
+  void written(size_t written_frames)
+  {
+    in_buffer.set_length(leftover_samples + frames_to_samples(written_frames));
+    jitter.input(written_frames);
+  }
+
+  void drop_audio_if_needed()
+  {
+    // Keep what the jitter buffer asks for, on top of the latency added on
+    // purpose.
+    size_t available = pending_frames();
+    size_t latency_frames = upsampling ? (additional_latency + 1) / 2
+                                       : additional_latency * 2;
+    size_t to_keep = latency_frames +
+      jitter.update(available > latency_frames ? available - latency_frames : 0);
+    if (available > to_keep) {
+      /* The oldest frames become the history of the filter. */
+      in_buffer.pop(nullptr, frames_to_samples(available - to_keep));
+    }
+  }
+
+  /** See cubeb_resampler_speex_one_way::set_buffer_bounds. */
+  void set_buffer_bounds(uint32_t min_frames, uint32_t max_frames)
+  {
+    jitter.set_bounds(min_frames, max_frames);
+  }
+
+  void buffer_stats(cubeb_resampler_input_buffer_stats * stats) const
+  {
+    jitter.stats(stats);
+  }
+
+  /** The ratio of a halfband resampler is fixed. */
+  int drift_compensation(double * /*ratio*/, uint32_t * /*target_frames*/) const
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  /** The filter of a halfband resampler is fixed. */
+  int quality() const
+  {
+    return -1;
+  }
+
+  bool prepare_qualities(int /*min_quality*/)
+  {
+    return true;
+  }
+
+  void set_quality(int /*quality*/) {}
+private:
+  /** Number of input frames that haven't been resampled yet. */
+  size_t pending_frames() const
+  {
+    return samples_to_frames(in_buffer.length()) - history_frames;
+  }
+
+  static float to_float(float sample) { return sample; }
+  static float to_float(short sample) { return sample; }
+  static void from_float(float sample, float * out) { *out = sample; }
+  static void from_float(float sample, short * out)
+  {
+    *out = static_cast<short>(std::max(-32768.0f,
+                                       std::min(32767.0f, roundf(sample))));
+  }
+
+  /** Writes up to `frame_count` frames in `output_buffer`, starting with the
+   * frames left over from the previous call. Sets `input_frames_used`. */
+  size_t produce(T * output_buffer, size_t frame_count)
+  {
+    size_t written = std::min(frame_count,
+                              samples_to_frames(out_leftover.length()));
+    if (written) {
+      out_leftover.pop(output_buffer, frames_to_samples(written));
+      output_buffer += frames_to_samples(written);
+    }
+    frame_count -= written;
+    input_frames_used = 0;
+
+    if (upsampling) {
+      size_t pairs = std::min(pending_frames(), (frame_count + 1) / 2);
+      if (!pairs) {
+        return written;
+      }
+      if (pairs * 2 > frame_count) {
+        /* Odd number of frames: the last frame is kept for the next call. */
+        upsample(output_buffer, pairs - 1);
+        consume(pairs - 1);
+        out_leftover.reserve(frames_to_samples(2));
+        upsample(out_leftover.data(), 1);
+        consume(1);
+        out_leftover.set_length(frames_to_samples(2));
+        out_leftover.pop(output_buffer + frames_to_samples(2 * (pairs - 1)),
+                         frames_to_samples(1));
+        return written + 2 * pairs - 1;
+      }
+      upsample(output_buffer, pairs);
+      consume(pairs);
+      return written + 2 * pairs;
+    }
+
+    size_t outputs = std::min(pending_frames() / 2, frame_count);
+    if (outputs) {
+      downsample(output_buffer, outputs);
+      consume(2 * outputs);
+    }
+    return written + outputs;
+  }
+
+  /** Makes sure `scratch` can hold `length` floats. */
+  void reserve_scratch(size_t length)
+  {
+    if (scratch.capacity() < length) {
+      scratch.reserve(length);
+    }
+  }
+
+  /** Drop `frames` input frames that have been resampled, keeping the history
+   * of the filter. */
+  void consume(size_t frames)
+  {
+    in_buffer.pop(nullptr, frames_to_samples(frames));
+    input_frames_used += frames;
+  }
+
+  /** Makes `pairs` pairs of output frames from the next `pairs` input frames.
+   * Even output frames are delayed input frames, odd output frames are
+   * interpolated. */
+  void upsample(T * output_buffer, size_t pairs)
+  {
+    if (!pairs) {
+      return;
+    }
+    size_t window = history_frames + pairs;
+    reserve_scratch(window + pairs);
+    float * x = scratch.data();
+    float * interpolated = x + window;
+    for (uint32_t c = 0; c < channels; c++) {
+      const T * in = in_buffer.data() + c;
+      for (size_t i = 0; i < window; i++) {
+        x[i] = to_float(in[i * channels]);
+      }
+      halfband_interpolate(kernel, x, pairs, interpolated);
+      /* The center of the filter, for the first pair. */
+      const T * delayed = in + (HALFBAND_HALF_LENGTH - 1) * channels;
+      T * out = output_buffer + c;
+      for (size_t j = 0; j < pairs; j++) {
+        out[0] = delayed[j * channels];
+        from_float(interpolated[j], out + channels);
+        out += 2 * channels;
+      }
+    }
+  }
+
+  /** Makes `outputs` output frames from the next 2 * `outputs` input frames.
+   * The input is split in even and odd frames: the center of the filter is on
+   * an odd frame, and the other non-zero coefficients on even frames. */
+  void downsample(T * output_buffer, size_t outputs)
+  {
+    size_t window = history_frames + 2 * outputs;
+    size_t phase_length = (window + 1) / 2;
+    reserve_scratch(2 * phase_length + outputs);
+    float * even = scratch.data();
+    float * odd = even + phase_length;
+    float * decimated = odd + phase_length;
+    for (uint32_t c = 0; c < channels; c++) {
+      const T * in = in_buffer.data() + c;
+      for (size_t i = 0; i < window / 2; i++) {
+        even[i] = to_float(in[2 * i * channels]);
+        odd[i] = to_float(in[(2 * i + 1) * channels]);
+      }
+      if (window % 2) {
+        even[window / 2] = to_float(in[(window - 1) * channels]);
+      }
+      halfband_decimate(kernel, even, odd, outputs, decimated);
+      T * out = output_buffer + c;
+      for (size_t j = 0; j < outputs; j++) {
+        from_float(decimated[j], out);
+        out += channels;
+      }
+    }
+  }
+
+  /** True if the target rate is twice the source rate, false if it's half. */
+  const bool upsampling;
+  const uint32_t source_rate;
+  /** Number of frames of the past that the filter needs, kept at the front of
+   * `in_buffer`. */
+  const size_t history_frames;
+  /** The filter, computed here rather than on the audio thread. */
+  const halfband_kernel kernel;
+  /** The history of the filter, followed by the input frames that haven't been
+   * resampled yet. */
+  sliding_array<T> in_buffer;
+  /** Resampled frames that haven't been output yet: when upsampling, input
+   * frames make output frames two by two. */
+  sliding_array<T> out_leftover;
+  /* Storage for the resampled frames, to be passed back to the caller. */
+  auto_array<T> out_buffer;
+  /** One channel of the input and of the output, as float. */
+  auto_array<float> scratch;
+  /** Additional latency inserted into the pipeline for synchronisation. */
+  uint32_t additional_latency;
+  /** When `input_buffer` is called, this allows tracking the number of samples
+      that were in the buffer. */
+  uint32_t leftover_samples;
+  /** The number of input frames used by the last call to `produce`. */
+  size_t input_frames_used;
+  /** Decides how many input frames drop_audio_if_needed keeps. */
+  jitter_buffer jitter;
+};
+
+/** This class allows delaying an audio stream by `frames` frames. The frames
+ * are stored in a sliding window: frames are written after the last ones, and
+ * read in place from the front, so that each direction of a callback costs at
+ * most one copy. */
 template<typename T>
 class delay_line : public processor {
 public:
@@ -388,6 +1476,7 @@ public:
     , length(frames)
     , leftover_samples(0)
     , sample_rate(sample_rate)
+    , jitter(sample_rate)
   {
     /* Fill the delay line with some silent frames to add latency. */
     delay_input_buffer.push_silence(frames * channels);
@@ -405,24 +1494,28 @@ public:
   void input(T * buffer, uint32_t frame_count)
   {
     delay_input_buffer.push(buffer, frames_to_samples(frame_count));
+    jitter.input(frame_count);
   }
-  /** Pop some frames from the internal buffer, into a internal output buffer.
-   * @parameter frames_needed the number of frames to be returned.
-   * @return a buffer containing the delayed frames. The consumer should not
-   * hold onto the pointer. */
+  /** Pop some frames from the delay line, without copying them.
+   * @parameter frames_needed the number of frames to be returned. Missing
+   * frames are silence.
+   * @return a pointer to the delayed frames, in the storage of the delay line.
+   * It stays valid until frames are pushed again: the consumer should not hold
+   * onto the pointer. */
   T * output(uint32_t frames_needed, size_t * input_frames_used)
   {
-    if (delay_output_buffer.capacity() < frames_to_samples(frames_needed)) {
-      delay_output_buffer.reserve(frames_to_samples(frames_needed));
+    size_t available = samples_to_frames(delay_input_buffer.length());
+    if (available < frames_needed) {
+      delay_input_buffer.push_silence(frames_to_samples(frames_needed - available));
+      jitter.underrun();
     }
 
-    delay_output_buffer.clear();
-    delay_output_buffer.push(delay_input_buffer.data(),
-                             frames_to_samples(frames_needed));
+    /* Popping doesn't move or overwrite the frames. */
+    T * delayed = delay_input_buffer.data();
     delay_input_buffer.pop(nullptr, frames_to_samples(frames_needed));
     *input_frames_used = frames_needed;
 
-    return delay_output_buffer.data();
+    return delayed;
   }
   /** Get a pointer to the first writable location in the input buffer>
    * @parameter frames_needed the number of frames the user needs to write into
@@ -441,6 +1534,7 @@ public:
   {
     delay_input_buffer.set_length(leftover_samples +
                                   frames_to_samples(frames_written));
+    jitter.input(frames_written);
   }
   /** Drains the delay line, emptying the buffer.
    * @parameter output_buffer the buffer in which the frames are written.
@@ -464,12 +1558,33 @@ public:
    * @returns the number of frames one will get. */
   size_t input_needed_for_output(uint32_t frames_needed) const
   {
-    return frames_needed;
+    /* Frames written beyond what was needed, on top of the delay, have not
+     * been output yet. */
+    size_t buffered = samples_to_frames(delay_input_buffer.length());
+    size_t surplus = buffered > length ? buffered - length : 0;
+    return frames_needed > surplus ? frames_needed - surplus : 0;
   }
   /** Returns the number of frames produces for `input_frames` frames in input */
   size_t output_for_input(uint32_t input_frames)
   {
-    return input_frames;
+    return input_frames + samples_to_frames(delay_input_buffer.length());
+  }
+  /** A delay line doesn't change the number of frames. */
+  size_t max_input_for_output(size_t frames) const
+  {
+    return frames;
+  }
+  size_t max_output_for_input(size_t frames) const
+  {
+    return frames;
+  }
+  /** See cubeb_resampler_speex_one_way::reserve. Frames that are output
+   * without having been written are silence added to the buffer. */
+  void reserve(size_t input_frames, size_t output_frames)
+  {
+    delay_input_buffer.reserve(
+        frames_to_samples(length + jitter.max_buffered() +
+                          2 * input_frames + output_frames));
   }
   /** The number of frames this delay line delays the stream by.
    * @returns The number of frames of delay. */
@@ -481,11 +1596,42 @@ public:
   void drop_audio_if_needed()
   {
     size_t available = samples_to_frames(delay_input_buffer.length());
-    uint32_t to_keep = min_buffered_audio_frame(sample_rate);
+    size_t to_keep = length +
+      jitter.update(available > length ? available - length : 0);
     if (available > to_keep) {
       delay_input_buffer.pop(nullptr, frames_to_samples(available - to_keep));
     }
   }
+
+  /** See cubeb_resampler_speex_one_way::set_buffer_bounds. */
+  void set_buffer_bounds(uint32_t min_frames, uint32_t max_frames)
+  {
+    jitter.set_bounds(min_frames, max_frames);
+  }
+
+  void buffer_stats(cubeb_resampler_input_buffer_stats * stats) const
+  {
+    jitter.stats(stats);
+  }
+
+  /** Delay lines always run at the nominal rate. */
+  int drift_compensation(double * /*ratio*/, uint32_t * /*target_frames*/) const
+  {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+
+  /** Delay lines have no filter. */
+  int quality() const
+  {
+    return -1;
+  }
+
+  bool prepare_qualities(int /*min_quality*/)
+  {
+    return true;
+  }
+
+  void set_quality(int /*quality*/) {}
 private:
   /** The length, in frames, of this delay line */
   uint32_t length;
@@ -493,13 +1639,72 @@ private:
       that where in the buffer. */
   uint32_t leftover_samples;
   /** The input buffer, where the delay is applied. */
-  auto_array<T> delay_input_buffer;
-  /** The output buffer. This is only ever used if using the ::output with a
-   * single argument. */
-  auto_array<T> delay_output_buffer;
+  sliding_array<T> delay_input_buffer;
   uint32_t sample_rate;
+  /** Decides how many frames drop_audio_if_needed keeps on top of the
+   * delay. */
+  jitter_buffer jitter;
 };
 
+/** The processors that can be used for one direction of a resampler. At most
+ * one of them is set. */
+template<typename T>
+struct cubeb_resampler_processors {
+  std::unique_ptr<cubeb_resampler_speex_one_way<T>> resampler;
+  std::unique_ptr<cubeb_resampler_halfband_one_way<T>> halfband;
+  std::unique_ptr<delay_line<T>> delay;
+
+  bool resampling() const
+  {
+    return resampler || halfband;
+  }
+
+  uint32_t latency() const
+  {
+    return resampler ? resampler->latency()
+                     : halfband ? halfband->latency() : 0;
+  }
+};
+
+/** Creates a resampler with `input_processor` for the input, and whichever
+ * output processor is set. */
+template<typename T, typename InputProcessing>
+cubeb_resampler *
+cubeb_resampler_create_with_input(InputProcessing * input_processor,
+                                  cubeb_resampler_processors<T> & output,
+                                  cubeb_stream * stream,
+                                  cubeb_data_callback callback,
+                                  void * user_ptr,
+                                  uint32_t rate,
+                                  uint32_t block_size)
+{
+  if (output.resampler) {
+    return new cubeb_resampler_speex<T,
+                                     InputProcessing,
+                                     cubeb_resampler_speex_one_way<T>>
+                                       (input_processor,
+                                        output.resampler.release(),
+                                        stream, callback, user_ptr,
+                                        rate, block_size);
+  }
+  if (output.halfband) {
+    return new cubeb_resampler_speex<T,
+                                     InputProcessing,
+                                     cubeb_resampler_halfband_one_way<T>>
+                                       (input_processor,
+                                        output.halfband.release(),
+                                        stream, callback, user_ptr,
+                                        rate, block_size);
+  }
+  return new cubeb_resampler_speex<T,
+                                   InputProcessing,
+                                   delay_line<T>>
+                                     (input_processor,
+                                      output.delay.release(),
+                                      stream, callback, user_ptr,
+                                      rate, block_size);
+}
+
 /** This sits behind the C API and is more typed. */
 template<typename T>
 cubeb_resampler *
@@ -509,94 +1714,132 @@ cubeb_resampler_create_internal(cubeb_stream * stream,
                                 unsigned int target_rate,
                                 cubeb_data_callback callback,
                                 void * user_ptr,
-                                cubeb_resampler_quality quality)
+                                cubeb_resampler_quality quality,
+                                cubeb_resampler_reclock reclock,
+                                uint32_t block_size)
 {
-  std::unique_ptr<cubeb_resampler_speex_one_way<T>> input_resampler = nullptr;
-  std::unique_ptr<cubeb_resampler_speex_one_way<T>> output_resampler = nullptr;
-  std::unique_ptr<delay_line<T>> input_delay = nullptr;
-  std::unique_ptr<delay_line<T>> output_delay = nullptr;
+  cubeb_resampler_processors<T> input;
+  cubeb_resampler_processors<T> output;
 
   assert((input_params || output_params) &&
          "need at least one valid parameter pointer.");
 
+  /* Reclocking only makes sense when there is an output clock to follow. */
+  bool reclock_input = reclock == CUBEB_RESAMPLER_RECLOCK_INPUT &&
+                       input_params && output_params;
+
   /* All the streams we have have a sample rate that matches the target
      sample rate, use a no-op resampler, that simply forwards the buffers to the
      callback. */
-  if (((input_params && input_params->rate == target_rate) &&
+  if (!reclock_input && !block_size &&
+      (((input_params && input_params->rate == target_rate) &&
       (output_params && output_params->rate == target_rate)) ||
       (input_params && !output_params && (input_params->rate == target_rate)) ||
-      (output_params && !input_params && (output_params->rate == target_rate))) {
+      (output_params && !input_params && (output_params->rate == target_rate)))) {
     return new passthrough_resampler<T>(stream, callback,
                                         user_ptr,
                                         input_params ? input_params->channels : 0,
+                                        output_params ? output_params->channels : 0,
                                         target_rate);
   }
 
   /* Determine if we need to resampler one or both directions, and create the
-     resamplers. */
+     resamplers. When one rate is exactly twice the other, a halfband filter
+     does the job for a fraction of the cost. */
   if (output_params && (output_params->rate != target_rate)) {
-    output_resampler.reset(
-        new cubeb_resampler_speex_one_way<T>(output_params->channels,
-                                             target_rate,
-                                             output_params->rate,
-                                             to_speex_quality(quality)));
-    if (!output_resampler) {
+    if (cubeb_resampler_halfband_one_way<T>::is_halfband_ratio(target_rate,
+                                                               output_params->rate)) {
+      output.halfband.reset(
+          new cubeb_resampler_halfband_one_way<T>(output_params->channels,
+                                                  target_rate,
+                                                  output_params->rate));
+    } else {
+      output.resampler.reset(
+          new cubeb_resampler_speex_one_way<T>(output_params->channels,
+                                               target_rate,
+                                               output_params->rate,
+                                               to_speex_quality(quality)));
+    }
+    if (!output.resampling()) {
       return NULL;
     }
   }
 
-  if (input_params && (input_params->rate != target_rate)) {
-    input_resampler.reset(
-        new cubeb_resampler_speex_one_way<T>(input_params->channels,
-                                             input_params->rate,
-                                             target_rate,
-                                             to_speex_quality(quality)));
-    if (!input_resampler) {
+  /* When reclocking, the input goes through a resampler even at the same rate,
+     so that its ratio can be adjusted. */
+  if (input_params && (input_params->rate != target_rate || reclock_input)) {
+    if (!reclock_input &&
+        cubeb_resampler_halfband_one_way<T>::is_halfband_ratio(input_params->rate,
+                                                               target_rate)) {
+      input.halfband.reset(
+          new cubeb_resampler_halfband_one_way<T>(input_params->channels,
+                                                  input_params->rate,
+                                                  target_rate));
+    } else {
+      input.resampler.reset(
+          new cubeb_resampler_speex_one_way<T>(input_params->channels,
+                                               input_params->rate,
+                                               target_rate,
+                                               to_speex_quality(quality)));
+    }
+    if (!input.resampling()) {
       return NULL;
     }
+    if (reclock_input) {
+      /* Aim for the middle of what drop_audio_if_needed lets through. */
+      input.resampler->enable_drift_compensation(
+          min_buffered_audio_frame(input_params->rate) / 2);
+    }
   }
 
   /* If we resample only one direction but we have a duplex stream, insert a
    * delay line with a length equal to the resampler latency of the
    * other direction so that the streams are synchronized. */
-  if (input_resampler && !output_resampler && input_params && output_params) {
-    output_delay.reset(new delay_line<T>(input_resampler->latency(),
+  if (!input.resampling() && !output.resampling()) {
+    /* Nothing to resample, but the callback is called with blocks of fixed
+     * size: the delay lines buffer the frames that don't fit in a block. */
+    assert(block_size);
+    if (input_params) {
+      input.delay.reset(new delay_line<T>(0,
+                                          input_params->channels,
+                                          input_params->rate));
+    }
+    if (output_params) {
+      output.delay.reset(new delay_line<T>(0,
+                                           output_params->channels,
+                                           output_params->rate));
+    }
+  } else if (input.resampling() && !output.resampling() && output_params) {
+    output.delay.reset(new delay_line<T>(input.latency(),
                                          output_params->channels,
                                          output_params->rate));
-    if (!output_delay) {
+    if (!output.delay) {
       return NULL;
     }
-  } else if (output_resampler && !input_resampler && input_params && output_params) {
-    input_delay.reset(new delay_line<T>(output_resampler->latency(),
+  } else if (output.resampling() && !input.resampling() && input_params) {
+    input.delay.reset(new delay_line<T>(output.latency(),
                                         input_params->channels,
                                         output_params->rate));
-    if (!input_delay) {
+    if (!input.delay) {
       return NULL;
     }
   }
 
-  if (input_resampler && output_resampler) {
-    return new cubeb_resampler_speex<T,
-                                     cubeb_resampler_speex_one_way<T>,
-                                     cubeb_resampler_speex_one_way<T>>
-                                       (input_resampler.release(),
-                                        output_resampler.release(),
-                                        stream, callback, user_ptr);
-  } else if (input_resampler) {
-    return new cubeb_resampler_speex<T,
-                                     cubeb_resampler_speex_one_way<T>,
-                                     delay_line<T>>
-                                      (input_resampler.release(),
-                                       output_delay.release(),
-                                       stream, callback, user_ptr);
-  } else {
-    return new cubeb_resampler_speex<T,
-                                     delay_line<T>,
-                                     cubeb_resampler_speex_one_way<T>>
-                                      (input_delay.release(),
-                                       output_resampler.release(),
-                                       stream, callback, user_ptr);
+  /* `fill` counts frames at the rate of the device that drives the stream. */
+  uint32_t fill_rate = output_params ? output_params->rate : input_params->rate;
+
+  if (input.resampler) {
+    return cubeb_resampler_create_with_input(input.resampler.release(), output,
+                                             stream, callback, user_ptr,
+                                             fill_rate, block_size);
+  } else if (input.halfband) {
+    return cubeb_resampler_create_with_input(input.halfband.release(), output,
+                                             stream, callback, user_ptr,
+                                             fill_rate, block_size);
   }
+  return cubeb_resampler_create_with_input(input.delay.release(), output,
+                                           stream, callback, user_ptr,
+                                           fill_rate, block_size);
 }
 
 #endif /* CUBEB_RESAMPLER_INTERNAL */
@@ -15,6 +15,8 @@
 #include <assert.h>
 #include "cubeb/cubeb.h"
 #include "cubeb-internal.h"
+#include "cubeb_convert.h"
+#include "cubeb_gain.h"
 
 #if defined(CUBEB_SNDIO_DEBUG)
 #define DPR(...) fprintf(stderr, __VA_ARGS__);
@@ -51,53 +53,9 @@ struct cubeb_stream {
   uint64_t swpos;                 /* number of frames produced/consumed */
   cubeb_data_callback data_cb;    /* cb to preapare data */
   cubeb_state_callback state_cb;  /* cb to notify about state changes */
-  float volume;			  /* current volume */
+  cubeb_gain *gain;		  /* play volume */
 };
 
-static void
-s16_setvol(void *ptr, long nsamp, float volume)
-{
-  int16_t *dst = ptr;
-  int32_t mult = volume * 32768;
-  int32_t s;
-
-  while (nsamp-- > 0) {
-    s = *dst;
-    s = (s * mult) >> 15;
-    *(dst++) = s;
-  }
-}
-
-static void
-float_to_s16(void *ptr, long nsamp, float volume)
-{
-  int16_t *dst = ptr;
-  float *src = ptr;
-  float mult = volume * 32768;
-  int s;
-
-  while (nsamp-- > 0) {
-    s = lrintf(*(src++) * mult);
-    if (s < -32768)
-      s = -32768;
-    else if (s > 32767)
-      s = 32767;
-    *(dst++) = s;
-  }
-}
-
-static void
-s16_to_float(void *ptr, long nsamp)
-{
-  int16_t *src = ptr;
-  float *dst = ptr;
-
-  src += nsamp;
-  dst += nsamp;
-  while (nsamp-- > 0)
-    *(--dst) = (1. / 32768) * *(--src);
-}
-
 static void
 sndio_onmove(void *arg, int delta)
 {
@@ -156,7 +114,8 @@ sndio_mainloop(void *arg)
       }
 
       if ((s->mode & SIO_REC) && s->conv)
-        s16_to_float(s->rbuf, s->nfr * s->rchan);
+        cubeb_convert_s16_to_float((int16_t *)s->rbuf, (float *)s->rbuf,
+                                   s->nfr * s->rchan, 1.0f);
 
       /* invoke call-back, it returns less that s->nfr if done */
       pthread_mutex_unlock(&s->mtx);
@@ -186,10 +145,20 @@ sndio_mainloop(void *arg)
         prime--;
 
       if (s->mode & SIO_PLAY) {
-        if (s->conv)
-          float_to_s16(s->pbuf, nfr * s->pchan, s->volume);
-        else
-          s16_setvol(s->pbuf, nfr * s->pchan, s->volume);
+        if (s->conv) {
+          /* apply the volume while converting, unless it is ramping or
+             differs between channels */
+          float gain;
+          if (!cubeb_gain_get_uniform(s->gain, &gain)) {
+            cubeb_gain_apply_float(s->gain, (float *)s->pbuf,
+                                   (float *)s->pbuf, nfr);
+            gain = 1.0f;
+          }
+          cubeb_convert_float_to_s16((float *)s->pbuf, (int16_t *)s->pbuf,
+                                     nfr * s->pchan, gain);
+        } else
+          cubeb_gain_apply_s16(s->gain, (int16_t *)s->pbuf,
+                               (int16_t *)s->pbuf, nfr);
       }
 
       if (s->mode & SIO_REC)
@@ -305,6 +274,10 @@ sndio_stream_init(cubeb * context,
       DPR("sndio_stream_init(), loopback not supported\n");
       goto err;
     }
+    if (input_stream_params->prefs & CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE) {
+      DPR("sndio_stream_init(), fixed block size not supported\n");
+      goto err;
+    }
     s->mode |= SIO_REC;
     format = input_stream_params->format;
     rate = input_stream_params->rate;
@@ -314,6 +287,10 @@ sndio_stream_init(cubeb * context,
       DPR("sndio_stream_init(), loopback not supported\n");
       goto err;
     }
+    if (output_stream_params->prefs & CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE) {
+      DPR("sndio_stream_init(), fixed block size not supported\n");
+      goto err;
+    }
     s->mode |= SIO_PLAY;
     format = output_stream_params->format;
     rate = output_stream_params->rate;
@@ -386,13 +363,15 @@ sndio_stream_init(cubeb * context,
     s->pbuf = malloc(bps * rpar.pchan * rpar.round);
     if (s->pbuf == NULL)
       goto err;
+    s->gain = cubeb_gain_create(rpar.pchan);
+    if (s->gain == NULL)
+      goto err;
   }
   if (s->mode & SIO_REC) {
     s->rbuf = malloc(bps * rpar.rchan * rpar.round);
     if (s->rbuf == NULL)
       goto err;
   }
-  s->volume = 1.;
   *stream = s;
   DPR("sndio_stream_init() end, ok\n");
   (void)context;
@@ -405,6 +384,8 @@ err:
     free(s->pbuf);
   if (s->rbuf)
     free(s->pbuf);
+  if (s->gain)
+    cubeb_gain_destroy(s->gain);
   free(s);
   return CUBEB_ERROR;
 }
@@ -447,8 +428,10 @@ sndio_stream_destroy(cubeb_stream *s)
 {
   DPR("sndio_stream_destroy()\n");
   sio_close(s->hdl);
-  if (s->mode & SIO_PLAY)
+  if (s->mode & SIO_PLAY) {
     free(s->pbuf);
+    cubeb_gain_destroy(s->gain);
+  }
   if (s->mode & SIO_REC)
     free(s->rbuf);
   free(s);
@@ -496,13 +479,36 @@ static int
 sndio_stream_set_volume(cubeb_stream *s, float volume)
 {
   DPR("sndio_stream_set_volume(%f)\n", volume);
-  pthread_mutex_lock(&s->mtx);
   if (volume < 0.)
     volume = 0.;
   else if (volume > 1.0)
     volume = 1.;
-  s->volume = volume;
-  pthread_mutex_unlock(&s->mtx);
+  if (s->mode & SIO_PLAY)
+    cubeb_gain_set_volume(s->gain, volume);
+  return CUBEB_OK;
+}
+
+static int
+sndio_stream_set_channel_volumes(cubeb_stream *s, float const *volumes,
+    uint32_t channels)
+{
+  DPR("sndio_stream_set_channel_volumes(%u)\n", channels);
+  if (!(s->mode & SIO_PLAY))
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  return cubeb_gain_set_channel_volumes(s->gain, volumes, channels);
+}
+
+static int
+sndio_stream_set_panning(cubeb_stream *s, float panning)
+{
+  DPR("sndio_stream_set_panning(%f)\n", panning);
+  if (!(s->mode & SIO_PLAY))
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  /*
+   * the layout of the stream isn't known here, so only stereo
+   * streams are panned.
+   */
+  cubeb_gain_set_panning(s->gain, CUBEB_LAYOUT_UNDEFINED, panning);
   return CUBEB_OK;
 }
 
@@ -572,7 +578,10 @@ static struct cubeb_ops const sndio_ops = {
   .stream_get_position = sndio_stream_get_position,
   .stream_get_latency = sndio_stream_get_latency,
   .stream_set_volume = sndio_stream_set_volume,
-  .stream_set_panning = NULL,
+  .stream_set_channel_volumes = sndio_stream_set_channel_volumes,
+  .stream_set_panning = sndio_stream_set_panning,
+  .stream_set_mixing_matrix = NULL,
+  .stream_set_input_buffer_bounds = NULL,
   .stream_get_current_device = NULL,
   .stream_device_destroy = NULL,
   .stream_register_device_changed_callback = NULL,
@@ -268,6 +268,190 @@ private:
   size_t length_;
 };
 
+/**
+ * An array that can have elements removed from its front without moving the
+ * remaining elements.
+ *
+ * This is used for buffers that are appended at the end and consumed from the
+ * front on every audio callback, such as the input buffers of the resamplers.
+ * The elements are always contiguous in memory, so `data()` can be handed to
+ * code that expects a linear buffer. Popping elements only advances a read
+ * offset. The remaining elements are moved back to the beginning of the
+ * storage only when there is not enough room left at the end, which makes
+ * consuming from the front O(1), and appending amortized O(1) per element.
+ */
+template<typename T>
+class sliding_array
+{
+public:
+  explicit sliding_array(uint32_t capacity = 0)
+    : data_(capacity ? new T[capacity] : nullptr)
+    , capacity_(capacity)
+    , start_(0)
+    , length_(0)
+  {}
+
+  ~sliding_array()
+  {
+    delete [] data_;
+  }
+
+  /** Get a pointer to the first element of the array. */
+  T * data() const
+  {
+    return data_ + start_;
+  }
+
+  T * end() const
+  {
+    return data_ + start_ + length_;
+  }
+
+  const T& at(size_t index) const
+  {
+    assert(index < length_ && "out of range");
+    return data_[start_ + index];
+  }
+
+  T& at(size_t index)
+  {
+    assert(index < length_ && "out of range");
+    return data_[start_ + index];
+  }
+
+  /** Get how many elements can be stored starting at `data()` without
+   * reallocating or moving the elements. */
+  size_t capacity() const
+  {
+    return capacity_ - start_;
+  }
+
+  /** Get how much elements this sliding_array contains. */
+  size_t length() const
+  {
+    return length_;
+  }
+
+  /** Keeps the storage, but removes all the elements from the array. */
+  void clear()
+  {
+    start_ = 0;
+    length_ = 0;
+  }
+
+  /** Ensure that at least `new_capacity` elements can be stored starting at
+   * `data()`. The elements are moved to the beginning of the storage if this
+   * is enough to make room for them, and the storage is reallocated otherwise.
+   * @returns true in case of success
+   * @returns false if the new capacity is not big enough to accomodate for the
+   *                elements in the array. */
+  bool reserve(size_t new_capacity)
+  {
+    if (new_capacity < length_) {
+      return false;
+    }
+    if (new_capacity <= capacity_ - start_) {
+      return true;
+    }
+    if (new_capacity <= capacity_) {
+      compact();
+      return true;
+    }
+    /* Allocate twice what is asked, so that the elements have room to slide
+     * for a while before having to be moved back to the beginning. */
+    size_t storage = new_capacity * 2;
+    T * new_data = new T[storage];
+    if (data_ && length_) {
+      PodCopy(new_data, data_ + start_, length_);
+    }
+    delete [] data_;
+    data_ = new_data;
+    capacity_ = storage;
+    start_ = 0;
+
+    return true;
+  }
+
+  /** Append `length` elements to the end of the array, making room for them
+   * if needed.
+   * @parameter elements the elements to append to the array.
+   * @parameter length the number of elements to append to the array. */
+  void push(const T * elements, size_t length)
+  {
+    reserve(length_ + length);
+    PodCopy(end(), elements, length);
+    length_ += length;
+  }
+
+  /** Append `length` zero-ed elements to the end of the array, making room for
+   * them if needed.
+   * @parameter length the number of elements to append to the array. */
+  void push_silence(size_t length)
+  {
+    if (length == 0) {
+      return;
+    }
+    reserve(length_ + length);
+    PodZero(end(), length);
+    length_ += length;
+  }
+
+  /** Return the number of elements that can be appended without reallocating
+   * or moving the elements. */
+  size_t available() const
+  {
+    return capacity() - length_;
+  }
+
+  /** Copies `length` elements to `elements` if it is not null, and remove them
+    * from the front of the array. The remaining elements are not moved.
+    * @parameter elements a buffer to copy the elements to, or nullptr.
+    * @parameter length the number of elements to remove.
+    * @returns true in case of success.
+    * @returns false if the array contains less than `length` elements. */
+  bool pop(T * elements, size_t length)
+  {
+    if (length > length_) {
+      return false;
+    }
+    if (elements) {
+      PodCopy(elements, data(), length);
+    }
+    length_ -= length;
+    /* Rewind for free when the array becomes empty. */
+    start_ = length_ ? start_ + length : 0;
+
+    return true;
+  }
+
+  /** Set the number of elements of the array, when elements have been written
+   * directly after `data()`. */
+  void set_length(size_t length)
+  {
+    assert(length <= capacity());
+    length_ = length;
+  }
+
+private:
+  /** Move the elements back to the beginning of the storage. */
+  void compact()
+  {
+    if (start_ && length_) {
+      PodMove(data_, data_ + start_, length_);
+    }
+    start_ = 0;
+  }
+
+  /** The underlying storage */
+  T * data_;
+  /** The size, in number of elements, of the storage. */
+  size_t capacity_;
+  /** The index of the first element in the storage. */
+  size_t start_;
+  /** The number of elements the array contains. */
+  size_t length_;
+};
+
 struct auto_array_wrapper {
   virtual void push(void * elements, size_t length) = 0;
   virtual size_t length() = 0;
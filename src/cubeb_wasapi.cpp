@@ -141,6 +141,7 @@ int wasapi_stream_stop(cubeb_stream * stm);
 int wasapi_stream_start(cubeb_stream * stm);
 void close_wasapi_stream(cubeb_stream * stm);
 int setup_wasapi_stream(cubeb_stream * stm);
+int apply_input_buffer_bounds(cubeb_stream * stm);
 static char const * wstr_to_utf8(wchar_t const * str);
 static std::unique_ptr<wchar_t const []> utf8_to_wstr(char const * str);
 
@@ -250,6 +251,12 @@ struct cubeb_stream {
   /* Mixer interfaces */
   std::unique_ptr<cubeb_mixer, decltype(&cubeb_mixer_destroy)> output_mixer = { nullptr, cubeb_mixer_destroy };
   std::unique_ptr<cubeb_mixer, decltype(&cubeb_mixer_destroy)> input_mixer = { nullptr, cubeb_mixer_destroy };
+  /* Whether the output goes through output_mixer: when the layouts of the
+     stream and of the device differ, or once a matrix has been set. */
+  std::atomic<bool> output_remix{ false };
+  /* The matrix set via stream_set_mixing_matrix, if any. Set again on the
+     output mixer when it is re-created on device changes. */
+  std::vector<float> output_matrix;
   /* A buffer for up/down mixing multi-channel audio output. */
   std::vector<BYTE> mix_buffer;
   /* WASAPI input works in "packets". We re-linearize the audio packets
@@ -263,6 +270,15 @@ struct cubeb_stream {
   /* Stream volume.  Set via stream_set_volume and used to reset volume on
      device changes. */
   float volume = 1.0;
+  /* Bounds of the input buffer of a duplex stream, at the rate of the input
+     stream. Set via stream_set_input_buffer_bounds before the stream starts,
+     applied to the resampler when it starts and again on device changes. */
+  bool has_input_buffer_bounds = false;
+  /* True once the stream has been started: the resampler can be in use from
+     then on. Protected by stream_reset_lock. */
+  bool started = false;
+  uint32_t input_buffer_min_frames = 0;
+  uint32_t input_buffer_max_frames = 0;
   /* True if the stream is draining. */
   bool draining = false;
   /* True when we've destroyed the stream. This pointer is leaked on stream
@@ -466,8 +482,9 @@ refill(cubeb_stream * stm, void * input_buffer, long input_frames_count,
   /* If we need to upmix after resampling, resample into the mix buffer to
      avoid a copy. Avoid exposing output if it is a dummy stream. */
   void * dest = nullptr;
+  bool remix = stm->output_remix.load(std::memory_order_relaxed);
   if (has_output(stm) && !stm->has_dummy_output) {
-    if (stm->output_mixer) {
+    if (remix) {
       dest = stm->mix_buffer.data();
     } else {
       dest = output_buffer;
@@ -501,7 +518,7 @@ refill(cubeb_stream * stm, void * input_buffer, long input_frames_count,
   XASSERT(out_frames == output_frames_needed || stm->draining || !has_output(stm) || stm->has_dummy_output);
 
   // We don't bother mixing dummy output as it will be silenced, otherwise mix output if needed
-  if (!stm->has_dummy_output && has_output(stm) && stm->output_mixer) {
+  if (!stm->has_dummy_output && has_output(stm) && remix) {
     XASSERT(dest == stm->mix_buffer.data());
     size_t dest_size =
       out_frames * stm->output_stream_params.channels * stm->bytes_per_sample;
@@ -1698,6 +1715,15 @@ int setup_wasapi_stream(cubeb_stream * stm)
   cubeb_stream_params output_params = stm->output_mix_params;
   output_params.channels = stm->output_stream_params.channels;
 
+  /* The capture and render endpoints of a duplex stream can be on different
+     devices, and so different clocks: make the input follow the output
+     rather than piling up or running out. A loopback stream captures the
+     device that drives it. */
+  cubeb_resampler_reclock reclock =
+    has_input(stm) && has_output(stm) && !stm->has_dummy_output
+      ? CUBEB_RESAMPLER_RECLOCK_INPUT
+      : CUBEB_RESAMPLER_RECLOCK_NONE;
+
   stm->resampler.reset(
     cubeb_resampler_create(stm,
                            has_input(stm) ? &input_params : nullptr,
@@ -1705,11 +1731,22 @@ int setup_wasapi_stream(cubeb_stream * stm)
                            target_sample_rate,
                            stm->data_callback,
                            stm->user_ptr,
-                           CUBEB_RESAMPLER_QUALITY_DESKTOP));
+                           CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                           reclock,
+                           cubeb_resampler_block_size(
+                             has_input(stm) ? &stm->input_stream_params : nullptr,
+                             has_output(stm) ? &stm->output_stream_params : nullptr,
+                             stm->latency)));
   if (!stm->resampler) {
     LOG("Could not get a resampler");
     return CUBEB_ERROR;
   }
+  if (stm->has_input_buffer_bounds &&
+      apply_input_buffer_bounds(stm) != CUBEB_OK) {
+    LOG("Could not set the bounds of the input buffer.");
+    return CUBEB_ERROR;
+  }
+  cubeb_resampler_reserve(stm->resampler.get(), stm->latency);
 
   XASSERT(has_input(stm) || has_output(stm));
 
@@ -1738,9 +1775,13 @@ int setup_wasapi_stream(cubeb_stream * stm)
     assert(stm->input_mixer);
   }
 
-  // Create output mixer.
-  if (has_output(stm) && stm->output_mix_params.layout != stm->output_stream_params.layout) {
-    if (stm->output_mix_params.layout == CUBEB_LAYOUT_UNDEFINED) {
+  // Create output mixer. It is there even when the layouts match, for
+  // stream_set_mixing_matrix.
+  if (has_output(stm)) {
+    bool layouts_differ =
+      stm->output_mix_params.layout != stm->output_stream_params.layout;
+    if (layouts_differ &&
+        stm->output_mix_params.layout == CUBEB_LAYOUT_UNDEFINED) {
       LOG("Output stream using undefined layout! Any mixing may be unpredictable!\n");
     }
     stm->output_mixer.reset(cubeb_mixer_create(stm->output_stream_params.format,
@@ -1749,6 +1790,17 @@ int setup_wasapi_stream(cubeb_stream * stm)
                                                stm->output_mix_params.channels,
                                                stm->output_mix_params.layout));
     assert(stm->output_mixer);
+    // Keep the matrix of the user over device changes, unless the new device
+    // has another number of channels.
+    if (!stm->output_matrix.empty() &&
+        (stm->output_matrix.size() != stm->output_stream_params.channels *
+                                      stm->output_mix_params.channels ||
+         cubeb_mixer_set_matrix(stm->output_mixer.get(),
+                                stm->output_matrix.data()) != CUBEB_OK)) {
+      LOG("Mixing matrix doesn't fit the new device, dropping it.");
+      stm->output_matrix.clear();
+    }
+    stm->output_remix = layouts_differ || !stm->output_matrix.empty();
     // Input is up/down mixed when depacketized in get_input_buffer.
     stm->mix_buffer.resize(
       frames_to_bytes_before_mix(stm, stm->output_buffer_frame_count));
@@ -1956,6 +2008,14 @@ int wasapi_stream_start(cubeb_stream * stm)
   XASSERT(stm && !stm->thread && !stm->shutdown_event);
   XASSERT(stm->output_client || stm->input_client);
 
+  /* The render thread doesn't run yet: the resampler isn't in use. */
+  if (!stm->started && stm->has_input_buffer_bounds &&
+      apply_input_buffer_bounds(stm) != CUBEB_OK) {
+    LOG("Could not set the bounds of the input buffer.");
+    return CUBEB_ERROR;
+  }
+  stm->started = true;
+
   stm->emergency_bailout = new std::atomic<bool>(false);
 
   if (stm->output_client) {
@@ -2098,6 +2158,72 @@ int wasapi_stream_get_latency(cubeb_stream * stm, uint32_t * latency)
   return CUBEB_OK;
 }
 
+int wasapi_stream_set_mixing_matrix(cubeb_stream * stm,
+                                    float const * matrix,
+                                    uint32_t in_channels,
+                                    uint32_t out_channels)
+{
+  auto_lock lock(stm->stream_reset_lock);
+
+  if (!has_output(stm) || stm->has_dummy_output) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  if (in_channels != stm->output_stream_params.channels ||
+      out_channels != stm->output_mix_params.channels) {
+    return CUBEB_ERROR_INVALID_PARAMETER;
+  }
+  if (!stm->output_mixer) {
+    return CUBEB_ERROR;
+  }
+
+  int r = cubeb_mixer_set_matrix(stm->output_mixer.get(), matrix);
+  if (r != CUBEB_OK) {
+    return r;
+  }
+  if (matrix) {
+    stm->output_matrix.assign(matrix, matrix + in_channels * out_channels);
+  } else {
+    stm->output_matrix.clear();
+  }
+  /* The mixer crossfades to the new matrix, even back to the one of the
+     layouts. */
+  stm->output_remix = true;
+  return CUBEB_OK;
+}
+
+/* The resampler counts the input frames at the rate of the device. */
+int apply_input_buffer_bounds(cubeb_stream * stm)
+{
+  uint64_t device_rate = stm->input_mix_params.rate;
+  uint64_t stream_rate = stm->input_stream_params.rate;
+  return cubeb_resampler_set_input_buffer_bounds(
+      stm->resampler.get(),
+      stm->input_buffer_min_frames * device_rate / stream_rate,
+      stm->input_buffer_max_frames * device_rate / stream_rate);
+}
+
+int wasapi_stream_set_input_buffer_bounds(cubeb_stream * stm,
+                                          uint32_t min_frames,
+                                          uint32_t max_frames)
+{
+  auto_lock lock(stm->stream_reset_lock);
+
+  /* A loopback stream captures the device that drives it. */
+  if (!has_input(stm) || !has_output(stm) || stm->has_dummy_output) {
+    return CUBEB_ERROR_NOT_SUPPORTED;
+  }
+  /* The resampler can't be changed while the render thread uses it. */
+  if (stm->started) {
+    return CUBEB_ERROR;
+  }
+
+  /* Applied in wasapi_stream_start. */
+  stm->has_input_buffer_bounds = true;
+  stm->input_buffer_min_frames = min_frames;
+  stm->input_buffer_max_frames = max_frames;
+  return CUBEB_OK;
+}
+
 int wasapi_stream_set_volume(cubeb_stream * stm, float volume)
 {
   auto_lock lock(stm->stream_reset_lock);
@@ -2385,7 +2511,10 @@ cubeb_ops const wasapi_ops = {
   /*.stream_get_position =*/ wasapi_stream_get_position,
   /*.stream_get_latency =*/ wasapi_stream_get_latency,
   /*.stream_set_volume =*/ wasapi_stream_set_volume,
+  /*.stream_set_channel_volumes =*/ NULL,
   /*.stream_set_panning =*/ NULL,
+  /*.stream_set_mixing_matrix =*/ wasapi_stream_set_mixing_matrix,
+  /*.stream_set_input_buffer_bounds =*/ wasapi_stream_set_input_buffer_bounds,
   /*.stream_get_current_device =*/ NULL,
   /*.stream_device_destroy =*/ NULL,
   /*.stream_register_device_changed_callback =*/ NULL,
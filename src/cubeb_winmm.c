@@ -415,8 +415,9 @@ winmm_stream_init(cubeb * context, cubeb_stream ** stream, char const * stream_n
     return CUBEB_ERROR_DEVICE_UNAVAILABLE;
   }
 
-  if (output_stream_params->prefs & CUBEB_STREAM_PREF_LOOPBACK) {
-    /* Loopback is not supported */
+  if (output_stream_params->prefs & (CUBEB_STREAM_PREF_LOOPBACK |
+                                     CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE)) {
+    /* Loopback and fixed block sizes are not supported */
     return CUBEB_ERROR_NOT_SUPPORTED;
   }
 
@@ -1060,7 +1061,10 @@ static struct cubeb_ops const winmm_ops = {
   /*.stream_get_position =*/ winmm_stream_get_position,
   /*.stream_get_latency = */ winmm_stream_get_latency,
   /*.stream_set_volume =*/ winmm_stream_set_volume,
+  /*.stream_set_channel_volumes =*/ NULL,
   /*.stream_set_panning =*/ NULL,
+  /*.stream_set_mixing_matrix =*/ NULL,
+  /*.stream_set_input_buffer_bounds =*/ NULL,
   /*.stream_get_current_device =*/ NULL,
   /*.stream_device_destroy =*/ NULL,
   /*.stream_register_device_changed_callback=*/ NULL,
@@ -0,0 +1,139 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+/**
+   @file gen_resample_tables.c
+   @brief Writes the filter tables of the most common ratios, at the
+   qualities cubeb uses, as a C header for resample.c, see
+   RESAMPLE_PRECOMPUTED_TABLES:
+
+      gen_resample_tables resample_tables.h
+
+   The tables are computed by resample.c itself, built without the
+   precomputed tables, so that they are identical to the ones it would
+   compute at runtime. Tables shared by several ratios (all the up-sampling
+   ones at a given quality, for instance) are only written once.
+*/
+
+#include <stdio.h>
+#include "resample.c"
+
+/* Both directions of each pair are generated. Ratios of exactly two are left
+   out: cubeb uses a halfband filter for them. */
+static const spx_uint32_t rate_pairs[][2] = {
+   { 44100, 48000 },
+   { 16000, 48000 },
+   { 16000, 44100 },
+   { 8000, 48000 },
+   { 32000, 48000 },
+   { 32000, 44100 },
+   { 22050, 48000 },
+};
+
+/* CUBEB_RESAMPLER_QUALITY_VOIP, DEFAULT and DESKTOP. */
+static const int qualities[] = {
+   SPEEX_RESAMPLER_QUALITY_VOIP,
+   SPEEX_RESAMPLER_QUALITY_DEFAULT,
+   SPEEX_RESAMPLER_QUALITY_DESKTOP,
+};
+
+#define PAIR_COUNT (sizeof(rate_pairs)/sizeof(rate_pairs[0]))
+#define QUALITY_COUNT (sizeof(qualities)/sizeof(qualities[0]))
+#define MAX_TABLES (2*PAIR_COUNT*QUALITY_COUNT)
+
+static spx_uint32_t table_length(const FilterTable *filter)
+{
+   return filter->use_direct ? filter->filt_len*filter->den_rate
+                             : filter->filt_len*filter->oversample+8;
+}
+
+int main(int argc, char **argv)
+{
+   SpeexResamplerState *states[MAX_TABLES];
+   const FilterTable *tables[MAX_TABLES];
+   int state_count = 0;
+   int table_count = 0;
+   int i;
+   unsigned p, d, q;
+   FILE *out;
+
+   if (argc != 2)
+   {
+      fprintf(stderr, "Usage: %s resample_tables.h\n", argv[0]);
+      return 1;
+   }
+
+   /* The resamplers are kept alive until the end, so that resamplers with
+      the same parameters share their table, which is written once. */
+   for (p=0;p<PAIR_COUNT;p++)
+   {
+      for (d=0;d<2;d++)
+      {
+         for (q=0;q<QUALITY_COUNT;q++)
+         {
+            int err;
+            SpeexResamplerState *st = speex_resampler_init(1, rate_pairs[p][d], rate_pairs[p][1-d], qualities[q], &err);
+            if (!st)
+            {
+               fprintf(stderr, "Could not create a resampler from %u to %u: %s\n",
+                       rate_pairs[p][d], rate_pairs[p][1-d], speex_resampler_strerror(err));
+               return 1;
+            }
+            states[state_count++] = st;
+            for (i=0;i<table_count;i++)
+            {
+               if (tables[i] == st->filter)
+                  break;
+            }
+            if (i == table_count)
+               tables[table_count++] = st->filter;
+         }
+      }
+   }
+
+   out = fopen(argv[1], "w");
+   if (!out)
+   {
+      fprintf(stderr, "Could not open %s\n", argv[1]);
+      return 1;
+   }
+
+   fprintf(out, "/* Generated by gen_resample_tables.c, do not edit. */\n\n");
+   for (i=0;i<table_count;i++)
+   {
+      spx_uint32_t length = table_length(tables[i]);
+      spx_uint32_t j;
+      fprintf(out, "static const spx_word16_t precomputed_filter_table_%d[%u] = {", i, length);
+      for (j=0;j<length;j++)
+      {
+         /* Nine significant digits are enough for a float to be read back
+            exactly. */
+         fprintf(out, "%s%.8ef,", j % 6 ? " " : "\n   ", tables[i]->data[j]);
+      }
+      fprintf(out, "\n};\n\n");
+   }
+
+   fprintf(out, "static const PrecomputedFilterTable precomputed_filter_tables[%d] = {\n", table_count);
+   for (i=0;i<table_count;i++)
+   {
+      const FilterTable *filter = tables[i];
+      fprintf(out, "   { %d, %u, %u, %u, %.8ef, %d, %u, precomputed_filter_table_%d },\n",
+              filter->use_direct, filter->den_rate, filter->filt_len,
+              filter->oversample, filter->cutoff, filter->quality,
+              table_length(filter), i);
+   }
+   fprintf(out, "};\n");
+
+   if (fclose(out))
+   {
+      fprintf(stderr, "Could not write %s\n", argv[1]);
+      return 1;
+   }
+
+   for (i=0;i<state_count;i++)
+      speex_resampler_destroy(states[i]);
+   return 0;
+}
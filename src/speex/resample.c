@@ -78,6 +78,11 @@ static void speex_free (void *ptr) {free(ptr);}
 #include "stack_alloc.h"
 #include <math.h>
 #include <limits.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -102,6 +107,10 @@ static void speex_free (void *ptr) {free(ptr);}
 #include "resample_neon.h"
 #endif
 
+#ifdef _USE_SIMD_DISPATCH
+#include "resample_x86.h"
+#endif
+
 /* Numer of elements to allocate on the stack */
 #ifdef VAR_ARRAYS
 #define FIXED_STACK_ALLOC 8192
@@ -109,6 +118,8 @@ static void speex_free (void *ptr) {free(ptr);}
 #define FIXED_STACK_ALLOC 1024
 #endif
 
+typedef struct FilterTable_ FilterTable;
+
 typedef int (*resampler_basic_func)(SpeexResamplerState *, spx_uint32_t , const spx_word16_t *, spx_uint32_t *, spx_word16_t *, spx_uint32_t *);
 
 struct SpeexResamplerState_ {
@@ -135,12 +146,32 @@ struct SpeexResamplerState_ {
    spx_uint32_t *magic_samples;
 
    spx_word16_t *mem;
-   spx_word16_t *sinc_table;
-   spx_uint32_t sinc_table_length;
+   const spx_word16_t *sinc_table;
+   /* The table in use, filters[quality]. */
+   FilterTable *filter;
+   /* The tables held by this resampler, by quality: the one in use and, once
+      speex_resampler_prepare_qualities has been called, the ones it can
+      switch to without going through the cache. */
+   FilterTable *filters[11];
+   int keep_filters;
+   /* Set by speex_resampler_set_max_ratio, 0 otherwise. */
+   spx_uint32_t max_num_rate;
+   spx_uint32_t max_den_rate;
    resampler_basic_func resampler_ptr;
 
    int    in_stride;
    int    out_stride;
+
+#ifdef _USE_SIMD_DISPATCH
+   inner_product_single_func inner_product_single_ptr;
+   interpolate_product_single_func interpolate_product_single_ptr;
+
+   /* Set by speex_resampler_set_multichannel. frames holds the filter memory
+      of all channels, interleaved, while they are processed together. */
+   interpolate_product_frames_func interpolate_product_frames_ptr;
+   spx_word16_t *frames;
+   spx_uint32_t frames_alloc_size;
+#endif
 } ;
 
 static const double kaiser12_table[68] = {
@@ -558,6 +589,61 @@ static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint3
 }
 #endif
 
+#ifdef _USE_SIMD_DISPATCH
+/* Same as resampler_basic_interpolate_single, for all the channels of
+   interleaved frames at once. The state of the first channel stands for all
+   of them. */
+static int resampler_frames_interpolate_single(SpeexResamplerState *st, const spx_word16_t *in, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+{
+   const int N = st->filt_len;
+   const int channels = st->nb_channels;
+   int out_sample = 0;
+   int last_sample = st->last_sample[0];
+   spx_uint32_t samp_frac_num = st->samp_frac_num[0];
+   const int int_advance = st->int_advance;
+   const int frac_advance = st->frac_advance;
+   const spx_uint32_t den_rate = st->den_rate;
+
+   while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
+   {
+      const int offset = samp_frac_num*st->oversample/st->den_rate;
+      const spx_word16_t frac = ((float)((samp_frac_num*st->oversample) % st->den_rate))/st->den_rate;
+      spx_word16_t interp[4];
+
+      cubic_coef(frac, interp);
+      st->interpolate_product_frames_ptr(in + channels * last_sample,
+                                         st->sinc_table + st->oversample + 4 - offset - 2,
+                                         N, st->oversample, interp,
+                                         out + channels * out_sample++);
+      last_sample += int_advance;
+      samp_frac_num += frac_advance;
+      if (samp_frac_num >= den_rate)
+      {
+         samp_frac_num -= den_rate;
+         last_sample++;
+      }
+   }
+
+   st->last_sample[0] = last_sample;
+   st->samp_frac_num[0] = samp_frac_num;
+   return out_sample;
+}
+
+/* Make room for the interleaved copy of the filter memory. Returns 0 on
+   allocation failure. */
+static int alloc_frames(SpeexResamplerState *st)
+{
+   spx_word16_t *frames;
+   if (st->frames_alloc_size >= st->mem_alloc_size)
+      return 1;
+   if (!(frames = (spx_word16_t*)speex_realloc(st->frames, st->nb_channels*st->mem_alloc_size*sizeof(*frames))))
+      return 0;
+   st->frames = frames;
+   st->frames_alloc_size = st->mem_alloc_size;
+   return 1;
+}
+#endif
+
 /* This resampler is used to produce zero output in situations where memory
    for the filter could not be allocated.  The expected numbers of input and
    output samples are still processed so that callers failing to check error
@@ -602,80 +688,331 @@ static int _muldiv(spx_uint32_t *result, spx_uint32_t value, spx_uint32_t mul, s
    return RESAMPLER_ERR_SUCCESS;
 }
 
-static int update_filter(SpeexResamplerState *st)
-{
-   spx_uint32_t old_length = st->filt_len;
-   spx_uint32_t old_alloc_size = st->mem_alloc_size;
+/* Filter tables only depend on the resampling ratio and on the quality, and
+   are never modified once computed: resamplers created with the same
+   parameters share them instead of each computing and holding their own copy.
+   Tables are reference counted and freed when the last resampler using them
+   is destroyed or switches to other parameters.
+   They are looked up by the parameters the table is computed from rather than
+   by ratio, so that interpolated tables are also shared between ratios that
+   only differ slightly, e.g. when the ratio is adjusted to follow a clock. */
+struct FilterTable_ {
+   FilterTable *next;
    int use_direct;
-   spx_uint32_t min_sinc_table_length;
-   spx_uint32_t min_alloc_size;
+   spx_uint32_t den_rate;
+   spx_uint32_t filt_len;
+   spx_uint32_t oversample;
+   float cutoff;
+   int quality;
+   spx_uint32_t refcount;
+   /* Set when data points to one of the precomputed tables below, that must
+      not be freed. */
+   int precomputed;
+   const spx_word16_t *data;
+};
 
-   st->int_advance = st->num_rate/st->den_rate;
-   st->frac_advance = st->num_rate%st->den_rate;
-   st->oversample = quality_map[st->quality].oversample;
-   st->filt_len = quality_map[st->quality].base_length;
+static FilterTable *filter_cache = NULL;
+
+#if defined(RESAMPLE_PRECOMPUTED_TABLES) && !defined(FIXED_POINT)
+/* Tables for the most common ratios and qualities, generated at build time by
+   gen_resample_tables.c with the code below, so that creating a resampler
+   with these parameters doesn't have to evaluate the window and the sinc. */
+typedef struct {
+   int use_direct;
+   spx_uint32_t den_rate;
+   spx_uint32_t filt_len;
+   spx_uint32_t oversample;
+   float cutoff;
+   int quality;
+   spx_uint32_t length;
+   const spx_word16_t *data;
+} PrecomputedFilterTable;
+
+#include "resample_tables.h"
+
+#define PRECOMPUTED_FILTER_TABLE_COUNT \
+   ((int)(sizeof(precomputed_filter_tables)/sizeof(precomputed_filter_tables[0])))
+
+static int use_precomputed_tables = 1;
+
+/* Returns the precomputed table for the parameters in key, or NULL. */
+static const spx_word16_t *find_precomputed_table(const FilterTable *key, spx_uint32_t length)
+{
+   int i;
+   if (!use_precomputed_tables)
+      return NULL;
+   for (i=0;i<PRECOMPUTED_FILTER_TABLE_COUNT;i++)
+   {
+      const PrecomputedFilterTable *table = &precomputed_filter_tables[i];
+      if (table->use_direct == key->use_direct &&
+          (!key->use_direct || table->den_rate == key->den_rate) &&
+          table->filt_len == key->filt_len &&
+          table->oversample == key->oversample &&
+          table->cutoff == key->cutoff &&
+          table->quality == key->quality &&
+          table->length == length)
+         return table->data;
+   }
+   return NULL;
+}
+#else
+#define PRECOMPUTED_FILTER_TABLE_COUNT 0
+#define find_precomputed_table(key, length) NULL
+#endif
+
+#if defined(_WIN32)
+static SRWLOCK filter_cache_lock = SRWLOCK_INIT;
+#define lock_filter_cache() AcquireSRWLockExclusive(&filter_cache_lock)
+#define unlock_filter_cache() ReleaseSRWLockExclusive(&filter_cache_lock)
+#else
+static pthread_mutex_t filter_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_filter_cache() pthread_mutex_lock(&filter_cache_lock)
+#define unlock_filter_cache() pthread_mutex_unlock(&filter_cache_lock)
+#endif
+
+static void compute_filter_table(const FilterTable *key, spx_word16_t *table)
+{
+   if (key->use_direct)
+   {
+      spx_uint32_t i;
+      for (i=0;i<key->den_rate;i++)
+      {
+         spx_int32_t j;
+         for (j=0;j<key->filt_len;j++)
+         {
+            table[i*key->filt_len+j] = sinc(key->cutoff,((j-(spx_int32_t)key->filt_len/2+1)-((float)i)/key->den_rate), key->filt_len, quality_map[key->quality].window_func);
+         }
+      }
+   } else {
+      spx_int32_t i;
+      for (i=-4;i<(spx_int32_t)(key->oversample*key->filt_len+4);i++)
+         table[i+4] = sinc(key->cutoff,(i/(float)key->oversample - key->filt_len/2), key->filt_len, quality_map[key->quality].window_func);
+   }
+}
+
+/* Whether filter is computed from the parameters in key. */
+static int filter_table_matches(const FilterTable *filter, const FilterTable *key)
+{
+   return filter->use_direct == key->use_direct &&
+          (!key->use_direct || filter->den_rate == key->den_rate) &&
+          filter->filt_len == key->filt_len &&
+          filter->oversample == key->oversample &&
+          filter->cutoff == key->cutoff &&
+          filter->quality == key->quality;
+}
+
+/* Returns a reference to the table for the parameters in key, computing it if
+   no other resampler uses it, or NULL if it can't be allocated. This locks
+   and can allocate: only the resamplers that have prepared their tables can
+   change their ratio or quality while they run, see prepare_filter. */
+static FilterTable *acquire_filter_table(const FilterTable *key, spx_uint32_t length)
+{
+   FilterTable *filter;
+   lock_filter_cache();
+   for (filter = filter_cache; filter; filter = filter->next)
+   {
+      if (filter_table_matches(filter, key))
+      {
+         filter->refcount++;
+         unlock_filter_cache();
+         return filter;
+      }
+   }
+   filter = (FilterTable *)speex_alloc(sizeof(FilterTable));
+   if (!filter)
+   {
+      unlock_filter_cache();
+      return NULL;
+   }
+   filter->data = find_precomputed_table(key, length);
+   filter->precomputed = filter->data != NULL;
+   if (!filter->precomputed)
+   {
+      spx_word16_t *table = (spx_word16_t *)speex_alloc(length*sizeof(spx_word16_t));
+      if (!table)
+      {
+         speex_free(filter);
+         unlock_filter_cache();
+         return NULL;
+      }
+      compute_filter_table(key, table);
+      filter->data = table;
+   }
+   filter->use_direct = key->use_direct;
+   filter->den_rate = key->den_rate;
+   filter->filt_len = key->filt_len;
+   filter->oversample = key->oversample;
+   filter->cutoff = key->cutoff;
+   filter->quality = key->quality;
+   filter->refcount = 1;
+   filter->next = filter_cache;
+   filter_cache = filter;
+   unlock_filter_cache();
+   return filter;
+}
+
+static void release_filter_table(FilterTable *filter)
+{
+   FilterTable **link;
+   if (!filter)
+      return;
+   lock_filter_cache();
+   if (--filter->refcount == 0)
+   {
+      for (link = &filter_cache; *link != filter; link = &(*link)->next)
+         ;
+      *link = filter->next;
+      if (!filter->precomputed)
+         speex_free((void *)filter->data);
+      speex_free(filter);
+   }
+   unlock_filter_cache();
+}
+
+EXPORT int speex_resampler_get_filter_table_count(void)
+{
+   FilterTable *filter;
+   int count = 0;
+   lock_filter_cache();
+   for (filter = filter_cache; filter; filter = filter->next)
+      count++;
+   unlock_filter_cache();
+   return count;
+}
+
+EXPORT int speex_resampler_set_precomputed_tables(int enable)
+{
+#if defined(RESAMPLE_PRECOMPUTED_TABLES) && !defined(FIXED_POINT)
+   lock_filter_cache();
+   use_precomputed_tables = enable;
+   unlock_filter_cache();
+#endif
+   return enable ? PRECOMPUTED_FILTER_TABLE_COUNT : 0;
+}
+
+/* Fills the parameters of the table for quality and the current ratio in key,
+   and the length of the table. When the ratio can change, see
+   speex_resampler_set_max_ratio, the table is computed for the highest ratio,
+   that needs the lowest cutoff, and is interpolated so that it doesn't depend
+   on the ratio. Returns 0 if the table would be too large. */
+static int filter_params(const SpeexResamplerState *st, int quality, FilterTable *key, spx_uint32_t *length)
+{
+   spx_uint32_t num_rate = st->num_rate;
+   spx_uint32_t den_rate = st->den_rate;
 
-   if (st->num_rate > st->den_rate)
+   if (st->max_den_rate &&
+       (unsigned long long)st->max_num_rate*st->den_rate >= (unsigned long long)st->num_rate*st->max_den_rate)
+   {
+      num_rate = st->max_num_rate;
+      den_rate = st->max_den_rate;
+   }
+
+   key->quality = quality;
+   key->den_rate = st->den_rate;
+   key->oversample = quality_map[quality].oversample;
+   key->filt_len = quality_map[quality].base_length;
+
+   if (num_rate > den_rate)
    {
       /* down-sampling */
-      st->cutoff = quality_map[st->quality].downsample_bandwidth * st->den_rate / st->num_rate;
-      if (_muldiv(&st->filt_len,st->filt_len,st->num_rate,st->den_rate) != RESAMPLER_ERR_SUCCESS)
-         goto fail;
+      key->cutoff = quality_map[quality].downsample_bandwidth * den_rate / num_rate;
+      if (_muldiv(&key->filt_len,key->filt_len,num_rate,den_rate) != RESAMPLER_ERR_SUCCESS)
+         return 0;
       /* Round up to make sure we have a multiple of 8 for SSE */
-      st->filt_len = ((st->filt_len-1)&(~0x7))+8;
-      if (2*st->den_rate < st->num_rate)
-         st->oversample >>= 1;
-      if (4*st->den_rate < st->num_rate)
-         st->oversample >>= 1;
-      if (8*st->den_rate < st->num_rate)
-         st->oversample >>= 1;
-      if (16*st->den_rate < st->num_rate)
-         st->oversample >>= 1;
-      if (st->oversample < 1)
-         st->oversample = 1;
+      key->filt_len = ((key->filt_len-1)&(~0x7))+8;
+      if (2*den_rate < num_rate)
+         key->oversample >>= 1;
+      if (4*den_rate < num_rate)
+         key->oversample >>= 1;
+      if (8*den_rate < num_rate)
+         key->oversample >>= 1;
+      if (16*den_rate < num_rate)
+         key->oversample >>= 1;
+      if (key->oversample < 1)
+         key->oversample = 1;
    } else {
       /* up-sampling */
-      st->cutoff = quality_map[st->quality].upsample_bandwidth;
+      key->cutoff = quality_map[quality].upsample_bandwidth;
    }
 
    /* Choose the resampling type that requires the least amount of memory */
 #ifdef RESAMPLE_FULL_SINC_TABLE
-   use_direct = 1;
-   if (INT_MAX/sizeof(spx_word16_t)/st->den_rate < st->filt_len)
-      goto fail;
+   key->use_direct = !st->max_den_rate;
+   if (key->use_direct && INT_MAX/sizeof(spx_word16_t)/key->den_rate < key->filt_len)
+      return 0;
 #else
-   use_direct = st->filt_len*st->den_rate <= st->filt_len*st->oversample+8
-                && INT_MAX/sizeof(spx_word16_t)/st->den_rate >= st->filt_len;
+   key->use_direct = !st->max_den_rate
+                     && key->filt_len*key->den_rate <= key->filt_len*key->oversample+8
+                     && INT_MAX/sizeof(spx_word16_t)/key->den_rate >= key->filt_len;
 #endif
-   if (use_direct)
+   if (key->use_direct)
    {
-      min_sinc_table_length = st->filt_len*st->den_rate;
+      *length = key->filt_len*key->den_rate;
    } else {
-      if ((INT_MAX/sizeof(spx_word16_t)-8)/st->oversample < st->filt_len)
-         goto fail;
+      if ((INT_MAX/sizeof(spx_word16_t)-8)/key->oversample < key->filt_len)
+         return 0;
 
-      min_sinc_table_length = st->filt_len*st->oversample+8;
+      *length = key->filt_len*key->oversample+8;
    }
-   if (st->sinc_table_length < min_sinc_table_length)
-   {
-      spx_word16_t *sinc_table = (spx_word16_t *)speex_realloc(st->sinc_table,min_sinc_table_length*sizeof(spx_word16_t));
-      if (!sinc_table)
-         goto fail;
+   return 1;
+}
 
-      st->sinc_table = sinc_table;
-      st->sinc_table_length = min_sinc_table_length;
-   }
-   if (use_direct)
+/* Makes filters[quality] the table for quality and the current ratio. This
+   only goes through the cache when the table held for this quality doesn't
+   fit, so it doesn't lock nor allocate for the tables prepared in advance.
+   Returns 0 on failure. */
+static int prepare_filter(SpeexResamplerState *st, int quality)
+{
+   FilterTable key;
+   spx_uint32_t length;
+   FilterTable *filter = st->filters[quality];
+
+   if (!filter_params(st, quality, &key, &length))
+      return 0;
+   if (filter && filter_table_matches(filter, &key))
+      return 1;
+   filter = acquire_filter_table(&key, length);
+   if (!filter)
+      return 0;
+   /* Release the previous table only now, in case both are the same. */
+   release_filter_table(st->filters[quality]);
+   st->filters[quality] = filter;
+   return 1;
+}
+
+static int update_filter(SpeexResamplerState *st)
+{
+   spx_uint32_t old_length = st->filt_len;
+   spx_uint32_t old_alloc_size = st->mem_alloc_size;
+   spx_uint32_t min_alloc_size;
+   FilterTable *filter;
+   int quality;
+
+   st->int_advance = st->num_rate/st->den_rate;
+   st->frac_advance = st->num_rate%st->den_rate;
+
+   if (!prepare_filter(st, st->quality))
+      goto fail;
+   if (!st->keep_filters)
    {
-      spx_uint32_t i;
-      for (i=0;i<st->den_rate;i++)
+      /* Only hold the table in use. */
+      for (quality=0;quality<=10;quality++)
       {
-         spx_int32_t j;
-         for (j=0;j<st->filt_len;j++)
+         if (quality != st->quality && st->filters[quality])
          {
-            st->sinc_table[i*st->filt_len+j] = sinc(st->cutoff,((j-(spx_int32_t)st->filt_len/2+1)-((float)i)/st->den_rate), st->filt_len, quality_map[st->quality].window_func);
+            release_filter_table(st->filters[quality]);
+            st->filters[quality] = NULL;
          }
       }
+   }
+   filter = st->filters[st->quality];
+   st->filter = filter;
+   st->sinc_table = filter->data;
+   st->filt_len = filter->filt_len;
+   st->oversample = filter->oversample;
+   st->cutoff = filter->cutoff;
+   if (filter->use_direct)
+   {
 #ifdef FIXED_POINT
       st->resampler_ptr = resampler_basic_direct_single;
 #else
@@ -686,9 +1023,6 @@ static int update_filter(SpeexResamplerState *st)
 #endif
       /*fprintf (stderr, "resampler uses direct sinc table and normalised cutoff %f\n", cutoff);*/
    } else {
-      spx_int32_t i;
-      for (i=-4;i<(spx_int32_t)(st->oversample*st->filt_len+4);i++)
-         st->sinc_table[i+4] = sinc(st->cutoff,(i/(float)st->oversample - st->filt_len/2), st->filt_len, quality_map[st->quality].window_func);
 #ifdef FIXED_POINT
       st->resampler_ptr = resampler_basic_interpolate_single;
 #else
@@ -718,6 +1052,13 @@ static int update_filter(SpeexResamplerState *st)
       st->mem = mem;
       st->mem_alloc_size = min_alloc_size;
    }
+#ifdef _USE_SIMD_DISPATCH
+   if (st->interpolate_product_frames_ptr && !alloc_frames(st))
+   {
+      /* Not worth failing for: go back to processing channels one by one. */
+      st->interpolate_product_frames_ptr = NULL;
+   }
+#endif
    if (!st->started)
    {
       spx_uint32_t i;
@@ -791,6 +1132,58 @@ fail:
    return RESAMPLER_ERR_ALLOC_FAILED;
 }
 
+#ifdef _USE_SIMD_DISPATCH
+/* Resamplers can be created on several threads at once: the CPU is probed
+   once, and the level set for testing is read and written atomically. */
+static int cpu_level;
+#if defined(_WIN32)
+static volatile LONG max_level = SPEEX_RESAMPLER_SIMD_AVX2_FMA;
+static INIT_ONCE cpu_level_once = INIT_ONCE_STATIC_INIT;
+static BOOL CALLBACK probe_cpu_level(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+   (void)once;
+   (void)param;
+   (void)context;
+   cpu_level = cpu_simd_level();
+   return TRUE;
+}
+#define init_cpu_level() InitOnceExecuteOnce(&cpu_level_once, probe_cpu_level, NULL, NULL)
+#define load_max_level() ((int)InterlockedCompareExchange(&max_level, 0, 0))
+#define store_max_level(level) InterlockedExchange(&max_level, (level))
+#else
+static int max_level = SPEEX_RESAMPLER_SIMD_AVX2_FMA;
+static pthread_once_t cpu_level_once = PTHREAD_ONCE_INIT;
+static void probe_cpu_level(void)
+{
+   cpu_level = cpu_simd_level();
+}
+#define init_cpu_level() pthread_once(&cpu_level_once, probe_cpu_level)
+#define load_max_level() __atomic_load_n(&max_level, __ATOMIC_RELAXED)
+#define store_max_level(level) __atomic_store_n(&max_level, (level), __ATOMIC_RELAXED)
+#endif
+#endif
+
+EXPORT int speex_resampler_get_simd_level(void)
+{
+#ifdef _USE_SIMD_DISPATCH
+   int level = load_max_level();
+   init_cpu_level();
+   if (cpu_level < level)
+      level = cpu_level;
+   return usable_simd_level(level);
+#else
+   return SPEEX_RESAMPLER_SIMD_NONE;
+#endif
+}
+
+EXPORT int speex_resampler_set_simd_level(int level)
+{
+#ifdef _USE_SIMD_DISPATCH
+   store_max_level(level);
+#endif
+   return speex_resampler_get_simd_level();
+}
+
 EXPORT SpeexResamplerState *speex_resampler_init(spx_uint32_t nb_channels, spx_uint32_t in_rate, spx_uint32_t out_rate, int quality, int *err)
 {
    return speex_resampler_init_frac(nb_channels, in_rate, out_rate, in_rate, out_rate, quality, err);
@@ -800,6 +1193,7 @@ EXPORT SpeexResamplerState *speex_resampler_init_frac(spx_uint32_t nb_channels,
 {
    SpeexResamplerState *st;
    int filter_err;
+   int i;
 
    if (nb_channels == 0 || ratio_num == 0 || ratio_den == 0 || quality > 10 || quality < 0)
    {
@@ -821,7 +1215,13 @@ EXPORT SpeexResamplerState *speex_resampler_init_frac(spx_uint32_t nb_channels,
    st->num_rate = 0;
    st->den_rate = 0;
    st->quality = -1;
-   st->sinc_table_length = 0;
+   st->sinc_table = NULL;
+   st->filter = NULL;
+   for (i=0;i<11;i++)
+      st->filters[i] = NULL;
+   st->keep_filters = 0;
+   st->max_num_rate = 0;
+   st->max_den_rate = 0;
    st->mem_alloc_size = 0;
    st->filt_len = 0;
    st->mem = 0;
@@ -834,6 +1234,15 @@ EXPORT SpeexResamplerState *speex_resampler_init_frac(spx_uint32_t nb_channels,
 
    st->buffer_size = 160;
 
+#ifdef _USE_SIMD_DISPATCH
+   select_simd_kernels(speex_resampler_get_simd_level(),
+                       &st->inner_product_single_ptr,
+                       &st->interpolate_product_single_ptr);
+   st->interpolate_product_frames_ptr = NULL;
+   st->frames = NULL;
+   st->frames_alloc_size = 0;
+#endif
+
    /* Per channel data */
    if (!(st->last_sample = (spx_int32_t*)speex_alloc(nb_channels*sizeof(spx_int32_t))))
       goto fail;
@@ -867,8 +1276,13 @@ fail:
 
 EXPORT void speex_resampler_destroy(SpeexResamplerState *st)
 {
+   int i;
    speex_free(st->mem);
-   speex_free(st->sinc_table);
+#ifdef _USE_SIMD_DISPATCH
+   speex_free(st->frames);
+#endif
+   for (i=0;i<11;i++)
+      release_filter_table(st->filters[i]);
    speex_free(st->last_sample);
    speex_free(st->magic_samples);
    speex_free(st->samp_frac_num);
@@ -1036,12 +1450,100 @@ EXPORT int speex_resampler_process_int(SpeexResamplerState *st, spx_uint32_t cha
    return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
 }
 
+#ifdef _USE_SIMD_DISPATCH
+/* The multichannel kernels can take over when all the channels are in the
+   same place, which is always the case unless some were processed on their
+   own, and when there are no "magic" samples left from a filter change. They
+   are only used with the interpolated filter. */
+static int can_process_frames(SpeexResamplerState *st)
+{
+   spx_uint32_t i;
+   if (!st->interpolate_product_frames_ptr || st->magic_samples[0] ||
+       st->resampler_ptr != resampler_basic_interpolate_single)
+      return 0;
+   for (i=1;i<st->nb_channels;i++)
+   {
+      if (st->last_sample[i] != st->last_sample[0] ||
+          st->samp_frac_num[i] != st->samp_frac_num[0] ||
+          st->magic_samples[i])
+         return 0;
+   }
+   return 1;
+}
+
+/* Same as running speex_resampler_process_float on each channel. The filter
+   memory is interleaved into st->frames for the duration of the call, so the
+   state stays usable by the functions that process one channel. */
+static void speex_resampler_process_frames(SpeexResamplerState *st, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
+{
+   spx_uint32_t i, j;
+   spx_uint32_t ilen = *in_len;
+   spx_uint32_t olen = *out_len;
+   spx_word16_t *x = st->frames;
+   const spx_uint32_t channels = st->nb_channels;
+   const spx_uint32_t filt_offs = st->filt_len - 1;
+   const spx_uint32_t xlen = st->mem_alloc_size - filt_offs;
+
+   if (!ilen || !olen)
+      return;
+
+   for (i=0;i<channels;i++)
+      for (j=0;j<filt_offs;j++)
+         x[j*channels+i] = st->mem[i*st->mem_alloc_size+j];
+
+   st->started = 1;
+   while (ilen && olen) {
+      spx_uint32_t ichunk = (ilen > xlen) ? xlen : ilen;
+      spx_uint32_t ochunk = olen;
+
+      if (in) {
+         for(j=0;j<ichunk*channels;++j)
+            x[filt_offs*channels+j]=in[j];
+      } else {
+         for(j=0;j<ichunk*channels;++j)
+            x[filt_offs*channels+j]=0;
+      }
+      ochunk = resampler_frames_interpolate_single(st, x, &ichunk, out, &ochunk);
+
+      if (st->last_sample[0] < (spx_int32_t)ichunk)
+         ichunk = st->last_sample[0];
+      st->last_sample[0] -= ichunk;
+      for(j=0;j<filt_offs*channels;++j)
+         x[j] = x[j+ichunk*channels];
+
+      ilen -= ichunk;
+      olen -= ochunk;
+      out += ochunk * channels;
+      if (in)
+         in += ichunk * channels;
+   }
+
+   for (i=0;i<channels;i++)
+   {
+      for (j=0;j<filt_offs;j++)
+         st->mem[i*st->mem_alloc_size+j] = x[j*channels+i];
+      st->last_sample[i] = st->last_sample[0];
+      st->samp_frac_num[i] = st->samp_frac_num[0];
+   }
+   *in_len -= ilen;
+   *out_len -= olen;
+}
+#endif
+
 EXPORT int speex_resampler_process_interleaved_float(SpeexResamplerState *st, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
 {
    spx_uint32_t i;
    int istride_save, ostride_save;
    spx_uint32_t bak_out_len = *out_len;
    spx_uint32_t bak_in_len = *in_len;
+
+#ifdef _USE_SIMD_DISPATCH
+   if (can_process_frames(st))
+   {
+      speex_resampler_process_frames(st, in, in_len, out, out_len);
+      return RESAMPLER_ERR_SUCCESS;
+   }
+#endif
    istride_save = st->in_stride;
    ostride_save = st->out_stride;
    st->in_stride = st->out_stride = st->nb_channels;
@@ -1082,6 +1584,27 @@ EXPORT int speex_resampler_process_interleaved_int(SpeexResamplerState *st, cons
    return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
 }
 
+EXPORT int speex_resampler_set_multichannel(SpeexResamplerState *st, int enable)
+{
+#ifdef _USE_SIMD_DISPATCH
+   interpolate_product_frames_func interpolate;
+   if (!enable)
+   {
+      st->interpolate_product_frames_ptr = NULL;
+      return RESAMPLER_ERR_SUCCESS;
+   }
+   if (!select_frame_kernels(speex_resampler_get_simd_level(), st->nb_channels,
+                             &interpolate))
+      return RESAMPLER_ERR_INVALID_ARG;
+   if (!alloc_frames(st))
+      return RESAMPLER_ERR_ALLOC_FAILED;
+   st->interpolate_product_frames_ptr = interpolate;
+   return RESAMPLER_ERR_SUCCESS;
+#else
+   return enable ? RESAMPLER_ERR_INVALID_ARG : RESAMPLER_ERR_SUCCESS;
+#endif
+}
+
 EXPORT int speex_resampler_set_rate(SpeexResamplerState *st, spx_uint32_t in_rate, spx_uint32_t out_rate)
 {
    return speex_resampler_set_rate_frac(st, in_rate, out_rate, in_rate, out_rate);
@@ -1168,6 +1691,43 @@ EXPORT void speex_resampler_get_quality(SpeexResamplerState *st, int *quality)
    *quality = st->quality;
 }
 
+EXPORT int speex_resampler_set_max_ratio(SpeexResamplerState *st, spx_uint32_t ratio_num, spx_uint32_t ratio_den)
+{
+   int quality;
+
+   if (ratio_num == 0 || ratio_den == 0)
+      return RESAMPLER_ERR_INVALID_ARG;
+   st->max_num_rate = ratio_num;
+   st->max_den_rate = ratio_den;
+   /* The tables prepared for the other qualities were for the previous
+      ratio. */
+   for (quality=0;quality<=10;quality++)
+   {
+      if (quality != st->quality && st->filters[quality] && !prepare_filter(st, quality))
+         return RESAMPLER_ERR_ALLOC_FAILED;
+   }
+   if (st->initialised)
+      return update_filter(st);
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+EXPORT int speex_resampler_prepare_qualities(SpeexResamplerState *st, int min_quality)
+{
+   int quality;
+
+   if (min_quality < 0 || min_quality > st->quality)
+      return RESAMPLER_ERR_INVALID_ARG;
+   st->keep_filters = 1;
+   /* The filter memory is already large enough: lower qualities have shorter
+      filters. */
+   for (quality=min_quality;quality<st->quality;quality++)
+   {
+      if (!prepare_filter(st, quality))
+         return RESAMPLER_ERR_ALLOC_FAILED;
+   }
+   return RESAMPLER_ERR_SUCCESS;
+}
+
 EXPORT void speex_resampler_set_input_stride(SpeexResamplerState *st, spx_uint32_t stride)
 {
    st->in_stride = stride;
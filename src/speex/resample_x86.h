@@ -0,0 +1,416 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+/**
+   @file resample_x86.h
+   @brief Resampler functions for x86, selected at runtime (SSE2, AVX2 and
+   AVX2 + FMA versions).
+
+   Unlike resample_sse.h, this does not require the whole library to be built
+   for a particular instruction set. Each resampler state picks the best
+   kernels supported by the CPU it runs on when it is created.
+*/
+
+#include <immintrin.h>
+#include "cubeb_cpu.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPEEX_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SPEEX_TARGET(isa)
+#endif
+
+/* GCC only allows using intrinsics in functions that have the right target
+   attribute since GCC 4.9. */
+#if defined(__GNUC__) && !defined(__clang__) && \
+    (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 9))
+#define SPEEX_NO_AVX2_DISPATCH
+#endif
+
+typedef float (*inner_product_single_func)(const float *a, const float *b, unsigned int len);
+typedef float (*interpolate_product_single_func)(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac);
+
+/* The resampling loops call those through the pointers stored in the state of
+   the resampler, selected by select_simd_kernels. */
+#define OVERRIDE_INNER_PRODUCT_SINGLE
+#define inner_product_single(a, b, len) \
+   (st->inner_product_single_ptr((a), (b), (len)))
+#define OVERRIDE_INTERPOLATE_PRODUCT_SINGLE
+#define interpolate_product_single(a, b, len, oversample, frac) \
+   (st->interpolate_product_single_ptr((a), (b), (len), (oversample), (frac)))
+
+/* Same as the generic code, for CPUs without SSE2. */
+static float inner_product_single_c(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i;
+   float sum = 0;
+   for (i=0;i<len;i++)
+      sum += a[i]*b[i];
+   return sum;
+}
+
+static float interpolate_product_single_c(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac)
+{
+   unsigned int i;
+   float accum[4] = {0,0,0,0};
+   for (i=0;i<len;i++)
+   {
+      const float curr_in = a[i];
+      accum[0] += curr_in*b[i*oversample];
+      accum[1] += curr_in*b[i*oversample+1];
+      accum[2] += curr_in*b[i*oversample+2];
+      accum[3] += curr_in*b[i*oversample+3];
+   }
+   return frac[0]*accum[0] + frac[1]*accum[1] + frac[2]*accum[2] + frac[3]*accum[3];
+}
+
+SPEEX_TARGET("sse2")
+static inline float horizontal_sum_sse2(__m128 sum)
+{
+   float ret;
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   _mm_store_ss(&ret, sum);
+   return ret;
+}
+
+SPEEX_TARGET("sse2")
+static float inner_product_single_sse2(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i;
+   __m128 sum = _mm_setzero_ps();
+   for (i=0;i<len;i+=8)
+   {
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+   }
+   return horizontal_sum_sse2(sum);
+}
+
+SPEEX_TARGET("sse2")
+static float interpolate_product_single_sse2(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac)
+{
+   unsigned int i;
+   __m128 sum = _mm_setzero_ps();
+   for (i=0;i<len;i+=2)
+   {
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_load1_ps(a+i), _mm_loadu_ps(b+i*oversample)));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_load1_ps(a+i+1), _mm_loadu_ps(b+(i+1)*oversample)));
+   }
+   return horizontal_sum_sse2(_mm_mul_ps(_mm_loadu_ps(frac), sum));
+}
+
+#ifndef SPEEX_NO_AVX2_DISPATCH
+SPEEX_TARGET("avx2")
+static inline float horizontal_sum_avx2(__m256 sum)
+{
+   return horizontal_sum_sse2(_mm_add_ps(_mm256_castps256_ps128(sum),
+                                         _mm256_extractf128_ps(sum, 1)));
+}
+
+/* Two taps of the interpolated table, each made of four consecutive
+   coefficients, in the low and high lanes of a register. */
+SPEEX_TARGET("avx2")
+static inline __m256 load_two_taps_avx2(const float *b, unsigned int i, const spx_uint32_t oversample)
+{
+   return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(b+i*oversample)),
+                               _mm_loadu_ps(b+(i+1)*oversample), 1);
+}
+
+SPEEX_TARGET("avx2")
+static inline __m256 broadcast_two_samples_avx2(const float *a, unsigned int i)
+{
+   return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(a[i])),
+                               _mm_set1_ps(a[i+1]), 1);
+}
+
+/* The filter length is always a multiple of 8. */
+SPEEX_TARGET("avx2")
+static float inner_product_single_avx2(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i = 0;
+   __m256 sum0 = _mm256_setzero_ps();
+   __m256 sum1 = _mm256_setzero_ps();
+   for (;i+16<=len;i+=16)
+   {
+      sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+      sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8)));
+   }
+   if (i<len)
+      sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+   return horizontal_sum_avx2(_mm256_add_ps(sum0, sum1));
+}
+
+SPEEX_TARGET("avx2")
+static float interpolate_product_single_avx2(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac)
+{
+   unsigned int i;
+   __m256 sum = _mm256_setzero_ps();
+   __m128 halves;
+   for (i=0;i<len;i+=2)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(broadcast_two_samples_avx2(a, i),
+                                             load_two_taps_avx2(b, i, oversample)));
+   halves = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+   return horizontal_sum_sse2(_mm_mul_ps(_mm_loadu_ps(frac), halves));
+}
+
+SPEEX_TARGET("avx2,fma")
+static float inner_product_single_fma(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i = 0;
+   __m256 sum0 = _mm256_setzero_ps();
+   __m256 sum1 = _mm256_setzero_ps();
+   for (;i+16<=len;i+=16)
+   {
+      sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum0);
+      sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8), sum1);
+   }
+   if (i<len)
+      sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum0);
+   return horizontal_sum_avx2(_mm256_add_ps(sum0, sum1));
+}
+
+SPEEX_TARGET("avx2,fma")
+static float interpolate_product_single_fma(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac)
+{
+   unsigned int i;
+   __m256 sum = _mm256_setzero_ps();
+   __m128 halves;
+   for (i=0;i<len;i+=2)
+      sum = _mm256_fmadd_ps(broadcast_two_samples_avx2(a, i),
+                            load_two_taps_avx2(b, i, oversample), sum);
+   halves = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+   return horizontal_sum_sse2(_mm_mul_ps(_mm_loadu_ps(frac), halves));
+}
+#endif /* SPEEX_NO_AVX2_DISPATCH */
+
+/* Multichannel kernels, used by speex_resampler_process_interleaved_float
+   once enabled with speex_resampler_set_multichannel. `a` points to
+   interleaved frames, and each tap of the filter is applied to all the
+   channels of a frame at once, one channel per SIMD lane. They write one
+   output frame to `out`.
+
+   This only pays off with the interpolated filter, where the four products of
+   each tap per channel are replaced by one interpolation of the taps shared by
+   all the channels. With the direct filter, the per-channel AVX2 products
+   already fill whole registers and are at least as fast.
+
+   Frames of 2 and 6 channels don't fill a whole number of registers, so
+   those consume two taps per register (or per three registers). The sums are
+   kept in up to four registers, which are folded into a frame at the end. */
+typedef void (*interpolate_product_frames_func)(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac, float *out);
+
+/* Number of taps interpolated at a time on the stack. */
+#define FRAME_KERNEL_TAPS 64
+
+/* [b[0], b[0], b[1], b[1]] */
+SPEEX_TARGET("sse2")
+static inline __m128 load_tap_pair_sse2(const float *b)
+{
+   __m128 taps = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)b);
+   return _mm_unpacklo_ps(taps, taps);
+}
+
+SPEEX_TARGET("sse2")
+static inline void accumulate_frames2_sse2(const float *a, const float *b, unsigned int len, __m128 *sum)
+{
+   unsigned int i;
+   for (i=0;i<len;i+=4)
+   {
+      sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(_mm_loadu_ps(a+2*i), load_tap_pair_sse2(b+i)));
+      sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(_mm_loadu_ps(a+2*i+4), load_tap_pair_sse2(b+i+2)));
+   }
+}
+
+SPEEX_TARGET("sse2")
+static inline void store_frames2_sse2(const __m128 *sum, float *out)
+{
+   __m128 frame = _mm_add_ps(sum[0], sum[1]);
+   frame = _mm_add_ps(frame, _mm_movehl_ps(frame, frame));
+   _mm_storel_pi((__m64 *)out, frame);
+}
+
+SPEEX_TARGET("sse2")
+static inline void accumulate_frames4_sse2(const float *a, const float *b, unsigned int len, __m128 *sum)
+{
+   unsigned int i;
+   for (i=0;i<len;i+=2)
+   {
+      sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(_mm_loadu_ps(a+4*i), _mm_set1_ps(b[i])));
+      sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(_mm_loadu_ps(a+4*i+4), _mm_set1_ps(b[i+1])));
+   }
+}
+
+SPEEX_TARGET("sse2")
+static inline void store_frames4_sse2(const __m128 *sum, float *out)
+{
+   _mm_storeu_ps(out, _mm_add_ps(sum[0], sum[1]));
+}
+
+/* Two frames are [c0 c1 c2 c3] [c4 c5 d0 d1] [d2 d3 d4 d5]. */
+SPEEX_TARGET("sse2")
+static inline void accumulate_frames6_sse2(const float *a, const float *b, unsigned int len, __m128 *sum)
+{
+   unsigned int i;
+   for (i=0;i<len;i+=2)
+   {
+      const __m128 taps = load_tap_pair_sse2(b+i);
+      sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(_mm_loadu_ps(a+6*i), _mm_shuffle_ps(taps, taps, 0x00)));
+      sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(_mm_loadu_ps(a+6*i+4), taps));
+      sum[2] = _mm_add_ps(sum[2], _mm_mul_ps(_mm_loadu_ps(a+6*i+8), _mm_shuffle_ps(taps, taps, 0xff)));
+   }
+}
+
+SPEEX_TARGET("sse2")
+static inline void store_frames6_sse2(const __m128 *sum, float *out)
+{
+   _mm_storeu_ps(out, _mm_add_ps(sum[0], _mm_shuffle_ps(sum[1], sum[2], _MM_SHUFFLE(1, 0, 3, 2))));
+   _mm_storel_pi((__m64 *)(out+4), _mm_add_ps(sum[1], _mm_movehl_ps(sum[2], sum[2])));
+}
+
+SPEEX_TARGET("sse2")
+static inline void accumulate_frames8_sse2(const float *a, const float *b, unsigned int len, __m128 *sum)
+{
+   unsigned int i;
+   for (i=0;i<len;i+=2)
+   {
+      const __m128 tap0 = _mm_set1_ps(b[i]);
+      const __m128 tap1 = _mm_set1_ps(b[i+1]);
+      sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(_mm_loadu_ps(a+8*i), tap0));
+      sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(_mm_loadu_ps(a+8*i+4), tap0));
+      sum[2] = _mm_add_ps(sum[2], _mm_mul_ps(_mm_loadu_ps(a+8*i+8), tap1));
+      sum[3] = _mm_add_ps(sum[3], _mm_mul_ps(_mm_loadu_ps(a+8*i+12), tap1));
+   }
+}
+
+SPEEX_TARGET("sse2")
+static inline void store_frames8_sse2(const __m128 *sum, float *out)
+{
+   _mm_storeu_ps(out, _mm_add_ps(sum[0], sum[2]));
+   _mm_storeu_ps(out+4, _mm_add_ps(sum[1], sum[3]));
+}
+
+/* Interpolate `len` taps of the oversampled table in one go, four at a time:
+   the same as what interpolate_product_single does to the sums, since it is
+   linear. */
+SPEEX_TARGET("sse2")
+static inline void interpolate_taps_sse2(const float *b, unsigned int len, const spx_uint32_t oversample, const float *frac, float *taps)
+{
+   unsigned int i;
+   const __m128 frac0 = _mm_set1_ps(frac[0]);
+   const __m128 frac1 = _mm_set1_ps(frac[1]);
+   const __m128 frac2 = _mm_set1_ps(frac[2]);
+   const __m128 frac3 = _mm_set1_ps(frac[3]);
+   for (i=0;i<len;i+=4)
+   {
+      __m128 row0 = _mm_loadu_ps(b+i*oversample);
+      __m128 row1 = _mm_loadu_ps(b+(i+1)*oversample);
+      __m128 row2 = _mm_loadu_ps(b+(i+2)*oversample);
+      __m128 row3 = _mm_loadu_ps(b+(i+3)*oversample);
+      _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+      _mm_storeu_ps(taps+i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(frac0, row0), _mm_mul_ps(frac1, row1)),
+                                       _mm_add_ps(_mm_mul_ps(frac2, row2), _mm_mul_ps(frac3, row3))));
+   }
+}
+
+#define DEFINE_FRAME_KERNELS_SSE2(channels) \
+SPEEX_TARGET("sse2") \
+static void interpolate_product_frames##channels##_sse2(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac, float *out) \
+{ \
+   unsigned int i; \
+   float taps[FRAME_KERNEL_TAPS]; \
+   __m128 sum[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() }; \
+   for (i=0;i<len;i+=FRAME_KERNEL_TAPS) \
+   { \
+      const unsigned int count = len-i < FRAME_KERNEL_TAPS ? len-i : FRAME_KERNEL_TAPS; \
+      interpolate_taps_sse2(b+i*oversample, count, oversample, frac, taps); \
+      accumulate_frames##channels##_sse2(a+i*channels, taps, count, sum); \
+   } \
+   store_frames##channels##_sse2(sum, out); \
+}
+
+DEFINE_FRAME_KERNELS_SSE2(2)
+DEFINE_FRAME_KERNELS_SSE2(4)
+DEFINE_FRAME_KERNELS_SSE2(6)
+DEFINE_FRAME_KERNELS_SSE2(8)
+
+/* Returns the best SPEEX_RESAMPLER_SIMD_* level supported by this CPU and
+   operating system. */
+static int cpu_simd_level(void)
+{
+   int features = cubeb_cpu_x86_features();
+   if ((features & CUBEB_CPU_AVX2) && (features & CUBEB_CPU_FMA))
+      return SPEEX_RESAMPLER_SIMD_AVX2_FMA;
+   if (features & CUBEB_CPU_AVX2)
+      return SPEEX_RESAMPLER_SIMD_AVX2;
+   if (features & CUBEB_CPU_SSE2)
+      return SPEEX_RESAMPLER_SIMD_SSE2;
+   return SPEEX_RESAMPLER_SIMD_NONE;
+}
+
+/* Clamp a SPEEX_RESAMPLER_SIMD_* level to what this build can dispatch to. */
+static int usable_simd_level(int level)
+{
+#ifdef SPEEX_NO_AVX2_DISPATCH
+   if (level > SPEEX_RESAMPLER_SIMD_SSE2)
+      level = SPEEX_RESAMPLER_SIMD_SSE2;
+#endif
+   if (level > SPEEX_RESAMPLER_SIMD_AVX2_FMA)
+      level = SPEEX_RESAMPLER_SIMD_AVX2_FMA;
+   if (level < SPEEX_RESAMPLER_SIMD_NONE)
+      level = SPEEX_RESAMPLER_SIMD_NONE;
+   return level;
+}
+
+static void select_simd_kernels(int level, inner_product_single_func *inner, interpolate_product_single_func *interpolate)
+{
+   switch (usable_simd_level(level))
+   {
+#ifndef SPEEX_NO_AVX2_DISPATCH
+      case SPEEX_RESAMPLER_SIMD_AVX2_FMA:
+         *inner = inner_product_single_fma;
+         *interpolate = interpolate_product_single_fma;
+         break;
+      case SPEEX_RESAMPLER_SIMD_AVX2:
+         *inner = inner_product_single_avx2;
+         *interpolate = interpolate_product_single_avx2;
+         break;
+#endif
+      case SPEEX_RESAMPLER_SIMD_SSE2:
+         *inner = inner_product_single_sse2;
+         *interpolate = interpolate_product_single_sse2;
+         break;
+      default:
+         *inner = inner_product_single_c;
+         *interpolate = interpolate_product_single_c;
+         break;
+   }
+}
+
+/* Returns 0 if there are no multichannel kernels for this number of channels
+   at this level. */
+static int select_frame_kernels(int level, spx_uint32_t channels, interpolate_product_frames_func *interpolate)
+{
+   if (usable_simd_level(level) < SPEEX_RESAMPLER_SIMD_SSE2)
+      return 0;
+   switch (channels)
+   {
+      case 2:
+         *interpolate = interpolate_product_frames2_sse2;
+         return 1;
+      case 4:
+         *interpolate = interpolate_product_frames4_sse2;
+         return 1;
+      case 6:
+         *interpolate = interpolate_product_frames6_sse2;
+         return 1;
+      case 8:
+         *interpolate = interpolate_product_frames8_sse2;
+         return 1;
+      default:
+         return 0;
+   }
+}
@@ -76,6 +76,13 @@
 #define speex_resampler_skip_zeros CAT_PREFIX(RANDOM_PREFIX,_resampler_skip_zeros)
 #define speex_resampler_reset_mem CAT_PREFIX(RANDOM_PREFIX,_resampler_reset_mem)
 #define speex_resampler_strerror CAT_PREFIX(RANDOM_PREFIX,_resampler_strerror)
+#define speex_resampler_get_simd_level CAT_PREFIX(RANDOM_PREFIX,_resampler_get_simd_level)
+#define speex_resampler_set_simd_level CAT_PREFIX(RANDOM_PREFIX,_resampler_set_simd_level)
+#define speex_resampler_set_multichannel CAT_PREFIX(RANDOM_PREFIX,_resampler_set_multichannel)
+#define speex_resampler_get_filter_table_count CAT_PREFIX(RANDOM_PREFIX,_resampler_get_filter_table_count)
+#define speex_resampler_set_precomputed_tables CAT_PREFIX(RANDOM_PREFIX,_resampler_set_precomputed_tables)
+#define speex_resampler_set_max_ratio CAT_PREFIX(RANDOM_PREFIX,_resampler_set_max_ratio)
+#define speex_resampler_prepare_qualities CAT_PREFIX(RANDOM_PREFIX,_resampler_prepare_qualities)
 
 #define spx_int16_t short
 #define spx_int32_t int
@@ -238,7 +245,9 @@ void speex_resampler_get_rate(SpeexResamplerState *st,
                               spx_uint32_t *out_rate);
 
 /** Set (change) the input/output sampling rates and resampling ratio
- * (fractional values in Hz supported).
+ * (fractional values in Hz supported). This can lock and allocate to get the
+ * new filter, unless the ratio stays under the one set with
+ * speex_resampler_set_max_ratio.
  * @param st Resampler state
  * @param ratio_num Numerator of the sampling rate ratio
  * @param ratio_den Denominator of the sampling rate ratio
@@ -261,7 +270,9 @@ void speex_resampler_get_ratio(SpeexResamplerState *st,
                                spx_uint32_t *ratio_num,
                                spx_uint32_t *ratio_den);
 
-/** Set (change) the conversion quality.
+/** Set (change) the conversion quality. This can lock and allocate to get
+ * the new filter, unless it has been prepared with
+ * speex_resampler_prepare_qualities.
  * @param st Resampler state
  * @param quality Resampling quality between 0 and 10, where 0 has poor
  * quality and 10 has very high quality.
@@ -336,6 +347,85 @@ int speex_resampler_reset_mem(SpeexResamplerState *st);
  */
 const char *speex_resampler_strerror(int err);
 
+/* Instruction sets that can be selected at runtime, on x86 builds where
+   _USE_SIMD_DISPATCH is defined. */
+enum {
+   SPEEX_RESAMPLER_SIMD_NONE     = 0,
+   SPEEX_RESAMPLER_SIMD_SSE2     = 1,
+   SPEEX_RESAMPLER_SIMD_AVX2     = 2,
+   SPEEX_RESAMPLER_SIMD_AVX2_FMA = 3
+};
+
+/** Returns the instruction set used by the resamplers created from now on,
+ * as one of the SPEEX_RESAMPLER_SIMD_* values. This is the best one supported
+ * by the CPU, unless it has been limited with speex_resampler_set_simd_level.
+ */
+int speex_resampler_get_simd_level(void);
+
+/** Limit the instruction set used by the resamplers created from now on. This
+ * is meant for testing and benchmarking. Resamplers being created on other
+ * threads at the same time may or may not see the new limit.
+ * @param level One of the SPEEX_RESAMPLER_SIMD_* values
+ * @return The level that will actually be used, which can be lower than
+ * `level` if the CPU does not support it.
+ */
+int speex_resampler_set_simd_level(int level);
+
+/** Process all the channels of interleaved float frames together in
+ * speex_resampler_process_interleaved_float, applying each filter tap to a
+ * whole frame with SIMD instructions, rather than one channel at a time. The
+ * output is the same, up to rounding. This is used when the ratio needs an
+ * interpolated filter, the others being faster one channel at a time. Only
+ * available for 2, 4, 6 and 8 channels, on x86 builds where
+ * _USE_SIMD_DISPATCH is defined.
+ * @param st Resampler state
+ * @param enable Non-zero to use the multichannel kernels, zero to stop
+ * @return RESAMPLER_ERR_INVALID_ARG if there are no kernels for this number
+ * of channels or CPU.
+ */
+int speex_resampler_set_multichannel(SpeexResamplerState *st, int enable);
+
+/** Returns the number of distinct filter tables currently in use. Resamplers
+ * with the same ratio and quality share a single table.
+ */
+int speex_resampler_get_filter_table_count(void);
+
+/** Enable or disable the filter tables generated at build time for the most
+ * common ratios and qualities, when the resampler was built with
+ * RESAMPLE_PRECOMPUTED_TABLES. They are enabled by default. Disabling them
+ * only affects the tables computed from then on.
+ * @param enable Non-zero to use the precomputed tables, zero to always
+ * compute the tables when creating a resampler.
+ * @return The number of precomputed tables in use.
+ */
+int speex_resampler_set_precomputed_tables(int enable);
+
+/** Let the ratio change, with speex_resampler_set_rate_frac, up to
+ * ratio_num / ratio_den without computing a new filter. The filter is
+ * computed for that ratio, with an interpolated table that works for any
+ * ratio, so that a lower one doesn't need another table. Changing the ratio
+ * up to that then doesn't lock or allocate, and can be done while processing
+ * audio in real time. This is meant to be called right after creating the
+ * resampler.
+ * @param st Resampler state
+ * @param ratio_num Numerator of the highest ratio
+ * @param ratio_den Denominator of the highest ratio
+ */
+int speex_resampler_set_max_ratio(SpeexResamplerState *st,
+                                  spx_uint32_t ratio_num,
+                                  spx_uint32_t ratio_den);
+
+/** Get the filters of the qualities from min_quality to the current one
+ * ready, so that speex_resampler_set_quality can switch between them without
+ * locking or allocating, while processing audio in real time. Qualities above
+ * the current one still go through the shared table cache.
+ * @param st Resampler state
+ * @param min_quality The lowest quality to prepare, up to the current one
+ * @return RESAMPLER_ERR_INVALID_ARG if min_quality is out of range.
+ */
+int speex_resampler_prepare_qualities(SpeexResamplerState *st,
+                                      int min_quality);
+
 #ifdef __cplusplus
 }
 #endif
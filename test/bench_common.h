@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* The command line and the JSON output shared by the benchmarks:
+ *
+ *   bench_<name> [-o results.json] [-d seconds] [--quick]
+ *
+ * where `--quick` is only accepted by the benchmarks that have a shorter
+ * run. The results are written on the standard output, or in the file passed
+ * with `-o`, as a JSON object whose members are values or arrays of
+ * objects. */
+#if !defined(BENCH_COMMON)
+#define BENCH_COMMON
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class bench_harness {
+public:
+  /* `seconds` is the time spent measuring each case when `-d` isn't
+     passed. */
+  bench_harness(double seconds, bool accepts_quick)
+    : seconds(seconds)
+    , quick(false)
+    , out(stdout)
+    , accepts_quick(accepts_quick)
+    , first_member(true)
+    , first_element(true)
+  {
+  }
+
+  ~bench_harness()
+  {
+    if (out != stdout) {
+      fclose(out);
+    }
+  }
+
+  /* Parses the command line and opens the output. Returns false, after
+     printing why, if the benchmark can't run. */
+  bool init(int argc, char * argv[])
+  {
+    const char * output_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+      if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+        output_path = argv[++i];
+      } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+        seconds = atof(argv[++i]);
+      } else if (accepts_quick && !strcmp(argv[i], "--quick")) {
+        quick = true;
+      } else {
+        usage(argv[0]);
+        return false;
+      }
+    }
+    if (seconds <= 0) {
+      usage(argv[0]);
+      return false;
+    }
+    if (output_path) {
+      out = fopen(output_path, "w");
+      if (!out) {
+        out = stdout;
+        fprintf(stderr, "Could not open %s\n", output_path);
+        return false;
+      }
+    }
+    fprintf(out, "{");
+    return true;
+  }
+
+  /* Writes a member whose value is formatted with `format`. */
+  void value(const char * name, const char * format, ...)
+  {
+    member(name);
+    va_list args;
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+  }
+
+  /* Starts a member that is an array of objects. */
+  void begin_array(const char * name)
+  {
+    member(name);
+    fprintf(out, "[");
+    first_element = true;
+  }
+
+  /* Starts an element of the current array, and returns where to write
+     it. */
+  FILE * element()
+  {
+    fprintf(out, "%s\n    ", first_element ? "" : ",");
+    first_element = false;
+    return out;
+  }
+
+  void end_array()
+  {
+    fprintf(out, "\n  ]");
+  }
+
+  /* Closes the JSON object. */
+  void finish()
+  {
+    fprintf(out, "\n}\n");
+  }
+
+  double seconds;
+  bool quick;
+
+private:
+  void usage(const char * name)
+  {
+    fprintf(stderr, "Usage: %s [-o output.json] [-d seconds]%s\n", name,
+            accepts_quick ? " [--quick]" : "");
+  }
+
+  void member(const char * name)
+  {
+    fprintf(out, "%s\n  \"%s\": ", first_member ? "" : ",", name);
+    first_member = false;
+  }
+
+  FILE * out;
+  const bool accepts_quick;
+  bool first_member;
+  bool first_element;
+};
+
+#endif /* BENCH_COMMON */
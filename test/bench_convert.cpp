@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* Throughput benchmark for the sample format conversions.
+ *
+ * This measures each function of cubeb_convert.h, in nanoseconds per sample,
+ * with each instruction set the CPU supports, on buffers of a typical
+ * callback size that stay in the cache.
+ *
+ * The results are written as JSON, on the standard output or in the file
+ * passed with `-o`, so that they can be compared between releases:
+ *
+ *   bench_convert [-o results.json] [-d seconds] */
+#include "cubeb_convert.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+namespace {
+
+const char * const simd_level_names[] = { "none", "sse2", "avx2", "neon" };
+
+/* 1024 stereo frames. */
+const size_t BENCH_SAMPLES = 2048;
+
+struct bench_buffers {
+  bench_buffers()
+    : floats(BENCH_SAMPLES)
+    , shorts(BENCH_SAMPLES)
+    , out_floats(BENCH_SAMPLES)
+    , out_shorts(BENCH_SAMPLES)
+    , left(BENCH_SAMPLES / 2)
+    , right(BENCH_SAMPLES / 2)
+  {
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+      floats[i] = 0.5f * sinf(i * 0.05f);
+      shorts[i] = static_cast<int16_t>(floats[i] * 32767);
+    }
+    cubeb_convert_dither_init(&dither, 1);
+  }
+
+  std::vector<float> floats;
+  std::vector<int16_t> shorts;
+  std::vector<float> out_floats;
+  std::vector<int16_t> out_shorts;
+  std::vector<float> left;
+  std::vector<float> right;
+  cubeb_convert_dither_state dither;
+};
+
+struct bench_case {
+  const char * name;
+  std::function<void(bench_buffers &)> run;
+};
+
+/* Returns the time per sample, in nanoseconds, of running `c` for about
+   `seconds`. */
+double run_case(const bench_case & c, bench_buffers & buffers, double seconds)
+{
+  /* Warm up the caches and the branch predictors. */
+  for (int i = 0; i < 100; i++) {
+    c.run(buffers);
+  }
+
+  uint64_t iterations = 0;
+  std::chrono::duration<double> elapsed(0);
+  auto start = std::chrono::steady_clock::now();
+  while (elapsed.count() < seconds) {
+    for (int i = 0; i < 100; i++) {
+      c.run(buffers);
+    }
+    iterations += 100;
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+  return elapsed.count() * 1e9 / (iterations * BENCH_SAMPLES);
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+  bench_harness bench(0.2, false);
+  if (!bench.init(argc, argv)) {
+    return EXIT_FAILURE;
+  }
+
+  const size_t n = BENCH_SAMPLES;
+  const bench_case cases[] = {
+    { "s16_to_float", [n](bench_buffers & b) {
+        cubeb_convert_s16_to_float(b.shorts.data(), b.out_floats.data(), n, 1.0f);
+      } },
+    { "float_to_s16", [n](bench_buffers & b) {
+        cubeb_convert_float_to_s16(b.floats.data(), b.out_shorts.data(), n, 1.0f);
+      } },
+    { "float_to_s16_dither", [n](bench_buffers & b) {
+        cubeb_convert_float_to_s16_dither(b.floats.data(), b.out_shorts.data(),
+                                          n, 1.0f, &b.dither);
+      } },
+    { "gain_float", [n](bench_buffers & b) {
+        cubeb_convert_gain_float(b.floats.data(), b.out_floats.data(), n, 0.5f);
+      } },
+    { "gain_s16", [n](bench_buffers & b) {
+        cubeb_convert_gain_s16(b.shorts.data(), b.out_shorts.data(), n, 0.5f);
+      } },
+    { "byteswap16", [n](bench_buffers & b) {
+        cubeb_convert_byteswap16(b.shorts.data(), b.out_shorts.data(), n);
+      } },
+    { "byteswap32", [n](bench_buffers & b) {
+        cubeb_convert_byteswap32(b.floats.data(), b.out_floats.data(), n);
+      } },
+    { "interleave_stereo", [n](bench_buffers & b) {
+        const float * planes[2] = { b.left.data(), b.right.data() };
+        cubeb_convert_interleave_float(planes, b.out_floats.data(), 2, n / 2,
+                                       1.0f);
+      } },
+    { "deinterleave_stereo", [n](bench_buffers & b) {
+        float * planes[2] = { b.left.data(), b.right.data() };
+        cubeb_convert_deinterleave_float(b.floats.data(), planes, 2, n / 2,
+                                         1.0f);
+      } },
+  };
+
+  bench_buffers buffers;
+  int best = cubeb_convert_get_simd_level();
+
+  bench.value("simd_level", "\"%s\"", simd_level_names[best]);
+  bench.value("samples", "%zu", n);
+  bench.begin_array("throughput");
+  for (int level = CUBEB_CONVERT_SIMD_NONE; level <= best; level++) {
+    if (cubeb_convert_set_simd_level(level) != level) {
+      continue;
+    }
+    for (const bench_case & c : cases) {
+      double ns = run_case(c, buffers, bench.seconds);
+      fprintf(bench.element(), "{ \"function\": \"%s\", "
+              "\"simd_level\": \"%s\", \"ns_per_sample\": %.4f }",
+              c.name, simd_level_names[level], ns);
+    }
+  }
+  bench.end_array();
+  bench.finish();
+  cubeb_convert_set_simd_level(best);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* Throughput benchmark for the mixer.
+ *
+ * This measures cubeb_mixer_mix, in nanoseconds per frame, for the most
+ * common pairs of layouts, in both sample formats, with the generic kernels
+ * and with the specialized ones when there are any, on buffers of a typical
+ * callback size that stay in the cache.
+ *
+ * The results are written as JSON, on the standard output or in the file
+ * passed with `-o`, so that they can be compared between releases:
+ *
+ *   bench_mixer [-o results.json] [-d seconds] */
+#include "cubeb/cubeb.h"
+#include "cubeb_mixer.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+const size_t BENCH_FRAMES = 1024;
+
+struct bench_case {
+  const char * name;
+  cubeb_channel_layout in_layout;
+  cubeb_channel_layout out_layout;
+};
+
+/* Returns the time per frame, in nanoseconds, of mixing for about
+   `seconds`. */
+double run_case(cubeb_mixer * mixer, const void * input, size_t input_size,
+                void * output, size_t output_size, double seconds)
+{
+  /* Warm up the caches and the branch predictors. */
+  for (int i = 0; i < 100; i++) {
+    cubeb_mixer_mix(mixer, BENCH_FRAMES, input, input_size,
+                    output, output_size);
+  }
+
+  uint64_t iterations = 0;
+  std::chrono::duration<double> elapsed(0);
+  auto start = std::chrono::steady_clock::now();
+  while (elapsed.count() < seconds) {
+    for (int i = 0; i < 100; i++) {
+      cubeb_mixer_mix(mixer, BENCH_FRAMES, input, input_size,
+                      output, output_size);
+    }
+    iterations += 100;
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+  return elapsed.count() * 1e9 / (iterations * BENCH_FRAMES);
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+  bench_harness bench(0.2, false);
+  if (!bench.init(argc, argv)) {
+    return EXIT_FAILURE;
+  }
+
+  const bench_case cases[] = {
+    { "5.1_to_stereo", CUBEB_LAYOUT_3F2_LFE, CUBEB_LAYOUT_STEREO },
+    { "7.1_to_stereo", CUBEB_LAYOUT_3F4_LFE, CUBEB_LAYOUT_STEREO },
+    { "stereo_to_5.1", CUBEB_LAYOUT_STEREO, CUBEB_LAYOUT_3F2_LFE },
+    { "mono_to_stereo", CUBEB_LAYOUT_MONO, CUBEB_LAYOUT_STEREO },
+    { "7.1_to_5.1", CUBEB_LAYOUT_3F4_LFE, CUBEB_LAYOUT_3F2_LFE },
+    { "quad_to_stereo", CUBEB_LAYOUT_QUAD, CUBEB_LAYOUT_STEREO },
+  };
+  const cubeb_sample_format formats[] = { CUBEB_SAMPLE_FLOAT32NE,
+                                          CUBEB_SAMPLE_S16NE };
+  const char * const kernel_names[] = { "generic", "specialized" };
+
+  /* Enough for 8 channels of floats. */
+  std::vector<float> floats(BENCH_FRAMES * 8);
+  std::vector<int16_t> shorts(BENCH_FRAMES * 8);
+  for (size_t i = 0; i < floats.size(); i++) {
+    floats[i] = 0.5f * sinf(i * 0.05f);
+    shorts[i] = static_cast<int16_t>(floats[i] * 32767);
+  }
+  std::vector<float> output(BENCH_FRAMES * 8);
+
+  bench.value("frames", "%zu", BENCH_FRAMES);
+  bench.begin_array("throughput");
+  for (const bench_case & c : cases) {
+    uint32_t in_channels = cubeb_channel_layout_nb_channels(c.in_layout);
+    uint32_t out_channels = cubeb_channel_layout_nb_channels(c.out_layout);
+    for (cubeb_sample_format format : formats) {
+      bool is_float = format == CUBEB_SAMPLE_FLOAT32NE;
+      size_t sample_size = is_float ? sizeof(float) : sizeof(int16_t);
+      const void * input = is_float ? static_cast<const void *>(floats.data())
+                                    : static_cast<const void *>(shorts.data());
+      double generic_ns = 0;
+      for (int specialized = 0; specialized < 2; specialized++) {
+        cubeb_mixer_set_specialized_kernels(specialized);
+        cubeb_mixer * mixer = cubeb_mixer_create(format,
+                                                 in_channels, c.in_layout,
+                                                 out_channels, c.out_layout);
+        double ns = run_case(mixer, input,
+                             BENCH_FRAMES * in_channels * sample_size,
+                             output.data(),
+                             BENCH_FRAMES * out_channels * sample_size,
+                             bench.seconds);
+        cubeb_mixer_destroy(mixer);
+        if (!specialized) {
+          generic_ns = ns;
+        }
+        fprintf(bench.element(), "{ \"layouts\": \"%s\", \"format\": \"%s\", "
+                "\"kernels\": \"%s\", \"ns_per_frame\": %.4f, "
+                "\"speedup\": %.2f }",
+                c.name, is_float ? "f32" : "s16",
+                kernel_names[specialized], ns, generic_ns / ns);
+      }
+    }
+  }
+  bench.end_array();
+  bench.finish();
+  cubeb_mixer_set_specialized_kernels(1);
+
+  return EXIT_SUCCESS;
+}
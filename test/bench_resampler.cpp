@@ -0,0 +1,489 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* Throughput and quality benchmark for the resampler.
+ *
+ * This measures the cost of cubeb_resampler_create and cubeb_resampler_fill
+ * (in nanoseconds per frame and number of allocations), for input, output and
+ * duplex streams, in S16 and float, for 1 to 8 channels, a number of common
+ * rate pairs and all the quality levels. It also measures the SNR and THD of
+ * the resampler, using sines at different frequencies.
+ *
+ * The results are written as JSON, on the standard output or in the file
+ * passed with `-o`, so that they can be compared between releases:
+ *
+ *   bench_resampler [-o results.json] [-d seconds] [--quick]
+ *
+ * Allocations are counted with rt_check, see rt_check.h, including the ones
+ * done with malloc, e.g. the speex resampler state. They are reported as -1
+ * where rt_check isn't available. */
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif // NOMINMAX
+#include "cubeb/cubeb.h"
+#include "cubeb_resampler.h"
+#include "speex/speex_resampler.h"
+#include "rt_check.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+const double BENCH_PI = 3.14159265358979323846;
+
+enum bench_mode {
+  BENCH_INPUT,
+  BENCH_OUTPUT,
+  BENCH_DUPLEX
+};
+
+const char * mode_names[] = { "input", "output", "duplex" };
+const char * quality_names[] = { "voip", "default", "desktop" };
+const char * simd_level_names[] = { "scalar", "sse2", "avx2", "avx2+fma" };
+
+/* Pairs of stream rate and device rate. */
+const uint32_t bench_rates[][2] = {
+  { 44100, 48000 },
+  { 48000, 44100 },
+  { 16000, 48000 },
+  { 48000, 16000 },
+  { 96000, 48000 },
+  { 48000, 48000 }
+};
+
+const uint32_t bench_channels[] = { 1, 2, 4, 6, 8 };
+
+/* Number of frames the backend asks for at each callback. */
+const long BENCH_CALLBACK_FRAMES = 256;
+
+struct callback_state {
+  cubeb_sample_format format;
+  uint32_t input_channels;
+  uint32_t output_channels;
+  /* Audio given to the callback for output streams, looped over. */
+  std::vector<float> pattern;
+  size_t pattern_index;
+};
+
+template<typename T>
+T to_sample(float value);
+
+template<>
+float to_sample<float>(float value)
+{
+  return value;
+}
+
+template<>
+short to_sample<short>(float value)
+{
+  return static_cast<short>(lrintf(value * 32767.0f));
+}
+
+template<typename T>
+long bench_callback_typed(callback_state * state, const T * in, T * out,
+                          long frames)
+{
+  if (!out) {
+    return frames;
+  }
+  if (in) {
+    for (long i = 0; i < frames; i++) {
+      for (uint32_t c = 0; c < state->output_channels; c++) {
+        out[i * state->output_channels + c] =
+          in[i * state->input_channels + c % state->input_channels];
+      }
+    }
+    return frames;
+  }
+  for (long i = 0; i < frames; i++) {
+    T sample = to_sample<T>(state->pattern[state->pattern_index]);
+    state->pattern_index = (state->pattern_index + 1) % state->pattern.size();
+    for (uint32_t c = 0; c < state->output_channels; c++) {
+      out[i * state->output_channels + c] = sample;
+    }
+  }
+  return frames;
+}
+
+long bench_data_callback(cubeb_stream * /*stm*/, void * user,
+                         const void * input_buffer, void * output_buffer,
+                         long frames)
+{
+  callback_state * state = static_cast<callback_state *>(user);
+  if (state->format == CUBEB_SAMPLE_FLOAT32NE) {
+    return bench_callback_typed(state, static_cast<const float *>(input_buffer),
+                                static_cast<float *>(output_buffer), frames);
+  }
+  return bench_callback_typed(state, static_cast<const short *>(input_buffer),
+                              static_cast<short *>(output_buffer), frames);
+}
+
+void fill_sine(std::vector<float> & buffer, double frequency, uint32_t rate,
+               size_t frames, double amplitude)
+{
+  buffer.resize(frames);
+  for (size_t i = 0; i < frames; i++) {
+    buffer[i] = static_cast<float>(amplitude *
+                                   sin(2 * BENCH_PI * frequency * i / rate));
+  }
+}
+
+template<typename T>
+void fill_interleaved(std::vector<T> & buffer, const std::vector<float> & mono,
+                      uint32_t channels)
+{
+  buffer.resize(mono.size() * channels);
+  for (size_t i = 0; i < mono.size(); i++) {
+    for (uint32_t c = 0; c < channels; c++) {
+      buffer[i * channels + c] = to_sample<T>(mono[i]);
+    }
+  }
+}
+
+struct fill_result {
+  double create_ns;
+  long long create_allocations;
+  double ns_per_frame;
+  long long fill_allocations;
+  uint64_t frames;
+};
+
+/* Starts counting the allocations made on the calling thread. */
+void start_counting_allocations()
+{
+  rt_check_clear();
+  rt_check_start();
+  rt_check_enter_realtime();
+}
+
+/* Returns the number of allocations since start_counting_allocations, or -1
+ * if they can't be counted in this build. */
+long long stop_counting_allocations()
+{
+  rt_check_leave_realtime();
+  rt_check_stop();
+  if (!rt_check_available()) {
+    return -1;
+  }
+  return static_cast<long long>(rt_check_allocation_count());
+}
+
+/* Runs one configuration for `seconds` of audio at the device rate, and
+ * returns the cost of the creation and of the fill calls. Output frames are
+ * counted for output and duplex streams, input frames for input streams. */
+template<typename T>
+bool run_fill(bench_mode mode, cubeb_sample_format format, uint32_t channels,
+              uint32_t stream_rate, uint32_t device_rate,
+              cubeb_resampler_quality quality, double seconds,
+              callback_state & state, fill_result & result)
+{
+  cubeb_stream_params device_params;
+  device_params.format = format;
+  device_params.rate = device_rate;
+  device_params.channels = channels;
+  device_params.layout = CUBEB_LAYOUT_UNDEFINED;
+  device_params.prefs = CUBEB_STREAM_PREF_NONE;
+
+  bool has_input = mode != BENCH_OUTPUT;
+  bool has_output = mode != BENCH_INPUT;
+
+  state.format = format;
+  state.input_channels = channels;
+  state.output_channels = channels;
+  state.pattern_index = 0;
+
+  std::vector<float> mono;
+  fill_sine(mono, 1000.0, device_rate, device_rate, 0.5);
+  std::vector<T> input;
+  fill_interleaved(input, mono, channels);
+  std::vector<T> output(BENCH_CALLBACK_FRAMES * channels);
+
+  start_counting_allocations();
+  auto start = std::chrono::steady_clock::now();
+  cubeb_resampler * resampler =
+    cubeb_resampler_create(nullptr, has_input ? &device_params : nullptr,
+                           has_output ? &device_params : nullptr,
+                           stream_rate, bench_data_callback, &state, quality,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+  std::chrono::duration<double, std::nano> create_time =
+    std::chrono::steady_clock::now() - start;
+  result.create_allocations = stop_counting_allocations();
+  result.create_ns = create_time.count();
+  if (!resampler) {
+    return false;
+  }
+  /* What a backend does before starting its stream, so that `fill` runs
+   * with the buffers at their final size. */
+  if (cubeb_resampler_reserve(resampler, BENCH_CALLBACK_FRAMES) != CUBEB_OK) {
+    cubeb_resampler_destroy(resampler);
+    return false;
+  }
+
+  /* Warm up, so that the buffers reach their steady state size. */
+  long callbacks = static_cast<long>(seconds * device_rate / BENCH_CALLBACK_FRAMES);
+  long warmup = std::max(1L, callbacks / 10);
+  size_t input_offset = 0;
+  auto fill_once = [&]() {
+    long input_frames = BENCH_CALLBACK_FRAMES;
+    if (input_offset + BENCH_CALLBACK_FRAMES > mono.size()) {
+      input_offset = 0;
+    }
+    long got = cubeb_resampler_fill(resampler,
+                                    has_input ? &input[input_offset * channels] : nullptr,
+                                    has_input ? &input_frames : nullptr,
+                                    has_output ? output.data() : nullptr,
+                                    has_output ? BENCH_CALLBACK_FRAMES : 0);
+    input_offset += BENCH_CALLBACK_FRAMES;
+    return got;
+  };
+
+  for (long i = 0; i < warmup; i++) {
+    fill_once();
+  }
+
+  start_counting_allocations();
+  uint64_t frames = 0;
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < callbacks; i++) {
+    long got = fill_once();
+    if (got < 0) {
+      break;
+    }
+    frames += got;
+  }
+  std::chrono::duration<double, std::nano> fill_time =
+    std::chrono::steady_clock::now() - start;
+  result.fill_allocations = stop_counting_allocations();
+  result.frames = frames;
+  result.ns_per_frame = frames ? fill_time.count() / frames : 0;
+
+  cubeb_resampler_destroy(resampler);
+  return true;
+}
+
+/* Amplitude of the component at `frequency` in `signal`, using a least
+ * squares fit of a sine and a cosine, so that it doesn't matter whether the
+ * signal contains a whole number of periods. */
+double component_amplitude(const std::vector<float> & signal, size_t start,
+                           size_t length, double frequency, uint32_t rate,
+                           double * phase = nullptr)
+{
+  double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+  for (size_t i = 0; i < length; i++) {
+    double w = 2 * BENCH_PI * frequency * (start + i) / rate;
+    double sw = sin(w);
+    double cw = cos(w);
+    ss += sw * sw;
+    cc += cw * cw;
+    sc += sw * cw;
+    ys += signal[start + i] * sw;
+    yc += signal[start + i] * cw;
+  }
+  double det = ss * cc - sc * sc;
+  double s = (ys * cc - yc * sc) / det;
+  double c = (yc * ss - ys * sc) / det;
+  if (phase) {
+    *phase = atan2(c, s);
+  }
+  return sqrt(s * s + c * c);
+}
+
+struct quality_result {
+  double frequency;
+  double snr_db;
+  double thd_db;
+};
+
+/* Resamples a sine with an output stream, and measures the SNR (noise and
+ * distortion relative to the fundamental) and THD (first harmonics relative to
+ * the fundamental) of the resampled signal. */
+quality_result measure_quality(uint32_t stream_rate, uint32_t device_rate,
+                               cubeb_resampler_quality quality,
+                               double frequency)
+{
+  cubeb_stream_params params;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+  params.rate = device_rate;
+  params.channels = 1;
+  params.layout = CUBEB_LAYOUT_UNDEFINED;
+  params.prefs = CUBEB_STREAM_PREF_NONE;
+
+  callback_state state;
+  state.format = params.format;
+  state.input_channels = 0;
+  state.output_channels = 1;
+  state.pattern_index = 0;
+  /* A whole number of periods, so that looping over the pattern is seamless. */
+  size_t periods = static_cast<size_t>(frequency);
+  size_t pattern_frames =
+    static_cast<size_t>(llround(periods * stream_rate / frequency));
+  frequency = periods * static_cast<double>(stream_rate) / pattern_frames;
+  fill_sine(state.pattern, frequency, stream_rate, pattern_frames, 0.5);
+
+  cubeb_resampler * resampler =
+    cubeb_resampler_create(nullptr, nullptr, &params, stream_rate,
+                           bench_data_callback, &state, quality,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+
+  /* Skip the start of the output, to ignore the latency of the filter. */
+  size_t skip = device_rate / 10;
+  size_t length = device_rate;
+  std::vector<float> output;
+  std::vector<float> buffer(BENCH_CALLBACK_FRAMES);
+  while (output.size() < skip + length) {
+    cubeb_resampler_fill(resampler, nullptr, nullptr, buffer.data(),
+                         BENCH_CALLBACK_FRAMES);
+    output.insert(output.end(), buffer.begin(), buffer.end());
+  }
+  cubeb_resampler_destroy(resampler);
+
+  double phase;
+  double fundamental = component_amplitude(output, skip, length, frequency,
+                                           device_rate, &phase);
+  /* Everything but the fundamental is noise or distortion. The harmonics are
+   * measured in the residual, so that the fundamental doesn't leak in them. */
+  std::vector<float> residual(output.size());
+  double noise = 0;
+  for (size_t i = skip; i < skip + length; i++) {
+    double w = 2 * BENCH_PI * frequency * i / device_rate;
+    residual[i] = static_cast<float>(output[i] - fundamental * sin(w + phase));
+    noise += residual[i] * residual[i];
+  }
+  noise /= length;
+  double harmonics = 0;
+  bool has_harmonics = false;
+  for (int h = 2; h <= 5 && h * frequency < device_rate / 2.0; h++) {
+    double a = component_amplitude(residual, skip, length, h * frequency,
+                                   device_rate);
+    harmonics += a * a / 2;
+    has_harmonics = true;
+  }
+  double signal_power = fundamental * fundamental / 2;
+
+  quality_result result;
+  result.frequency = frequency;
+  result.snr_db = 10 * log10(signal_power / std::max(noise, 1e-30));
+  /* NaN when all the harmonics are above the Nyquist frequency. */
+  result.thd_db = has_harmonics
+    ? 10 * log10(std::max(harmonics, 1e-30) / signal_power) : NAN;
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+  bench_harness bench(1.0, true);
+  if (!bench.init(argc, argv)) {
+    return EXIT_FAILURE;
+  }
+  bool quick = bench.quick;
+
+  int simd_level = speex_resampler_get_simd_level();
+  bench.value("simd_level", "\"%s\"", simd_level_names[simd_level]);
+  bench.value("callback_frames", "%ld", BENCH_CALLBACK_FRAMES);
+  /* create_ns is a lot lower for the ratios that have a precomputed table. */
+  bench.value("precomputed_filter_tables", "%d",
+              speex_resampler_set_precomputed_tables(1));
+  bench.begin_array("throughput");
+
+  const cubeb_sample_format formats[] = { CUBEB_SAMPLE_S16NE,
+                                          CUBEB_SAMPLE_FLOAT32NE };
+  size_t channel_count = quick ? 2 : sizeof(bench_channels) / sizeof(bench_channels[0]);
+  size_t rate_count = sizeof(bench_rates) / sizeof(bench_rates[0]);
+  callback_state state;
+  fill_sine(state.pattern, 440.0, 48000, 48000, 0.5);
+
+  for (int mode = BENCH_INPUT; mode <= BENCH_DUPLEX; mode++) {
+    for (cubeb_sample_format format : formats) {
+      for (size_t c = 0; c < channel_count; c++) {
+        for (size_t r = 0; r < rate_count; r++) {
+          for (int q = CUBEB_RESAMPLER_QUALITY_VOIP;
+               q <= CUBEB_RESAMPLER_QUALITY_DESKTOP; q++) {
+            uint32_t channels = bench_channels[c];
+            uint32_t stream_rate = bench_rates[r][0];
+            uint32_t device_rate = bench_rates[r][1];
+            fill_result result;
+            bool ok = format == CUBEB_SAMPLE_FLOAT32NE
+              ? run_fill<float>(static_cast<bench_mode>(mode), format, channels,
+                                stream_rate, device_rate,
+                                static_cast<cubeb_resampler_quality>(q),
+                                bench.seconds, state, result)
+              : run_fill<short>(static_cast<bench_mode>(mode), format, channels,
+                                stream_rate, device_rate,
+                                static_cast<cubeb_resampler_quality>(q),
+                                bench.seconds, state, result);
+            if (!ok) {
+              fprintf(stderr, "Could not create a resampler\n");
+              return EXIT_FAILURE;
+            }
+            fprintf(bench.element(), "{ \"mode\": \"%s\", \"format\": \"%s\", "
+                    "\"channels\": %u, \"stream_rate\": %u, \"device_rate\": %u, "
+                    "\"quality\": \"%s\", \"create_ns\": %.0f, "
+                    "\"create_allocations\": %lld, \"ns_per_frame\": %.3f, "
+                    "\"fill_allocations\": %lld, \"frames\": %llu }",
+                    mode_names[mode],
+                    format == CUBEB_SAMPLE_FLOAT32NE ? "f32" : "s16",
+                    channels, stream_rate, device_rate, quality_names[q],
+                    result.create_ns,
+                    result.create_allocations,
+                    result.ns_per_frame,
+                    result.fill_allocations,
+                    static_cast<unsigned long long>(result.frames));
+          }
+        }
+      }
+    }
+  }
+  bench.end_array();
+
+  bench.begin_array("quality");
+  for (size_t r = 0; r < rate_count; r++) {
+    uint32_t stream_rate = bench_rates[r][0];
+    uint32_t device_rate = bench_rates[r][1];
+    for (int q = CUBEB_RESAMPLER_QUALITY_VOIP;
+         q <= CUBEB_RESAMPLER_QUALITY_DESKTOP; q++) {
+      /* Logarithmic sweep up to 80% of the lowest Nyquist frequency. */
+      double highest = 0.4 * std::min(stream_rate, device_rate);
+      const int steps = quick ? 4 : 10;
+      double min_snr = INFINITY;
+      double max_thd = -INFINITY;
+      FILE * out = bench.element();
+      fprintf(out, "{ \"stream_rate\": %u, \"device_rate\": %u, "
+              "\"quality\": \"%s\", \"sweep\": [",
+              stream_rate, device_rate, quality_names[q]);
+      for (int i = 0; i < steps; i++) {
+        double frequency = 100.0 * pow(highest / 100.0, i / (steps - 1.0));
+        quality_result result =
+          measure_quality(stream_rate, device_rate,
+                          static_cast<cubeb_resampler_quality>(q), frequency);
+        min_snr = std::min(min_snr, result.snr_db);
+        fprintf(out, "%s\n        { \"frequency\": %.1f, \"snr_db\": %.2f, ",
+                i ? "," : "", result.frequency, result.snr_db);
+        if (std::isnan(result.thd_db)) {
+          fprintf(out, "\"thd_db\": null }");
+        } else {
+          max_thd = std::max(max_thd, result.thd_db);
+          fprintf(out, "\"thd_db\": %.2f }", result.thd_db);
+        }
+      }
+      fprintf(out, "\n      ], \"min_snr_db\": %.2f, \"max_thd_db\": %.2f }",
+              min_snr, max_thd);
+    }
+  }
+  bench.end_array();
+  bench.finish();
+
+  return EXIT_SUCCESS;
+}
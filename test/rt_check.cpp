@@ -0,0 +1,274 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* See rt_check.h. The functions below replace the ones of the C library in the
+ * executable this is linked in, and in the shared libraries it loads: glibc
+ * supports replacing malloc, and the other functions are looked up with
+ * dlsym(RTLD_NEXT). */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "rt_check.h"
+#include <atomic>
+#include <string>
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || \
+    __has_feature(memory_sanitizer)
+#define RT_CHECK_SANITIZED
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define RT_CHECK_SANITIZED
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && !defined(RT_CHECK_SANITIZED)
+#define RT_CHECK_ENABLED
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+/** The number of calls whose stack trace is kept. */
+const size_t RT_CHECK_MAX_VIOLATIONS = 64;
+const int RT_CHECK_MAX_FRAMES = 32;
+
+struct rt_violation {
+  const char * function;
+  void * frames[RT_CHECK_MAX_FRAMES];
+  int frame_count;
+};
+
+std::atomic<size_t> violation_count(0);
+std::atomic<size_t> allocation_count(0);
+std::atomic<bool> recording(false);
+
+/* Plain thread-locals: the storage of the executable is allocated with the
+ * thread, accessing it never allocates. */
+#if defined(_MSC_VER)
+#define RT_CHECK_THREAD_LOCAL __declspec(thread)
+#else
+#define RT_CHECK_THREAD_LOCAL __thread
+#endif
+RT_CHECK_THREAD_LOCAL int realtime_depth;
+RT_CHECK_THREAD_LOCAL bool in_check;
+
+#if defined(RT_CHECK_ENABLED)
+rt_violation violations[RT_CHECK_MAX_VIOLATIONS];
+
+/** Records a call to `function` if the calling thread is real-time.
+ * `allocation` is true for the functions that allocate memory. */
+__attribute__((noinline)) void check(const char * function,
+                                     bool allocation = false)
+{
+  if (!realtime_depth || in_check || !recording) {
+    return;
+  }
+  in_check = true;
+  if (allocation) {
+    allocation_count++;
+  }
+  size_t index = violation_count++;
+  if (index < RT_CHECK_MAX_VIOLATIONS) {
+    rt_violation & v = violations[index];
+    v.function = function;
+    v.frame_count = backtrace(v.frames, RT_CHECK_MAX_FRAMES);
+  }
+  in_check = false;
+}
+
+/** Looks up the function that `name` replaces. */
+template<typename F>
+F real(F & cached, const char * name)
+{
+  if (!cached) {
+    cached = reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+  }
+  return cached;
+}
+
+struct rt_check_init {
+  rt_check_init()
+  {
+    /* The first call to backtrace loads the unwinder, which allocates. */
+    void * frames[1];
+    backtrace(frames, 1);
+  }
+} init;
+#endif
+
+} // namespace
+
+bool rt_check_available()
+{
+#if defined(RT_CHECK_ENABLED)
+  return true;
+#else
+  return false;
+#endif
+}
+
+void rt_check_enter_realtime()
+{
+  realtime_depth++;
+}
+
+void rt_check_leave_realtime()
+{
+  realtime_depth--;
+}
+
+void rt_check_start()
+{
+  recording = true;
+}
+
+void rt_check_stop()
+{
+  recording = false;
+}
+
+void rt_check_clear()
+{
+  violation_count = 0;
+  allocation_count = 0;
+}
+
+size_t rt_check_violation_count()
+{
+  return violation_count;
+}
+
+size_t rt_check_allocation_count()
+{
+  return allocation_count;
+}
+
+std::string rt_check_report()
+{
+  size_t count = violation_count;
+  std::string report = std::to_string(count) +
+                       " calls that can block on a real-time thread:\n";
+#if defined(RT_CHECK_ENABLED)
+  for (size_t i = 0; i < count && i < RT_CHECK_MAX_VIOLATIONS; i++) {
+    const rt_violation & v = violations[i];
+    report += std::string(v.function) + "\n";
+    char ** symbols = backtrace_symbols(v.frames, v.frame_count);
+    /* The first frame is `check`. */
+    for (int f = 1; symbols && f < v.frame_count; f++) {
+      report += "    " + std::string(symbols[f]) + "\n";
+    }
+    free(symbols);
+  }
+  if (count > RT_CHECK_MAX_VIOLATIONS) {
+    report += "... and " + std::to_string(count - RT_CHECK_MAX_VIOLATIONS) +
+              " more\n";
+  }
+#endif
+  return report;
+}
+
+#if defined(RT_CHECK_ENABLED)
+extern "C" {
+
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * ptr, size_t size);
+void * __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void * ptr);
+
+void * malloc(size_t size)
+{
+  check("malloc", true);
+  return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size)
+{
+  check("calloc", true);
+  return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+  check("realloc", true);
+  return __libc_realloc(ptr, size);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+  check("memalign", true);
+  return __libc_memalign(alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+  check("aligned_alloc", true);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void ** ptr, size_t alignment, size_t size)
+{
+  check("posix_memalign", true);
+  if (!alignment || (alignment & (alignment - 1)) ||
+      alignment % sizeof(void *)) {
+    return EINVAL;
+  }
+  void * p = __libc_memalign(alignment, size);
+  if (!p) {
+    return ENOMEM;
+  }
+  *ptr = p;
+  return 0;
+}
+
+void free(void * ptr)
+{
+  if (ptr) {
+    check("free");
+  }
+  __libc_free(ptr);
+}
+
+/* Replaces `name`, calling the real function with the same arguments. */
+#define RT_CHECK_REPLACE(ret, name, params, args)  \
+  ret name params                                  \
+  {                                                \
+    static ret (*real_##name) params;              \
+    check(#name);                                  \
+    return real(real_##name, #name) args;          \
+  }
+
+RT_CHECK_REPLACE(int, pthread_mutex_lock, (pthread_mutex_t * m), (m))
+RT_CHECK_REPLACE(int, pthread_rwlock_rdlock, (pthread_rwlock_t * l), (l))
+RT_CHECK_REPLACE(int, pthread_rwlock_wrlock, (pthread_rwlock_t * l), (l))
+RT_CHECK_REPLACE(int, pthread_join, (pthread_t t, void ** rv), (t, rv))
+RT_CHECK_REPLACE(int, sem_wait, (sem_t * s), (s))
+RT_CHECK_REPLACE(int, nanosleep,
+                 (const struct timespec * req, struct timespec * rem),
+                 (req, rem))
+RT_CHECK_REPLACE(int, clock_nanosleep,
+                 (clockid_t clock, int flags, const struct timespec * req,
+                  struct timespec * rem),
+                 (clock, flags, req, rem))
+RT_CHECK_REPLACE(int, usleep, (useconds_t us), (us))
+RT_CHECK_REPLACE(int, poll, (struct pollfd * fds, nfds_t n, int timeout),
+                 (fds, n, timeout))
+RT_CHECK_REPLACE(ssize_t, read, (int fd, void * buf, size_t count),
+                 (fd, buf, count))
+RT_CHECK_REPLACE(ssize_t, write, (int fd, const void * buf, size_t count),
+                 (fd, buf, count))
+
+} // extern "C"
+#endif
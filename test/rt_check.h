@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* Real-time safety checks for the tests.
+ *
+ * Linking rt_check in a test executable replaces the memory allocation
+ * functions, the blocking locks and a few blocking system calls with versions
+ * that record each call made on a thread marked as real-time, with a stack
+ * trace, before calling the real function. A real-time thread is a thread
+ * between rt_check_enter_realtime and rt_check_leave_realtime, e.g. the thread
+ * that calls the data callback of a stream.
+ *
+ * This only works on Linux with glibc, and not with the address, thread or
+ * memory sanitizers, that replace the same functions: rt_check_available
+ * returns false otherwise. This must not be linked in Gecko. */
+#ifndef CUBEB_RT_CHECK_H
+#define CUBEB_RT_CHECK_H
+
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+/** Returns true if the calls are intercepted in this build. */
+bool rt_check_available();
+
+/** Mark the calling thread as real-time until the matching
+ * rt_check_leave_realtime. These nest. A thread that never leaves stays
+ * real-time until it exits, which is how the data callback can mark the
+ * thread of a stream on its first call. */
+void rt_check_enter_realtime();
+void rt_check_leave_realtime();
+
+/** Start or stop recording the calls made on real-time threads. */
+void rt_check_start();
+void rt_check_stop();
+
+/** Forget the recorded calls. */
+void rt_check_clear();
+
+/** Returns the number of calls recorded since the last rt_check_clear. */
+size_t rt_check_violation_count();
+
+/** Returns the number of those calls that allocated memory: malloc and the
+ * functions like it, including through operator new. */
+size_t rt_check_allocation_count();
+
+/** Returns a description of the recorded calls, with their symbolized stack
+ * traces. This allocates, and must not be called on a real-time thread. */
+std::string rt_check_report();
+
+/** Marks the current thread as real-time while it is in scope. */
+class rt_check_scope {
+public:
+  rt_check_scope()
+  {
+    rt_check_enter_realtime();
+  }
+  ~rt_check_scope()
+  {
+    rt_check_leave_realtime();
+  }
+};
+
+/** Fixture that records the calls made on real-time threads during a test.
+ * The test fails if there are any, unless `expect_rt_safe` is false, in which
+ * case they are only printed. */
+class rt_check_test : public ::testing::Test {
+protected:
+  void SetUp() override
+  {
+    rt_check_clear();
+    rt_check_start();
+  }
+
+  void TearDown() override
+  {
+    rt_check_stop();
+    if (!rt_check_violation_count()) {
+      return;
+    }
+    if (expect_rt_safe) {
+      ADD_FAILURE() << rt_check_report();
+    } else {
+      fprintf(stderr, "%s", rt_check_report().c_str());
+    }
+  }
+
+  /* When false, the calls on real-time threads are reported but don't fail
+   * the test. */
+  bool expect_rt_safe = true;
+};
+
+#endif /* CUBEB_RT_CHECK_H */
@@ -0,0 +1,338 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "cubeb_convert.h"
+
+namespace {
+
+/* Odd sizes, so that the vector loops have a tail. */
+const size_t convert_test_sizes[] = { 0, 1, 7, 8, 15, 16, 17, 33, 1027 };
+
+std::vector<float> convert_test_floats(size_t samples)
+{
+  std::vector<float> v(samples);
+  for (size_t i = 0; i < samples; i++) {
+    /* Some values out of [-1; 1], to check the clipping. */
+    v[i] = (rand() / static_cast<float>(RAND_MAX)) * 2.4f - 1.2f;
+  }
+  return v;
+}
+
+std::vector<int16_t> convert_test_s16(size_t samples)
+{
+  std::vector<int16_t> v(samples);
+  for (size_t i = 0; i < samples; i++) {
+    v[i] = static_cast<int16_t>(rand() % 65536 - 32768);
+  }
+  return v;
+}
+
+/* Run `test` with each instruction set this CPU supports, the scalar
+   version first. */
+template<typename Test>
+void for_each_simd_level(Test test)
+{
+  int best = cubeb_convert_get_simd_level();
+  for (int level = CUBEB_CONVERT_SIMD_NONE; level <= best; level++) {
+    if (cubeb_convert_set_simd_level(level) == level) {
+      test(level);
+    }
+  }
+  cubeb_convert_set_simd_level(best);
+}
+
+} // namespace
+
+TEST(cubeb, convert_values)
+{
+  for_each_simd_level([](int) {
+    const float in[] = { 0.0f, 0.5f, -0.5f, 1.0f, -1.0f, 2.0f, -2.0f,
+                         1.0f / 65536, 3.0f / 65536, 0.25f };
+    const int16_t expected[] = { 0, 16384, -16384, 32767, -32768, 32767,
+                                 -32768, 0, 2, 8192 };
+    int16_t out[10];
+    cubeb_convert_float_to_s16(in, out, 10, 1.0f);
+    ASSERT_EQ(memcmp(out, expected, sizeof(out)), 0);
+
+    float back[10];
+    cubeb_convert_s16_to_float(expected, back, 10, 0.5f);
+    ASSERT_EQ(back[1], 0.25f);
+    ASSERT_EQ(back[4], -0.5f);
+
+    int16_t scaled[10];
+    cubeb_convert_gain_s16(expected, scaled, 10, 2.0f);
+    ASSERT_EQ(scaled[1], 32767);
+    ASSERT_EQ(scaled[2], -32768);
+    ASSERT_EQ(scaled[9], 16384);
+  });
+}
+
+TEST(cubeb, convert_simd_matches_scalar)
+{
+  for (size_t samples : convert_test_sizes) {
+    std::vector<float> floats = convert_test_floats(samples);
+    std::vector<int16_t> shorts = convert_test_s16(samples);
+    std::vector<int16_t> ref_s16, ref_gain_s16;
+    std::vector<float> ref_float, ref_gain_float;
+
+    for_each_simd_level([&](int level) {
+      std::vector<int16_t> out_s16(samples);
+      std::vector<int16_t> out_gain_s16(samples);
+      std::vector<float> out_float(samples);
+      std::vector<float> out_gain_float(samples);
+      cubeb_convert_float_to_s16(floats.data(), out_s16.data(), samples, 0.8f);
+      cubeb_convert_gain_s16(shorts.data(), out_gain_s16.data(), samples, 1.3f);
+      cubeb_convert_s16_to_float(shorts.data(), out_float.data(), samples, 0.7f);
+      cubeb_convert_gain_float(floats.data(), out_gain_float.data(), samples, 0.3f);
+      if (level == CUBEB_CONVERT_SIMD_NONE) {
+        ref_s16 = out_s16;
+        ref_gain_s16 = out_gain_s16;
+        ref_float = out_float;
+        ref_gain_float = out_gain_float;
+      } else {
+        ASSERT_EQ(out_s16, ref_s16);
+        ASSERT_EQ(out_gain_s16, ref_gain_s16);
+        ASSERT_EQ(out_float, ref_float);
+        ASSERT_EQ(out_gain_float, ref_gain_float);
+      }
+    });
+  }
+}
+
+TEST(cubeb, convert_gain_ramp)
+{
+  /* Channel counts with each number of frames per group of eight samples. */
+  const uint32_t channel_counts[] = { 1, 2, 3, 4, 6, 8, 33 };
+  const float from[] = { 1.0f, 0.5f, 0.0f, 0.25f, 1.0f, 0.75f, 0.1f, 0.9f,
+                         1.0f, 0.5f, 0.0f, 0.25f, 1.0f, 0.75f, 0.1f, 0.9f,
+                         1.0f, 0.5f, 0.0f, 0.25f, 1.0f, 0.75f, 0.1f, 0.9f,
+                         1.0f, 0.5f, 0.0f, 0.25f, 1.0f, 0.75f, 0.1f, 0.9f,
+                         1.0f };
+  const float to[] = { 0.0f, 0.5f, 1.0f, 0.8f, 1.2f, 0.3f, 0.6f, 0.0f,
+                       0.0f, 0.5f, 1.0f, 0.8f, 1.2f, 0.3f, 0.6f, 0.0f,
+                       0.0f, 0.5f, 1.0f, 0.8f, 1.2f, 0.3f, 0.6f, 0.0f,
+                       0.0f, 0.5f, 1.0f, 0.8f, 1.2f, 0.3f, 0.6f, 0.0f,
+                       0.0f };
+  for (uint32_t channels : channel_counts) {
+    for (size_t frames : convert_test_sizes) {
+      size_t samples = frames * channels;
+      std::vector<float> floats = convert_test_floats(samples);
+      std::vector<int16_t> shorts = convert_test_s16(samples);
+      std::vector<float> ref_float;
+      std::vector<int16_t> ref_s16;
+
+      for_each_simd_level([&](int level) {
+        std::vector<float> out_float(samples);
+        std::vector<int16_t> out_s16(samples);
+        cubeb_convert_gain_ramp_float(floats.data(), out_float.data(),
+                                      channels, frames, from, to);
+        cubeb_convert_gain_ramp_s16(shorts.data(), out_s16.data(),
+                                    channels, frames, from, to);
+        if (level == CUBEB_CONVERT_SIMD_NONE) {
+          ref_float = out_float;
+          ref_s16 = out_s16;
+        } else {
+          ASSERT_EQ(out_float, ref_float);
+          ASSERT_EQ(out_s16, ref_s16);
+        }
+      });
+
+      for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+          float t = static_cast<float>(f + 1) / frames;
+          float gain = from[c] + (to[c] - from[c]) * t;
+          size_t i = f * channels + c;
+          ASSERT_NEAR(ref_float[i], floats[i] * gain, 1e-5);
+        }
+      }
+    }
+  }
+
+  /* A constant gain per channel is exact. */
+  const float gains[] = { 0.5f, 0.25f, 0.0f };
+  std::vector<float> in = convert_test_floats(3 * 17);
+  std::vector<float> out(in.size());
+  cubeb_convert_gain_ramp_float(in.data(), out.data(), 3, 17, gains, gains);
+  for (size_t i = 0; i < in.size(); i++) {
+    ASSERT_EQ(out[i], in[i] * gains[i % 3]);
+  }
+}
+
+TEST(cubeb, convert_gain_unity_and_mute)
+{
+  for (size_t samples : convert_test_sizes) {
+    std::vector<float> floats = convert_test_floats(samples);
+    std::vector<int16_t> shorts = convert_test_s16(samples);
+    std::vector<float> out_float(samples, 0.5f);
+    std::vector<int16_t> out_s16(samples, 1);
+
+    cubeb_convert_gain_float(floats.data(), out_float.data(), samples, 1.0f);
+    cubeb_convert_gain_s16(shorts.data(), out_s16.data(), samples, 1.0f);
+    ASSERT_EQ(out_float, floats);
+    ASSERT_EQ(out_s16, shorts);
+
+    cubeb_convert_gain_float(floats.data(), floats.data(), samples, 0.0f);
+    cubeb_convert_gain_s16(shorts.data(), shorts.data(), samples, 0.0f);
+    ASSERT_EQ(floats, std::vector<float>(samples, 0.0f));
+    ASSERT_EQ(shorts, std::vector<int16_t>(samples, 0));
+  }
+}
+
+TEST(cubeb, convert_accumulate)
+{
+  for (size_t samples : convert_test_sizes) {
+    std::vector<float> floats = convert_test_floats(samples);
+    std::vector<int16_t> shorts = convert_test_s16(samples);
+    std::vector<float> bus = convert_test_floats(samples);
+    std::vector<float> ref;
+
+    for_each_simd_level([&](int level) {
+      std::vector<float> out = bus;
+      cubeb_convert_accumulate_float(floats.data(), out.data(), samples, 0.6f);
+      cubeb_convert_accumulate_s16(shorts.data(), out.data(), samples, 0.3f);
+      if (level == CUBEB_CONVERT_SIMD_NONE) {
+        ref = out;
+      } else {
+        ASSERT_EQ(out, ref);
+      }
+    });
+
+    for (size_t i = 0; i < samples; i++) {
+      float expected = bus[i] + floats[i] * 0.6f + shorts[i] * 0.3f / 32768;
+      ASSERT_NEAR(ref[i], expected, 1e-5);
+    }
+
+    /* A gain of zero leaves the samples alone. */
+    std::vector<float> out = bus;
+    cubeb_convert_accumulate_s16(shorts.data(), out.data(), samples, 0.0f);
+    ASSERT_EQ(out, bus);
+  }
+}
+
+TEST(cubeb, convert_in_place)
+{
+  for_each_simd_level([](int) {
+    for (size_t samples : convert_test_sizes) {
+      std::vector<int16_t> shorts = convert_test_s16(samples);
+      std::vector<float> expected(samples);
+      cubeb_convert_s16_to_float(shorts.data(), expected.data(), samples, 1.0f);
+
+      /* Enough room for the floats, with the S16 samples at the start. */
+      std::vector<float> buffer(samples);
+      std::copy(shorts.begin(), shorts.end(),
+                reinterpret_cast<int16_t *>(buffer.data()));
+      cubeb_convert_s16_to_float(reinterpret_cast<int16_t *>(buffer.data()),
+                                 buffer.data(), samples, 1.0f);
+      ASSERT_EQ(buffer, expected);
+
+      cubeb_convert_float_to_s16(buffer.data(),
+                                 reinterpret_cast<int16_t *>(buffer.data()),
+                                 samples, 1.0f);
+      ASSERT_TRUE(std::equal(shorts.begin(), shorts.end(),
+                             reinterpret_cast<int16_t *>(buffer.data())));
+    }
+  });
+}
+
+TEST(cubeb, convert_dither)
+{
+  const size_t samples = 4099;
+  std::vector<float> in(samples);
+  for (size_t i = 0; i < samples; i++) {
+    in[i] = 0.3f * sinf(i * 0.01f);
+  }
+  std::vector<int16_t> undithered(samples);
+  cubeb_convert_float_to_s16(in.data(), undithered.data(), samples, 1.0f);
+
+  std::vector<int16_t> reference;
+  for_each_simd_level([&](int level) {
+    cubeb_convert_dither_state state;
+    cubeb_convert_dither_init(&state, 42);
+    std::vector<int16_t> out(samples);
+    /* In two parts, to check that the state carries over. */
+    cubeb_convert_float_to_s16_dither(in.data(), out.data(), 1001, 1.0f,
+                                      &state);
+    cubeb_convert_float_to_s16_dither(in.data() + 1001, out.data() + 1001,
+                                      samples - 1001, 1.0f, &state);
+    if (level == CUBEB_CONVERT_SIMD_NONE) {
+      reference = out;
+    } else {
+      ASSERT_EQ(out, reference);
+    }
+  });
+
+  size_t changed = 0;
+  double error = 0;
+  for (size_t i = 0; i < samples; i++) {
+    ASSERT_LE(abs(reference[i] - undithered[i]), 1);
+    changed += reference[i] != undithered[i];
+    error += reference[i] - in[i] * 32768.0;
+  }
+  ASSERT_GT(changed, samples / 10);
+  /* The noise has no DC offset. */
+  ASSERT_LT(std::fabs(error / samples), 0.05);
+}
+
+TEST(cubeb, convert_byteswap)
+{
+  for_each_simd_level([](int) {
+    for (size_t samples : convert_test_sizes) {
+      std::vector<uint16_t> in16(samples);
+      std::vector<uint32_t> in32(samples);
+      for (size_t i = 0; i < samples; i++) {
+        in16[i] = static_cast<uint16_t>(0x0102 + i);
+        in32[i] = 0x01020304 + i;
+      }
+      std::vector<uint16_t> out16(samples);
+      std::vector<uint32_t> out32(samples);
+      cubeb_convert_byteswap16(in16.data(), out16.data(), samples);
+      cubeb_convert_byteswap32(in32.data(), out32.data(), samples);
+      for (size_t i = 0; i < samples; i++) {
+        uint16_t x = in16[i];
+        uint32_t y = in32[i];
+        ASSERT_EQ(out16[i], ((x & 0xff) << 8) | (x >> 8));
+        ASSERT_EQ(out32[i], ((y & 0xff) << 24) | ((y & 0xff00) << 8) |
+                            ((y >> 8) & 0xff00) | (y >> 24));
+      }
+    }
+  });
+}
+
+TEST(cubeb, convert_interleave)
+{
+  for_each_simd_level([](int) {
+    for (uint32_t channels = 1; channels <= 3; channels++) {
+      for (size_t frames : convert_test_sizes) {
+        std::vector<float> interleaved = convert_test_floats(frames * channels);
+        std::vector<std::vector<float>> planar(channels,
+                                               std::vector<float>(frames));
+        std::vector<float *> planes;
+        for (auto & p : planar) {
+          planes.push_back(p.data());
+        }
+        cubeb_convert_deinterleave_float(interleaved.data(), planes.data(),
+                                         channels, frames, 0.5f);
+        for (size_t f = 0; f < frames; f++) {
+          for (uint32_t c = 0; c < channels; c++) {
+            ASSERT_EQ(planar[c][f], interleaved[f * channels + c] * 0.5f);
+          }
+        }
+
+        std::vector<float> back(frames * channels);
+        std::vector<const float *> const_planes(planes.begin(), planes.end());
+        cubeb_convert_interleave_float(const_planes.data(), back.data(),
+                                       channels, frames, 2.0f);
+        ASSERT_EQ(back, interleaved);
+      }
+    }
+  });
+}
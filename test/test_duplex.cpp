@@ -175,3 +175,64 @@ TEST(cubeb, duplex_collection_change)
   ASSERT_EQ(r, CUBEB_OK) << "Error initializing cubeb stream";
   cubeb_stream_destroy(stream);
 }
+
+TEST(cubeb, duplex_input_buffer_bounds)
+{
+  cubeb *ctx;
+  cubeb_stream *stream;
+  cubeb_stream_params input_params;
+  cubeb_stream_params output_params;
+  int r;
+  user_state_duplex stream_state;
+  uint32_t latency_frames = 0;
+
+  r = common_init(&ctx, "Cubeb duplex example with input buffer bounds");
+  ASSERT_EQ(r, CUBEB_OK) << "Error initializing cubeb library";
+
+  std::unique_ptr<cubeb, decltype(&cubeb_destroy)>
+    cleanup_cubeb_at_exit(ctx, cubeb_destroy);
+
+  if (!has_available_input_device(ctx)) {
+    return;
+  }
+
+  input_params.format = STREAM_FORMAT;
+  input_params.rate = 48000;
+  input_params.channels = 1;
+  input_params.layout = CUBEB_LAYOUT_MONO;
+  input_params.prefs = CUBEB_STREAM_PREF_NONE;
+  output_params.format = STREAM_FORMAT;
+  output_params.rate = 48000;
+  output_params.channels = 2;
+  output_params.layout = CUBEB_LAYOUT_STEREO;
+  output_params.prefs = CUBEB_STREAM_PREF_NONE;
+
+  r = cubeb_get_min_latency(ctx, &output_params, &latency_frames);
+  ASSERT_EQ(r, CUBEB_OK) << "Could not get minimal latency";
+
+  r = cubeb_stream_init(ctx, &stream, "Cubeb duplex",
+                        NULL, &input_params, NULL, &output_params,
+                        latency_frames, data_cb_duplex, state_cb_duplex, &stream_state);
+  ASSERT_EQ(r, CUBEB_OK) << "Error initializing cubeb stream";
+
+  std::unique_ptr<cubeb_stream, decltype(&cubeb_stream_destroy)>
+    cleanup_stream_at_exit(stream, cubeb_stream_destroy);
+
+  ASSERT_EQ(cubeb_stream_set_input_buffer_bounds(stream, 4800, 480),
+            CUBEB_ERROR_INVALID_PARAMETER);
+  /* Between 2ms and 100ms. */
+  r = cubeb_stream_set_input_buffer_bounds(stream, 96, 4800);
+  if (r == CUBEB_ERROR_NOT_SUPPORTED) {
+    return;
+  }
+  ASSERT_EQ(r, CUBEB_OK);
+
+  cubeb_stream_start(stream);
+  /* The input is being buffered: too late to change how. */
+  ASSERT_EQ(cubeb_stream_set_input_buffer_bounds(stream, 96, 4800),
+            CUBEB_ERROR);
+  delay(500);
+  cubeb_stream_stop(stream);
+
+  ASSERT_TRUE(stream_state.seen_audio.load());
+}
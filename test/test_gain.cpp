@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#include "gtest/gtest.h"
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include "cubeb/cubeb.h"
+#include "cubeb_gain.h"
+#include "cubeb_panner.h"
+
+#if !defined(M_PI)
+#define M_PI 3.14159265358979323846
+#endif
+
+TEST(cubeb, gain_unity)
+{
+  cubeb_gain * gain = cubeb_gain_create(2);
+  std::vector<float> in(2 * 100);
+  for (size_t i = 0; i < in.size(); i++) {
+    in[i] = i / 200.0f;
+  }
+  std::vector<float> out(in.size());
+
+  float uniform = 0;
+  ASSERT_EQ(cubeb_gain_get_uniform(gain, &uniform), 1);
+  ASSERT_EQ(uniform, 1.0f);
+  cubeb_gain_apply_float(gain, in.data(), out.data(), 100);
+  ASSERT_EQ(out, in);
+
+  cubeb_gain_destroy(gain);
+}
+
+/* A volume set before the first block is applied at once, later ones are
+ * ramped to over the next block. */
+TEST(cubeb, gain_ramp)
+{
+  const size_t frames = 256;
+  cubeb_gain * gain = cubeb_gain_create(2);
+  std::vector<float> in(2 * frames, 1.0f);
+  std::vector<float> out(in.size());
+
+  cubeb_gain_set_volume(gain, 0.5f);
+  cubeb_gain_apply_float(gain, in.data(), out.data(), frames);
+  ASSERT_EQ(out, std::vector<float>(in.size(), 0.5f));
+
+  cubeb_gain_set_volume(gain, 0.0f);
+  float uniform;
+  ASSERT_EQ(cubeb_gain_get_uniform(gain, &uniform), 0);
+  cubeb_gain_apply_float(gain, in.data(), out.data(), frames);
+  for (size_t f = 0; f < frames; f++) {
+    float expected = 0.5f - 0.5f * (f + 1) / frames;
+    ASSERT_NEAR(out[2 * f], expected, 1e-6);
+    ASSERT_EQ(out[2 * f], out[2 * f + 1]);
+  }
+  /* Each frame is quieter than the previous one. */
+  for (size_t f = 1; f < frames; f++) {
+    ASSERT_LT(out[2 * f], out[2 * (f - 1)]);
+  }
+
+  ASSERT_EQ(cubeb_gain_get_uniform(gain, &uniform), 1);
+  ASSERT_EQ(uniform, 0.0f);
+  cubeb_gain_apply_float(gain, in.data(), out.data(), frames);
+  ASSERT_EQ(out, std::vector<float>(in.size(), 0.0f));
+
+  cubeb_gain_destroy(gain);
+}
+
+TEST(cubeb, gain_channel_volumes)
+{
+  const size_t frames = 37;
+  cubeb_gain * gain = cubeb_gain_create(3);
+  const float volumes[] = { 1.0f, 0.5f, 0.0f };
+  ASSERT_EQ(cubeb_gain_set_channel_volumes(gain, volumes, 2),
+            CUBEB_ERROR_INVALID_PARAMETER);
+  ASSERT_EQ(cubeb_gain_set_channel_volumes(gain, volumes, 3), CUBEB_OK);
+  cubeb_gain_set_volume(gain, 0.5f);
+
+  std::vector<int16_t> in(3 * frames);
+  for (size_t i = 0; i < in.size(); i++) {
+    in[i] = static_cast<int16_t>(i * 1771 - 32768);
+  }
+  std::vector<int16_t> out(in.size());
+  float uniform;
+  ASSERT_EQ(cubeb_gain_get_uniform(gain, &uniform), 0);
+  cubeb_gain_apply_s16(gain, in.data(), out.data(), frames);
+  for (size_t i = 0; i < in.size(); i++) {
+    float g = 0.5f * volumes[i % 3];
+    ASSERT_EQ(out[i], static_cast<int16_t>(lrintf(in[i] * g)));
+  }
+
+  /* In place. */
+  cubeb_gain_apply_s16(gain, in.data(), in.data(), frames);
+  ASSERT_EQ(in, out);
+
+  cubeb_gain_destroy(gain);
+}
+
+TEST(cubeb, gain_panning)
+{
+  /* 5.1 is FL, FR, FC, LFE, SL, SR. */
+  const uint32_t channels = 6;
+  float gains[channels];
+  float cross[channels];
+  cubeb_pan_gains(CUBEB_LAYOUT_3F2_LFE, channels, 0.0f, gains, cross);
+  for (uint32_t c = 0; c < channels; c++) {
+    ASSERT_EQ(gains[c], 1.0f);
+    ASSERT_EQ(cross[c], 0.0f);
+  }
+  cubeb_pan_gains(CUBEB_LAYOUT_3F2_LFE, channels, 0.5f, gains, cross);
+  const float attenuation = sqrtf(2.0f) * sinf(M_PI / 8);
+  const float expected[] = { attenuation, 1, 1, 1, attenuation, 1 };
+  for (uint32_t c = 0; c < channels; c++) {
+    ASSERT_NEAR(gains[c], expected[c], 1e-6);
+    ASSERT_EQ(cross[c], 0.0f);
+  }
+  /* An undefined layout is panned if it is stereo, and not otherwise. */
+  cubeb_pan_gains(CUBEB_LAYOUT_UNDEFINED, 3, -1.0f, gains, cross);
+  for (uint32_t c = 0; c < 3; c++) {
+    ASSERT_EQ(gains[c], 1.0f);
+    ASSERT_EQ(cross[c], 0.0f);
+  }
+
+  /* Fully to the left: the right channels are silent once the ramp is
+   * over, and the others untouched. */
+  const size_t frames = 64;
+  cubeb_gain * gain = cubeb_gain_create(channels);
+  std::vector<float> in(channels * frames, 0.25f);
+  std::vector<float> out(in.size());
+  cubeb_gain_apply_float(gain, in.data(), out.data(), frames);
+  cubeb_gain_set_panning(gain, CUBEB_LAYOUT_3F2_LFE, -1.0f);
+  cubeb_gain_apply_float(gain, in.data(), out.data(), frames);
+  cubeb_gain_apply_float(gain, in.data(), out.data(), frames);
+  const bool right[] = { false, true, false, false, false, true };
+  for (size_t i = 0; i < out.size(); i++) {
+    ASSERT_EQ(out[i], right[i % channels] ? 0.0f : 0.25f);
+  }
+
+  cubeb_gain_destroy(gain);
+}
+
+/* Stereo keeps the cos/sin law on [0; 1], where the channel the stream is
+ * panned away from is mixed into the other one. */
+TEST(cubeb, gain_panning_stereo)
+{
+  float gains[2];
+  float cross[2];
+  cubeb_pan_gains(CUBEB_LAYOUT_UNDEFINED, 2, -1.0f, gains, cross);
+  ASSERT_EQ(gains[0], 1.0f);
+  ASSERT_NEAR(gains[1], 0.0f, 1e-6);
+  ASSERT_NEAR(cross[0], 1.0f, 1e-6);
+  ASSERT_EQ(cross[1], 0.0f);
+  cubeb_pan_gains(CUBEB_LAYOUT_STEREO, 2, 0.5f, gains, cross);
+  ASSERT_NEAR(gains[0], cosf(0.75f * M_PI / 2), 1e-6);
+  ASSERT_EQ(gains[1], 1.0f);
+  ASSERT_EQ(cross[0], 0.0f);
+  ASSERT_NEAR(cross[1], sinf(0.75f * M_PI / 2), 1e-6);
+
+  const size_t frames = 64;
+  cubeb_gain * gain = cubeb_gain_create(2);
+  std::vector<short> in(2 * frames);
+  for (size_t f = 0; f < frames; f++) {
+    in[2 * f] = 1000;
+    in[2 * f + 1] = 3000;
+  }
+  std::vector<short> out(in.size());
+  cubeb_gain_apply_s16(gain, in.data(), out.data(), frames);
+  ASSERT_EQ(out, in);
+
+  /* Fully to the left, the right channel ends up in the left one. The ramp
+   * goes there without a jump. */
+  cubeb_gain_set_panning(gain, CUBEB_LAYOUT_STEREO, -1.0f);
+  float uniform;
+  ASSERT_EQ(cubeb_gain_get_uniform(gain, &uniform), 0);
+  cubeb_gain_apply_s16(gain, in.data(), out.data(), frames);
+  for (size_t f = 0; f < frames; f++) {
+    float k = float(f + 1) / frames;
+    ASSERT_NEAR(out[2 * f], 1000 + 3000 * k, 1);
+    ASSERT_NEAR(out[2 * f + 1], 3000 * (1 - k), 1);
+  }
+  cubeb_gain_apply_s16(gain, in.data(), out.data(), frames);
+  for (size_t f = 0; f < frames; f++) {
+    ASSERT_EQ(out[2 * f], 4000);
+    ASSERT_EQ(out[2 * f + 1], 0);
+  }
+
+  /* Back to the center, the channels are apart again. */
+  cubeb_gain_set_panning(gain, CUBEB_LAYOUT_STEREO, 0.0f);
+  cubeb_gain_apply_s16(gain, in.data(), out.data(), frames);
+  cubeb_gain_apply_s16(gain, in.data(), out.data(), frames);
+  ASSERT_EQ(out, in);
+  ASSERT_EQ(cubeb_gain_get_uniform(gain, &uniform), 1);
+  ASSERT_EQ(uniform, 1.0f);
+
+  cubeb_gain_destroy(gain);
+}
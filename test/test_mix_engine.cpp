@@ -0,0 +1,231 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#include "gtest/gtest.h"
+#include <limits.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "cubeb/cubeb.h"
+#include "cubeb_gain.h"
+#include "cubeb_mix_engine.h"
+
+namespace {
+
+/* A source writing a constant, for `length` frames, then nothing. */
+struct constant_source {
+  float value;
+  long length;
+  long played;
+  std::atomic<bool> removed;
+  std::atomic<int> late_calls;
+
+  explicit constant_source(float value, long length = LONG_MAX)
+    : value(value), length(length), played(0), removed(false), late_calls(0)
+  {
+  }
+};
+
+template<typename T>
+long constant_source_callback(void * user_ptr, void * buffer, long frames)
+{
+  constant_source * source = static_cast<constant_source *>(user_ptr);
+  if (source->removed) {
+    source->late_calls++;
+  }
+  long got = std::min(frames, source->length - source->played);
+  T * out = static_cast<T *>(buffer);
+  T sample = std::is_same<T, float>::value
+             ? static_cast<T>(source->value)
+             : static_cast<T>(source->value * 32768);
+  for (long i = 0; i < got * 2; i++) {
+    out[i] = sample;
+  }
+  source->played += got;
+  return got;
+}
+
+} // namespace
+
+TEST(cubeb, mix_engine_sum)
+{
+  ASSERT_FALSE(cubeb_mix_engine_create(CUBEB_SAMPLE_FLOAT32BE, 2));
+  ASSERT_FALSE(cubeb_mix_engine_create(CUBEB_SAMPLE_FLOAT32NE, 0));
+
+  cubeb_mix_engine * engine = cubeb_mix_engine_create(CUBEB_SAMPLE_FLOAT32NE, 2);
+  ASSERT_TRUE(engine);
+
+  /* Nothing to mix: silence. */
+  const long frames = 5000;
+  std::vector<float> out(2 * frames, 1.0f);
+  ASSERT_EQ(cubeb_mix_engine_mix(engine, out.data(), frames), 0u);
+  ASSERT_EQ(out, std::vector<float>(out.size(), 0.0f));
+
+  /* The second one stops in the middle, the third one is half as loud. */
+  constant_source a(0.25f), b(0.125f, 1000), c(0.5f);
+  cubeb_gain * gain = cubeb_gain_create(2);
+  cubeb_gain_set_volume(gain, 0.5f);
+  cubeb_mix_source * sa =
+    cubeb_mix_source_create(engine, constant_source_callback<float>, &a, nullptr);
+  cubeb_mix_source * sb =
+    cubeb_mix_source_create(engine, constant_source_callback<float>, &b, nullptr);
+  cubeb_mix_source * sc =
+    cubeb_mix_source_create(engine, constant_source_callback<float>, &c, gain);
+  ASSERT_EQ(cubeb_mix_engine_add(engine, sa), CUBEB_OK);
+  ASSERT_EQ(cubeb_mix_engine_add(engine, sa), CUBEB_ERROR);
+  ASSERT_EQ(cubeb_mix_engine_add(engine, sb), CUBEB_OK);
+  ASSERT_EQ(cubeb_mix_engine_add(engine, sc), CUBEB_OK);
+
+  ASSERT_EQ(cubeb_mix_engine_mix(engine, out.data(), frames), 3u);
+  for (long i = 0; i < 2 * frames; i++) {
+    ASSERT_EQ(out[i], i < 2 * 1000 ? 0.625f : 0.5f);
+  }
+
+  cubeb_mix_engine_remove(engine, sa);
+  cubeb_mix_engine_remove(engine, sa);
+  ASSERT_EQ(cubeb_mix_engine_mix(engine, out.data(), frames), 2u);
+  ASSERT_EQ(out, std::vector<float>(out.size(), 0.25f));
+
+  /* Added back. */
+  ASSERT_EQ(cubeb_mix_engine_add(engine, sa), CUBEB_OK);
+  ASSERT_EQ(cubeb_mix_engine_mix(engine, out.data(), frames), 3u);
+  ASSERT_EQ(out, std::vector<float>(out.size(), 0.5f));
+
+  cubeb_mix_engine_remove(engine, sa);
+  cubeb_mix_engine_remove(engine, sb);
+  cubeb_mix_engine_remove(engine, sc);
+  cubeb_mix_source_destroy(sa);
+  cubeb_mix_source_destroy(sb);
+  cubeb_mix_source_destroy(sc);
+  cubeb_gain_destroy(gain);
+  cubeb_mix_engine_destroy(engine);
+}
+
+TEST(cubeb, mix_engine_s16_clips)
+{
+  cubeb_mix_engine * engine = cubeb_mix_engine_create(CUBEB_SAMPLE_S16NE, 2);
+  constant_source a(0.75f), b(0.75f), c(-0.5f);
+  cubeb_mix_source * sources[] = {
+    cubeb_mix_source_create(engine, constant_source_callback<int16_t>, &a, nullptr),
+    cubeb_mix_source_create(engine, constant_source_callback<int16_t>, &b, nullptr),
+    cubeb_mix_source_create(engine, constant_source_callback<int16_t>, &c, nullptr),
+  };
+  const long frames = 256;
+  std::vector<int16_t> out(2 * frames);
+
+  /* The sum is only clipped once all the sources are added. */
+  for (cubeb_mix_source * source : sources) {
+    cubeb_mix_engine_add(engine, source);
+  }
+  cubeb_mix_engine_mix(engine, out.data(), frames);
+  ASSERT_EQ(out, std::vector<int16_t>(out.size(), 32767));
+
+  cubeb_mix_engine_remove(engine, sources[2]);
+  cubeb_mix_engine_mix(engine, out.data(), frames);
+  ASSERT_EQ(out, std::vector<int16_t>(out.size(), 32767));
+
+  cubeb_mix_engine_remove(engine, sources[0]);
+  cubeb_mix_engine_mix(engine, out.data(), frames);
+  ASSERT_EQ(out, std::vector<int16_t>(out.size(), 24576));
+
+  cubeb_mix_engine_remove(engine, sources[1]);
+  for (cubeb_mix_source * source : sources) {
+    cubeb_mix_source_destroy(source);
+  }
+  cubeb_mix_engine_destroy(engine);
+}
+
+/* Sources are added and removed while another thread mixes: once removed, a
+ * source is never called again. */
+TEST(cubeb, mix_engine_threads)
+{
+  cubeb_mix_engine * engine = cubeb_mix_engine_create(CUBEB_SAMPLE_FLOAT32NE, 2);
+  const int source_count = 16;
+  std::vector<std::unique_ptr<constant_source>> states;
+  std::vector<cubeb_mix_source *> sources;
+  for (int i = 0; i < source_count; i++) {
+    states.emplace_back(new constant_source(0.01f));
+    sources.push_back(cubeb_mix_source_create(engine,
+                                              constant_source_callback<float>,
+                                              states.back().get(), nullptr));
+  }
+
+  std::atomic<bool> done(false);
+  std::thread mixing([&]() {
+    std::vector<float> out(2 * 128);
+    while (!done) {
+      cubeb_mix_engine_mix(engine, out.data(), 128);
+    }
+  });
+
+  /* Two threads, each adding and removing its half of the sources. */
+  auto control = [&](int first) {
+    for (int i = 0; i < 2000; i++) {
+      int s = first + i % (source_count / 2);
+      states[s]->removed = false;
+      cubeb_mix_engine_add(engine, sources[s]);
+      std::this_thread::yield();
+      cubeb_mix_engine_remove(engine, sources[s]);
+      states[s]->removed = true;
+    }
+  };
+  std::thread control0(control, 0);
+  std::thread control1(control, source_count / 2);
+  control0.join();
+  control1.join();
+  done = true;
+  mixing.join();
+
+  for (int i = 0; i < source_count; i++) {
+    ASSERT_EQ(states[i]->late_calls, 0);
+    cubeb_mix_source_destroy(sources[i]);
+  }
+  cubeb_mix_engine_destroy(engine);
+}
+
+namespace {
+
+long
+done_source_callback(void * user_ptr, void *, long)
+{
+  int * calls = static_cast<int *>(user_ptr);
+  (*calls)++;
+  return -1;
+}
+
+} // namespace
+
+/* A source that returns a negative value isn't called again until it is
+ * added again. */
+TEST(cubeb, mix_engine_done)
+{
+  cubeb_mix_engine * engine = cubeb_mix_engine_create(CUBEB_SAMPLE_FLOAT32NE, 2);
+  int calls = 0;
+  cubeb_mix_source * source =
+    cubeb_mix_source_create(engine, done_source_callback, &calls, nullptr);
+  std::vector<float> out(2 * 128, 1.0f);
+
+  ASSERT_EQ(cubeb_mix_engine_add(engine, source), CUBEB_OK);
+  ASSERT_EQ(cubeb_mix_engine_mix(engine, out.data(), 128), 0u);
+  ASSERT_EQ(out, std::vector<float>(out.size(), 0.0f));
+  ASSERT_EQ(cubeb_mix_engine_mix(engine, out.data(), 128), 0u);
+  ASSERT_EQ(calls, 1);
+
+  /* Still added until removed. */
+  ASSERT_EQ(cubeb_mix_engine_add(engine, source), CUBEB_ERROR);
+  cubeb_mix_engine_remove(engine, source);
+  ASSERT_EQ(cubeb_mix_engine_add(engine, source), CUBEB_OK);
+  cubeb_mix_engine_mix(engine, out.data(), 128);
+  ASSERT_EQ(calls, 2);
+
+  cubeb_mix_engine_remove(engine, source);
+  cubeb_mix_source_destroy(source);
+  cubeb_mix_engine_destroy(engine);
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#include "gtest/gtest.h"
+#include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "cubeb/cubeb.h"
+#include "cubeb_mixer.h"
+
+const cubeb_channel_layout mixer_test_layouts[] = {
+  CUBEB_LAYOUT_MONO,
+  CUBEB_LAYOUT_STEREO,
+  CUBEB_LAYOUT_STEREO_LFE,
+  CUBEB_LAYOUT_3F,
+  CUBEB_LAYOUT_QUAD,
+  CUBEB_LAYOUT_3F1_LFE,
+  CUBEB_LAYOUT_3F2_LFE,
+  CUBEB_LAYOUT_3F2_LFE_BACK,
+  CUBEB_LAYOUT_3F3R_LFE,
+  CUBEB_LAYOUT_3F4_LFE,
+};
+
+template<typename T>
+cubeb_sample_format mixer_test_format();
+
+template<>
+cubeb_sample_format mixer_test_format<float>()
+{
+  return CUBEB_SAMPLE_FLOAT32NE;
+}
+
+template<>
+cubeb_sample_format mixer_test_format<int16_t>()
+{
+  return CUBEB_SAMPLE_S16NE;
+}
+
+template<typename T>
+T mixer_test_sample(uint32_t & seed);
+
+template<>
+float mixer_test_sample<float>(uint32_t & seed)
+{
+  seed = seed * 1664525 + 1013904223;
+  return (seed >> 8) / static_cast<float>(1 << 23) - 1;
+}
+
+template<>
+int16_t mixer_test_sample<int16_t>(uint32_t & seed)
+{
+  seed = seed * 1664525 + 1013904223;
+  return static_cast<int16_t>(seed >> 16);
+}
+
+/* Mixes `frames` frames at once, then one at a time: the kernels write whole
+ * vectors, that overflow into the next frame, except at the end of the
+ * buffer. */
+template<typename T>
+void test_mixer_frame_by_frame(cubeb_channel_layout in_layout,
+                               cubeb_channel_layout out_layout)
+{
+  const uint32_t in_channels = cubeb_channel_layout_nb_channels(in_layout);
+  const uint32_t out_channels = cubeb_channel_layout_nb_channels(out_layout);
+  const size_t frames = 131;
+  cubeb_mixer * mixer = cubeb_mixer_create(mixer_test_format<T>(),
+                                           in_channels, in_layout,
+                                           out_channels, out_layout);
+
+  uint32_t seed = 1;
+  std::vector<T> input(frames * in_channels);
+  for (T & sample : input) {
+    sample = mixer_test_sample<T>(seed);
+  }
+  std::vector<T> expected(frames * out_channels);
+  ASSERT_EQ(cubeb_mixer_mix(mixer, frames,
+                            input.data(), input.size() * sizeof(T),
+                            expected.data(), expected.size() * sizeof(T)),
+            0);
+
+  for (size_t i = 0; i < frames; i++) {
+    std::vector<T> output(out_channels);
+    ASSERT_EQ(cubeb_mixer_mix(mixer, 1,
+                              input.data() + i * in_channels,
+                              in_channels * sizeof(T),
+                              output.data(), out_channels * sizeof(T)),
+              0);
+    for (uint32_t c = 0; c < out_channels; c++) {
+      ASSERT_EQ(output[c], expected[i * out_channels + c])
+        << "layout " << in_layout << " to " << out_layout
+        << ", frame " << i << ", channel " << c;
+    }
+  }
+  cubeb_mixer_destroy(mixer);
+}
+
+TEST(cubeb, mixer_frame_by_frame)
+{
+  for (cubeb_channel_layout in : mixer_test_layouts) {
+    for (cubeb_channel_layout out : mixer_test_layouts) {
+      test_mixer_frame_by_frame<float>(in, out);
+      test_mixer_frame_by_frame<int16_t>(in, out);
+    }
+  }
+}
+
+TEST(cubeb, mixer_stereo_to_mono)
+{
+  cubeb_mixer * mixer = cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE,
+                                           2, CUBEB_LAYOUT_STEREO,
+                                           1, CUBEB_LAYOUT_MONO);
+  const float input[] = { 0.25f, 0.5f, -1.0f, 1.0f, 0.125f, -0.5f };
+  float output[3];
+  ASSERT_EQ(cubeb_mixer_mix(mixer, 3, input, sizeof(input),
+                            output, sizeof(output)),
+            0);
+  for (uint32_t i = 0; i < 3; i++) {
+    ASSERT_NEAR(output[i], (input[2 * i] + input[2 * i + 1]) * 0.70710678f, 1e-6);
+  }
+  cubeb_mixer_destroy(mixer);
+}
+
+TEST(cubeb, mixer_copy_s16)
+{
+  // A coefficient of 1, which doesn't fit in 16 bits: the samples are copied.
+  cubeb_mixer * mixer = cubeb_mixer_create(CUBEB_SAMPLE_S16NE,
+                                           2, CUBEB_LAYOUT_STEREO,
+                                           4, CUBEB_LAYOUT_QUAD);
+  const int16_t input[] = { 32767, -32768, 1, -1, 0, 12345, -12345, 7 };
+  int16_t output[4 * 4];
+  ASSERT_EQ(cubeb_mixer_mix(mixer, 4, input, sizeof(input),
+                            output, sizeof(output)),
+            0);
+  for (uint32_t i = 0; i < 4; i++) {
+    ASSERT_EQ(output[4 * i], input[2 * i]);
+    ASSERT_EQ(output[4 * i + 1], input[2 * i + 1]);
+    ASSERT_EQ(output[4 * i + 2], 0);
+    ASSERT_EQ(output[4 * i + 3], 0);
+  }
+  cubeb_mixer_destroy(mixer);
+}
+
+/* Drives each output channel to full scale, with the sign of each input
+ * channel matching the one of its coefficient. */
+void test_mixer_saturates(cubeb_channel_layout in_layout,
+                          cubeb_channel_layout out_layout)
+{
+  const uint32_t in_channels = cubeb_channel_layout_nb_channels(in_layout);
+  const uint32_t out_channels = cubeb_channel_layout_nb_channels(out_layout);
+  cubeb_mixer * mixer = cubeb_mixer_create(CUBEB_SAMPLE_S16NE,
+                                           in_channels, in_layout,
+                                           out_channels, out_layout);
+  // The coefficients, scaled down.
+  std::vector<int16_t> coefficients(in_channels * out_channels);
+  for (uint32_t j = 0; j < in_channels; j++) {
+    std::vector<int16_t> input(in_channels);
+    input[j] = 16384;
+    ASSERT_EQ(cubeb_mixer_mix(mixer, 1,
+                              input.data(), input.size() * sizeof(int16_t),
+                              coefficients.data() + j * out_channels,
+                              out_channels * sizeof(int16_t)),
+              0);
+  }
+
+  for (uint32_t o = 0; o < out_channels; o++) {
+    for (int sign = -1; sign <= 1; sign += 2) {
+      std::vector<int16_t> input(in_channels);
+      bool used = false;
+      for (uint32_t j = 0; j < in_channels; j++) {
+        int16_t c = coefficients[j * out_channels + o];
+        used |= c != 0;
+        if (c) {
+          input[j] = (c > 0) == (sign > 0) ? 32767 : -32768;
+        }
+      }
+      std::vector<int16_t> output(out_channels);
+      ASSERT_EQ(cubeb_mixer_mix(mixer, 1,
+                                input.data(), input.size() * sizeof(int16_t),
+                                output.data(), output.size() * sizeof(int16_t)),
+                0);
+      if (used) {
+        ASSERT_GT(sign * output[o], 0)
+          << "layout " << in_layout << " to " << out_layout
+          << ", channel " << o;
+      }
+    }
+  }
+  cubeb_mixer_destroy(mixer);
+}
+
+TEST(cubeb, mixer_s16_saturates)
+{
+  // The rounding of the coefficients can take the sums past full scale: they
+  // saturate instead of wrapping around.
+  for (cubeb_channel_layout in : mixer_test_layouts) {
+    for (cubeb_channel_layout out : mixer_test_layouts) {
+      test_mixer_saturates(in, out);
+    }
+  }
+}
+
+template<typename T>
+void test_mixer_specialized(cubeb_channel_layout in_layout,
+                            cubeb_channel_layout out_layout)
+{
+  const uint32_t in_channels = cubeb_channel_layout_nb_channels(in_layout);
+  const uint32_t out_channels = cubeb_channel_layout_nb_channels(out_layout);
+  // Odd, for the last frame that the specialized kernels leave to the generic
+  // ones.
+  const size_t frames = 257;
+  uint32_t seed = 1;
+  std::vector<T> input(frames * in_channels);
+  for (T & sample : input) {
+    sample = mixer_test_sample<T>(seed);
+  }
+
+  std::vector<T> outputs[2];
+  for (int specialized = 0; specialized < 2; specialized++) {
+    cubeb_mixer_set_specialized_kernels(specialized);
+    cubeb_mixer * mixer = cubeb_mixer_create(mixer_test_format<T>(),
+                                             in_channels, in_layout,
+                                             out_channels, out_layout);
+    outputs[specialized].resize(frames * out_channels);
+    ASSERT_EQ(cubeb_mixer_mix(mixer, frames,
+                              input.data(), input.size() * sizeof(T),
+                              outputs[specialized].data(),
+                              outputs[specialized].size() * sizeof(T)),
+              0);
+    cubeb_mixer_destroy(mixer);
+  }
+  cubeb_mixer_set_specialized_kernels(1);
+  ASSERT_EQ(outputs[0], outputs[1])
+    << "layout " << in_layout << " to " << out_layout;
+}
+
+TEST(cubeb, mixer_specialized_kernels)
+{
+  ASSERT_GT(cubeb_mixer_set_specialized_kernels(1), 0);
+  const cubeb_channel_layout pairs[][2] = {
+    { CUBEB_LAYOUT_3F2_LFE, CUBEB_LAYOUT_STEREO },
+    { CUBEB_LAYOUT_3F2_LFE_BACK, CUBEB_LAYOUT_STEREO },
+    { CUBEB_LAYOUT_3F4_LFE, CUBEB_LAYOUT_STEREO },
+    { CUBEB_LAYOUT_STEREO, CUBEB_LAYOUT_3F2_LFE },
+    { CUBEB_LAYOUT_MONO, CUBEB_LAYOUT_STEREO },
+  };
+  for (uint32_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+    test_mixer_specialized<float>(pairs[i][0], pairs[i][1]);
+    test_mixer_specialized<int16_t>(pairs[i][0], pairs[i][1]);
+  }
+}
+
+TEST(cubeb, mixer_shared_matrices)
+{
+  size_t initial = cubeb_mixer_shared_matrix_count();
+  cubeb_mixer * mixers[4] = {
+    cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE, 6, CUBEB_LAYOUT_3F2_LFE,
+                       2, CUBEB_LAYOUT_STEREO),
+    cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE, 6, CUBEB_LAYOUT_3F2_LFE,
+                       2, CUBEB_LAYOUT_STEREO),
+    // The S16 matrix is normalized differently.
+    cubeb_mixer_create(CUBEB_SAMPLE_S16NE, 6, CUBEB_LAYOUT_3F2_LFE,
+                       2, CUBEB_LAYOUT_STEREO),
+    cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO,
+                       6, CUBEB_LAYOUT_3F2_LFE),
+  };
+  ASSERT_EQ(cubeb_mixer_shared_matrix_count(), initial + 3);
+
+  // Mixers sharing a matrix mix the same.
+  std::vector<float> input(6 * 64, 0.25f);
+  std::vector<float> outputs[2];
+  for (int i = 0; i < 2; i++) {
+    outputs[i].resize(2 * 64);
+    ASSERT_EQ(cubeb_mixer_mix(mixers[i], 64,
+                              input.data(), input.size() * sizeof(float),
+                              outputs[i].data(), outputs[i].size() * sizeof(float)),
+              0);
+  }
+  ASSERT_EQ(outputs[0], outputs[1]);
+
+  cubeb_mixer_destroy(mixers[0]);
+  ASSERT_EQ(cubeb_mixer_shared_matrix_count(), initial + 3);
+  cubeb_mixer_destroy(mixers[1]);
+  ASSERT_EQ(cubeb_mixer_shared_matrix_count(), initial + 2);
+  cubeb_mixer_destroy(mixers[2]);
+  cubeb_mixer_destroy(mixers[3]);
+  ASSERT_EQ(cubeb_mixer_shared_matrix_count(), initial);
+}
+
+TEST(cubeb, mixer_shared_matrices_threads)
+{
+  size_t initial = cubeb_mixer_shared_matrix_count();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 200; i++) {
+        cubeb_channel_layout in = mixer_test_layouts[i % 4];
+        cubeb_mixer * mixer =
+          cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE,
+                             cubeb_channel_layout_nb_channels(in), in,
+                             2, CUBEB_LAYOUT_STEREO);
+        cubeb_mixer_destroy(mixer);
+      }
+    });
+  }
+  for (std::thread & thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(cubeb_mixer_shared_matrix_count(), initial);
+}
+
+/* A custom matrix is crossfaded in over the next call to cubeb_mixer_mix, then
+ * used alone, until the matrix of the layouts is restored the same way. */
+TEST(cubeb, mixer_set_matrix)
+{
+  const uint32_t in_channels = 6;
+  const uint32_t out_channels = 2;
+  const size_t frames = 150;
+  const float matrix[out_channels * in_channels] = {
+    0.5f, 0.0f, -0.25f, 1.0f, 0.0f, 0.125f,
+    0.0f, 0.75f, 0.25f, 0.0f, -1.0f, 0.5f,
+  };
+  cubeb_mixer * mixer = cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE,
+                                           in_channels, CUBEB_LAYOUT_3F2_LFE,
+                                           out_channels, CUBEB_LAYOUT_STEREO);
+
+  uint32_t seed = 1;
+  std::vector<float> input(frames * in_channels);
+  for (float & sample : input) {
+    sample = mixer_test_sample<float>(seed);
+  }
+  std::vector<float> custom(frames * out_channels);
+  for (size_t f = 0; f < frames; f++) {
+    for (uint32_t o = 0; o < out_channels; o++) {
+      for (uint32_t i = 0; i < in_channels; i++) {
+        custom[f * out_channels + o] +=
+          matrix[o * in_channels + i] * input[f * in_channels + i];
+      }
+    }
+  }
+  std::vector<float> layouts(frames * out_channels);
+  std::vector<float> output(frames * out_channels);
+  auto mix = [&](std::vector<float> & out) {
+    ASSERT_EQ(cubeb_mixer_mix(mixer, frames,
+                              input.data(), input.size() * sizeof(float),
+                              out.data(), out.size() * sizeof(float)),
+              0);
+  };
+  mix(layouts);
+
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, matrix), CUBEB_OK);
+  mix(output);
+  for (size_t f = 0; f < frames; f++) {
+    float t = static_cast<float>(f + 1) / frames;
+    for (uint32_t o = 0; o < out_channels; o++) {
+      size_t s = f * out_channels + o;
+      ASSERT_NEAR(output[s], layouts[s] * (1 - t) + custom[s] * t, 1e-5);
+    }
+  }
+  mix(output);
+  for (size_t s = 0; s < output.size(); s++) {
+    ASSERT_NEAR(output[s], custom[s], 1e-5);
+  }
+
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, nullptr), CUBEB_OK);
+  mix(output);
+  ASSERT_NE(output, layouts);
+  mix(output);
+  ASSERT_EQ(output, layouts);
+
+  const float nan_matrix[out_channels * in_channels] = { NAN };
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, nan_matrix),
+            CUBEB_ERROR_INVALID_PARAMETER);
+  cubeb_mixer_destroy(mixer);
+
+  // Out of the range of the 17.15 coefficients.
+  mixer = cubeb_mixer_create(CUBEB_SAMPLE_S16NE,
+                             in_channels, CUBEB_LAYOUT_3F2_LFE,
+                             out_channels, CUBEB_LAYOUT_STEREO);
+  const float loud_matrix[out_channels * in_channels] = { 1.5f };
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, loud_matrix),
+            CUBEB_ERROR_INVALID_PARAMETER);
+  // Too large to be rounded to an integer.
+  const float huge_matrix[out_channels * in_channels] = { -1e30f };
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, huge_matrix),
+            CUBEB_ERROR_INVALID_PARAMETER);
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, matrix), CUBEB_OK);
+  cubeb_mixer_destroy(mixer);
+}
+
+/* Matrices replaced while another thread mixes: each output sample is
+ * between the gains of the two matrices, and the channels stay in sync. */
+TEST(cubeb, mixer_set_matrix_threads)
+{
+  const size_t frames = 256;
+  const float gains[2] = { 0.25f, 0.75f };
+  cubeb_mixer * mixer = cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE,
+                                           2, CUBEB_LAYOUT_STEREO,
+                                           2, CUBEB_LAYOUT_STEREO);
+  std::vector<float> input(frames * 2, 1.0f);
+  std::vector<float> output(frames * 2);
+  const float first[4] = { gains[0], 0, 0, gains[0] };
+  ASSERT_EQ(cubeb_mixer_set_matrix(mixer, first), CUBEB_OK);
+  // Crossfade from the identity matrix of the layouts before starting.
+  cubeb_mixer_mix(mixer, frames,
+                  input.data(), input.size() * sizeof(float),
+                  output.data(), output.size() * sizeof(float));
+
+  std::atomic<bool> done(false);
+  std::thread control([&]() {
+    for (int i = 0; i < 2000; i++) {
+      float gain = gains[i % 2];
+      const float matrix[4] = { gain, 0, 0, gain };
+      cubeb_mixer_set_matrix(mixer, matrix);
+    }
+    done = true;
+  });
+
+  bool in_range = true;
+  while (!done && in_range) {
+    cubeb_mixer_mix(mixer, frames,
+                    input.data(), input.size() * sizeof(float),
+                    output.data(), output.size() * sizeof(float));
+    for (size_t f = 0; f < frames; f++) {
+      in_range &= output[2 * f] >= gains[0] - 1e-6f &&
+                  output[2 * f] <= gains[1] + 1e-6f &&
+                  output[2 * f] == output[2 * f + 1];
+    }
+  }
+  control.join();
+  ASSERT_TRUE(in_range);
+  cubeb_mixer_destroy(mixer);
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#include "gtest/gtest.h"
+#include <vector>
+#include "cubeb/cubeb.h"
+#include "cubeb_pipeline.h"
+
+struct pipeline_test_state {
+  /* Value of the first sample of each channel written by the callback. */
+  float value = 0.5f;
+  long max_frames_per_callback = 0;
+  long callbacks = 0;
+  long frames_available = -1;
+  void * last_output = nullptr;
+  const void * last_input = nullptr;
+};
+
+template<typename T>
+T pipeline_test_sample(float x);
+
+template<>
+float pipeline_test_sample<float>(float x) { return x; }
+
+template<>
+short pipeline_test_sample<short>(float x) { return static_cast<short>(x * 32768); }
+
+template<typename T>
+long pipeline_test_callback(cubeb_stream * stm, void * user_ptr,
+                            const void * input_buffer,
+                            void * output_buffer, long frame_count)
+{
+  pipeline_test_state * state = static_cast<pipeline_test_state *>(user_ptr);
+  state->callbacks++;
+  state->max_frames_per_callback =
+    std::max(state->max_frames_per_callback, frame_count);
+  state->last_output = output_buffer;
+  state->last_input = input_buffer;
+
+  long frames = frame_count;
+  if (state->frames_available >= 0) {
+    frames = std::min(frames, state->frames_available);
+    state->frames_available -= frames;
+  }
+  /* Stereo: the left channel is `value`, the right one is `-value / 2`. */
+  T * out = static_cast<T *>(output_buffer);
+  for (long i = 0; i < frames; i++) {
+    out[2 * i] = pipeline_test_sample<T>(state->value);
+    out[2 * i + 1] = pipeline_test_sample<T>(-state->value / 2);
+  }
+  return frames;
+}
+
+cubeb_stream_params
+pipeline_test_params(cubeb_sample_format format, uint32_t channels,
+                     cubeb_channel_layout layout)
+{
+  cubeb_stream_params params;
+  params.format = format;
+  params.rate = 48000;
+  params.channels = channels;
+  params.layout = layout;
+  params.prefs = CUBEB_STREAM_PREF_NONE;
+  return params;
+}
+
+TEST(cubeb, pipeline_passthrough)
+{
+  pipeline_test_state state;
+  cubeb_stream_params params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<float>, &state,
+                          nullptr, nullptr, &params, &params);
+  ASSERT_TRUE(pipeline);
+
+  std::vector<float> out(2 * 10000);
+  long got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), 10000);
+  ASSERT_EQ(got, 10000);
+  /* The callback wrote directly in the device buffer, in a single call. */
+  ASSERT_EQ(state.callbacks, 1);
+  ASSERT_EQ(state.last_output, out.data());
+  ASSERT_EQ(out[2 * 9999], 0.5f);
+
+  cubeb_pipeline_destroy(pipeline);
+}
+
+TEST(cubeb, pipeline_volume)
+{
+  pipeline_test_state state;
+  cubeb_stream_params params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<float>, &state,
+                          nullptr, nullptr, &params, &params);
+  ASSERT_TRUE(pipeline);
+
+  cubeb_pipeline_set_volume(pipeline, 0.5f);
+
+  const long frames = 10000;
+  std::vector<float> out(2 * frames);
+  long got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  /* Processed in blocks small enough to stay in the cache. */
+  ASSERT_GT(state.callbacks, 1);
+  ASSERT_LT(state.max_frames_per_callback, frames);
+  for (long i = 0; i < frames; i++) {
+    ASSERT_EQ(out[2 * i], 0.25f);
+    ASSERT_EQ(out[2 * i + 1], -0.125f);
+  }
+
+  cubeb_pipeline_destroy(pipeline);
+}
+
+TEST(cubeb, pipeline_convert)
+{
+  pipeline_test_state state;
+  state.value = 1.0f;
+  cubeb_stream_params stream_params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_stream_params device_params =
+    pipeline_test_params(CUBEB_SAMPLE_S16NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<float>, &state,
+                          nullptr, nullptr, &stream_params, &device_params);
+  ASSERT_TRUE(pipeline);
+
+  const long frames = 5000;
+  std::vector<short> out(2 * frames);
+  long got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  for (long i = 0; i < frames; i++) {
+    /* 1.0 is clipped. */
+    ASSERT_EQ(out[2 * i], 32767);
+    ASSERT_EQ(out[2 * i + 1], -16384);
+  }
+
+  /* The volume ramps down over the next block, then stays. */
+  cubeb_pipeline_set_volume(pipeline, 0.5f);
+  got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  for (long i = 1; i < frames; i++) {
+    ASSERT_LE(out[2 * i], out[2 * (i - 1)]);
+    ASSERT_GE(out[2 * i], 16384);
+  }
+  got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  for (long i = 0; i < frames; i++) {
+    ASSERT_EQ(out[2 * i], 16384);
+    ASSERT_EQ(out[2 * i + 1], -8192);
+  }
+
+  cubeb_pipeline_destroy(pipeline);
+}
+
+TEST(cubeb, pipeline_downmix)
+{
+  pipeline_test_state state;
+  cubeb_stream_params stream_params =
+    pipeline_test_params(CUBEB_SAMPLE_S16NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_stream_params device_params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 1, CUBEB_LAYOUT_MONO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<short>, &state,
+                          nullptr, nullptr, &stream_params, &device_params);
+  ASSERT_TRUE(pipeline);
+
+  const long frames = 20000;
+  std::vector<float> out(frames);
+  long got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  for (long i = 0; i < frames; i++) {
+    /* Stereo to mono is the average of both channels. */
+    ASSERT_NEAR(out[i], (0.5f - 0.25f) / 2, 1e-3);
+  }
+
+  cubeb_pipeline_destroy(pipeline);
+}
+
+TEST(cubeb, pipeline_mixing_matrix)
+{
+  pipeline_test_state state;
+  cubeb_stream_params params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<float>, &state,
+                          nullptr, nullptr, &params, &params);
+  ASSERT_TRUE(pipeline);
+
+  const float swap[4] = { 0, 1,
+                          1, 0 };
+  ASSERT_EQ(cubeb_pipeline_set_mixing_matrix(pipeline, swap, 2, 1),
+            CUBEB_ERROR_INVALID_PARAMETER);
+  ASSERT_EQ(cubeb_pipeline_set_mixing_matrix(pipeline, swap, 2, 2), CUBEB_OK);
+
+  const long frames = 10000;
+  std::vector<float> out(2 * frames);
+  long got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  /* The first block crossfades to the new matrix. */
+  ASSERT_NEAR(out[0], 0.5f, 1e-3);
+  ASSERT_EQ(out[2 * (frames - 1)], -0.25f);
+  ASSERT_EQ(out[2 * (frames - 1) + 1], 0.5f);
+
+  got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), frames);
+  ASSERT_EQ(got, frames);
+  for (long i = 0; i < frames; i++) {
+    ASSERT_EQ(out[2 * i], -0.25f);
+    ASSERT_EQ(out[2 * i + 1], 0.5f);
+  }
+
+  cubeb_pipeline_destroy(pipeline);
+}
+
+TEST(cubeb, pipeline_drain)
+{
+  pipeline_test_state state;
+  state.frames_available = 3000;
+  cubeb_stream_params params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<float>, &state,
+                          nullptr, nullptr, &params, &params);
+  ASSERT_TRUE(pipeline);
+  cubeb_pipeline_set_volume(pipeline, 0.5f);
+
+  std::vector<float> out(2 * 10000);
+  long got = cubeb_pipeline_fill(pipeline, nullptr, nullptr, out.data(), 10000);
+  ASSERT_EQ(got, 3000);
+
+  cubeb_pipeline_destroy(pipeline);
+}
+
+TEST(cubeb, pipeline_duplex_input)
+{
+  pipeline_test_state state;
+  cubeb_stream_params params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 2, CUBEB_LAYOUT_STEREO);
+  cubeb_stream_params input_params =
+    pipeline_test_params(CUBEB_SAMPLE_FLOAT32NE, 1, CUBEB_LAYOUT_MONO);
+  cubeb_pipeline * pipeline =
+    cubeb_pipeline_create(nullptr, pipeline_test_callback<float>, &state,
+                          nullptr, &input_params, &params, &params);
+  ASSERT_TRUE(pipeline);
+  cubeb_pipeline_set_volume(pipeline, 0.5f);
+
+  const long frames = 10000;
+  std::vector<float> in(frames);
+  std::vector<float> out(2 * frames);
+  long in_frames = frames;
+  long got = cubeb_pipeline_fill(pipeline, in.data(), &in_frames,
+                                 out.data(), frames);
+  ASSERT_EQ(got, frames);
+  ASSERT_EQ(in_frames, frames);
+  /* Each block got its own part of the input buffer. */
+  ASSERT_GT(state.callbacks, 1);
+  ASSERT_EQ(state.last_input, in.data() + (state.callbacks - 1) *
+                                          state.max_frames_per_callback);
+
+  cubeb_pipeline_destroy(pipeline);
+}
@@ -10,9 +10,14 @@
 #include "gtest/gtest.h"
 #include "common.h"
 #include "cubeb_resampler_internal.h"
+#include "rt_check.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 /* Windows cmath USE_MATH_DEFINE thing... */
 const float PI = 3.14159265359f;
@@ -338,7 +343,8 @@ void test_resampler_duplex(uint32_t input_channels, uint32_t output_channels,
 
   cubeb_resampler * resampler =
     cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params, target_rate,
-                           data_cb_resampler, (void*)&state, CUBEB_RESAMPLER_QUALITY_VOIP);
+                           data_cb_resampler, (void*)&state, CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
   long latency = cubeb_resampler_latency(resampler);
 
@@ -462,6 +468,42 @@ TEST(cubeb, resampler_delay_line)
   }
 }
 
+TEST(cubeb, resampler_delay_line_in_place)
+{
+  const uint32_t channels = 2;
+  const uint32_t delay_frames = 37;
+  const uint32_t chunks[] = { 1, 128, 441, 7, 1024, 64 };
+  delay_line<float> delay(delay_frames, channels, 44100);
+  std::vector<float> input(1024 * channels);
+  float next_in = 0;
+  float next_out = -static_cast<float>(delay_frames);
+
+  for (uint32_t i = 0; i < 100; i++) {
+    uint32_t frames = chunks[i % array_size(chunks)];
+    for (uint32_t j = 0; j < frames; j++, next_in++) {
+      input[j * channels] = next_in;
+      input[j * channels + 1] = -next_in;
+    }
+    delay.input(input.data(), frames);
+    size_t used;
+    const float * output = delay.output(frames, &used);
+    ASSERT_EQ(used, frames);
+    for (uint32_t j = 0; j < frames; j++, next_out++) {
+      float expected = next_out < 0 ? 0 : next_out;
+      ASSERT_EQ(output[j * channels], expected);
+      ASSERT_EQ(output[j * channels + 1], -expected);
+    }
+  }
+
+  // Asking for more than was put in gives silence.
+  size_t used;
+  const float * output = delay.output(delay_frames + 10, &used);
+  ASSERT_EQ(used, delay_frames + 10);
+  for (uint32_t j = delay_frames; j < delay_frames + 10; j++) {
+    ASSERT_EQ(output[j * channels], 0);
+  }
+}
+
 long test_output_only_noop_data_cb(cubeb_stream * /*stm*/, void * /*user_ptr*/,
                                    const void * input_buffer,
                                    void * output_buffer, long frame_count)
@@ -484,7 +526,8 @@ TEST(cubeb, resampler_output_only_noop)
   cubeb_resampler * resampler =
     cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &output_params, target_rate,
                            test_output_only_noop_data_cb, nullptr,
-                           CUBEB_RESAMPLER_QUALITY_VOIP);
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
   const long out_frames = 128;
   float out_buffer[out_frames];
@@ -523,7 +566,8 @@ TEST(cubeb, resampler_drain)
   cubeb_resampler * resampler =
     cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &output_params, target_rate,
                            test_drain_data_cb, &cb_count,
-                           CUBEB_RESAMPLER_QUALITY_VOIP);
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
   const long out_frames = 128;
   float out_buffer[out_frames];
@@ -572,7 +616,8 @@ TEST(cubeb, resampler_passthrough_output_only)
   cubeb_resampler * resampler =
     cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &output_params,
                            target_rate, cb_passthrough_resampler_output, nullptr,
-                           CUBEB_RESAMPLER_QUALITY_VOIP);
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
   float output_buffer[output_channels * 256];
 
@@ -616,7 +661,8 @@ TEST(cubeb, resampler_passthrough_input_only)
   cubeb_resampler * resampler =
     cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, nullptr,
                            target_rate, cb_passthrough_resampler_input, nullptr,
-                           CUBEB_RESAMPLER_QUALITY_VOIP);
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
   float input_buffer[input_channels * 256];
 
@@ -737,7 +783,8 @@ TEST(cubeb, resampler_passthrough_duplex_callback_reordering)
   cubeb_resampler * resampler =
     cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params,
                            target_rate, cb_passthrough_resampler_duplex, &c,
-                           CUBEB_RESAMPLER_QUALITY_VOIP);
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
   const long BUF_BASE_SIZE = 256;
   float input_buffer_prebuffer[input_channels * BUF_BASE_SIZE * 2];
@@ -792,6 +839,98 @@ TEST(cubeb, resampler_passthrough_duplex_callback_reordering)
   cubeb_resampler_destroy(resampler);
 }
 
+struct zero_copy_state {
+  const void * last_input;
+  long calls;
+};
+
+long cb_passthrough_zero_copy(cubeb_stream * /*stm*/, void * user_ptr,
+                              const void * input_buffer,
+                              void * output_buffer, long frame_count)
+{
+  zero_copy_state * state = static_cast<zero_copy_state *>(user_ptr);
+  state->last_input = input_buffer;
+  state->calls++;
+  const float * in = static_cast<const float *>(input_buffer);
+  float * out = static_cast<float *>(output_buffer);
+  if (out) {
+    for (long i = 0; i < frame_count; i++) {
+      out[i] = in[i];
+    }
+  }
+  return frame_count;
+}
+
+TEST(cubeb, resampler_passthrough_zero_copy)
+{
+  // Test that the passthrough resampler gives the input buffer of the backend
+  // to the callback when it doesn't have to buffer anything.
+  cubeb_stream_params params;
+  params.channels = 1;
+  params.rate = 48000;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+  zero_copy_state state = { nullptr, 0 };
+
+  cubeb_resampler * resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, &params, &params,
+                           params.rate, cb_passthrough_zero_copy, &state,
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+
+  const long frames = 128;
+  float input[frames * 2];
+  float output[frames];
+  long seq_idx = 0;
+  long output_seq_idx = 0;
+
+  // Same number of frames: the input goes straight to the callback.
+  seq_idx = seq(input, 1, seq_idx, frames);
+  long input_frames = frames;
+  long got = cubeb_resampler_fill(resampler, input, &input_frames, output, frames);
+  ASSERT_EQ(got, frames);
+  ASSERT_EQ(input_frames, frames);
+  ASSERT_EQ(state.last_input, input);
+  is_seq(output, 1, frames, output_seq_idx);
+  output_seq_idx += frames;
+
+  // More input than output: the callback still gets the backend buffer, the
+  // rest is kept for later.
+  seq_idx = seq(input, 1, seq_idx, frames * 2);
+  input_frames = frames * 2;
+  got = cubeb_resampler_fill(resampler, input, &input_frames, output, frames);
+  ASSERT_EQ(got, frames);
+  ASSERT_EQ(state.last_input, input);
+  is_seq(output, 1, frames, output_seq_idx);
+  output_seq_idx += frames;
+
+  // Some frames are buffered, the input has to be appended to them.
+  seq_idx = seq(input, 1, seq_idx, frames);
+  input_frames = frames;
+  got = cubeb_resampler_fill(resampler, input, &input_frames, output, frames);
+  ASSERT_EQ(got, frames);
+  ASSERT_NE(state.last_input, input);
+  is_seq(output, 1, frames, output_seq_idx);
+  output_seq_idx += frames;
+
+  // Drain what is left in the internal buffer.
+  input_frames = 0;
+  got = cubeb_resampler_fill(resampler, input, &input_frames, output, frames);
+  ASSERT_EQ(got, frames);
+  is_seq(output, 1, frames, output_seq_idx);
+  output_seq_idx += frames;
+
+  // Nothing is buffered anymore.
+  seq_idx = seq(input, 1, seq_idx, frames);
+  input_frames = frames;
+  got = cubeb_resampler_fill(resampler, input, &input_frames, output, frames);
+  ASSERT_EQ(state.last_input, input);
+  is_seq(output, 1, frames, output_seq_idx);
+  ASSERT_EQ(state.calls, 5);
+
+  cubeb_resampler_destroy(resampler);
+}
+
 // Artificially simulate output thread underruns,
 // by building up artificial delay in the input.
 // Check that the frame drop logic kicks in.
@@ -820,7 +959,8 @@ TEST(cubeb, resampler_drift_drop_data)
     cubeb_resampler * resampler =
       cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params,
         target_rate, cb_passthrough_resampler_duplex, &c,
-        CUBEB_RESAMPLER_QUALITY_VOIP);
+        CUBEB_RESAMPLER_QUALITY_VOIP,
+        CUBEB_RESAMPLER_RECLOCK_NONE, 0);
 
     const long BUF_BASE_SIZE = 256;
 
@@ -889,3 +1029,1273 @@ TEST(cubeb, resampler_drift_drop_data)
   }
 }
 
+long cb_silent_duplex(cubeb_stream * /*stm*/, void * /*user_ptr*/,
+                      const void * /*input_buffer*/,
+                      void * output_buffer, long frame_count)
+{
+  memset(output_buffer, 0, frame_count * 2 * sizeof(float));
+  return frame_count;
+}
+
+// Simulate an input device whose clock runs slightly faster or slower than the
+// clock of the output device, and check that the ratio of the input resampler
+// follows it instead of dropping frames or starving.
+TEST(cubeb, resampler_drift_compensation)
+{
+  const double drifts[] = { 500e-6, -500e-6 };
+  const uint32_t sample_rate = 44100;
+  const long BUF_BASE_SIZE = 256;
+  const long PREBUFFER_FRAMES = 1024;
+
+  for (double drift : drifts) {
+    cubeb_stream_params input_params;
+    cubeb_stream_params output_params;
+    input_params.channels = 1;
+    input_params.rate = sample_rate;
+    input_params.format = CUBEB_SAMPLE_FLOAT32NE;
+    output_params.channels = 2;
+    output_params.rate = sample_rate;
+    output_params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+    cubeb_resampler * resampler =
+      cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params,
+                             sample_rate, cb_silent_duplex, nullptr,
+                             CUBEB_RESAMPLER_QUALITY_VOIP,
+                             CUBEB_RESAMPLER_RECLOCK_INPUT, 0);
+
+    double ratio;
+    uint32_t target_frames;
+    ASSERT_EQ(cubeb_resampler_get_drift_compensation(resampler, &ratio, &target_frames),
+              CUBEB_OK);
+    ASSERT_EQ(ratio, 1.0);
+    ASSERT_EQ(target_frames, min_buffered_audio_frame(sample_rate) / 2);
+
+    std::vector<float> input(BUF_BASE_SIZE * 2 + PREBUFFER_FRAMES);
+    std::vector<float> output(BUF_BASE_SIZE * output_params.channels);
+    fill_with_sine(input.data(), sample_rate, 1, input.size(), 0);
+
+    long provided = 0;
+    long consumed = 0;
+    double input_position = PREBUFFER_FRAMES;
+    // Two minutes of audio.
+    for (long i = 0; i < 120 * sample_rate / BUF_BASE_SIZE; i++) {
+      input_position += BUF_BASE_SIZE * (1.0 + drift);
+      long frames = static_cast<long>(input_position) - provided;
+      long got = cubeb_resampler_fill(resampler, input.data(), &frames,
+                                      output.data(), BUF_BASE_SIZE);
+      ASSERT_EQ(got, BUF_BASE_SIZE);
+      provided = static_cast<long>(input_position);
+      consumed += frames;
+      // Frames are only dropped above min_buffered_audio_frame, so this means
+      // no input has been dropped.
+      ASSERT_LE(provided - consumed,
+                static_cast<long>(min_buffered_audio_frame(sample_rate)));
+    }
+
+    ASSERT_EQ(cubeb_resampler_get_drift_compensation(resampler, &ratio, &target_frames),
+              CUBEB_OK);
+    ASSERT_NEAR(ratio, 1.0 + drift, 100e-6);
+    ASSERT_NEAR(provided - consumed, target_frames, sample_rate / 100);
+
+    cubeb_resampler_destroy(resampler);
+  }
+}
+
+TEST(cubeb, resampler_drift_compensation_not_supported)
+{
+  cubeb_stream_params output_params;
+  output_params.channels = 2;
+  output_params.rate = 44100;
+  output_params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+  // There is no clock to follow for output-only streams.
+  cubeb_resampler * resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &output_params,
+                           48000, cb_silent_duplex, nullptr,
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_INPUT, 0);
+  double ratio;
+  uint32_t target_frames;
+  ASSERT_EQ(cubeb_resampler_get_drift_compensation(resampler, &ratio, &target_frames),
+            CUBEB_ERROR_NOT_SUPPORTED);
+  cubeb_resampler_destroy(resampler);
+}
+
+// Simulates an input buffer consumed by 10ms every call, and fed by
+// `arrivals`, repeated for `calls` calls. Returns the number of calls that were
+// missing input.
+long simulate_jitter(jitter_buffer & jitter, size_t & buffered,
+                     const std::vector<size_t> & arrivals, long calls)
+{
+  const size_t frames = 480;
+  long missing = 0;
+  for (long i = 0; i < calls; i++) {
+    size_t arrived = arrivals[i % arrivals.size()];
+    jitter.input(arrived);
+    buffered += arrived;
+    if (buffered < frames) {
+      jitter.underrun();
+      missing++;
+      buffered = 0;
+    } else {
+      buffered -= frames;
+    }
+    buffered = std::min(buffered, jitter.update(buffered));
+  }
+  return missing;
+}
+
+TEST(cubeb, resampler_jitter_buffer)
+{
+  const uint32_t rate = 48000;
+  const size_t frames = 480;
+  const uint32_t max_frames = 2 * min_buffered_audio_frame(rate);
+  jitter_buffer jitter(rate);
+  cubeb_resampler_input_buffer_stats stats;
+
+  // Fixed by default.
+  size_t buffered = 0;
+  ASSERT_EQ(simulate_jitter(jitter, buffered, { 2 * frames, 0 }, 100), 0);
+  jitter.stats(&stats);
+  ASSERT_EQ(stats.target_frames, min_buffered_audio_frame(rate));
+  ASSERT_EQ(stats.max_frames, min_buffered_audio_frame(rate));
+
+  jitter_buffer adaptive(rate);
+  adaptive.set_bounds(0, max_frames);
+  ASSERT_EQ(adaptive.target(), max_frames);
+
+  // Regular input: only the margin is kept after a few seconds.
+  buffered = 0;
+  ASSERT_EQ(simulate_jitter(adaptive, buffered, { frames }, 1000), 0);
+  ASSERT_LT(adaptive.target(), frames / 2);
+
+  // Bursts of 20ms every other call. Some input is missing until the target
+  // has grown, and then never again.
+  long missing = simulate_jitter(adaptive, buffered, { 2 * frames, 0 }, 100);
+  ASSERT_GT(missing, 0);
+  ASSERT_EQ(simulate_jitter(adaptive, buffered, { 2 * frames, 0 }, 1000), 0);
+  ASSERT_GE(adaptive.target(), frames);
+  ASSERT_LE(adaptive.target(), 2 * frames);
+  adaptive.stats(&stats);
+  ASSERT_GE(stats.underruns, static_cast<uint32_t>(missing));
+  ASSERT_GT(stats.jitter_frames, 0u);
+
+  // Back to regular input: the target goes back down.
+  ASSERT_EQ(simulate_jitter(adaptive, buffered, { frames }, 2000), 0);
+  ASSERT_LT(adaptive.target(), frames / 2);
+
+  // The bounds hold.
+  jitter_buffer bounded(rate);
+  bounded.set_bounds(frames, frames);
+  buffered = 0;
+  simulate_jitter(bounded, buffered, { 4 * frames, 0, 0, 0 }, 100);
+  ASSERT_EQ(bounded.target(), frames);
+  simulate_jitter(bounded, buffered, { frames }, 1000);
+  ASSERT_EQ(bounded.target(), frames);
+}
+
+TEST(cubeb, resampler_input_buffer_bounds)
+{
+  const uint32_t target_rate = 48000;
+  const long frames = 480;
+  cubeb_stream_params input_params;
+  cubeb_stream_params output_params;
+  input_params.channels = 1;
+  input_params.format = CUBEB_SAMPLE_FLOAT32NE;
+  output_params.channels = 2;
+  output_params.rate = target_rate;
+  output_params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+  // Passthrough, halfband and speex input processors.
+  const uint32_t input_rates[] = { 48000, 96000, 44100 };
+  for (uint32_t input_rate : input_rates) {
+    input_params.rate = input_rate;
+    cubeb_resampler * resampler =
+      cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params,
+                             target_rate, cb_silent_duplex, nullptr,
+                             CUBEB_RESAMPLER_QUALITY_VOIP,
+                             CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+    cubeb_resampler_reserve(resampler, 2 * frames);
+
+    cubeb_resampler_input_buffer_stats stats;
+    ASSERT_EQ(cubeb_resampler_get_input_buffer_stats(resampler, &stats), CUBEB_OK);
+    ASSERT_EQ(stats.target_frames, min_buffered_audio_frame(input_rate));
+    ASSERT_EQ(cubeb_resampler_set_input_buffer_bounds(resampler, 100, 10),
+              CUBEB_ERROR_INVALID_PARAMETER);
+    ASSERT_EQ(cubeb_resampler_set_input_buffer_bounds(resampler, 0,
+                                                      input_rate / 10),
+              CUBEB_OK);
+    ASSERT_EQ(cubeb_resampler_get_input_buffer_stats(resampler, &stats), CUBEB_OK);
+    ASSERT_EQ(stats.target_frames, input_rate / 10);
+
+    // Ten seconds of regular input, with an extra frame every other call that
+    // is dropped.
+    std::vector<float> input(2 * frames * input_rate / target_rate + 1);
+    std::vector<float> output(frames * output_params.channels);
+    long provided = 0;
+    for (long i = 0; i < 1000; i++) {
+      long input_frames = (i + 1) * frames * input_rate / target_rate - provided +
+                          i % 2;
+      provided += input_frames - i % 2;
+      ASSERT_EQ(cubeb_resampler_fill(resampler, input.data(), &input_frames,
+                                     output.data(), frames),
+                frames);
+    }
+
+    ASSERT_EQ(cubeb_resampler_get_input_buffer_stats(resampler, &stats), CUBEB_OK);
+    ASSERT_LT(stats.target_frames, min_buffered_audio_frame(input_rate) / 2);
+    ASSERT_EQ(stats.min_frames, 0u);
+    ASSERT_EQ(stats.max_frames, input_rate / 10);
+    ASSERT_GT(stats.dropped_frames, 0u);
+    cubeb_resampler_destroy(resampler);
+  }
+
+  // No input to buffer.
+  cubeb_resampler * resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &output_params,
+                           44100, cb_silent_duplex, nullptr,
+                           CUBEB_RESAMPLER_QUALITY_VOIP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+  cubeb_resampler_input_buffer_stats stats;
+  ASSERT_EQ(cubeb_resampler_set_input_buffer_bounds(resampler, 0, 480),
+            CUBEB_ERROR_NOT_SUPPORTED);
+  ASSERT_EQ(cubeb_resampler_get_input_buffer_stats(resampler, &stats),
+            CUBEB_ERROR_NOT_SUPPORTED);
+  cubeb_resampler_destroy(resampler);
+}
+
+struct block_state {
+  long block_size;
+  long wrong_sizes = 0;
+  uint32_t input_channels;
+  uint32_t output_channels;
+  // Next value of the sequence written in the output, for output-only streams.
+  float next_output = 0;
+  // Next value of the sequence expected in the input, or -1 if the input is
+  // not checked.
+  float next_input = -1;
+  bool input_in_sequence = true;
+};
+
+// Copies the first input channel to all output channels, or writes a sequence
+// for output-only streams.
+long cb_fixed_blocks(cubeb_stream * /*stm*/, void * user_ptr,
+                     const void * input_buffer,
+                     void * output_buffer, long frame_count)
+{
+  block_state * state = static_cast<block_state *>(user_ptr);
+  const float * in = static_cast<const float *>(input_buffer);
+  float * out = static_cast<float *>(output_buffer);
+  if (frame_count != state->block_size) {
+    state->wrong_sizes++;
+  }
+  for (long i = 0; i < frame_count; i++) {
+    if (in && state->next_input >= 0) {
+      if (in[i * state->input_channels] != state->next_input) {
+        state->input_in_sequence = false;
+      }
+      state->next_input++;
+    }
+    if (out) {
+      float value = in ? in[i * state->input_channels] : state->next_output++;
+      for (uint32_t c = 0; c < state->output_channels; c++) {
+        out[i * state->output_channels + c] = value;
+      }
+    }
+  }
+  return frame_count;
+}
+
+// Callback sizes of the backend, that aren't multiple of each other.
+const long backend_buffer_sizes[] = { 441, 128, 1000, 17, 256, 480, 1, 512 };
+
+TEST(cubeb, resampler_block_size)
+{
+  cubeb_stream_params params;
+  params.prefs = CUBEB_STREAM_PREF_NONE;
+  ASSERT_EQ(cubeb_resampler_block_size(&params, nullptr, 200), 0u);
+  params.prefs = CUBEB_STREAM_PREF_FIXED_BLOCK_SIZE;
+  ASSERT_EQ(cubeb_resampler_block_size(&params, nullptr, 200), 256u);
+  ASSERT_EQ(cubeb_resampler_block_size(nullptr, &params, 256), 256u);
+  ASSERT_EQ(cubeb_resampler_block_size(nullptr, &params, 257), 512u);
+}
+
+TEST(cubeb, resampler_fixed_blocks_output_only)
+{
+  const long block_size = 256;
+  const uint32_t rates[][2] = { { 48000, 48000 }, { 44100, 48000 }, { 48000, 44100 } };
+  for (auto & rate : rates) {
+    cubeb_stream_params output_params;
+    output_params.channels = 2;
+    output_params.rate = rate[1];
+    output_params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+    block_state state;
+    state.block_size = block_size;
+    state.input_channels = 0;
+    state.output_channels = output_params.channels;
+
+    cubeb_resampler * resampler =
+      cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &output_params,
+                             rate[0], cb_fixed_blocks, &state,
+                             CUBEB_RESAMPLER_QUALITY_VOIP,
+                             CUBEB_RESAMPLER_RECLOCK_NONE, block_size);
+
+    float expected = 0;
+    for (int i = 0; i < 200; i++) {
+      long frames = backend_buffer_sizes[i % array_size(backend_buffer_sizes)];
+      std::vector<float> output(frames * output_params.channels);
+      long got = cubeb_resampler_fill(resampler, nullptr, nullptr,
+                                      output.data(), frames);
+      ASSERT_EQ(got, frames);
+      if (rate[0] == rate[1]) {
+        for (long j = 0; j < frames; j++) {
+          ASSERT_EQ(output[j * output_params.channels], expected++);
+        }
+      }
+    }
+    ASSERT_EQ(state.wrong_sizes, 0);
+
+    cubeb_resampler_destroy(resampler);
+  }
+}
+
+TEST(cubeb, resampler_fixed_blocks_input_only)
+{
+  const long block_size = 128;
+  const uint32_t rates[][2] = { { 48000, 48000 }, { 44100, 48000 }, { 48000, 44100 } };
+  for (auto & rate : rates) {
+    cubeb_stream_params input_params;
+    input_params.channels = 1;
+    input_params.rate = rate[0];
+    input_params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+    block_state state;
+    state.block_size = block_size;
+    state.input_channels = input_params.channels;
+    state.output_channels = 0;
+    if (rate[0] == rate[1]) {
+      state.next_input = 0;
+    }
+
+    cubeb_resampler * resampler =
+      cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, nullptr,
+                             rate[1], cb_fixed_blocks, &state,
+                             CUBEB_RESAMPLER_QUALITY_VOIP,
+                             CUBEB_RESAMPLER_RECLOCK_NONE, block_size);
+
+    float next = 0;
+    long total = 0;
+    for (int i = 0; i < 200; i++) {
+      long frames = backend_buffer_sizes[i % array_size(backend_buffer_sizes)];
+      std::vector<float> input(frames);
+      for (long j = 0; j < frames; j++) {
+        input[j] = next++;
+      }
+      long frames_used = frames;
+      long got = cubeb_resampler_fill(resampler, input.data(), &frames_used,
+                                      nullptr, 0);
+      ASSERT_EQ(got, frames);
+      total += frames;
+    }
+    ASSERT_EQ(state.wrong_sizes, 0);
+    ASSERT_TRUE(state.input_in_sequence);
+    if (rate[0] == rate[1]) {
+      // Everything but the last partial block went to the callback.
+      ASSERT_EQ(state.next_input, (total - 1) / block_size * block_size);
+    }
+
+    cubeb_resampler_destroy(resampler);
+  }
+}
+
+TEST(cubeb, resampler_fixed_blocks_duplex)
+{
+  const long block_size = 256;
+  const uint32_t rates[][3] = {
+    // input, output, target
+    { 48000, 48000, 48000 },
+    { 44100, 48000, 48000 },
+    { 48000, 44100, 48000 },
+    { 44100, 44100, 48000 },
+  };
+  for (auto & rate : rates) {
+    cubeb_stream_params input_params;
+    cubeb_stream_params output_params;
+    input_params.channels = 1;
+    input_params.rate = rate[0];
+    input_params.format = CUBEB_SAMPLE_FLOAT32NE;
+    output_params.channels = 2;
+    output_params.rate = rate[1];
+    output_params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+    block_state state;
+    state.block_size = block_size;
+    state.input_channels = input_params.channels;
+    state.output_channels = output_params.channels;
+
+    cubeb_resampler * resampler =
+      cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params,
+                             rate[2], cb_fixed_blocks, &state,
+                             CUBEB_RESAMPLER_QUALITY_VOIP,
+                             CUBEB_RESAMPLER_RECLOCK_NONE, block_size);
+    long latency = cubeb_resampler_latency(resampler);
+
+    float next = 1;
+    long position = 0;
+    for (int i = 0; i < 200; i++) {
+      long frames = backend_buffer_sizes[i % array_size(backend_buffer_sizes)];
+      std::vector<float> input(frames);
+      std::vector<float> output(frames * output_params.channels);
+      for (long j = 0; j < frames; j++) {
+        input[j] = next++;
+      }
+      long frames_used = frames;
+      long got = cubeb_resampler_fill(resampler, input.data(), &frames_used,
+                                      output.data(), frames);
+      ASSERT_EQ(got, frames);
+      if (rate[0] == rate[1] && rate[1] == rate[2]) {
+        // The input comes out of the output after the latency of both sides.
+        for (long j = 0; j < frames; j++, position++) {
+          float expected = position < 2 * latency ? 0 : position - 2 * latency + 1;
+          ASSERT_EQ(output[j * output_params.channels], expected);
+        }
+      }
+    }
+    ASSERT_EQ(state.wrong_sizes, 0);
+
+    cubeb_resampler_destroy(resampler);
+  }
+}
+
+TEST(cubeb, resampler_input_needed_for_output)
+{
+  cubeb_resampler_speex_one_way<float> resampler(1, 44100, 48000, 3);
+  std::vector<float> input(2000, 0.5f);
+  std::vector<float> output(2000);
+
+  // Unresampled frames are at the source rate: the input asked for, on top
+  // of what is left over, always gives the output.
+  resampler.input(input.data(), 100);
+  ASSERT_EQ(resampler.output(output.data(), 50), 50u);
+  const uint32_t sizes[] = { 128, 441, 1, 512, 480, 7, 1024 };
+  for (uint32_t frames : sizes) {
+    uint32_t needed = resampler.input_needed_for_output(frames);
+    ASSERT_LE(needed, ceilf(frames * 44100.0f / 48000) + 1);
+    resampler.input(input.data(), needed);
+    ASSERT_EQ(resampler.output(output.data(), frames), frames);
+  }
+
+  // More left over than needed: nothing to add.
+  resampler.input(input.data(), 1000);
+  ASSERT_EQ(resampler.input_needed_for_output(10), 0u);
+}
+
+/* Returns the index of the first frame of `signal` above 0.5, or -1. */
+long step_position(const std::vector<float> & signal)
+{
+  for (size_t i = 0; i < signal.size(); i++) {
+    if (signal[i] > 0.5f) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+TEST(cubeb, resampler_added_latency)
+{
+  // The latency added to synchronize the two directions of a duplex stream
+  // is counted at the target rate, and is not dropped as excess buffering,
+  // even when longer than what is normally kept.
+  const uint32_t source_rate = 48000;
+  const uint32_t target_rate = 16000;
+  const uint32_t latencies[] = { 160, 1600 };
+  for (uint32_t added : latencies) {
+    cubeb_resampler_speex_one_way<float> resampler(1, source_rate, target_rate,
+                                                   3);
+    uint32_t before = resampler.latency();
+    resampler.add_latency(added);
+    ASSERT_EQ(resampler.latency(), before + added);
+
+    // A step, in chunks of 10ms, as fill does it.
+    std::vector<float> input(source_rate / 100, 1.0f);
+    std::vector<float> chunk(target_rate / 100);
+    std::vector<float> output;
+    for (int i = 0; i < 30; i++) {
+      resampler.input(input.data(), input.size());
+      resampler.drop_audio_if_needed();
+      size_t got = resampler.output(chunk.data(), chunk.size());
+      output.insert(output.end(), chunk.begin(), chunk.begin() + got);
+    }
+    ASSERT_NEAR(step_position(output), resampler.latency(), 2) << added;
+  }
+
+  // Same for a delay line.
+  const uint32_t length = 4800;
+  delay_line<float> delay(length, 1, source_rate);
+  std::vector<float> input(source_rate / 100, 1.0f);
+  std::vector<float> output;
+  for (int i = 0; i < 20; i++) {
+    delay.input(input.data(), input.size());
+    delay.drop_audio_if_needed();
+    size_t used;
+    float * delayed = delay.output(input.size(), &used);
+    output.insert(output.end(), delayed, delayed + input.size());
+  }
+  ASSERT_EQ(step_position(output), static_cast<long>(length));
+}
+
+/* Resample a stereo sine wave from `source_rate` to `target_rate`, using the
+ * SIMD kernels for `simd_level`, and returns the resampled frames. */
+std::vector<float> resample_with_simd_level(int simd_level, int quality,
+                                            uint32_t source_rate,
+                                            uint32_t target_rate,
+                                            uint32_t frames)
+{
+  const uint32_t channels = 2;
+  speex_resampler_set_simd_level(simd_level);
+  cubeb_resampler_speex_one_way<float> resampler(channels, source_rate,
+                                                 target_rate, quality);
+  speex_resampler_set_simd_level(SPEEX_RESAMPLER_SIMD_AVX2_FMA);
+
+  std::vector<float> input(frames * channels);
+  fill_with_sine(input.data(), source_rate, channels, frames, 0);
+  std::vector<float> output(resampler.output_for_input(frames) * channels);
+  resampler.input(input.data(), frames);
+  size_t got = resampler.output(output.data(), output.size() / channels);
+  output.resize(got * channels);
+  return output;
+}
+
+TEST(cubeb, resampler_simd_levels)
+{
+  const uint32_t rates[][2] = {
+    { 44100, 48000 }, // interpolated filter
+    { 48000, 44100 },
+    { 48000, 96000 }, // direct filter
+    { 96000, 48000 },
+    { 48000, 16000 },
+  };
+  const int best = speex_resampler_get_simd_level();
+
+  for (uint32_t i = 0; i < array_size(rates); i++) {
+    for (int quality = CUBEB_RESAMPLER_QUALITY_VOIP;
+         quality <= CUBEB_RESAMPLER_QUALITY_DESKTOP; quality++) {
+      int speex_quality =
+        to_speex_quality(static_cast<cubeb_resampler_quality>(quality));
+      std::vector<float> reference =
+        resample_with_simd_level(SPEEX_RESAMPLER_SIMD_NONE, speex_quality,
+                                 rates[i][0], rates[i][1], rates[i][0]);
+      for (int level = SPEEX_RESAMPLER_SIMD_SSE2; level <= best; level++) {
+        std::vector<float> simd =
+          resample_with_simd_level(level, speex_quality,
+                                   rates[i][0], rates[i][1], rates[i][0]);
+        ASSERT_EQ(simd.size(), reference.size());
+        for (size_t j = 0; j < simd.size(); j++) {
+          ASSERT_NEAR(simd[j], reference[j], 1e-5)
+            << "simd level " << level << " at " << j;
+        }
+      }
+    }
+  }
+}
+
+/* Resample `channels` channels of sines from `source_rate` to `target_rate` in
+ * chunks of varying sizes, with or without the multichannel kernels. Halfway
+ * through, the ratio changes, which changes the length of the filter when
+ * downsampling. */
+std::vector<float> resample_interleaved(bool multichannel, uint32_t channels,
+                                        uint32_t source_rate,
+                                        uint32_t target_rate)
+{
+  const uint32_t chunks[] = { 1, 480, 17, 1024, 3, 256, 4096, 64 };
+  int r;
+  SpeexResamplerState * st =
+    speex_resampler_init(channels, source_rate, target_rate,
+                         to_speex_quality(CUBEB_RESAMPLER_QUALITY_DESKTOP), &r);
+  EXPECT_EQ(r, RESAMPLER_ERR_SUCCESS);
+  int expected = multichannel && speex_resampler_get_simd_level() &&
+                 channels % 2 == 0 && channels <= 8
+                 ? RESAMPLER_ERR_SUCCESS : RESAMPLER_ERR_INVALID_ARG;
+  EXPECT_EQ(speex_resampler_set_multichannel(st, multichannel),
+            multichannel ? expected : RESAMPLER_ERR_SUCCESS);
+
+  std::vector<float> input(4096 * channels);
+  std::vector<float> output;
+  uint32_t position = 0;
+  for (uint32_t i = 0; i < 2 * array_size(chunks); i++) {
+    if (i == array_size(chunks)) {
+      speex_resampler_set_rate_frac(st, source_rate + source_rate / 10,
+                                    target_rate, source_rate, target_rate);
+    }
+    uint32_t in_len = chunks[i % array_size(chunks)];
+    position = fill_with_sine(input.data(), source_rate, channels, in_len,
+                              position);
+    // Tell the channels apart, to catch lanes mixed up.
+    for (uint32_t j = 0; j < in_len * channels; j++) {
+      input[j] *= 1.0f - 0.1f * (j % channels);
+    }
+    uint32_t out_len = in_len * 2 * target_rate / source_rate + 2;
+    size_t offset = output.size();
+    output.resize(offset + out_len * channels);
+    speex_resampler_process_interleaved_float(st, input.data(), &in_len,
+                                              output.data() + offset, &out_len);
+    output.resize(offset + out_len * channels);
+  }
+  speex_resampler_destroy(st);
+  return output;
+}
+
+TEST(cubeb, resampler_multichannel_kernels)
+{
+  const uint32_t rates[][2] = {
+    { 44100, 48000 }, // interpolated filter, multichannel kernels
+    { 48000, 44100 },
+    { 22050, 48000 },
+    { 48000, 96000 }, // direct filter, one channel at a time
+  };
+
+  for (uint32_t channels = 1; channels <= 8; channels++) {
+    for (uint32_t i = 0; i < array_size(rates); i++) {
+      std::vector<float> reference =
+        resample_interleaved(false, channels, rates[i][0], rates[i][1]);
+      std::vector<float> frames =
+        resample_interleaved(true, channels, rates[i][0], rates[i][1]);
+      ASSERT_EQ(frames.size(), reference.size());
+      for (size_t j = 0; j < frames.size(); j++) {
+        ASSERT_NEAR(frames[j], reference[j], 1e-5)
+          << channels << " channels, " << rates[i][0] << " -> "
+          << rates[i][1] << ", sample " << j;
+      }
+    }
+  }
+}
+
+/* Run with --gtest_also_run_disabled_tests to print the throughput of each
+ * set of SIMD kernels available on this machine. */
+TEST(cubeb, DISABLED_resampler_simd_benchmark)
+{
+  const char * level_names[] = { "scalar", "sse2", "avx2", "avx2+fma" };
+  const char * quality_names[] = { "VOIP", "DEFAULT", "DESKTOP" };
+  const uint32_t rates[][2] = { { 44100, 48000 }, { 48000, 44100 } };
+  const uint32_t channels = 2;
+  const uint32_t seconds = 20;
+  const uint32_t chunk_ms = 10;
+  const int best = speex_resampler_get_simd_level();
+
+  for (uint32_t r = 0; r < array_size(rates); r++) {
+    const uint32_t source_rate = rates[r][0];
+    const uint32_t target_rate = rates[r][1];
+    const uint32_t chunk_frames = source_rate * chunk_ms / 1000;
+    std::vector<float> input(chunk_frames * channels);
+    std::vector<float> output(2 * chunk_frames * channels);
+    fill_with_sine(input.data(), source_rate, channels, chunk_frames, 0);
+
+    for (int quality = CUBEB_RESAMPLER_QUALITY_VOIP;
+         quality <= CUBEB_RESAMPLER_QUALITY_DESKTOP; quality++) {
+      double scalar_fps = 0;
+      for (int level = SPEEX_RESAMPLER_SIMD_NONE; level <= best; level++) {
+        speex_resampler_set_simd_level(level);
+        cubeb_resampler_speex_one_way<float> resampler(
+          channels, source_rate, target_rate,
+          to_speex_quality(static_cast<cubeb_resampler_quality>(quality)));
+        speex_resampler_set_simd_level(SPEEX_RESAMPLER_SIMD_AVX2_FMA);
+
+        uint32_t chunks = seconds * 1000 / chunk_ms;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < chunks; i++) {
+          resampler.input(input.data(), chunk_frames);
+          resampler.output(output.data(), resampler.output_for_input(0));
+        }
+        std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+        double fps = chunks * chunk_frames / elapsed.count();
+        if (level == SPEEX_RESAMPLER_SIMD_NONE) {
+          scalar_fps = fps;
+        }
+        fprintf(stderr, "%6u -> %6u %-7s %-8s %12.0f frames/s (x%.2f)\n",
+                source_rate, target_rate, quality_names[quality],
+                level_names[level], fps, fps / scalar_fps);
+      }
+    }
+  }
+}
+
+TEST(cubeb, resampler_shared_filter_tables)
+{
+  const uint32_t channels = 2;
+  const uint32_t frames = 4410;
+  const int initial_count = speex_resampler_get_filter_table_count();
+
+  std::vector<float> input(frames * channels);
+  fill_with_sine(input.data(), 44100, channels, frames, 0);
+
+  {
+    cubeb_resampler_speex_one_way<float> first(channels, 44100, 48000, 4);
+    ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 1);
+    {
+      cubeb_resampler_speex_one_way<float> second(channels, 44100, 48000, 4);
+      ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 1);
+      cubeb_resampler_speex_one_way<float> other_quality(channels, 44100, 48000, 5);
+      ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 2);
+      cubeb_resampler_speex_one_way<float> other_ratio(channels, 48000, 44100, 4);
+      ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 3);
+
+      // Resamplers sharing a table produce the same output.
+      std::vector<float> output_first(first.output_for_input(frames) * channels);
+      std::vector<float> output_second(output_first.size());
+      first.input(input.data(), frames);
+      second.input(input.data(), frames);
+      size_t got_first = first.output(output_first.data(), output_first.size() / channels);
+      size_t got_second = second.output(output_second.data(), output_second.size() / channels);
+      ASSERT_EQ(got_first, got_second);
+      ASSERT_EQ(output_first, output_second);
+    }
+    // The table of `first` is still alive, the others are gone.
+    ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 1);
+  }
+  ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count);
+}
+
+TEST(cubeb, resampler_prepared_filter_tables)
+{
+  const int initial_count = speex_resampler_get_filter_table_count();
+  int err;
+  SpeexResamplerState * st = speex_resampler_init(2, 48000, 44100, 4, &err);
+  ASSERT_EQ(err, RESAMPLER_ERR_SUCCESS);
+
+  // Without preparing, changing the quality swaps the table.
+  ASSERT_EQ(speex_resampler_set_quality(st, 3), RESAMPLER_ERR_SUCCESS);
+  ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 1);
+  ASSERT_EQ(speex_resampler_set_quality(st, 4), RESAMPLER_ERR_SUCCESS);
+
+  // Up to 0.1% above the nominal ratio, and qualities 1 to 4.
+  ASSERT_EQ(speex_resampler_set_max_ratio(st, 480480, 441000),
+            RESAMPLER_ERR_SUCCESS);
+  ASSERT_EQ(speex_resampler_prepare_qualities(st, 5), RESAMPLER_ERR_INVALID_ARG);
+  ASSERT_EQ(speex_resampler_prepare_qualities(st, 1), RESAMPLER_ERR_SUCCESS);
+  ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 4);
+
+  // Switching between them keeps the tables the resampler holds.
+  const uint32_t frames = 480;
+  std::vector<float> input(frames * 2, 0.5f);
+  std::vector<float> output(frames * 2);
+  for (spx_uint32_t num : { 479520u, 480000u, 480480u, 480000u }) {
+    ASSERT_EQ(speex_resampler_set_rate_frac(st, num, 441000, 48000, 44100),
+              RESAMPLER_ERR_SUCCESS);
+    for (int quality = 1; quality <= 4; quality++) {
+      ASSERT_EQ(speex_resampler_set_quality(st, quality), RESAMPLER_ERR_SUCCESS);
+      ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count + 4);
+      spx_uint32_t in_len = frames;
+      spx_uint32_t out_len = frames;
+      ASSERT_EQ(speex_resampler_process_interleaved_float(st, input.data(), &in_len,
+                                                          output.data(), &out_len),
+                RESAMPLER_ERR_SUCCESS);
+      ASSERT_GT(out_len, 0u);
+    }
+  }
+
+  speex_resampler_destroy(st);
+  ASSERT_EQ(speex_resampler_get_filter_table_count(), initial_count);
+}
+
+template<typename T>
+void test_halfband(uint32_t channels, uint32_t source_rate, uint32_t target_rate,
+                   float tolerance)
+{
+  // Resample a sine in chunks of varying, sometimes odd, sizes, and compare
+  // with the same sine at the target rate, delayed by the latency.
+  const uint32_t frames = source_rate;
+  std::vector<float> sine(frames * channels);
+  fill_with_sine(sine.data(), source_rate, channels, frames, 0);
+  std::vector<T> input(sine.size());
+  for (size_t i = 0; i < sine.size(); i++) {
+    input[i] = static_cast<T>(sine[i] * (std::is_same<T, short>::value ? 32767 : 1));
+  }
+
+  cubeb_resampler_halfband_one_way<T> resampler(channels, source_rate, target_rate);
+  uint32_t latency = resampler.latency();
+
+  std::vector<T> output;
+  const size_t chunks[] = { 441, 1, 128, 17, 480, 256, 3 };
+  size_t input_index = 0;
+  for (size_t i = 0; output.size() / channels < target_rate / 2; i++) {
+    size_t out_frames = chunks[i % array_size(chunks)];
+    size_t in_frames = resampler.input_needed_for_output(out_frames);
+    ASSERT_LE((input_index + in_frames) * channels, input.size());
+    resampler.input(input.data() + input_index * channels, in_frames);
+    input_index += in_frames;
+    std::vector<T> chunk(out_frames * channels);
+    size_t got = resampler.output(chunk.data(), out_frames);
+    ASSERT_EQ(got, out_frames);
+    output.insert(output.end(), chunk.begin(), chunk.end());
+  }
+
+  std::vector<float> expected((target_rate / 2) * channels);
+  fill_with_sine(expected.data(), target_rate, channels, target_rate / 2 - latency, 0);
+  float scale = std::is_same<T, short>::value ? 1 / 32767.f : 1;
+  float max_error = 0;
+  // Skip the start, where the filter is still filling up.
+  for (size_t i = 2 * latency; i < target_rate / 2; i++) {
+    for (uint32_t c = 0; c < channels; c++) {
+      float error = output[i * channels + c] * scale -
+                    expected[(i - latency) * channels + c];
+      max_error = std::max(max_error, std::fabs(error));
+    }
+  }
+  ASSERT_LT(max_error, tolerance);
+}
+
+TEST(cubeb, resampler_precomputed_filter_tables)
+{
+  if (!speex_resampler_set_precomputed_tables(1)) {
+    fprintf(stderr, "Built without precomputed filter tables, skipping.\n");
+    return;
+  }
+  const uint32_t channels = 2;
+  const uint32_t rates[][2] = { { 44100, 48000 }, { 48000, 44100 },
+                                { 16000, 48000 }, { 48000, 16000 },
+                                { 44100, 16000 } };
+  const int qualities[] = { SPEEX_RESAMPLER_QUALITY_VOIP,
+                            SPEEX_RESAMPLER_QUALITY_DEFAULT,
+                            SPEEX_RESAMPLER_QUALITY_DESKTOP };
+
+  for (uint32_t i = 0; i < array_size(rates); i++) {
+    for (int quality : qualities) {
+      const uint32_t frames = rates[i][0] / 10;
+      std::vector<float> input(frames * channels);
+      fill_with_sine(input.data(), rates[i][0], channels, frames, 0);
+      std::vector<float> outputs[2];
+      // Computed, then precomputed: the table of the first resampler is gone
+      // when the second one is created.
+      for (int precomputed = 0; precomputed < 2; precomputed++) {
+        speex_resampler_set_precomputed_tables(precomputed);
+        cubeb_resampler_speex_one_way<float> resampler(channels, rates[i][0],
+                                                       rates[i][1], quality);
+        std::vector<float> & output = outputs[precomputed];
+        output.resize(resampler.output_for_input(frames) * channels);
+        resampler.input(input.data(), frames);
+        output.resize(resampler.output(output.data(),
+                                       output.size() / channels) * channels);
+      }
+      ASSERT_EQ(outputs[0], outputs[1])
+        << rates[i][0] << " to " << rates[i][1] << ", quality " << quality;
+    }
+  }
+  speex_resampler_set_precomputed_tables(1);
+}
+
+TEST(cubeb, resampler_halfband)
+{
+  const uint32_t rates[][2] = {
+    { 48000, 96000 }, { 96000, 48000 }, { 22050, 44100 }, { 44100, 22050 }
+  };
+  for (auto & rate : rates) {
+    for (uint32_t channels = 1; channels <= 3; channels++) {
+      test_halfband<float>(channels, rate[0], rate[1], 1e-4f);
+      test_halfband<short>(channels, rate[0], rate[1], 2e-4f);
+    }
+  }
+}
+
+long cb_halfband_duplex(cubeb_stream * /*stm*/, void * /*user_ptr*/,
+                        const void * input_buffer,
+                        void * output_buffer, long frame_count)
+{
+  const float * in = static_cast<const float *>(input_buffer);
+  float * out = static_cast<float *>(output_buffer);
+  for (long i = 0; i < frame_count; i++) {
+    out[i] = in[i];
+  }
+  return frame_count;
+}
+
+TEST(cubeb, resampler_halfband_selected)
+{
+  // Exact 2x and 1/2x conversions use the halfband resampler.
+  cubeb_stream_params params;
+  params.channels = 1;
+  params.rate = 96000;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+  cubeb_resampler * resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &params, 48000,
+                           cb_passthrough_resampler_output, nullptr,
+                           CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+  ASSERT_EQ(cubeb_resampler_latency(resampler), 2 * HALFBAND_HALF_LENGTH);
+  cubeb_resampler_destroy(resampler);
+
+  // Duplex stream with the halfband resampler on the input side only: the
+  // output is delayed by the same amount.
+  cubeb_stream_params input_params = params;
+  cubeb_stream_params output_params = params;
+  output_params.rate = 48000;
+  resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, &input_params, &output_params,
+                           48000, cb_halfband_duplex, nullptr,
+                           CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+  ASSERT_EQ(cubeb_resampler_latency(resampler), HALFBAND_HALF_LENGTH - 1);
+
+  std::vector<float> input(2 * 257);
+  std::vector<float> output(257);
+  for (int i = 0; i < 100; i++) {
+    long frames = 256 + (i % 2);
+    long input_frames = 2 * frames;
+    long got = cubeb_resampler_fill(resampler, input.data(), &input_frames,
+                                    output.data(), frames);
+    ASSERT_EQ(got, frames);
+    ASSERT_EQ(input_frames, 2 * frames);
+  }
+  cubeb_resampler_destroy(resampler);
+}
+
+TEST(cubeb, resampler_adaptive_quality)
+{
+  const uint32_t rate = 48000;
+  const long frames = 480; // 10ms
+  const int max_quality = SPEEX_RESAMPLER_QUALITY_DESKTOP;
+  adaptive_quality adaptive(max_quality, rate);
+  long elapsed_frames = 0;
+
+  // Spending 80% of the time in `fill`: one step down every 100ms.
+  while (adaptive.quality() > SPEEX_RESAMPLER_QUALITY_MIN) {
+    int before = adaptive.quality();
+    adaptive.update(frames, std::chrono::milliseconds(8));
+    elapsed_frames += frames;
+    ASSERT_GE(adaptive.quality(), before - 1);
+  }
+  ASSERT_LE(elapsed_frames, (max_quality + 1) * rate / 10);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(adaptive.update(frames, std::chrono::milliseconds(8)),
+              SPEEX_RESAMPLER_QUALITY_MIN);
+  }
+
+  // Somewhere between the thresholds: the quality stays where it is.
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(adaptive.update(frames, std::chrono::milliseconds(3)),
+              SPEEX_RESAMPLER_QUALITY_MIN);
+  }
+
+  // With headroom, one step up every two seconds, back to where it started.
+  for (int i = 0; i < 150; i++) {
+    ASSERT_EQ(adaptive.update(frames, std::chrono::milliseconds(1)),
+              SPEEX_RESAMPLER_QUALITY_MIN);
+  }
+  for (int i = 0; i < 100 * 2 * (max_quality + 1); i++) {
+    adaptive.update(frames, std::chrono::milliseconds(1));
+  }
+  ASSERT_EQ(adaptive.quality(), max_quality);
+
+  // A single slow call doesn't move it.
+  adaptive.update(frames, std::chrono::milliseconds(12));
+  for (int i = 0; i < 20; i++) {
+    ASSERT_EQ(adaptive.update(frames, std::chrono::milliseconds(1)),
+              max_quality);
+  }
+}
+
+TEST(cubeb, resampler_set_quality)
+{
+  const uint32_t channels = 2;
+  const uint32_t source_rate = 44100;
+  const uint32_t target_rate = 48000;
+  const uint32_t chunk = 441;
+  cubeb_resampler_speex_one_way<float> resampler(channels, source_rate,
+                                                 target_rate,
+                                                 SPEEX_RESAMPLER_QUALITY_DESKTOP);
+  const uint32_t latency = resampler.latency();
+  const int qualities[] = { 1, 0, 8, 3, SPEEX_RESAMPLER_QUALITY_DESKTOP };
+
+  std::vector<float> input(chunk * channels);
+  std::vector<float> output;
+  uint32_t phase = 0;
+  for (uint32_t i = 0; i < 10 * array_size(qualities); i++) {
+    if (i % 10 == 9) {
+      resampler.set_quality(qualities[i / 10]);
+      ASSERT_EQ(resampler.quality(), qualities[i / 10]);
+      // The stream isn't delayed more or less than it was.
+      ASSERT_EQ(resampler.latency(), latency);
+    }
+    phase = fill_with_sine(input.data(), source_rate, channels, chunk, phase);
+    size_t offset = output.size();
+    output.resize(offset + resampler.output_for_input(chunk) * channels);
+    resampler.input(input.data(), chunk);
+    size_t got = resampler.output(output.data() + offset,
+                                  (output.size() - offset) / channels);
+    output.resize(offset + got * channels);
+  }
+
+  // No clicks when the filter changes: after the start, the 440Hz sine never
+  // moves by much more than 2 * PI * 440 / 48000 * 0.5 from one frame to the
+  // next.
+  for (size_t i = (latency + 100) * channels; i + channels < output.size(); i++) {
+    ASSERT_LT(std::fabs(output[i + channels] - output[i]), 0.04f)
+      << "frame " << i / channels;
+  }
+}
+
+long cb_slow_output(cubeb_stream * /*stm*/, void * /*user_ptr*/,
+                    const void * /*input_buffer*/,
+                    void * output_buffer, long frame_count)
+{
+  // Take most of the duration of the audio, at 48kHz.
+  delay(frame_count / 60);
+  memset(output_buffer, 0, frame_count * sizeof(float));
+  return frame_count;
+}
+
+TEST(cubeb, resampler_adaptive_quality_enable)
+{
+  cubeb_stream_params params;
+  params.channels = 1;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+
+  // Only speex resamplers have a quality to adjust.
+  const uint32_t rates[][2] = { { 48000, 0 }, { 96000, 0 }, { 44100, 1 } };
+  for (uint32_t i = 0; i < array_size(rates); i++) {
+    params.rate = rates[i][0];
+    cubeb_resampler * resampler =
+      cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &params, 48000,
+                             cb_slow_output, nullptr,
+                             CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                             CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+    ASSERT_EQ(cubeb_resampler_enable_adaptive_quality(resampler),
+              rates[i][1] ? CUBEB_OK : CUBEB_ERROR_NOT_SUPPORTED);
+    cubeb_resampler_destroy(resampler);
+  }
+
+  // The quality goes down under load, without changing the latency. The
+  // filters of the lower qualities are all computed when enabling.
+  cubeb_resampler * resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, nullptr, &params, 48000,
+                           cb_slow_output, nullptr,
+                           CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+  int table_count = speex_resampler_get_filter_table_count();
+  ASSERT_EQ(cubeb_resampler_enable_adaptive_quality(resampler), CUBEB_OK);
+  ASSERT_GT(speex_resampler_get_filter_table_count(), table_count);
+  table_count = speex_resampler_get_filter_table_count();
+  long latency = cubeb_resampler_latency(resampler);
+  std::vector<float> output(441);
+  for (int i = 0; i < 30; i++) {
+    ASSERT_EQ(cubeb_resampler_fill(resampler, nullptr, nullptr,
+                                   output.data(), output.size()),
+              static_cast<long>(output.size()));
+    ASSERT_EQ(cubeb_resampler_latency(resampler), latency);
+    ASSERT_EQ(speex_resampler_get_filter_table_count(), table_count);
+  }
+  cubeb_resampler_destroy(resampler);
+}
+
+/* When `user_ptr` points to true, this takes most of the duration of the
+ * audio, at 48kHz, so that adaptive quality steps down. It spins, because
+ * sleeping would be caught by rt_check. */
+long cb_no_allocation(cubeb_stream * /*stm*/, void * user_ptr,
+                      const void * /*input_buffer*/,
+                      void * output_buffer, long frame_count)
+{
+  if (*static_cast<bool *>(user_ptr)) {
+    auto end = std::chrono::steady_clock::now() +
+               std::chrono::microseconds(frame_count * 16);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+  }
+  if (output_buffer) {
+    memset(output_buffer, 0, frame_count * 2 * sizeof(float));
+  }
+  return frame_count;
+}
+
+TEST(cubeb, resampler_fill_does_not_allocate)
+{
+  if (!rt_check_available()) {
+    fprintf(stderr, "Real-time checks not available, skipping.\n");
+    return;
+  }
+  const uint32_t max_frames = 512;
+  /* Callback sizes of the backend: smaller than what was reserved, then
+   * larger, which is done in several passes. */
+  const long sizes[] = { 128, 512, 1, 441, 300, 512, 2000, 7, 4096, 512 };
+  /* Speex, halfband and no resampling. */
+  const uint32_t rates[] = { 44100, 96000, 48000 };
+  const uint32_t block_sizes[] = { 0, 256 };
+  enum { INPUT, OUTPUT, DUPLEX };
+  /* Reclocking adjusts the ratio of the input resampler, adaptive quality
+   * changes the filters, both from `fill`. */
+  struct {
+    cubeb_resampler_reclock reclock;
+    bool adaptive;
+  } const variants[] = {
+    { CUBEB_RESAMPLER_RECLOCK_NONE, false },
+    { CUBEB_RESAMPLER_RECLOCK_INPUT, false },
+    { CUBEB_RESAMPLER_RECLOCK_NONE, true },
+    { CUBEB_RESAMPLER_RECLOCK_INPUT, true }
+  };
+
+  for (auto variant : variants) {
+    for (uint32_t rate : rates) {
+      for (uint32_t block_size : block_sizes) {
+        for (int mode = INPUT; mode <= DUPLEX; mode++) {
+          /* Only speex resamplers have a quality to adapt. */
+          bool slow = variant.adaptive && rate == 44100;
+          if (variant.adaptive && !slow) {
+            continue;
+          }
+          cubeb_stream_params params;
+          params.format = CUBEB_SAMPLE_FLOAT32NE;
+          params.rate = rate;
+          params.channels = 2;
+          params.prefs = CUBEB_STREAM_PREF_NONE;
+          cubeb_resampler * resampler =
+            cubeb_resampler_create((cubeb_stream*)nullptr,
+                                   mode != OUTPUT ? &params : nullptr,
+                                   mode != INPUT ? &params : nullptr,
+                                   48000, cb_no_allocation, &slow,
+                                   CUBEB_RESAMPLER_QUALITY_DEFAULT,
+                                   variant.reclock, block_size);
+          ASSERT_TRUE(resampler);
+          if (variant.adaptive) {
+            ASSERT_EQ(cubeb_resampler_enable_adaptive_quality(resampler),
+                      CUBEB_OK);
+          }
+          ASSERT_EQ(cubeb_resampler_reserve(resampler, max_frames), CUBEB_OK);
+
+          std::vector<float> input(2 * 4096);
+          std::vector<float> output(2 * 4096);
+          /* Twice, so that the buffers are in their steady state. */
+          for (int i = 0; i < 2; i++) {
+            for (long frames : sizes) {
+              long input_frames = frames;
+              long got;
+              rt_check_clear();
+              rt_check_start();
+              {
+                rt_check_scope realtime;
+                got = cubeb_resampler_fill(resampler,
+                                           mode != OUTPUT ? input.data() : nullptr,
+                                           mode != OUTPUT ? &input_frames : nullptr,
+                                           mode != INPUT ? output.data() : nullptr,
+                                           mode != INPUT ? frames : 0);
+              }
+              rt_check_stop();
+              ASSERT_EQ(rt_check_violation_count(), 0u)
+                << "rate " << rate << ", block size " << block_size
+                << ", mode " << mode << ", reclock " << variant.reclock
+                << ", adaptive " << variant.adaptive << ", " << frames
+                << " frames\n" << rt_check_report();
+              /* Input streams return the number of input frames used, which
+               * depends on the state of the resampler. */
+              ASSERT_EQ(got, mode == INPUT ? input_frames : frames);
+            }
+          }
+          cubeb_resampler_destroy(resampler);
+        }
+      }
+    }
+  }
+}
+
+template<typename T>
+void test_resampler_offline(uint32_t source_rate, uint32_t target_rate,
+                            cubeb_resampler_quality quality)
+{
+  const uint32_t channels = 2;
+  /* Long enough for a few chunks per thread, and not a whole number of
+   * periods of the ratio. */
+  const long input_frames = 3 * source_rate + 17;
+  std::vector<float> sine(input_frames * channels);
+  fill_with_sine(sine.data(), source_rate, channels, input_frames, 0);
+  std::vector<T> input(sine.size());
+  /* Some noise, so that every input frame matters. */
+  uint32_t seed = 1;
+  for (size_t i = 0; i < sine.size(); i++) {
+    seed = seed * 1664525 + 1013904223;
+    float noise = (seed >> 8) / static_cast<float>(1 << 24) - 0.5f;
+    input[i] = static_cast<T>((sine[i] + 0.25f * noise) *
+                              (std::is_same<T, short>::value ? 32767 : 1));
+  }
+
+  long output_frames = cubeb_resampler_offline_output_frames(source_rate,
+                                                             target_rate,
+                                                             input_frames);
+  cubeb_resampler_speex_one_way<T> resampler(channels, source_rate, target_rate,
+                                             to_speex_quality(quality));
+  std::vector<T> expected((output_frames + 100) * channels);
+  resampler.input(input.data(), input_frames);
+  size_t got = resampler.output(expected.data(), output_frames + 100);
+  ASSERT_EQ(got, static_cast<size_t>(output_frames))
+    << source_rate << " to " << target_rate;
+  expected.resize(got * channels);
+
+  const uint32_t thread_counts[] = { 1, 2, 4, 0 };
+  for (uint32_t threads : thread_counts) {
+    std::vector<T> output(output_frames * channels);
+    ASSERT_EQ(cubeb_resampler_offline(cubeb_format<T>(), channels, source_rate,
+                                      target_rate, quality, input.data(),
+                                      input_frames, output.data(),
+                                      output_frames, threads),
+              output_frames);
+    ASSERT_EQ(output, expected)
+      << source_rate << " to " << target_rate << ", quality " << quality
+      << ", " << threads << " threads";
+  }
+
+  std::vector<T> output(output_frames * channels);
+  ASSERT_EQ(cubeb_resampler_offline(cubeb_format<T>(), channels, source_rate,
+                                    target_rate, quality, input.data(),
+                                    input_frames, output.data(),
+                                    output_frames - 1, 2),
+            CUBEB_ERROR_INVALID_PARAMETER);
+}
+
+TEST(cubeb, resampler_offline)
+{
+  const uint32_t rates[][2] = { { 44100, 48000 }, { 48000, 44100 },
+                                { 48000, 16000 }, { 16000, 44100 },
+                                { 44100, 96000 } };
+  for (uint32_t i = 0; i < array_size(rates); i++) {
+    test_resampler_offline<float>(rates[i][0], rates[i][1],
+                                  CUBEB_RESAMPLER_QUALITY_DEFAULT);
+    test_resampler_offline<short>(rates[i][0], rates[i][1],
+                                  CUBEB_RESAMPLER_QUALITY_DEFAULT);
+  }
+  test_resampler_offline<float>(44100, 48000, CUBEB_RESAMPLER_QUALITY_VOIP);
+  test_resampler_offline<float>(48000, 44100, CUBEB_RESAMPLER_QUALITY_DESKTOP);
+  ASSERT_EQ(cubeb_resampler_offline_output_frames(44100, 48000, 0), 0);
+}
+
+TEST(cubeb, DISABLED_resampler_offline_benchmark)
+{
+  const uint32_t channels = 2;
+  const uint32_t source_rate = 44100;
+  const uint32_t target_rate = 48000;
+  const long input_frames = 600 * source_rate;
+  std::vector<float> input(input_frames * channels);
+  fill_with_sine(input.data(), source_rate, channels, input_frames, 0);
+  long output_frames = cubeb_resampler_offline_output_frames(source_rate,
+                                                             target_rate,
+                                                             input_frames);
+  std::vector<float> output(output_frames * channels);
+
+  double single_thread = 0;
+  for (uint32_t threads = 1;
+       threads <= std::max(1u, std::thread::hardware_concurrency());
+       threads *= 2) {
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(cubeb_resampler_offline(CUBEB_SAMPLE_FLOAT32NE, channels,
+                                      source_rate, target_rate,
+                                      CUBEB_RESAMPLER_QUALITY_DESKTOP,
+                                      input.data(), input_frames,
+                                      output.data(), output_frames, threads),
+              output_frames);
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    if (threads == 1) {
+      single_thread = elapsed.count();
+    }
+    fprintf(stderr, "%2u threads: %8.3fs (x%.2f)\n", threads, elapsed.count(),
+            single_thread / elapsed.count());
+  }
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* Checks that the code that runs on the audio thread doesn't allocate, lock
+ * or make blocking system calls, see rt_check.h.
+ *
+ * The backends run their callbacks on threads of their own, and have known
+ * issues: their tests only print what they find, unless the
+ * CUBEB_RT_CHECK_STRICT environment variable is set. */
+#include "gtest/gtest.h"
+#include "rt_check.h"
+#include <pthread.h>
+#include <string.h>
+#include <vector>
+#include "common.h"
+#include "cubeb_log.h"
+#include "cubeb_mixer.h"
+#include "cubeb_resampler.h"
+#include "cubeb_ringbuffer.h"
+
+#define RT_CHECK_AVAILABLE_OR_RETURN()                                  \
+  do {                                                                  \
+    if (!rt_check_available()) {                                        \
+      fprintf(stderr, "Real-time checks not available, skipping.\n");   \
+      return;                                                           \
+    }                                                                   \
+  } while (0)
+
+/* Out of line, so that the compiler can't remove the allocation. */
+void * (* volatile rt_safety_malloc)(size_t) = malloc;
+
+TEST_F(rt_check_test, rt_check_detects_blocking_calls)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  /* Not recorded outside of a real-time thread. */
+  free(rt_safety_malloc(16));
+  pthread_mutex_lock(&mutex);
+  pthread_mutex_unlock(&mutex);
+  ASSERT_EQ(rt_check_violation_count(), 0u);
+
+  {
+    rt_check_scope realtime;
+    void * p = rt_safety_malloc(16);
+    free(p);
+    /* Trying to lock doesn't block. */
+    if (!pthread_mutex_trylock(&mutex)) {
+      pthread_mutex_unlock(&mutex);
+    }
+    pthread_mutex_lock(&mutex);
+    pthread_mutex_unlock(&mutex);
+  }
+  ASSERT_EQ(rt_check_violation_count(), 3u);
+
+  std::string report = rt_check_report();
+  ASSERT_NE(report.find("malloc"), std::string::npos);
+  ASSERT_NE(report.find("free"), std::string::npos);
+  ASSERT_NE(report.find("pthread_mutex_lock"), std::string::npos);
+  rt_check_clear();
+}
+
+long data_cb_rt_safety(cubeb_stream * /*stm*/, void * /*user_ptr*/,
+                       const void * /*input_buffer*/,
+                       void * output_buffer, long frame_count)
+{
+  if (output_buffer) {
+    memset(output_buffer, 0, frame_count * 2 * sizeof(float));
+  }
+  return frame_count;
+}
+
+TEST_F(rt_check_test, rt_safety_resampler)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  cubeb_stream_params params;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+  params.rate = 44100;
+  params.channels = 2;
+  params.prefs = CUBEB_STREAM_PREF_NONE;
+  cubeb_resampler * resampler =
+    cubeb_resampler_create((cubeb_stream*)nullptr, &params, &params, 48000,
+                           data_cb_rt_safety, nullptr,
+                           CUBEB_RESAMPLER_QUALITY_DEFAULT,
+                           CUBEB_RESAMPLER_RECLOCK_NONE, 0);
+  ASSERT_TRUE(resampler);
+  cubeb_resampler_reserve(resampler, 512);
+
+  std::vector<float> input(2 * 2048);
+  std::vector<float> output(2 * 2048);
+  const long sizes[] = { 256, 512, 441, 2048, 128 };
+  {
+    rt_check_scope realtime;
+    for (long frames : sizes) {
+      long input_frames = frames;
+      cubeb_resampler_fill(resampler, input.data(), &input_frames,
+                           output.data(), frames);
+    }
+  }
+  cubeb_resampler_destroy(resampler);
+}
+
+TEST_F(rt_check_test, rt_safety_mixer)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  cubeb_mixer * mixer = cubeb_mixer_create(CUBEB_SAMPLE_FLOAT32NE,
+                                           6, CUBEB_LAYOUT_3F2_LFE,
+                                           2, CUBEB_LAYOUT_STEREO);
+  const size_t frames = 512;
+  std::vector<float> input(6 * frames);
+  std::vector<float> output(2 * frames);
+  {
+    rt_check_scope realtime;
+    ASSERT_EQ(cubeb_mixer_mix(mixer, frames,
+                              input.data(), input.size() * sizeof(float),
+                              output.data(), output.size() * sizeof(float)),
+              0);
+  }
+  cubeb_mixer_destroy(mixer);
+}
+
+TEST_F(rt_check_test, rt_safety_ring_buffer)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  lock_free_audio_ring_buffer<float> ring(2, 1024);
+  std::vector<float> frames(2 * 256);
+  {
+    rt_check_scope realtime;
+    for (int i = 0; i < 16; i++) {
+      ASSERT_EQ(ring.enqueue(frames.data(), 256), 256);
+      ASSERT_EQ(ring.dequeue(frames.data(), 256), 256);
+    }
+  }
+}
+
+void log_cb_rt_safety(const char * /*fmt*/, ...)
+{
+}
+
+TEST_F(rt_check_test, rt_safety_async_logger)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  ASSERT_EQ(cubeb_set_log_callback(CUBEB_LOG_VERBOSE, log_cb_rt_safety),
+            CUBEB_OK);
+  /* The first message starts the thread of the logger. */
+  ALOGV("starting");
+  {
+    rt_check_scope realtime;
+    for (int i = 0; i < 16; i++) {
+      ALOGV("message %d from the audio thread", i);
+    }
+  }
+  cubeb_async_log_reset_threads();
+  ASSERT_EQ(cubeb_set_log_callback(CUBEB_LOG_DISABLED, nullptr), CUBEB_OK);
+}
+
+long data_cb_rt_safety_backend(cubeb_stream * stm, void * user_ptr,
+                               const void * input_buffer,
+                               void * output_buffer, long frame_count)
+{
+  /* Never left: the thread of the stream stays marked. */
+  static __thread bool marked = false;
+  if (!marked) {
+    rt_check_enter_realtime();
+    marked = true;
+  }
+  return data_cb_rt_safety(stm, user_ptr, input_buffer, output_buffer,
+                           frame_count);
+}
+
+void state_cb_rt_safety(cubeb_stream * /*stm*/, void * /*user_ptr*/,
+                        cubeb_state /*state*/)
+{
+}
+
+/* Plays silence with `backend` for a while, recording what happens on the
+ * thread of the stream. */
+void run_backend_rt_safety(const char * backend)
+{
+  cubeb * ctx;
+  if (cubeb_init(&ctx, "Cubeb real-time safety test", backend) != CUBEB_OK) {
+    fprintf(stderr, "%s not available, skipping.\n", backend);
+    return;
+  }
+  if (strcmp(cubeb_get_backend_id(ctx), backend)) {
+    fprintf(stderr, "%s not available, skipping.\n", backend);
+    cubeb_destroy(ctx);
+    return;
+  }
+
+  cubeb_stream_params params;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+  params.rate = 44100;
+  params.channels = 2;
+  params.layout = CUBEB_LAYOUT_STEREO;
+  params.prefs = CUBEB_STREAM_PREF_NONE;
+  cubeb_stream * stream;
+  int r = cubeb_stream_init(ctx, &stream, "Cubeb real-time safety test",
+                            nullptr, nullptr, nullptr, &params, 512,
+                            data_cb_rt_safety_backend, state_cb_rt_safety,
+                            nullptr);
+  if (r != CUBEB_OK) {
+    fprintf(stderr, "No output device with %s, skipping.\n", backend);
+    cubeb_destroy(ctx);
+    return;
+  }
+
+  ASSERT_EQ(cubeb_stream_start(stream), CUBEB_OK);
+  delay(500);
+  /* Stopping the stream takes locks on the thread of the stream. */
+  rt_check_stop();
+  ASSERT_EQ(cubeb_stream_stop(stream), CUBEB_OK);
+  cubeb_stream_destroy(stream);
+  cubeb_destroy(ctx);
+}
+
+TEST_F(rt_check_test, rt_safety_alsa)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  expect_rt_safe = getenv("CUBEB_RT_CHECK_STRICT") != nullptr;
+  run_backend_rt_safety("alsa");
+}
+
+TEST_F(rt_check_test, rt_safety_pulse)
+{
+  RT_CHECK_AVAILABLE_OR_RETURN();
+  expect_rt_safe = getenv("CUBEB_RT_CHECK_STRICT") != nullptr;
+  run_backend_rt_safety("pulse");
+}
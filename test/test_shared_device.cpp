@@ -0,0 +1,216 @@
+/*
+ * Copyright © 2018 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+
+/* libcubeb api/function test. Plays streams that share a device stream, see
+   CUBEB_STREAM_PREF_SHARED_DEVICE, on the ALSA backend. */
+#include "gtest/gtest.h"
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "cubeb/cubeb.h"
+#include "common.h"
+
+namespace {
+
+const uint32_t SAMPLE_FREQUENCY = 48000;
+const uint32_t CHANNELS = 2;
+
+struct shared_state {
+  /* Frames to play before draining, or -1 to fail the callback. */
+  long frames_left = SAMPLE_FREQUENCY / 10;
+  std::atomic<int> data_calls{ 0 };
+  std::atomic<int> drained{ 0 };
+  std::atomic<int> errors{ 0 };
+};
+
+long
+shared_data_cb(cubeb_stream * stream, void * user, const void * input_buffer,
+               void * output_buffer, long nframes)
+{
+  shared_state * u = static_cast<shared_state *>(user);
+  u->data_calls++;
+  if (u->frames_left < 0) {
+    return CUBEB_ERROR;
+  }
+  long frames = std::min(nframes, u->frames_left);
+  memset(output_buffer, 0, frames * CHANNELS * sizeof(float));
+  u->frames_left -= frames;
+  return frames;
+}
+
+void
+shared_state_cb(cubeb_stream * stream, void * user, cubeb_state state)
+{
+  shared_state * u = static_cast<shared_state *>(user);
+  if (state == CUBEB_STATE_DRAINED) {
+    u->drained++;
+  } else if (state == CUBEB_STATE_ERROR) {
+    u->errors++;
+  }
+}
+
+cubeb_stream_params
+shared_params()
+{
+  cubeb_stream_params params;
+  params.format = CUBEB_SAMPLE_FLOAT32NE;
+  params.rate = SAMPLE_FREQUENCY;
+  params.channels = CHANNELS;
+  params.layout = CUBEB_LAYOUT_STEREO;
+  params.prefs = CUBEB_STREAM_PREF_SHARED_DEVICE;
+  return params;
+}
+
+/* The backend, and a device, are not always there: the tests then do
+   nothing. */
+std::unique_ptr<cubeb, decltype(&cubeb_destroy)>
+init_alsa()
+{
+  cubeb * ctx = nullptr;
+  if (cubeb_init(&ctx, "Cubeb shared device test", "alsa") != CUBEB_OK ||
+      strcmp(cubeb_get_backend_id(ctx), "alsa") != 0) {
+    fprintf(stderr, "ALSA not available, skipping.\n");
+    if (ctx) {
+      cubeb_destroy(ctx);
+    }
+    ctx = nullptr;
+  }
+  return { ctx, cubeb_destroy };
+}
+
+int
+init_shared_stream(cubeb * ctx, cubeb_stream ** stream, shared_state * state)
+{
+  cubeb_stream_params params = shared_params();
+  return cubeb_stream_init(ctx, stream, "Cubeb shared device", NULL, NULL,
+                           NULL, &params, 4096, shared_data_cb,
+                           shared_state_cb, state);
+}
+
+} // namespace
+
+/* Streams opened at the same time on a device that isn't open yet all join
+   a single device stream, which would fail on devices that can only be
+   opened once otherwise. */
+TEST(cubeb, shared_device_concurrent_init)
+{
+  auto ctx = init_alsa();
+  if (!ctx) {
+    return;
+  }
+
+  cubeb_stream * probe;
+  shared_state probe_state;
+  if (init_shared_stream(ctx.get(), &probe, &probe_state) != CUBEB_OK) {
+    fprintf(stderr, "No output device, skipping.\n");
+    return;
+  }
+  cubeb_stream_destroy(probe);
+
+  const int stream_count = 8;
+  std::vector<shared_state> states(stream_count);
+  std::vector<cubeb_stream *> streams(stream_count, nullptr);
+  std::vector<int> results(stream_count, CUBEB_ERROR);
+  std::atomic<int> ready{ 0 };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < stream_count; i++) {
+    threads.emplace_back([&, i]() {
+      ready++;
+      while (ready < stream_count) {
+        std::this_thread::yield();
+      }
+      results[i] = init_shared_stream(ctx.get(), &streams[i], &states[i]);
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+
+  for (int i = 0; i < stream_count; i++) {
+    ASSERT_EQ(results[i], CUBEB_OK);
+    ASSERT_EQ(cubeb_stream_start(streams[i]), CUBEB_OK);
+  }
+  delay(500);
+  for (int i = 0; i < stream_count; i++) {
+    ASSERT_EQ(states[i].drained, 1);
+    ASSERT_EQ(states[i].errors, 0);
+    cubeb_stream_destroy(streams[i]);
+  }
+}
+
+/* A drained stream isn't called anymore, and can be started again. */
+TEST(cubeb, shared_device_drain)
+{
+  auto ctx = init_alsa();
+  if (!ctx) {
+    return;
+  }
+
+  cubeb_stream * stream;
+  shared_state state;
+  if (init_shared_stream(ctx.get(), &stream, &state) != CUBEB_OK) {
+    fprintf(stderr, "No output device, skipping.\n");
+    return;
+  }
+
+  ASSERT_EQ(cubeb_stream_start(stream), CUBEB_OK);
+  uint64_t position = 0;
+  for (int i = 0; i < 40 && !state.drained; i++) {
+    uint64_t next;
+    ASSERT_EQ(cubeb_stream_get_position(stream, &next), CUBEB_OK);
+    ASSERT_GE(next, position);
+    position = next;
+    delay(10);
+  }
+  ASSERT_EQ(state.drained, 1);
+  int calls = state.data_calls;
+  delay(100);
+  ASSERT_EQ(state.data_calls, calls);
+  ASSERT_EQ(state.drained, 1);
+
+  state.frames_left = SAMPLE_FREQUENCY / 10;
+  ASSERT_EQ(cubeb_stream_start(stream), CUBEB_OK);
+  delay(500);
+  ASSERT_GT(state.data_calls, calls);
+  ASSERT_EQ(state.drained, 2);
+
+  cubeb_stream_destroy(stream);
+}
+
+/* A stream whose callback fails gets a single error, and isn't called
+   anymore. */
+TEST(cubeb, shared_device_callback_error)
+{
+  auto ctx = init_alsa();
+  if (!ctx) {
+    return;
+  }
+
+  cubeb_stream * stream;
+  shared_state state;
+  state.frames_left = -1;
+  if (init_shared_stream(ctx.get(), &stream, &state) != CUBEB_OK) {
+    fprintf(stderr, "No output device, skipping.\n");
+    return;
+  }
+
+  ASSERT_EQ(cubeb_stream_start(stream), CUBEB_OK);
+  delay(100);
+  ASSERT_EQ(state.data_calls, 1);
+  ASSERT_EQ(state.errors, 1);
+  ASSERT_EQ(state.drained, 0);
+  ASSERT_EQ(cubeb_stream_start(stream), CUBEB_ERROR);
+
+  cubeb_stream_destroy(stream);
+}
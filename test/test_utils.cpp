@@ -70,3 +70,81 @@ TEST(cubeb, auto_array)
   ASSERT_EQ(array.capacity(), 20u);
 }
 
+
+TEST(cubeb, sliding_array)
+{
+  sliding_array<uint32_t> array;
+  uint32_t a[10];
+
+  for (uint32_t i = 0; i < 10; i++) {
+    a[i] = i;
+  }
+
+  ASSERT_EQ(array.capacity(), 0u);
+  ASSERT_EQ(array.length(), 0u);
+
+  array.push(a, 10);
+  ASSERT_EQ(array.length(), 10u);
+  ASSERT_GE(array.capacity(), 10u);
+  ASSERT_TRUE(!array.reserve(9));
+
+  uint32_t * storage = array.data();
+  size_t capacity = array.capacity();
+
+  uint32_t b[10];
+  array.pop(b, 5);
+
+  // Popping does not move the remaining elements.
+  ASSERT_EQ(array.length(), 5u);
+  ASSERT_EQ(array.data(), storage + 5);
+  ASSERT_EQ(array.capacity(), capacity - 5);
+  for (uint32_t i = 0; i < 5; i++) {
+    ASSERT_EQ(b[i], i);
+    ASSERT_EQ(array.data()[i], 5 + i);
+    ASSERT_EQ(array.at(i), 5 + i);
+  }
+
+  // Making room for more elements than what is left at the end of the storage
+  // moves the elements back to the beginning, without reallocating.
+  ASSERT_TRUE(array.reserve(capacity));
+  ASSERT_EQ(array.data(), storage);
+  ASSERT_EQ(array.capacity(), capacity);
+  for (uint32_t i = 0; i < 5; i++) {
+    ASSERT_EQ(array.data()[i], 5 + i);
+  }
+
+  // Elements are always contiguous, whatever the sequence of push and pop.
+  uint32_t expected = 5;
+  uint32_t next = 0;
+  for (uint32_t j = 0; j < 100; j++) {
+    for (uint32_t i = 0; i < 7; i++) {
+      a[i] = 10 + next++;
+    }
+    array.push(a, 7);
+    ASSERT_TRUE(array.pop(nullptr, 6));
+    expected += 6;
+    for (uint32_t i = 0; i < array.length(); i++) {
+      ASSERT_EQ(array.data()[i], expected + i);
+    }
+  }
+
+  ASSERT_TRUE(!array.pop(nullptr, array.length() + 1));
+
+  // Writing directly after the existing elements.
+  size_t leftover = array.length();
+  array.reserve(leftover + 3);
+  uint32_t * in = array.data() + leftover;
+  for (uint32_t i = 0; i < 3; i++) {
+    in[i] = 10 + next++;
+  }
+  array.set_length(leftover + 3);
+  for (uint32_t i = 0; i < array.length(); i++) {
+    ASSERT_EQ(array.data()[i], expected + i);
+  }
+
+  array.push_silence(2);
+  ASSERT_EQ(array.data()[array.length() - 1], 0u);
+
+  array.clear();
+  ASSERT_EQ(array.length(), 0u);
+}